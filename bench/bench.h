@@ -0,0 +1,31 @@
+/*
+ * ==============================================================================
+ * HOST BENCHMARK SUPPORT
+ * ==============================================================================
+ * WHAT: What the stubs in bench/stubs.c give the benchmark
+ * WHY: The kernel's headers describe the drivers, not the counters a host
+ *      run wants to report
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/* Disk traffic since the counters were last cleared */
+struct bench_disk_stats {
+    uint64_t reads;              /* Read requests */
+    uint64_t writes;             /* Write requests */
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t flushes;            /* disk_flush() calls */
+};
+
+extern struct bench_disk_stats bench_disk;
+extern int bench_verbose;        /* Pass VGA output through to stdout */
+
+int bench_disk_open(const char* path, uint32_t sectors);
+void bench_disk_clear(void);
+int bench_memory_init(uint32_t bytes);
+
+#endif /* BENCH_H */
@@ -0,0 +1,228 @@
+/*
+ * ==============================================================================
+ * HOST STUBS FOR THE FILESYSTEM BENCHMARK
+ * ==============================================================================
+ * WHAT: Just enough of the kernel's drivers to run xaefs.c, bcache.c,
+ *       memory.c, slab.c and string.c as a normal Linux program
+ * WHY: Filesystem changes can be measured without booting QEMU
+ * HOW: The disk is a RAM buffer, or a file image mapped into memory; every
+ *      sector moved is counted. Screen and serial output is discarded
+ *      unless bench_verbose is set. Physical memory is one block mapped
+ *      below 4GB, since memory.c keeps page addresses in 32 bits.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/disk.h"
+#include "include/memory.h"
+#include "include/perf.h"
+#include "include/string.h"
+#include "bench.h"
+
+#define HOST_MEMORY_BASE 0x10000000UL   /* Where the "physical" RAM is mapped */
+
+struct bench_disk_stats bench_disk;
+int bench_verbose;
+
+static uint8_t* disk_image;
+static uint32_t disk_sectors;
+static struct disk_request* queue_head;
+
+/* Symbols the kernel gets from linker.ld */
+uint8_t _kernel_start[1];
+uint8_t _kernel_end[1];
+
+/*
+ * bench_disk_open() - Back the disk with a file image, or RAM if path is NULL
+ * RETURNS: 0 on success, -1 on error
+ */
+int bench_disk_open(const char* path, uint32_t sectors)
+{
+    if (!path) {
+        disk_image = calloc(sectors, DISK_SECTOR_SIZE);
+        disk_sectors = sectors;
+        return disk_image ? 0 : -1;
+    }
+    
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if ((uint64_t)st.st_size < (uint64_t)sectors * DISK_SECTOR_SIZE) {
+        if (ftruncate(fd, (off_t)sectors * DISK_SECTOR_SIZE) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        sectors = (uint32_t)(st.st_size / DISK_SECTOR_SIZE);
+    }
+    
+    disk_image = mmap(NULL, (size_t)sectors * DISK_SECTOR_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (disk_image == MAP_FAILED) {
+        disk_image = NULL;
+        return -1;
+    }
+    
+    disk_sectors = sectors;
+    return 0;
+}
+
+/*
+ * bench_disk_clear() - Zero the whole disk, as a fresh image would be
+ */
+void bench_disk_clear(void)
+{
+    memset(disk_image, 0, (size_t)disk_sectors * DISK_SECTOR_SIZE);
+}
+
+/*
+ * bench_memory_init() - Map the RAM memory.c hands out and initialise it
+ * RETURNS: 0 on success, -1 if the fixed mapping isn't available
+ */
+int bench_memory_init(uint32_t bytes)
+{
+    static struct e820_map map;
+    void* ram = mmap((void*)HOST_MEMORY_BASE, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    
+    if (ram != (void*)HOST_MEMORY_BASE) return -1;
+    
+    map.count = 1;
+    map.entries[0].base = HOST_MEMORY_BASE;
+    map.entries[0].length = bytes;
+    map.entries[0].type = E820_USABLE;
+    map.entries[0].acpi = 1;
+    memory_init(&map);
+    
+    return 0;
+}
+
+/* Transfers, counted */
+static int image_io(uint32_t lba, uint32_t count, uint8_t* buffer, int write)
+{
+    if (lba >= disk_sectors || count > disk_sectors - lba) return -1;
+    
+    uint8_t* sector = disk_image + (size_t)lba * DISK_SECTOR_SIZE;
+    if (write) {
+        memcpy(sector, buffer, (size_t)count * DISK_SECTOR_SIZE);
+        bench_disk.writes++;
+        bench_disk.sectors_written += count;
+    } else {
+        memcpy(buffer, sector, (size_t)count * DISK_SECTOR_SIZE);
+        bench_disk.reads++;
+        bench_disk.sectors_read += count;
+    }
+    return 0;
+}
+
+/* disk.h */
+void disk_init(void) {}
+
+int disk_read_sector(uint32_t lba, uint8_t* buffer)
+{
+    return image_io(lba, 1, buffer, 0);
+}
+
+int disk_write_sector(uint32_t lba, const uint8_t* buffer)
+{
+    return image_io(lba, 1, (uint8_t*)buffer, 1);
+}
+
+int disk_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    return image_io(lba, count, buffer, 0);
+}
+
+int disk_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    return image_io(lba, count, (uint8_t*)buffer, 1);
+}
+
+int disk_flush(void)
+{
+    bench_disk.flushes++;
+    return 0;
+}
+
+uint32_t disk_get_sectors(void)
+{
+    return disk_sectors;
+}
+
+/* Queued requests complete on the next poll, in submission order */
+int disk_submit(struct disk_request* req)
+{
+    struct disk_request** link = &queue_head;
+    
+    if (req->count == 0) return -1;
+    
+    req->status = DISK_REQ_PENDING;
+    req->next = NULL;
+    while (*link) link = &(*link)->next;
+    *link = req;
+    return 0;
+}
+
+void disk_poll(void)
+{
+    while (queue_head) {
+        struct disk_request* req = queue_head;
+        
+        queue_head = req->next;
+        req->next = NULL;
+        req->status = image_io(req->lba, req->count, req->buffer, req->write);
+        if (req->done) req->done(req);
+    }
+}
+
+int disk_wait_request(struct disk_request* req)
+{
+    while (req->status == DISK_REQ_PENDING) {
+        disk_poll();
+    }
+    return req->status;
+}
+
+/* Completions only run from disk_poll() here, nothing to hold off */
+uint32_t disk_lock(void) { return 0; }
+void disk_unlock(uint32_t flags) { (void)flags; }
+
+/* vga.h / serial.h */
+void vga_print(const char* str) { if (bench_verbose) fputs(str, stdout); }
+void vga_putchar(char c) { if (bench_verbose) putchar(c); }
+void vga_print_hex(uint32_t value) { if (bench_verbose) printf("%08X", value); }
+void serial_print(const char* str) { (void)str; }
+void serial_putchar(char c) { (void)c; }
+
+/* perf.h: the benchmark does its own timing */
+void perf_count(uint32_t counter, uint32_t n)
+{
+    (void)counter;
+    (void)n;
+}
+
+uint32_t perf_record(uint32_t histogram, uint64_t start)
+{
+    (void)histogram;
+    (void)start;
+    return 0;
+}
+
+void perf_trace(uint32_t event, uint32_t arg)
+{
+    (void)event;
+    (void)arg;
+}
@@ -0,0 +1,343 @@
+/*
+ * ==============================================================================
+ * XAE-FS HOST BENCHMARK
+ * ==============================================================================
+ * WHAT: Times filesystem and string operations as a normal Linux program
+ * WHY: A change to xaefs.c or lib/string.c can be measured and compared
+ *      in seconds, without QEMU
+ * HOW: The real xaefs.c, bcache.c, memory.c, slab.c and string.c are built
+ *      for the host against the stubs in bench/stubs.c. For each file
+ *      count the filesystem is formatted and put through create, tag,
+ *      lookup, search, listing, write, sync, a cold reload and delete.
+ *
+ * OUTPUT: One JSON object per line, e.g.
+ *   {"bench":"create","n":128,"ops":128,"ns_per_op":812.4,
+ *    "sectors_read":0,"sectors_written":0,"sectors_written_per_op":0.00}
+ *
+ * USAGE: xaefs_bench [-n files]... [-i disk.img] [-v]
+ *   -n  File count to run with (repeatable, default 32 128 252)
+ *   -i  Use a file image instead of a RAM disk
+ *   -v  Show the filesystem's console output
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "include/xaefs.h"
+#include "include/bcache.h"
+#include "include/slab.h"
+#include "include/string.h"
+#include "bench.h"
+
+#define BENCH_DISK_SECTORS 20480            /* 10MB, like build/xae_disk.img */
+#define BENCH_MEMORY (64 * 1024 * 1024)
+#define BENCH_MAX_COUNTS 8
+#define BENCH_MAX_FILES (XAEFS_MAX_FILES - 4)    /* Root, /sys, /usr and /tmp take the rest */
+#define BENCH_TAGS 8                        /* Files are spread over t0..t7 */
+#define BENCH_FILE_BYTES 4096
+#define BENCH_STRING_BYTES 4096
+#define BENCH_STRING_ROUNDS 100000
+
+/* One running measurement */
+struct bench_timer {
+    struct timespec start;
+    struct bench_disk_stats disk;
+};
+
+static uint8_t file_data[BENCH_FILE_BYTES];
+
+/*
+ * bench_start() / bench_stop() - Measure one phase and print its line
+ */
+static void bench_start(struct bench_timer* t)
+{
+    t->disk = bench_disk;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+static void bench_stop(struct bench_timer* t, const char* name, uint32_t n, uint32_t ops)
+{
+    struct timespec end;
+    double ns;
+    uint64_t read, written;
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (double)(end.tv_sec - t->start.tv_sec) * 1e9 + (double)(end.tv_nsec - t->start.tv_nsec);
+    read = bench_disk.sectors_read - t->disk.sectors_read;
+    written = bench_disk.sectors_written - t->disk.sectors_written;
+    if (ops == 0) ops = 1;
+    
+    printf("{\"bench\":\"%s\",\"n\":%u,\"ops\":%u,\"ns_per_op\":%.1f,"
+           "\"sectors_read\":%llu,\"sectors_written\":%llu,\"sectors_written_per_op\":%.2f}\n",
+           name, n, ops, ns / ops, (unsigned long long)read, (unsigned long long)written,
+           (double)written / ops);
+    fflush(stdout);
+}
+
+static void file_path(char* buf, size_t size, uint32_t i)
+{
+    snprintf(buf, size, "/f%04u", i);
+}
+
+/*
+ * count_failure() - Report operations the filesystem refused
+ * WHY: A benchmark that silently measures failures measures nothing
+ */
+static int count_failure(const char* name, uint32_t failed)
+{
+    if (failed) fprintf(stderr, "%s: %u operations failed\n", name, failed);
+    return failed ? 1 : 0;
+}
+
+/*
+ * bench_xaefs() - Run every filesystem phase with n files
+ * RETURNS: 0 if every operation succeeded, 1 otherwise
+ */
+static int bench_xaefs(uint32_t n)
+{
+    struct bench_timer t;
+    char path[32];
+    char tag[8];
+    uint32_t failed = 0;
+    uint32_t i;
+    int errors = 0;
+    
+    /* Fresh disk, fresh cache */
+    bench_disk_clear();
+    bcache_init();
+    xaefs_init();
+    xaefs_format("bench");
+    xaefs_sync();
+    
+    bench_start(&t);
+    for (i = 0; i < n; i++) {
+        file_path(path, sizeof(path), i);
+        if (xaefs_create(path, XAEFS_FILE_REGULAR, XAEFS_PRIORITY_NORMAL) < 0) failed++;
+    }
+    bench_stop(&t, "create", n, n);
+    errors |= count_failure("create", failed);
+    
+    failed = 0;
+    bench_start(&t);
+    for (i = 0; i < n; i++) {
+        file_path(path, sizeof(path), i);
+        snprintf(tag, sizeof(tag), "t%u", i % BENCH_TAGS);
+        if (xaefs_add_tag(path, tag) != 0) failed++;
+    }
+    bench_stop(&t, "add_tag", n, n);
+    errors |= count_failure("add_tag", failed);
+    
+    failed = 0;
+    bench_start(&t);
+    for (i = 0; i < n; i++) {
+        file_path(path, sizeof(path), i);
+        if (xaefs_lookup(path, 0) < 0) failed++;
+    }
+    bench_stop(&t, "lookup", n, n);
+    errors |= count_failure("lookup", failed);
+    
+    bench_start(&t);
+    for (i = 0; i < BENCH_TAGS; i++) {
+        snprintf(tag, sizeof(tag), "t%u", i);
+        xaefs_find_by_tag(tag);
+    }
+    bench_stop(&t, "find_by_tag", n, BENCH_TAGS);
+    
+    bench_start(&t);
+    for (i = 0; i < BENCH_TAGS; i++) {
+        snprintf(tag, sizeof(tag), "t%u", i);
+        xaefs_find_tags(tag, -1);
+    }
+    bench_stop(&t, "find_tags", n, BENCH_TAGS);
+    
+    bench_start(&t);
+    xaefs_list_dir("/");
+    bench_stop(&t, "list_dir", n, 1);
+    
+    failed = 0;
+    bench_start(&t);
+    for (i = 0; i < n; i++) {
+        int fd;
+        
+        file_path(path, sizeof(path), i);
+        fd = xaefs_open(path, XAEFS_OPEN_WRITE);
+        if (fd < 0 || xaefs_write(fd, file_data, sizeof(file_data)) != (int)sizeof(file_data)) {
+            failed++;
+        }
+        if (fd >= 0) xaefs_close(fd);
+    }
+    bench_stop(&t, "write_4k", n, n);
+    errors |= count_failure("write_4k", failed);
+    
+    bench_start(&t);
+    xaefs_sync();
+    bench_stop(&t, "sync", n, 1);
+    
+    /* Metadata change committed on its own: the journal's cost per operation */
+    failed = 0;
+    bench_start(&t);
+    for (i = 0; i < n; i++) {
+        file_path(path, sizeof(path), i);
+        if (xaefs_set_priority(path, XAEFS_PRIORITY_HIGH) != 0) failed++;
+        xaefs_commit();
+    }
+    bench_stop(&t, "commit", n, n);
+    errors |= count_failure("commit", failed);
+    xaefs_sync();
+    
+    /* Cold start: a new, empty cache, as after a reboot. Allocator state
+     * carries over, so bcache's previous pages are simply not reused. */
+    bcache_init();
+    bench_start(&t);
+    xaefs_init();
+    xaefs_load();
+    bench_stop(&t, "load", n, 1);
+    if (!xaefs_is_loaded()) errors |= count_failure("load", 1);
+    
+    failed = 0;
+    bench_start(&t);
+    for (i = 0; i < n; i++) {
+        file_path(path, sizeof(path), i);
+        if (xaefs_lookup(path, 0) < 0) failed++;
+    }
+    bench_stop(&t, "lookup_loaded", n, n);
+    errors |= count_failure("lookup_loaded", failed);
+    
+    failed = 0;
+    bench_start(&t);
+    for (i = 0; i < n; i++) {
+        file_path(path, sizeof(path), i);
+        if (xaefs_delete(path) != 0) failed++;
+    }
+    bench_stop(&t, "delete", n, n);
+    errors |= count_failure("delete", failed);
+    
+    bench_start(&t);
+    xaefs_sync();
+    bench_stop(&t, "delete_sync", n, 1);
+    
+    return errors;
+}
+
+/*
+ * bench_string() - Time the lib/string routines the filesystem leans on
+ */
+static void bench_string(void)
+{
+    static uint8_t src[BENCH_STRING_BYTES + 8];
+    static uint8_t dst[BENCH_STRING_BYTES + 8];
+    static char name[XAEFS_MAX_FILENAME];
+    struct bench_timer t;
+    volatile uint32_t sink = 0;
+    uint32_t i;
+    
+    memset(name, 'a', sizeof(name) - 1);
+    
+    bench_start(&t);
+    for (i = 0; i < BENCH_STRING_ROUNDS; i++) {
+        memcpy(dst, src, BENCH_STRING_BYTES);
+    }
+    bench_stop(&t, "memcpy_4k", BENCH_STRING_BYTES, BENCH_STRING_ROUNDS);
+    
+    bench_start(&t);
+    for (i = 0; i < BENCH_STRING_ROUNDS; i++) {
+        memcpy(dst + 1, src + 3, BENCH_STRING_BYTES);
+    }
+    bench_stop(&t, "memcpy_4k_unaligned", BENCH_STRING_BYTES, BENCH_STRING_ROUNDS);
+    
+    bench_start(&t);
+    for (i = 0; i < BENCH_STRING_ROUNDS; i++) {
+        memmove(src + 1, src, BENCH_STRING_BYTES);
+    }
+    bench_stop(&t, "memmove_4k_overlap", BENCH_STRING_BYTES, BENCH_STRING_ROUNDS);
+    
+    bench_start(&t);
+    for (i = 0; i < BENCH_STRING_ROUNDS; i++) {
+        memset(dst, (int)i, BENCH_STRING_BYTES);
+    }
+    bench_stop(&t, "memset_4k", BENCH_STRING_BYTES, BENCH_STRING_ROUNDS);
+    
+    memcpy(dst, src, BENCH_STRING_BYTES);
+    bench_start(&t);
+    for (i = 0; i < BENCH_STRING_ROUNDS; i++) {
+        sink += (uint32_t)memcmp(dst, src, BENCH_STRING_BYTES);
+    }
+    bench_stop(&t, "memcmp_4k", BENCH_STRING_BYTES, BENCH_STRING_ROUNDS);
+    
+    bench_start(&t);
+    for (i = 0; i < BENCH_STRING_ROUNDS; i++) {
+        sink += (uint32_t)strlen(name);
+    }
+    bench_stop(&t, "strlen_63", sizeof(name) - 1, BENCH_STRING_ROUNDS);
+    
+    bench_start(&t);
+    for (i = 0; i < BENCH_STRING_ROUNDS; i++) {
+        sink += (uint32_t)strcmp(name, name);
+    }
+    bench_stop(&t, "strcmp_63", sizeof(name) - 1, BENCH_STRING_ROUNDS);
+    
+    (void)sink;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t counts[BENCH_MAX_COUNTS] = { 32, 128, BENCH_MAX_FILES };
+    uint32_t count_num = 3;
+    int custom_counts = 0;
+    const char* image = NULL;
+    int errors = 0;
+    int opt;
+    uint32_t i;
+    
+    while ((opt = getopt(argc, argv, "n:i:v")) != -1) {
+        switch (opt) {
+            case 'n':
+                if (!custom_counts) count_num = 0;
+                custom_counts = 1;
+                if (count_num < BENCH_MAX_COUNTS) {
+                    counts[count_num++] = (uint32_t)strtoul(optarg, NULL, 0);
+                }
+                break;
+            case 'i':
+                image = optarg;
+                break;
+            case 'v':
+                bench_verbose = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n files]... [-i disk.img] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+    
+    if (bench_disk_open(image, BENCH_DISK_SECTORS) != 0) {
+        fprintf(stderr, "cannot open disk %s\n", image ? image : "(RAM)");
+        return 1;
+    }
+    if (bench_memory_init(BENCH_MEMORY) != 0) {
+        fprintf(stderr, "cannot map %u bytes of RAM below 4GB\n", BENCH_MEMORY);
+        return 1;
+    }
+    slab_init();
+    
+    for (i = 0; i < sizeof(file_data); i++) {
+        file_data[i] = (uint8_t)i;
+    }
+    
+    for (i = 0; i < count_num; i++) {
+        if (counts[i] == 0 || counts[i] > BENCH_MAX_FILES) {
+            fprintf(stderr, "file count %u out of range (1-%u)\n", counts[i], BENCH_MAX_FILES);
+            errors = 1;
+            continue;
+        }
+        errors |= bench_xaefs(counts[i]);
+    }
+    
+    bench_string();
+    
+    return errors;
+}
@@ -5,10 +5,22 @@
 ; WHY: When your computer starts, the BIOS loads the first 512 bytes from
 ;      your disk into memory at address 0x7C00 and jumps to it. This is that code!
 ; HOW: We set up the CPU to 16-bit mode, load our kernel from disk, then jump to it
+;
+; The kernel is linked to run at 1MB. It is read in chunks into a buffer
+; below 1MB and copied up from there in "unreal mode": real mode with the
+; 4GB segment limits left over from a quick trip into protected mode.
 
 [BITS 16]           ; Tell assembler we're in 16-bit real mode (old DOS-style mode)
 [ORG 0x7C00]        ; BIOS loads us at memory address 0x7C00
 
+E820_MAP    equ 0x0500      ; Memory map for the kernel: dword count, then entries
+E820_MAX    equ 32          ; Entries we have room for (24 bytes each)
+SMAP        equ 0x534D4150  ; 'SMAP' signature for INT 15h, AX=E820h
+KERNEL_BASE equ 0x100000    ; Where the kernel is linked to run (1MB)
+KERNEL_MAGIC equ 0x4B454158 ; "XAEK", first dword of the kernel header
+BOUNCE_SEG  equ 0x1000      ; Chunks are read to 0x1000:0000 (0x10000) first
+CHUNK_SECTORS equ 64        ; Sectors per chunk (32KB; some BIOSes stop at 127)
+
 start:
     ; Save boot drive number (BIOS passes it in DL)
     mov [boot_drive], dl
@@ -27,28 +39,71 @@ start:
     mov si, msg_boot    ; SI = pointer to our message string
     call print_string   ; Call our print function
 
-    ; STEP 3: Load the kernel from disk into memory
-    ; WHY: Our kernel is too big for 512 bytes, it's stored in the next sectors
-    mov bx, 0x1000      ; Load kernel at memory address 0x1000:0000
-    mov es, bx
-    xor bx, bx          ; ES:BX = 0x1000:0x0000 (physical address 0x10000)
-
-    mov ah, 0x02        ; BIOS function: Read Sectors
-    mov al, 60          ; Read 60 sectors (about 30KB for kernel with network stack)
-    mov ch, 0           ; Cylinder 0
-    mov cl, 2           ; Start at sector 2 (sector 1 is this bootloader)
-    mov dh, 0           ; Head 0
-    mov dl, [boot_drive] ; Use the drive we booted from
-    int 0x13            ; Call BIOS disk interrupt
-    
-    jc disk_error       ; If carry flag set, there was an error
+    ; STEP 3: Ask the BIOS for the physical memory map (E820)
+    ; WHY: Only the BIOS knows how much RAM there is and which ranges are
+    ;      ROM, ACPI tables or holes; the kernel sizes its page allocator
+    ;      from this list. A count of 0 means the call isn't supported.
+    xor ebx, ebx        ; Continuation value: 0 = first entry
+    xor bp, bp          ; BP = entries stored
+    mov di, E820_MAP + 4 ; ES:DI = where the BIOS writes the entry
+.e820_next:
+    mov eax, 0xE820
+    mov edx, SMAP
+    mov ecx, 24         ; Room for an ACPI 3.0 entry
+    mov dword [di + 20], 1 ; Default "valid" attribute for 20-byte entries
+    int 0x15
+    jc .e820_done       ; Carry = error, or already past the last entry
+    cmp eax, SMAP
+    jne .e820_done
+    jcxz .e820_skip     ; CX = bytes the BIOS returned: none, no entry
+    mov eax, [di + 8]
+    or eax, [di + 12]   ; 64-bit length of the range
+    jz .e820_skip       ; Ignore zero-length ranges
+    inc bp
+    add di, 24
+    cmp bp, E820_MAX
+    jae .e820_done
+.e820_skip:
+    test ebx, ebx       ; EBX = 0 after the last entry
+    jnz .e820_next
+.e820_done:
+    mov [E820_MAP], bp
+    mov word [E820_MAP + 2], 0
 
-    ; STEP 4: Switch to protected mode and jump to kernel
-    mov si, msg_kernel
-    call print_string
-    
+    ; STEP 4: Enable the A20 line ("fast A20" via system control port 0x92)
+    ; WHY: With A20 off, every odd megabyte aliases the one below it, so
+    ;      the kernel copied to 1MB would land on top of the IVT
+    in al, 0x92
+    or al, 2                ; Bit 1 = A20 enable
+    and al, 0xFE            ; Never set bit 0 (it resets the machine)
+    out 0x92, al
+
+    ; STEP 5: Load the kernel from disk into memory
+    ; HOW: The first sector holds the kernel header, which says how many
+    ;      sectors the image has (stamped by the linker at build time)
+    mov cx, 1
+    call load_chunk
+    cmp dword [dword KERNEL_BASE], KERNEL_MAGIC
+    jne disk_error
+    mov ax, [dword KERNEL_BASE + 4]
+    dec ax              ; AX = sectors still to load (header is done)
+.load_next:
+    mov cx, ax
+    jcxz .loaded
+    cmp cx, CHUNK_SECTORS
+    jbe .load_last
+    mov cx, CHUNK_SECTORS
+.load_last:
+    sub ax, cx
+    push ax
+    call load_chunk
+    pop ax
+    jmp .load_next
+.loaded:
+
+    ; STEP 6: Switch to protected mode and jump to kernel
+    ; (load_chunk already loaded the GDT)
     cli                     ; Disable interrupts
-    lgdt [gdt_descriptor]   ; Load GDT
     
     ; Enable protected mode
     mov eax, cr0
@@ -60,23 +115,115 @@ start:
 
 [BITS 32]
 protected_mode:
-    ; Set up segments
+    ; Just enough to read the header: kernel_entry sets up the other
+    ; segments and its stack itself
     mov ax, 0x10
     mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
-    mov ss, ax
-    mov esp, 0x90000
     
-    ; Jump to kernel (flat address 0x10000)
-    jmp 0x08:0x10000
+    ; Jump to the entry point from the kernel header, memory map pointer in EBX
+    mov ebx, E820_MAP
+    jmp [KERNEL_BASE + 8]
 
+[BITS 16]
 disk_error:
     mov si, msg_error
     call print_string
     hlt                 ; Halt the CPU
 
+; ==============================================================================
+; FUNCTION: load_chunk
+; INPUT: CX = sectors to load (1 to CHUNK_SECTORS)
+; OUTPUT: The next CX kernel sectors copied to [kernel_dest], which moves on
+;         past them; DS = ES = 0 with 4GB limits
+; ==============================================================================
+load_chunk:
+    push cx
+    cmp byte [use_lba], 0
+    je .chs
+    mov [dap_count], cx
+    mov si, dap
+    mov ah, 0x42        ; BIOS function: Extended Read
+    mov dl, [boot_drive]
+    int 0x13
+    jnc .copy
+    ; No packet reads (most floppies): switch to CHS, but only on the
+    ; very first read - a later failure is a real disk error
+    cmp word [dap_lba], 1
+    jne disk_error
+    mov byte [use_lba], 0
+    ; CHS reads go one sector at a time, since a single call can't cross
+    ; a track on every BIOS, so they need the geometry. Only asked for
+    ; here: some BIOSes don't report it for drives they emulate for LBA.
+    mov ah, 0x08        ; BIOS function: Get Drive Parameters
+    mov dl, [boot_drive]
+    xor di, di          ; ES:DI = 0:0 works around some buggy BIOSes
+    int 0x13            ; (ES is still 0 on the first read)
+    jc disk_error
+    and cl, 0x3F        ; CL bits 0-5 = sectors per track
+    mov [sectors], cl
+    mov [heads], dh     ; DH = highest head number
+    pop cx
+    push cx
+.chs:
+    mov ax, BOUNCE_SEG
+    mov es, ax
+    xor bx, bx          ; ES:BX = bounce buffer
+.chs_next:
+    push cx
+    mov ax, 0x0201      ; BIOS function: Read Sectors, 1 sector
+    mov cx, [chs_sector] ; Cylinder (CH), sector (CL)
+    mov dh, [chs_head]
+    mov dl, [boot_drive]
+    int 0x13
+    jc disk_error
+    
+    mov ax, es          ; Next 512 bytes (one paragraph is 16 bytes)
+    add ax, 0x20
+    mov es, ax
+    
+    inc cl              ; Next sector, wrapping to the next head/cylinder
+    cmp cl, [sectors]
+    jbe .same_track
+    mov cl, 1
+    inc dh
+    cmp dh, [heads]
+    jbe .same_track
+    xor dh, dh
+    inc ch
+.same_track:
+    mov [chs_sector], cx
+    mov [chs_head], dh
+    pop cx
+    loop .chs_next
+.copy:
+    ; Enter unreal mode: loading DS and ES in protected mode sets their
+    ; limits to 4GB, and real mode keeps those limits
+    cli
+    lgdt [gdt_descriptor]
+    mov eax, cr0
+    or al, 1
+    mov cr0, eax
+    mov bx, 0x10
+    mov ds, bx
+    mov es, bx
+    and al, 0xFE
+    mov cr0, eax
+    xor bx, bx
+    mov ds, bx
+    mov es, bx
+    sti
+    
+    pop cx
+    add [dap_lba], cx   ; Where the next chunk starts
+    movzx ecx, cx
+    shl ecx, 7          ; Dwords to copy (128 per sector)
+    mov esi, BOUNCE_SEG * 16
+    mov edi, [kernel_dest]
+    cld
+    a32 rep movsd
+    mov [kernel_dest], edi
+    ret
+
 ; ==============================================================================
 ; FUNCTION: print_string
 ; INPUT: SI = pointer to null-terminated string
@@ -98,8 +245,16 @@ print_string:
 
 ; Messages
 msg_boot:   db 'XAE OS Booting...', 13, 10, 0
-msg_kernel: db 'Loading kernel...', 13, 10, 0
-msg_error:  db 'Disk read error!', 13, 10, 0
+msg_error:  db 'Disk error!', 13, 10, 0
+
+; Disk address packet for INT 13h AH=42h
+dap:
+    db 0x10, 0          ; Packet size, reserved
+dap_count:
+    dw 0                ; Sectors to read
+    dw 0, BOUNCE_SEG    ; Buffer offset, segment
+dap_lba:
+    dd 1, 0             ; First sector (sector 0 is this bootloader)
 
 ; ==============================================================================
 ; GDT for Protected Mode
@@ -131,8 +286,16 @@ gdt_descriptor:
     dw gdt_end - gdt_start - 1
     dd gdt_start
 
-; Boot drive number (saved from BIOS)
+; Boot drive number (saved from BIOS) and its geometry
 boot_drive: db 0
+sectors:    db 0            ; Sectors per track
+heads:      db 0            ; Highest head number
+use_lba:    db 1            ; 0 = no packet reads, use CHS
+
+; Load progress
+kernel_dest: dd KERNEL_BASE ; Where the next chunk is copied to
+chs_sector: dw 0x0002       ; Cylinder 0, sector 2 - sector 1 is this bootloader
+chs_head:   db 0
 
 ; ==============================================================================
 ; BOOT SIGNATURE
@@ -6,6 +6,9 @@
 
 #include "include/disk.h"
 #include "include/vga.h"
+#include "include/string.h"
+#include "include/perf.h"
+#include "include/interrupt.h"
 
 /* ATA I/O Ports (Primary bus, Secondary drive) */
 #define ATA_DATA        0x1F0   /* Data register (16-bit) */
@@ -18,23 +21,85 @@
 #define ATA_DRIVE       0x1F6   /* Drive/Head register */
 #define ATA_STATUS      0x1F7   /* Status register (read) */
 #define ATA_COMMAND     0x1F7   /* Command register (write) */
+#define ATA_ALT_STATUS  0x3F6   /* Alternate status (read, no side effects) */
+#define ATA_CONTROL     0x3F6   /* Device control (write) */
+
+/* PCI configuration ports (to find the bus-master IDE controller) */
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+#define PCI_CLASS_IDE      0x0101  /* Mass storage class, IDE subclass */
+
+/* Bus-master IDE registers (primary channel, offsets from BAR4) */
+#define BM_COMMAND      0x00    /* Start/stop and direction */
+#define BM_STATUS       0x02    /* Active/error/interrupt bits */
+#define BM_PRDT         0x04    /* Physical address of the PRD table */
+#define BM_CMD_START    0x01    /* Start the DMA engine */
+#define BM_CMD_READ     0x08    /* Direction: device to memory */
+#define BM_SR_ACTIVE    0x01    /* Transfer in progress */
+#define BM_SR_ERR       0x02    /* DMA error (write 1 to clear) */
+#define BM_SR_IRQ       0x04    /* Drive raised its interrupt (write 1 to clear) */
 
 /* Drive selection */
 #define ATA_DRIVE_MASTER 0xE0  /* Master drive (LBA mode) */
 #define ATA_DRIVE_SLAVE  0xF0  /* Slave drive (LBA mode) */
 #define SELECTED_DRIVE   ATA_DRIVE_SLAVE  /* Use secondary disk for data */
+#define ATA_DRIVE_LBA48  (SELECTED_DRIVE & 0xF0)  /* No LBA bits in the drive register */
 
 /* ATA Status bits */
 #define ATA_SR_BSY      0x80    /* Busy */
 #define ATA_SR_DRDY     0x40    /* Drive ready */
+#define ATA_SR_DF       0x20    /* Drive fault */
 #define ATA_SR_DRQ      0x08    /* Data request ready */
 #define ATA_SR_ERR      0x01    /* Error */
 
 /* ATA Commands */
 #define ATA_CMD_READ    0x20    /* Read sectors */
+#define ATA_CMD_READ_EXT 0x24   /* Read sectors (LBA48) */
+#define ATA_CMD_READ_MULTIPLE 0xC4       /* Read, one DRQ block per N sectors */
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29   /* Same, LBA48 */
 #define ATA_CMD_WRITE   0x30    /* Write sectors */
+#define ATA_CMD_WRITE_EXT 0x34  /* Write sectors (LBA48) */
+#define ATA_CMD_WRITE_MULTIPLE 0xC5      /* Write, one DRQ block per N sectors */
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39  /* Same, LBA48 */
+#define ATA_CMD_SET_MULTIPLE 0xC6        /* Set sectors per DRQ block */
+#define ATA_CMD_FLUSH   0xE7    /* Flush the drive's write cache */
+#define ATA_CMD_FLUSH_EXT 0xEA  /* Flush the write cache (LBA48 drives) */
+#define ATA_CMD_READ_DMA 0xC8   /* Read sectors by DMA */
+#define ATA_CMD_READ_DMA_EXT 0x25        /* Same, LBA48 */
+#define ATA_CMD_WRITE_DMA 0xCA  /* Write sectors by DMA */
+#define ATA_CMD_WRITE_DMA_EXT 0x35       /* Same, LBA48 */
 #define ATA_CMD_IDENTIFY 0xEC   /* Identify drive */
 
+/* Transfer limits (DISK_MAX_TRANSFER is in disk.h; the count register sends 256 as 0) */
+#define DISK_MAX_MULTIPLE 16    /* Largest DRQ block we ask for */
+#define DISK_LBA28_LIMIT 0x10000000  /* First sector LBA28 can't address */
+#define DISK_PRD_ENTRIES 32     /* Scatter-gather entries per DMA command */
+#define DISK_PRD_EOT    0x8000  /* Flag on the last PRD entry */
+#define DISK_DMA_TIMEOUT 10000000    /* Polls before a DMA command is abandoned */
+#define DISK_IRQ        14      /* Primary IDE channel */
+
+/* Physical Region Descriptor: one contiguous piece of a DMA transfer */
+struct disk_prd {
+    uint32_t addr;           /* Physical address (must be even) */
+    uint16_t bytes;          /* Byte count, 0 = 64KB */
+    uint16_t flags;          /* DISK_PRD_EOT on the last entry */
+} __attribute__((packed));
+
+/* What IDENTIFY told us about the drive */
+static uint8_t disk_present;
+static uint8_t disk_lba48;       /* Drive supports 48-bit addressing */
+static uint16_t disk_multiple;   /* Sectors per DRQ block (1 = multiple mode off) */
+static uint32_t disk_sectors;    /* Addressable sectors (capped at 32 bits) */
+
+/* DMA state; the table is 256-byte aligned so it never crosses 64KB */
+static struct disk_prd prd_table[DISK_PRD_ENTRIES] __attribute__((aligned(256)));
+static uint16_t bm_base;                   /* Bus-master registers, 0 = PIO only */
+static struct disk_request* queue_head;    /* Waiting requests, sorted by LBA */
+static struct disk_request* active;        /* Batch the controller is working on */
+static uint32_t elevator_lba;              /* Sector after the last dispatched batch */
+static uint32_t active_polls;              /* Polls since the batch was started */
+static uint8_t irq_driven;                 /* IRQ 14 handler installed */
+
 /* Port I/O functions */
 static inline uint8_t inb(uint16_t port) 
 {
@@ -48,16 +113,44 @@ static inline void outb(uint16_t port, uint8_t val)
     __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
-static inline uint16_t inw(uint16_t port) 
+static inline uint32_t inl(uint16_t port)
 {
-    uint16_t ret;
-    __asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    uint32_t ret;
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
     return ret;
 }
 
-static inline void outw(uint16_t port, uint16_t val) 
+static inline void outl(uint16_t port, uint32_t val)
 {
-    __asm__ volatile ("outw %0, %1" : : "a"(val), "Nd"(port));
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+/*
+ * insw() / outsw() - Move a block of words through the data register
+ * 
+ * WHY: One rep instruction per DRQ block instead of a call per word
+ */
+static inline void insw(uint16_t port, void* buffer, uint32_t words)
+{
+    __asm__ volatile ("rep insw" : "+D"(buffer), "+c"(words) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buffer, uint32_t words)
+{
+    __asm__ volatile ("rep outsw" : "+S"(buffer), "+c"(words) : "d"(port));
+}
+
+/*
+ * ata_delay() - Give the drive 400ns to update its status
+ * 
+ * HOW: Each read of the alternate status port takes about 100ns
+ */
+static void ata_delay(void)
+{
+    inb(ATA_ALT_STATUS);
+    inb(ATA_ALT_STATUS);
+    inb(ATA_ALT_STATUS);
+    inb(ATA_ALT_STATUS);
 }
 
 /*
@@ -87,17 +180,212 @@ static int disk_wait(void)
     return 0;
 }
 
+/*
+ * disk_wait_drq() - Wait for the next DRQ block
+ * 
+ * WHAT: Poll until the drive is ready to move data, or reports a failure
+ * RETURNS: 0 when DRQ is set, -1 on error, drive fault or timeout
+ */
+static int disk_wait_drq(void)
+{
+    uint8_t status;
+    uint32_t timeout = 100000;
+    
+    while ((status = inb(ATA_STATUS)) & ATA_SR_BSY) {
+        if (--timeout == 0) return -1;
+    }
+    
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) return -1;
+    if (!(status & ATA_SR_DRQ)) return -1;
+    
+    return 0;
+}
+
+/*
+ * disk_wait_done() - Wait for a command to finish and check its result
+ * RETURNS: 0 on success, -1 on error, drive fault or timeout
+ */
+static int disk_wait_done(void)
+{
+    uint8_t status;
+    uint32_t timeout = 100000;
+    
+    ata_delay();
+    
+    while ((status = inb(ATA_STATUS)) & ATA_SR_BSY) {
+        if (--timeout == 0) return -1;
+    }
+    
+    return (status & (ATA_SR_ERR | ATA_SR_DF)) ? -1 : 0;
+}
+
+/*
+ * disk_command() - Program the task file and issue a transfer command
+ * 
+ * WHAT: Send LBA, sector count and command for up to DISK_MAX_TRANSFER sectors
+ * HOW: LBA28 while the request fits below 128GB (fewer port writes),
+ *      otherwise LBA48: the high bytes of count and LBA go first, then
+ *      the low bytes through the same registers
+ */
+static void disk_command(uint32_t lba, uint32_t count, uint8_t cmd28, uint8_t cmd48)
+{
+    if (disk_lba48 && lba + count > DISK_LBA28_LIMIT) {
+        outb(ATA_DRIVE, ATA_DRIVE_LBA48);
+        outb(ATA_SECTOR_COUNT, (uint8_t)(count >> 8));  /* Count bits 8-15 */
+        outb(ATA_LBA_LOW,  (uint8_t)(lba >> 24));       /* LBA bits 24-31 */
+        outb(ATA_LBA_MID,  0);                          /* LBA bits 32-39 */
+        outb(ATA_LBA_HIGH, 0);                          /* LBA bits 40-47 */
+        outb(ATA_SECTOR_COUNT, (uint8_t)count);         /* Count bits 0-7 */
+        outb(ATA_LBA_LOW,  (uint8_t)(lba));
+        outb(ATA_LBA_MID,  (uint8_t)(lba >> 8));
+        outb(ATA_LBA_HIGH, (uint8_t)(lba >> 16));
+        outb(ATA_COMMAND, cmd48);
+    } else {
+        outb(ATA_DRIVE, SELECTED_DRIVE | ((lba >> 24) & 0x0F)); /* LBA bits 24-27 */
+        outb(ATA_SECTOR_COUNT, (uint8_t)count);     /* 256 is sent as 0 */
+        outb(ATA_LBA_LOW,  (uint8_t)(lba));         /* LBA bits 0-7 */
+        outb(ATA_LBA_MID,  (uint8_t)(lba >> 8));    /* LBA bits 8-15 */
+        outb(ATA_LBA_HIGH, (uint8_t)(lba >> 16));   /* LBA bits 16-23 */
+        outb(ATA_COMMAND, cmd28);
+    }
+    
+    ata_delay();
+}
+
+/*
+ * disk_identify() - Read the drive's IDENTIFY data
+ * 
+ * WHAT: Learn the size, LBA48 support and largest DRQ block of the drive
+ * RETURNS: 0 on success, -1 if no ATA drive answered
+ */
+static int disk_identify(uint16_t* id)
+{
+    outb(ATA_DRIVE, SELECTED_DRIVE);
+    ata_delay();
+    outb(ATA_SECTOR_COUNT, 0);
+    outb(ATA_LBA_LOW, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HIGH, 0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+    ata_delay();
+    
+    /* Status 0 = no drive, 0xFF = nothing on the bus */
+    uint8_t status = inb(ATA_STATUS);
+    if (status == 0 || status == 0xFF) return -1;
+    
+    /* ATAPI and SATA devices abort with a signature in LBA mid/high */
+    if (disk_wait_drq() != 0) return -1;
+    if (inb(ATA_LBA_MID) != 0 || inb(ATA_LBA_HIGH) != 0) return -1;
+    
+    insw(ATA_DATA, id, 256);
+    return 0;
+}
+
+/*
+ * disk_set_multiple() - Enable multiple mode
+ * 
+ * WHAT: Ask the drive to transfer up to `count` sectors per DRQ block
+ * WHY: READ/WRITE MULTIPLE then need one status wait (and one interrupt,
+ *      had we enabled them) per block instead of per sector
+ * RETURNS: Sectors per block actually in effect
+ */
+static uint16_t disk_set_multiple(uint16_t count)
+{
+    if (count < 2) return 1;
+    if (disk_wait() != 0) return 1;
+    
+    outb(ATA_DRIVE, SELECTED_DRIVE);
+    outb(ATA_SECTOR_COUNT, (uint8_t)count);
+    outb(ATA_COMMAND, ATA_CMD_SET_MULTIPLE);
+    
+    return disk_wait_done() == 0 ? count : 1;
+}
+
+/*
+ * find_bus_master() - Locate the PCI IDE controller's bus-master registers
+ * 
+ * WHAT: Scan PCI for an IDE controller and enable bus mastering on it
+ * HOW: Same config-space walk as the RTL8139 driver, matching the class
+ *      code instead of vendor/device IDs; BAR4 holds the register base
+ * RETURNS: I/O base of the bus-master registers, 0 if there is none
+ */
+static uint16_t find_bus_master(void)
+{
+    uint32_t bus, device, function;
+    
+    for (bus = 0; bus < 256; bus++) {
+        for (device = 0; device < 32; device++) {
+            for (function = 0; function < 8; function++) {
+                uint32_t address = 0x80000000 | (bus << 16) | (device << 11) | (function << 8);
+                
+                outl(PCI_CONFIG_ADDRESS, address);
+                if ((inl(PCI_CONFIG_DATA) & 0xFFFF) == 0xFFFF) {
+                    if (function == 0) break;  /* No device in this slot */
+                    continue;
+                }
+                
+                outl(PCI_CONFIG_ADDRESS, address | 0x08);
+                if ((inl(PCI_CONFIG_DATA) >> 16) != PCI_CLASS_IDE) continue;
+                
+                outl(PCI_CONFIG_ADDRESS, address | 0x20);
+                uint32_t bar4 = inl(PCI_CONFIG_DATA);
+                if (!(bar4 & 1)) continue;  /* Must be an I/O space BAR */
+                
+                /* Enable I/O decoding and bus mastering */
+                outl(PCI_CONFIG_ADDRESS, address | 0x04);
+                uint32_t cmd = inl(PCI_CONFIG_DATA);
+                outl(PCI_CONFIG_ADDRESS, address | 0x04);
+                outl(PCI_CONFIG_DATA, cmd | 0x05);
+                
+                return (uint16_t)(bar4 & 0xFFFC);
+            }
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * disk_handle_interrupt() - IRQ 14 handler
+ * 
+ * HOW: A DMA batch is completed by disk_poll(), which acknowledges the
+ *      drive; an interrupt of a PIO command only needs its status read
+ */
+static void disk_handle_interrupt(void)
+{
+    if (active) {
+        disk_poll();
+    } else {
+        (void)inb(ATA_STATUS);
+    }
+}
+
 /*
  * disk_init() - Initialize disk driver
  * 
  * WHAT: Set up ATA disk for use
  * WHY: Must initialize before reading/writing
- * HOW: Select drive, check if present
+ * HOW: Select drive, IDENTIFY it, then switch on multiple mode with the
+ *      largest power-of-two block it supports (up to DISK_MAX_MULTIPLE)
  */
 void disk_init(void) 
 {
+    static uint16_t id[256];
+    char num[12];
+    uint16_t multiple;
+    
     vga_print("  - Initializing ATA disk driver...\n");
     
+    disk_present = 0;
+    disk_lba48 = 0;
+    disk_multiple = 1;
+    disk_sectors = 0;
+    bm_base = 0;
+    queue_head = NULL;
+    active = NULL;
+    elevator_lba = 0;
+    irq_driven = 0;
+    
     /* Select slave drive (secondary disk for data storage) */
     outb(ATA_DRIVE, SELECTED_DRIVE);
     
@@ -108,138 +396,484 @@ void disk_init(void)
     }
     
     /* Try to wait for drive - if it times out, continue anyway */
-    if (disk_wait() != 0) {
+    if (disk_wait() != 0 || disk_identify(id) != 0) {
         vga_print("  - Warning: Data disk not responding\n");
         vga_print("  - System will continue without persistence\n");
         return;
     }
     
-    vga_print("  - Data disk ready (10MB persistent storage)\n");
+    disk_present = 1;
+    disk_lba48 = (id[83] & (1 << 10)) != 0;
+    
+    if (disk_lba48) {
+        /* Words 100-103: 48-bit sector count */
+        disk_sectors = (id[102] || id[103]) ? 0xFFFFFFFF :
+                       ((uint32_t)id[101] << 16) | id[100];
+    } else {
+        /* Words 60-61: 28-bit sector count */
+        disk_sectors = ((uint32_t)id[61] << 16) | id[60];
+    }
+    
+    /* Word 47 bits 0-7: largest DRQ block for READ/WRITE MULTIPLE */
+    multiple = DISK_MAX_MULTIPLE;
+    while (multiple > (id[47] & 0xFF)) {
+        multiple >>= 1;
+    }
+    disk_multiple = disk_set_multiple(multiple);
+    
+    /* Word 49 bit 8: DMA supported */
+    if (id[49] & (1 << 8)) {
+        bm_base = find_bus_master();
+    }
+    if (bm_base) {
+        outb(ATA_CONTROL, 0);  /* Let the drive raise INTRQ so BM_SR_IRQ gets set */
+        outb(bm_base + BM_COMMAND, 0);
+        outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+        irq_driven = (irq_register(DISK_IRQ, disk_handle_interrupt) == 0);
+    }
+    
+    vga_print("  - Data disk ready (");
+    vga_print(utoa(disk_sectors / 2048, num));
+    vga_print("MB, ");
+    vga_print(disk_lba48 ? "LBA48, " : "LBA28, ");
+    if (bm_base) {
+        vga_print(irq_driven ? "DMA, IRQ 14)\n" : "DMA)\n");
+    } else {
+        vga_print(utoa(disk_multiple, num));
+        vga_print(" sectors per block)\n");
+    }
 }
 
 /*
- * disk_read_sector() - Read one sector from disk
- * 
- * WHAT: Read 512 bytes from specified sector
- * WHY: To load data from persistent storage
- * HOW: Use ATA READ command in PIO mode
- * 
- * PARAMS:
- *   lba - Logical Block Address (sector number)
- *   buffer - Where to store the 512 bytes
- * RETURNS: 0 on success, -1 on error
+ * disk_transfer_read() - One read command of up to DISK_MAX_TRANSFER sectors
  */
-int disk_read_sector(uint32_t lba, uint8_t* buffer) 
+static int disk_transfer_read(uint32_t lba, uint32_t count, uint8_t* buffer)
 {
-    uint16_t i;
-    uint16_t* buf16 = (uint16_t*)buffer;
-    
-    /* Wait for disk to be ready */
     if (disk_wait() != 0) return -1;
     
-    /* Send read parameters */
-    outb(ATA_SECTOR_COUNT, 1);              /* Read 1 sector */
-    outb(ATA_LBA_LOW,  (uint8_t)(lba));     /* LBA bits 0-7 */
-    outb(ATA_LBA_MID,  (uint8_t)(lba >> 8)); /* LBA bits 8-15 */
-    outb(ATA_LBA_HIGH, (uint8_t)(lba >> 16)); /* LBA bits 16-23 */
-    outb(ATA_DRIVE, SELECTED_DRIVE | ((lba >> 24) & 0x0F)); /* LBA bits 24-27 */
+    if (disk_multiple > 1) {
+        disk_command(lba, count, ATA_CMD_READ_MULTIPLE, ATA_CMD_READ_MULTIPLE_EXT);
+    } else {
+        disk_command(lba, count, ATA_CMD_READ, ATA_CMD_READ_EXT);
+    }
     
-    /* Send READ command */
-    outb(ATA_COMMAND, ATA_CMD_READ);
+    /* The drive raises DRQ once per block of disk_multiple sectors */
+    while (count > 0) {
+        uint32_t n = count < disk_multiple ? count : disk_multiple;
+        
+        if (disk_wait_drq() != 0) return -1;
+        insw(ATA_DATA, buffer, n * (DISK_SECTOR_SIZE / 2));
+        
+        buffer += n * DISK_SECTOR_SIZE;
+        count -= n;
+    }
     
-    /* Wait for data to be ready */
+    return disk_wait_done();
+}
+
+/*
+ * disk_transfer_write() - One write command of up to DISK_MAX_TRANSFER sectors
+ * 
+ * NOTE: Completion only means the drive has the data, possibly still in
+ *       its write cache; disk_flush() is the durability barrier
+ */
+static int disk_transfer_write(uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
     if (disk_wait() != 0) return -1;
     
-    /* Check for errors */
-    if (inb(ATA_STATUS) & ATA_SR_ERR) {
-        return -1;
+    if (disk_multiple > 1) {
+        disk_command(lba, count, ATA_CMD_WRITE_MULTIPLE, ATA_CMD_WRITE_MULTIPLE_EXT);
+    } else {
+        disk_command(lba, count, ATA_CMD_WRITE, ATA_CMD_WRITE_EXT);
     }
     
-    /* Read 256 words (512 bytes) */
-    for (i = 0; i < 256; i++) {
-        buf16[i] = inw(ATA_DATA);
+    while (count > 0) {
+        uint32_t n = count < disk_multiple ? count : disk_multiple;
+        
+        if (disk_wait_drq() != 0) return -1;
+        outsw(ATA_DATA, buffer, n * (DISK_SECTOR_SIZE / 2));
+        
+        buffer += n * DISK_SECTOR_SIZE;
+        count -= n;
     }
     
-    return 0;
+    return disk_wait_done();
 }
 
 /*
- * disk_write_sector() - Write one sector to disk
+ * prd_entries() - PRD entries needed for a request's buffer
  * 
- * WHAT: Write 512 bytes to specified sector
- * WHY: To save data to persistent storage
- * HOW: Use ATA WRITE command in PIO mode
+ * WHY: A PRD entry can't cross a 64KB boundary of physical memory
+ */
+static uint32_t prd_entries(const struct disk_request* req)
+{
+    uint32_t offset = (uint32_t)req->buffer & 0xFFFF;
+    
+    return (offset + req->count * DISK_SECTOR_SIZE + 0xFFFF) >> 16;
+}
+
+/*
+ * build_prd() - Fill the PRD table with the buffers of a batch
  * 
- * PARAMS:
- *   lba - Logical Block Address (sector number)
- *   buffer - The 512 bytes to write
- * RETURNS: 0 on success, -1 on error
+ * HOW: Every request contributes one entry per 64KB piece of its buffer,
+ *      so merged requests don't need their buffers to be contiguous
  */
-int disk_write_sector(uint32_t lba, const uint8_t* buffer) 
+static void build_prd(struct disk_request* batch)
 {
-    uint16_t i;
-    const uint16_t* buf16 = (const uint16_t*)buffer;
+    uint32_t n = 0;
+    struct disk_request* req;
     
-    /* Wait for disk to be ready */
-    if (disk_wait() != 0) return -1;
+    for (req = batch; req; req = req->next) {
+        uint32_t addr = (uint32_t)req->buffer;
+        uint32_t left = req->count * DISK_SECTOR_SIZE;
+        
+        while (left > 0) {
+            uint32_t chunk = 0x10000 - (addr & 0xFFFF);  /* Up to the next 64KB boundary */
+            if (chunk > left) chunk = left;
+            
+            prd_table[n].addr = addr;
+            prd_table[n].bytes = (uint16_t)chunk;  /* 64KB wraps to 0, as required */
+            prd_table[n].flags = 0;
+            
+            addr += chunk;
+            left -= chunk;
+            n++;
+        }
+    }
     
-    /* Send write parameters */
-    outb(ATA_SECTOR_COUNT, 1);              /* Write 1 sector */
-    outb(ATA_LBA_LOW,  (uint8_t)(lba));     /* LBA bits 0-7 */
-    outb(ATA_LBA_MID,  (uint8_t)(lba >> 8)); /* LBA bits 8-15 */
-    outb(ATA_LBA_HIGH, (uint8_t)(lba >> 16)); /* LBA bits 16-23 */
-    outb(ATA_DRIVE, SELECTED_DRIVE | ((lba >> 24) & 0x0F)); /* LBA bits 24-27 */
+    prd_table[n - 1].flags = DISK_PRD_EOT;
+}
+
+/*
+ * complete_batch() - Finish every request of a batch
+ * 
+ * NOTE: The link is read before the callback runs, since a callback may
+ *       reuse or resubmit its request
+ */
+static void complete_batch(struct disk_request* batch, int result)
+{
+    while (batch) {
+        struct disk_request* req = batch;
+        
+        batch = req->next;
+        req->next = NULL;
+        req->status = result;
+        if (req->done) req->done(req);
+    }
+}
+
+/*
+ * disk_dispatch() - Start the next batch if the controller is idle
+ * 
+ * WHAT: The elevator: pick the next request, merge its neighbours, start DMA
+ * HOW: C-SCAN - take the first request at or after the sector the last
+ *      batch ended on, wrapping to the lowest LBA at the end of the disk.
+ *      Requests right behind it in the same direction join the batch as
+ *      long as the sector count and PRD table allow.
+ */
+static void disk_dispatch(void)
+{
+    struct disk_request** link = &queue_head;
+    struct disk_request* first;
+    struct disk_request* last;
+    uint32_t count;
+    uint32_t entries;
     
-    /* Send WRITE command */
-    outb(ATA_COMMAND, ATA_CMD_WRITE);
+    if (active || !queue_head) return;
     
-    /* Wait for disk to be ready for data */
-    if (disk_wait() != 0) return -1;
+    while (*link && (*link)->lba < elevator_lba) {
+        link = &(*link)->next;
+    }
+    if (!*link) link = &queue_head;
     
-    /* Write 256 words (512 bytes) */
-    for (i = 0; i < 256; i++) {
-        outw(ATA_DATA, buf16[i]);
+    first = *link;
+    last = first;
+    count = first->count;
+    entries = prd_entries(first);
+    
+    while (last->next && last->next->write == first->write &&
+           last->next->lba == last->lba + last->count &&
+           count + last->next->count <= DISK_MAX_TRANSFER &&
+           entries + prd_entries(last->next) <= DISK_PRD_ENTRIES) {
+        last = last->next;
+        count += last->count;
+        entries += prd_entries(last);
     }
     
-    /* Flush cache (wait for write to complete) */
-    if (disk_wait() != 0) return -1;
+    *link = last->next;
+    last->next = NULL;
+    active = first;
+    active_polls = 0;
+    elevator_lba = first->lba + count;
+    
+    build_prd(first);
+    
+    outb(bm_base + BM_COMMAND, 0);
+    outl(bm_base + BM_PRDT, (uint32_t)prd_table);
+    outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);  /* Write 1 to clear */
     
-    /* Check for errors */
-    if (inb(ATA_STATUS) & ATA_SR_ERR) {
-        return -1;
+    if (disk_wait() != 0) {
+        active = NULL;
+        complete_batch(first, -1);
+        return;
     }
     
-    return 0;
+    if (first->write) {
+        disk_command(first->lba, count, ATA_CMD_WRITE_DMA, ATA_CMD_WRITE_DMA_EXT);
+        outb(bm_base + BM_COMMAND, BM_CMD_START);
+    } else {
+        disk_command(first->lba, count, ATA_CMD_READ_DMA, ATA_CMD_READ_DMA_EXT);
+        outb(bm_base + BM_COMMAND, BM_CMD_READ | BM_CMD_START);
+    }
 }
 
 /*
- * disk_read_sectors() - Read multiple sectors
+ * disk_poll() - Advance the request queue
+ * 
+ * WHAT: Complete the running batch if the drive is done, then start the next
+ * WHY: Run by the IRQ 14 handler; also called from idle loops and by
+ *      anyone waiting on a request, which covers running without the IRQ
+ *      and a lost interrupt. Never blocks, so the shell and network keep
+ *      running while the disk works.
+ * HOW: The drive's interrupt sets BM_SR_IRQ in the bus-master status;
+ *      reading the ATA status register acknowledges it. Interrupts are
+ *      off throughout, so the handler and a poller never both complete
+ *      the same batch.
  */
-int disk_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer) 
+void disk_poll(void)
 {
-    uint32_t i;
+    uint32_t flags = irq_save();
     
-    for (i = 0; i < count; i++) {
-        if (disk_read_sector(lba + i, buffer + (i * DISK_SECTOR_SIZE)) != 0) {
-            return -1;
+    if (active) {
+        uint8_t bm = inb(bm_base + BM_STATUS);
+        int result = 0;
+        
+        if (!(bm & (BM_SR_IRQ | BM_SR_ERR))) {
+            if (++active_polls < DISK_DMA_TIMEOUT) {
+                irq_restore(flags);
+                return;
+            }
+            result = -1;  /* The drive never answered */
         }
+        
+        outb(bm_base + BM_COMMAND, 0);  /* Stop the engine */
+        if (inb(ATA_STATUS) & (ATA_SR_ERR | ATA_SR_DF)) result = -1;
+        if (bm & BM_SR_ERR) result = -1;
+        outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+        
+        struct disk_request* batch = active;
+        active = NULL;
+        complete_batch(batch, result);
     }
     
-    return 0;
+    disk_dispatch();
+    irq_restore(flags);
 }
 
 /*
- * disk_write_sectors() - Write multiple sectors
+ * disk_drain() - Wait until every queued request has completed
+ * 
+ * WHY: PIO commands and CACHE FLUSH can't be issued while DMA is running
  */
-int disk_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer) 
+static void disk_drain(void)
 {
-    uint32_t i;
+    while (active || queue_head) {
+        disk_poll();
+    }
+}
+
+/*
+ * disk_submit() - Queue an asynchronous transfer
+ * 
+ * WHAT: Hand a request to the driver; req->done runs once it completes
+ * HOW: DMA requests are inserted into the LBA-sorted queue (after any with
+ *      the same LBA, so those keep their order). Without a bus-master
+ *      controller, or for an odd buffer address DMA can't use, the
+ *      transfer is done right away by PIO and completes before returning.
+ * NOTE: The caller must not touch the buffer, or queue an overlapping
+ *       request, until the request completes - the elevator reorders
+ * RETURNS: 0 if accepted (done will be called), -1 on a bad request
+ */
+int disk_submit(struct disk_request* req)
+{
+    if (!disk_present || req->count == 0 || req->count > DISK_MAX_TRANSFER) return -1;
+    
+    req->status = DISK_REQ_PENDING;
+    req->next = NULL;
+    perf_count(req->write ? PERF_DISK_WRITE_SECTORS : PERF_DISK_READ_SECTORS, req->count);
+    perf_trace(req->write ? TRACE_DISK_WRITE : TRACE_DISK_READ, req->lba);
     
-    for (i = 0; i < count; i++) {
-        if (disk_write_sector(lba + i, buffer + (i * DISK_SECTOR_SIZE)) != 0) {
-            return -1;
+    if (!bm_base || ((uint32_t)req->buffer & 1)) {
+        int result;
+        
+        disk_drain();
+        if (req->write) {
+            result = disk_transfer_write(req->lba, req->count, req->buffer);
+        } else {
+            result = disk_transfer_read(req->lba, req->count, req->buffer);
         }
+        complete_batch(req, result);
+        return 0;
+    }
+    
+    uint32_t flags = irq_save();
+    struct disk_request** link = &queue_head;
+    while (*link && (*link)->lba <= req->lba) {
+        link = &(*link)->next;
     }
+    req->next = *link;
+    *link = req;
     
+    disk_dispatch();
+    irq_restore(flags);
     return 0;
 }
+
+/*
+ * disk_wait_request() - Poll the queue until a request has completed
+ * RETURNS: The request's result, 0 on success or -1 on error
+ */
+int disk_wait_request(struct disk_request* req)
+{
+    while (req->status == DISK_REQ_PENDING) {
+        disk_poll();
+    }
+    
+    return req->status;
+}
+
+/*
+ * disk_lock() / disk_unlock() - Keep request completions from running
+ * 
+ * WHY: For code that shares state with its completion callbacks, which
+ *      the IRQ 14 handler may run at any time; nests like irq_save()
+ */
+uint32_t disk_lock(void)
+{
+    return irq_save();
+}
+
+void disk_unlock(uint32_t flags)
+{
+    irq_restore(flags);
+}
+
+/*
+ * disk_transfer() - Synchronous transfer through the request queue
+ * 
+ * HOW: One queued request per DISK_MAX_TRANSFER sectors, waited on in turn;
+ *      the whole call is timed into the read or write histogram
+ */
+static int disk_transfer(uint32_t lba, uint32_t count, uint8_t* buffer, uint8_t write)
+{
+    struct disk_request req;
+    uint64_t start = perf_clock();
+    int result = 0;
+    
+    if (!disk_present) return -1;
+    
+    while (count > 0) {
+        uint32_t n = count < DISK_MAX_TRANSFER ? count : DISK_MAX_TRANSFER;
+        
+        req.lba = lba;
+        req.count = n;
+        req.buffer = buffer;
+        req.write = write;
+        req.done = NULL;
+        req.context = NULL;
+        if (disk_submit(&req) != 0 || disk_wait_request(&req) != 0) {
+            result = -1;
+            break;
+        }
+        
+        lba += n;
+        count -= n;
+        buffer += n * DISK_SECTOR_SIZE;
+    }
+    
+    perf_record(write ? PERF_DISK_WRITE : PERF_DISK_READ, start);
+    return result;
+}
+
+/*
+ * disk_read_sector() - Read one sector from disk
+ * 
+ * WHAT: Read 512 bytes from specified sector
+ * WHY: To load data from persistent storage
+ * 
+ * PARAMS:
+ *   lba - Logical Block Address (sector number)
+ *   buffer - Where to store the 512 bytes
+ * RETURNS: 0 on success, -1 on error
+ */
+int disk_read_sector(uint32_t lba, uint8_t* buffer)
+{
+    return disk_read_sectors(lba, 1, buffer);
+}
+
+/*
+ * disk_write_sector() - Write one sector to disk
+ * 
+ * WHAT: Write 512 bytes to specified sector
+ * WHY: To save data to persistent storage
+ * 
+ * PARAMS:
+ *   lba - Logical Block Address (sector number)
+ *   buffer - The 512 bytes to write
+ * RETURNS: 0 on success, -1 on error
+ */
+int disk_write_sector(uint32_t lba, const uint8_t* buffer)
+{
+    return disk_write_sectors(lba, 1, buffer);
+}
+
+/*
+ * disk_read_sectors() - Read multiple sectors
+ * 
+ * HOW: Queued like any other request and waited on (DMA when available)
+ */
+int disk_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    return disk_transfer(lba, count, buffer, 0);
+}
+
+/*
+ * disk_write_sectors() - Write multiple sectors
+ * 
+ * HOW: Queued like any other request and waited on (DMA when available)
+ */
+int disk_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    return disk_transfer(lba, count, (uint8_t*)buffer, 1);  /* Only read from */
+}
+
+/*
+ * disk_flush() - Flush the drive's write cache
+ * 
+ * WHAT: Returns once everything written so far is on the media
+ * WHY: Writes complete as soon as the drive caches them, and the cache
+ *      may reach the platter in any order. Callers issue this only at
+ *      ordering points (before and after a journal commit, on sync).
+ * RETURNS: 0 on success, -1 on error
+ */
+int disk_flush(void)
+{
+    if (!disk_present) return -1;
+    
+    disk_drain();
+    if (disk_wait() != 0) return -1;
+    
+    outb(ATA_DRIVE, SELECTED_DRIVE);
+    outb(ATA_COMMAND, disk_lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH);
+    
+    return disk_wait_done();
+}
+
+/*
+ * disk_get_sectors() - Number of sectors reported by IDENTIFY
+ * RETURNS: Sector count, 0 if no drive was found
+ */
+uint32_t disk_get_sectors(void)
+{
+    return disk_sectors;
+}
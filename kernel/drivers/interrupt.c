@@ -0,0 +1,272 @@
+/*
+ * ==============================================================================
+ * INTERRUPT IMPLEMENTATION
+ * ==============================================================================
+ */
+
+#include "include/interrupt.h"
+#include "include/vga.h"
+#include "include/serial.h"
+#include "include/string.h"
+
+/* 8259 PIC ports and commands */
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+#define PIC_EOI      0x20
+#define PIC_READ_ISR 0x0B
+#define PIC_ICW1     0x11           /* Edge triggered, cascade, ICW4 follows */
+#define PIC_ICW4     0x01           /* 8086 mode */
+#define PIC_CASCADE_IRQ 2           /* Slave PIC is wired to master IRQ 2 */
+
+#define KERNEL_CODE_SEGMENT 0x08    /* From the bootloader's GDT */
+#define IDT_INTERRUPT_GATE 0x8E     /* Present, ring 0, 32-bit, IF cleared on entry */
+#define IDT_STUBS (IRQ_BASE + IRQ_COUNT)
+
+/* One IDT entry */
+struct idt_entry {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type;
+    uint16_t offset_high;
+} __attribute__((packed));
+
+struct idt_pointer {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+static struct idt_entry idt[256] __attribute__((aligned(8)));
+static irq_handler_t irq_handlers[IRQ_COUNT];
+static uint16_t irq_mask = 0xFFFF;  /* Everything masked to start with */
+
+/*
+ * The entry stubs. Each pushes a dummy error code where the CPU doesn't
+ * (so every frame looks the same) and its vector number, then jumps to
+ * isr_common, which saves the registers and calls interrupt_dispatch().
+ * isr_table lists the stubs for interrupts_init().
+ */
+#define ISR(n)    ".globl isr" #n "\nisr" #n ":\n    pushl $0\n    pushl $" #n "\n    jmp isr_common\n"
+#define ISR_ERR(n) ".globl isr" #n "\nisr" #n ":\n    pushl $" #n "\n    jmp isr_common\n"
+
+__asm__(
+    ".text\n"
+    ISR(0) ISR(1) ISR(2) ISR(3) ISR(4) ISR(5) ISR(6) ISR(7)
+    ISR_ERR(8) ISR(9) ISR_ERR(10) ISR_ERR(11) ISR_ERR(12) ISR_ERR(13) ISR_ERR(14) ISR(15)
+    ISR(16) ISR_ERR(17) ISR(18) ISR(19) ISR(20) ISR_ERR(21) ISR(22) ISR(23)
+    ISR(24) ISR(25) ISR(26) ISR(27) ISR(28) ISR_ERR(29) ISR_ERR(30) ISR(31)
+    ISR(32) ISR(33) ISR(34) ISR(35) ISR(36) ISR(37) ISR(38) ISR(39)
+    ISR(40) ISR(41) ISR(42) ISR(43) ISR(44) ISR(45) ISR(46) ISR(47)
+    "isr_common:\n"
+    "    pushal\n"
+    "    cld\n"                         /* The C code expects DF clear */
+    "    pushl %esp\n"                  /* struct interrupt_frame* */
+    "    call interrupt_dispatch\n"
+    "    addl $4, %esp\n"
+    "    popal\n"
+    "    addl $8, %esp\n"               /* Vector and error code */
+    "    iret\n"
+    ".section .rodata\n"
+    ".align 4\n"
+    "isr_table:\n"
+    "    .long isr0, isr1, isr2, isr3, isr4, isr5, isr6, isr7\n"
+    "    .long isr8, isr9, isr10, isr11, isr12, isr13, isr14, isr15\n"
+    "    .long isr16, isr17, isr18, isr19, isr20, isr21, isr22, isr23\n"
+    "    .long isr24, isr25, isr26, isr27, isr28, isr29, isr30, isr31\n"
+    "    .long isr32, isr33, isr34, isr35, isr36, isr37, isr38, isr39\n"
+    "    .long isr40, isr41, isr42, isr43, isr44, isr45, isr46, isr47\n"
+    ".text\n"
+);
+
+extern const uint32_t isr_table[IDT_STUBS];
+
+/* I/O port operations */
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+/* Dual output helper */
+static void interrupt_print(const char* str) {
+    vga_print(str);
+    serial_print(str);
+}
+
+static void interrupt_print_hex(uint32_t value) {
+    const char* hex_chars = "0123456789ABCDEF";
+    char buffer[11] = "0x";
+    
+    for (int i = 9; i >= 2; i--) {
+        buffer[i] = hex_chars[value & 0xF];
+        value >>= 4;
+    }
+    buffer[10] = '\0';
+    
+    interrupt_print(buffer);
+}
+
+/*
+ * pic_write_mask() - Load the IRQ mask into both PICs
+ */
+static void pic_write_mask(void)
+{
+    outb(PIC1_DATA, (uint8_t)irq_mask);
+    outb(PIC2_DATA, (uint8_t)(irq_mask >> 8));
+}
+
+/*
+ * pic_remap() - Move the IRQs to vectors 32-47
+ * 
+ * WHY: The BIOS leaves IRQ 0-7 on vectors 8-15, where they collide with
+ *      CPU exceptions (double fault, page fault, ...)
+ */
+static void pic_remap(void)
+{
+    outb(PIC1_COMMAND, PIC_ICW1);
+    outb(PIC2_COMMAND, PIC_ICW1);
+    outb(PIC1_DATA, IRQ_BASE);               /* ICW2: vector offsets */
+    outb(PIC2_DATA, IRQ_BASE + 8);
+    outb(PIC1_DATA, 1 << PIC_CASCADE_IRQ);   /* ICW3: slave on IRQ 2 */
+    outb(PIC2_DATA, PIC_CASCADE_IRQ);
+    outb(PIC1_DATA, PIC_ICW4);
+    outb(PIC2_DATA, PIC_ICW4);
+    
+    pic_write_mask();
+}
+
+/*
+ * pic_spurious() - Check for a spurious IRQ 7 or 15
+ * 
+ * WHY: The PIC raises vector 7 (or 15) when an IRQ goes away before it is
+ *      acknowledged; that interrupt isn't in service and gets no EOI
+ *      (except the master's EOI for the cascade, for IRQ 15)
+ */
+static int pic_spurious(uint32_t irq)
+{
+    if (irq == 7) {
+        outb(PIC1_COMMAND, PIC_READ_ISR);
+        return !(inb(PIC1_COMMAND) & 0x80);
+    }
+    if (irq == 15) {
+        outb(PIC2_COMMAND, PIC_READ_ISR);
+        if (!(inb(PIC2_COMMAND) & 0x80)) {
+            outb(PIC1_COMMAND, PIC_EOI);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * interrupt_dispatch() - Common C entry of every stub
+ * 
+ * WHAT: Exceptions report and halt; IRQs run their handler, then EOI
+ * HOW: EOI goes to the slave too for IRQ 8-15. It is sent after the
+ *      handler, so the same IRQ can't come back while it runs.
+ */
+void interrupt_dispatch(struct interrupt_frame* frame);
+void interrupt_dispatch(struct interrupt_frame* frame)
+{
+    if (frame->vector < IRQ_BASE) {
+        interrupt_print("\n[PANIC] CPU exception ");
+        interrupt_print_hex(frame->vector);
+        interrupt_print(" at EIP ");
+        interrupt_print_hex(frame->eip);
+        interrupt_print(", error code ");
+        interrupt_print_hex(frame->error_code);
+        interrupt_print("\n");
+        serial_flush_output();  /* Interrupts stay off, so nothing else will */
+        
+        while (1) {
+            __asm__ __volatile__("cli; hlt");
+        }
+    }
+    
+    uint32_t irq = frame->vector - IRQ_BASE;
+    
+    if (pic_spurious(irq)) return;
+    
+    if (irq_handlers[irq]) {
+        irq_handlers[irq]();
+    }
+    
+    if (irq >= 8) outb(PIC2_COMMAND, PIC_EOI);
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+/*
+ * idt_set_gate() - Point one vector at a stub
+ */
+static void idt_set_gate(uint32_t vector, uint32_t handler)
+{
+    idt[vector].offset_low = handler & 0xFFFF;
+    idt[vector].selector = KERNEL_CODE_SEGMENT;
+    idt[vector].zero = 0;
+    idt[vector].type = IDT_INTERRUPT_GATE;
+    idt[vector].offset_high = handler >> 16;
+}
+
+/*
+ * interrupts_init() - Build and load the IDT, remap the PICs
+ * 
+ * WHY: Must run before any driver registers an IRQ; interrupts stay off
+ *      until interrupts_enable()
+ */
+void interrupts_init(void)
+{
+    struct idt_pointer pointer;
+    uint32_t i;
+    
+    /* Vectors past the IRQs stay not-present (a stray INT faults) */
+    memset(idt, 0, sizeof(idt));
+    for (i = 0; i < IDT_STUBS; i++) {
+        idt_set_gate(i, isr_table[i]);
+    }
+    for (i = 0; i < IRQ_COUNT; i++) {
+        irq_handlers[i] = NULL;
+    }
+    
+    pointer.limit = sizeof(idt) - 1;
+    pointer.base = (uint32_t)idt;
+    __asm__ __volatile__("lidt %0" : : "m"(pointer));
+    
+    irq_mask = 0xFFFF;
+    pic_remap();
+}
+
+/*
+ * irq_register() - Install the handler of one IRQ and unmask it
+ * RETURNS: 0 on success, -1 for an invalid IRQ or one already taken
+ */
+int irq_register(uint8_t irq, irq_handler_t handler)
+{
+    uint32_t flags;
+    
+    if (irq >= IRQ_COUNT || irq == PIC_CASCADE_IRQ || !handler || irq_handlers[irq]) {
+        return -1;
+    }
+    
+    flags = irq_save();
+    irq_handlers[irq] = handler;
+    irq_mask &= ~(1u << irq);
+    if (irq >= 8) irq_mask &= ~(1u << PIC_CASCADE_IRQ);
+    pic_write_mask();
+    irq_restore(flags);
+    
+    return 0;
+}
+
+/*
+ * interrupts_enable() - Start taking interrupts
+ */
+void interrupts_enable(void)
+{
+    __asm__ __volatile__("sti");
+}
@@ -6,6 +6,7 @@
 
 #include "include/keyboard.h"
 #include "include/vga.h"
+#include "include/task.h"
 
 /* US QWERTY keyboard layout - scan code to ASCII */
 static const char scancode_map[] = {
@@ -61,7 +62,8 @@ uint8_t keyboard_has_input(void)
  * 
  * WHAT: Wait for keypress and return ASCII character
  * WHY: Basic input function for reading user commands
- * HOW: Poll keyboard controller until key available, convert scan code
+ * HOW: Poll keyboard controller until key available (sleeping a tick
+ *      between polls so other tasks run), convert scan code
  * RETURNS: ASCII character
  */
 char keyboard_getchar(void) 
@@ -71,7 +73,9 @@ char keyboard_getchar(void)
     /* Wait for key press */
     while (1) {
         /* Check if data is available (bit 0 of status register) */
-        if (inb(0x64) & 0x01) {
+        if (!(inb(0x64) & 0x01)) {
+            task_sleep(1);
+        } else {
             scancode = inb(0x60);
             
             /* Check for shift press/release */
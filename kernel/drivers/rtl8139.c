@@ -1,20 +1,55 @@
 #include "include/rtl8139.h"
 #include "include/vga.h"
+#include "include/string.h"
+#include "include/interrupt.h"
+#include "include/task.h"
+#include "include/perf.h"
 #include <stdint.h>
 
 // PCI configuration
 #define PCI_CONFIG_ADDRESS 0xCF8
 #define PCI_CONFIG_DATA    0xCFC
+#define PCI_INTERRUPT_LINE 0x3C
 
 static uint32_t rtl8139_io_base = 0;
 static uint8_t* rx_buffer;
-static uint8_t* tx_buffers[4];
-static uint8_t tx_current = 0;
 static uint16_t rx_offset = 0;
+static uint8_t irq_driven = 0;
 
-// Receive buffer (8KB + 16 bytes for wraparound)
-static uint8_t rx_buf[8192 + 16 + 1500] __attribute__((aligned(4)));
-static uint8_t tx_buf[4][1536] __attribute__((aligned(4)));
+// Receive ring (32KB + 16 bytes, plus room for a frame written past the
+// end in WRAP mode)
+static uint8_t rx_buf[RTL8139_RX_RING_SIZE + 16 + 1536] __attribute__((aligned(4)));
+
+// Frames taken off the ring by the interrupt handler, waiting for
+// rtl8139_poll(). Single producer (IRQ) and consumer (main loop), so the
+// free-running indices need no lock.
+struct rx_slot {
+    uint16_t length;
+    uint8_t data[RTL8139_RX_MAX_FRAME];
+};
+
+static struct rx_slot rx_queue[RTL8139_RX_QUEUE];
+static volatile uint32_t rx_head = 0;   // Written by the handler
+static volatile uint32_t rx_tail = 0;   // Written by rtl8139_poll()
+static struct task* rx_task = 0;       // Woken when frames are queued
+
+// Transmit buffers. The stack builds each frame in place in one of these
+// (rtl8139_tx_alloc), then submits it; the 4 descriptors are loaded in
+// ring order and frames that find them all busy wait in the backlog.
+// Shared with the interrupt handler, so changed only with IRQs off.
+static uint8_t tx_buf[RTL8139_TX_BUFFERS][RTL8139_TX_BUFFER_SIZE] __attribute__((aligned(4)));
+static uint16_t tx_length[RTL8139_TX_BUFFERS];
+static uint8_t tx_free[RTL8139_TX_BUFFERS];        // Stack of free buffer numbers
+static uint8_t tx_free_count = 0;
+static uint8_t tx_backlog[RTL8139_TX_BUFFERS];     // FIFO of submitted buffers
+static uint8_t tx_backlog_head = 0;
+static uint8_t tx_backlog_count = 0;
+static uint8_t tx_desc_buffer[RTL8139_TX_DESCRIPTORS];  // Buffer in each descriptor
+static uint8_t tx_next = 0;        // Next descriptor to load
+static uint8_t tx_dirty = 0;       // Oldest descriptor still sending
+static uint8_t tx_in_flight = 0;
+
+#define TX_ALLOC_SPINS 1000000     // Give up waiting for a free buffer
 
 // Port I/O helpers
 static inline void outb(uint16_t port, uint8_t val) {
@@ -31,6 +66,12 @@ static inline void outw(uint16_t port, uint16_t val) {
     asm volatile ("outw %0, %1" : : "a"(val), "Nd"(port));
 }
 
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    asm volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
 static inline void outl(uint16_t port, uint32_t val) {
     asm volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
 }
@@ -57,6 +98,19 @@ static uint32_t pci_find_device(uint16_t vendor_id, uint16_t device_id) {
     return 0;
 }
 
+// Point the NIC at the start of an empty receive ring and (re)start RX
+static void rx_start(void) {
+    outl(rtl8139_io_base + RTL8139_RXBUF, (uint32_t)rx_buffer);
+    outw(rtl8139_io_base + RTL8139_RXBUFPTR, 0xFFF0);  // CAPR trails by 16
+    rx_offset = 0;
+    
+    // Accept all packets, 32KB ring, WRAP: a frame that runs past the
+    // end is written on into the slack instead of wrapping
+    outl(rtl8139_io_base + RTL8139_RCR,
+         RTL8139_RCR_AAP | RTL8139_RCR_APM | RTL8139_RCR_AM | RTL8139_RCR_AB |
+         RTL8139_RCR_WRAP | RTL8139_RCR_RBLEN_32K);
+}
+
 void rtl8139_init(void) {
     vga_print("Searching for RTL8139 on PCI bus...\n");
     
@@ -93,25 +147,21 @@ void rtl8139_init(void) {
     
     // Initialize buffers
     rx_buffer = rx_buf;
-    for (int i = 0; i < 4; i++) {
-        tx_buffers[i] = tx_buf[i];
+    for (int i = 0; i < RTL8139_TX_BUFFERS; i++) {
+        tx_free[i] = i;
     }
+    tx_free_count = RTL8139_TX_BUFFERS;
+    tx_backlog_head = tx_backlog_count = 0;
+    tx_next = tx_dirty = tx_in_flight = 0;   // Reset starts at descriptor 0
     
-    // Set receive buffer address
-    outl(rtl8139_io_base + RTL8139_RXBUF, (uint32_t)rx_buffer);
-    
-    // Reset receive buffer pointer (CAPR)
-    outw(rtl8139_io_base + RTL8139_RXBUFPTR, 0);
-    rx_offset = 0;
+    // Set up the receive ring
+    rx_start();
+    rx_head = rx_tail = 0;
     
-    // Set IMR (interrupt mask) - enable ROK and TOK
-    outw(rtl8139_io_base + RTL8139_IMR, RTL8139_INT_ROK | RTL8139_INT_TOK);
-    
-    // Set RCR (receive config) - accept all packets with wrap
-    // WRAP=1, accept all physical, multicast, broadcast
-    outl(rtl8139_io_base + RTL8139_RCR, 
-         0x0000000F |  // Accept all packets (AAP, APM, AM, AB)
-         (1 << 7));     // WRAP at end of buffer
+    // Set IMR (interrupt mask) - receive, overflow and transmit events
+    outw(rtl8139_io_base + RTL8139_IMR,
+         RTL8139_INT_ROK | RTL8139_INT_RER | RTL8139_INT_RXOVW | RTL8139_INT_FOVW |
+         RTL8139_INT_TOK | RTL8139_INT_TER);
     
     // Set TCR (transmit config) - standard configuration
     outl(rtl8139_io_base + RTL8139_TCR, 0x03000700);
@@ -119,6 +169,19 @@ void rtl8139_init(void) {
     // Enable receive and transmit
     outb(rtl8139_io_base + RTL8139_CMD, RTL8139_CMD_RX_EN | RTL8139_CMD_TX_EN);
     
+    // Take the interrupt the BIOS routed to us; without one, rtl8139_poll()
+    // keeps checking the ring itself
+    outl(PCI_CONFIG_ADDRESS, pci_addr | PCI_INTERRUPT_LINE);
+    uint8_t irq = inl(PCI_CONFIG_DATA) & 0xFF;
+    irq_driven = (irq_register(irq, rtl8139_handle_interrupt) == 0);
+    if (irq_driven) {
+        vga_print("RTL8139 on IRQ 0x");
+        vga_print_hex(irq);
+        vga_print("\n");
+    } else {
+        vga_print("RTL8139: no usable IRQ, polling\n");
+    }
+    
     vga_print("RTL8139 READY!\n");
     vga_print("MAC Address: ");
     for (int i = 0; i < 6; i++) {
@@ -133,71 +196,211 @@ void rtl8139_init(void) {
     vga_print("Network card initialized and ready to receive\n");
 }
 
-void rtl8139_send_packet(const uint8_t* data, uint16_t length) {
-    if (rtl8139_io_base == 0 || length > 1500) return;
+// Hand a frame to the next descriptor
+static void tx_load(uint8_t index) {
+    uint8_t desc = tx_next;
     
-    // Copy to TX buffer
-    for (uint16_t i = 0; i < length; i++) {
-        tx_buffers[tx_current][i] = data[i];
+    tx_desc_buffer[desc] = index;
+    outl(rtl8139_io_base + RTL8139_TXADDR0 + (desc * 4), (uint32_t)tx_buf[index]);
+    
+    // Writing the length clears OWN and starts the transmission
+    outl(rtl8139_io_base + RTL8139_TXSTATUS0 + (desc * 4), tx_length[index]);
+    
+    tx_next = (tx_next + 1) % RTL8139_TX_DESCRIPTORS;
+    tx_in_flight++;
+}
+
+// Free the buffers of finished descriptors, oldest first (the NIC
+// completes them in order), then move backlogged frames onto the
+// descriptors that opened up. Caller has IRQs off.
+static void tx_reclaim(void) {
+    while (tx_in_flight > 0) {
+        uint32_t status = inl(rtl8139_io_base + RTL8139_TXSTATUS0 + (tx_dirty * 4));
+        
+        if (!(status & (RTL8139_TSD_TOK | RTL8139_TSD_TUN | RTL8139_TSD_TABT))) break;
+        if (!(status & RTL8139_TSD_TOK)) perf_count(PERF_NET_TX_ERRORS, 1);
+        
+        tx_free[tx_free_count++] = tx_desc_buffer[tx_dirty];
+        tx_dirty = (tx_dirty + 1) % RTL8139_TX_DESCRIPTORS;
+        tx_in_flight--;
     }
     
-    // Set transmit address
-    outl(rtl8139_io_base + RTL8139_TXADDR0 + (tx_current * 4), 
-         (uint32_t)tx_buffers[tx_current]);
+    while (tx_in_flight < RTL8139_TX_DESCRIPTORS && tx_backlog_count > 0) {
+        tx_load(tx_backlog[tx_backlog_head]);
+        tx_backlog_head = (tx_backlog_head + 1) % RTL8139_TX_BUFFERS;
+        tx_backlog_count--;
+    }
+}
+
+// Reserve a transmit buffer (RTL8139_TX_BUFFER_SIZE bytes) to build a
+// frame in. Waits for the NIC if all of them are queued or in flight.
+// Returns NULL if there is no NIC or nothing completes in time.
+uint8_t* rtl8139_tx_alloc(void) {
+    if (rtl8139_io_base == 0) return NULL;
     
-    // Set transmit status (length)
-    outl(rtl8139_io_base + RTL8139_TXSTATUS0 + (tx_current * 4), length);
+    for (uint32_t spins = 0; spins < TX_ALLOC_SPINS; spins++) {
+        uint32_t flags = irq_save();
+        
+        tx_reclaim();   // Also catches completions when running without an IRQ
+        if (tx_free_count > 0) {
+            uint8_t index = tx_free[--tx_free_count];
+            irq_restore(flags);
+            return tx_buf[index];
+        }
+        
+        irq_restore(flags);
+    }
     
-    // Move to next TX buffer
-    tx_current = (tx_current + 1) % 4;
+    perf_count(PERF_NET_TX_DROPPED, 1);
+    perf_trace(TRACE_NET_DROP, 0);
+    return NULL;
 }
 
-void rtl8139_handle_interrupt(void) {
-    if (rtl8139_io_base == 0) return;
+// Send a frame built in a buffer from rtl8139_tx_alloc(). The buffer
+// belongs to the driver from here on, even when this fails.
+// Returns 0 if the frame was queued, -1 if it is not a valid frame.
+int rtl8139_tx_submit(uint8_t* frame, uint16_t length) {
+    uint32_t index = (uint32_t)(frame - tx_buf[0]) / RTL8139_TX_BUFFER_SIZE;
+    uint32_t flags;
     
-    uint16_t status = inb(rtl8139_io_base + RTL8139_ISR);
+    if (index >= RTL8139_TX_BUFFERS || frame != tx_buf[index]) return -1;
     
-    // Acknowledge interrupt if any
-    if (status != 0) {
-        outb(rtl8139_io_base + RTL8139_ISR, status);
+    flags = irq_save();
+    
+    if (length > RTL8139_TX_MAX_FRAME) {
+        tx_free[tx_free_count++] = index;
+        perf_count(PERF_NET_TX_DROPPED, 1);
+        perf_trace(TRACE_NET_DROP, length);
+        irq_restore(flags);
+        return -1;
     }
     
-    // Check if receive buffer is not empty (poll mode)
-    // Bit 0 of CMD register = 1 means buffer is empty
-    uint8_t cmd = inb(rtl8139_io_base + RTL8139_CMD);
+    // The NIC doesn't pad runt frames itself
+    if (length < RTL8139_TX_MIN_FRAME) {
+        memset(frame + length, 0, RTL8139_TX_MIN_FRAME - length);
+        length = RTL8139_TX_MIN_FRAME;
+    }
+    tx_length[index] = length;
     
-    if ((cmd & 0x01) == 0) {
-        extern void net_process_packet(uint8_t* packet, uint16_t length);
-        
+    // Keep frames in order: only go straight to a descriptor if no others wait
+    tx_reclaim();
+    if (tx_backlog_count == 0 && tx_in_flight < RTL8139_TX_DESCRIPTORS) {
+        tx_load(index);
+    } else {
+        tx_backlog[(tx_backlog_head + tx_backlog_count) % RTL8139_TX_BUFFERS] = index;
+        tx_backlog_count++;
+    }
+    perf_count(PERF_NET_TX, 1);
+    perf_trace(TRACE_NET_TX, length);
+    
+    irq_restore(flags);
+    return 0;
+}
+
+// Send a frame that is already built elsewhere (costs one copy)
+void rtl8139_send_packet(const uint8_t* data, uint16_t length) {
+    if (length > RTL8139_TX_MAX_FRAME) return;
+    
+    uint8_t* frame = rtl8139_tx_alloc();
+    if (!frame) return;
+    
+    memcpy(frame, data, length);
+    rtl8139_tx_submit(frame, length);
+}
+
+// Restart the receiver after a corrupt header or an overflow; whatever
+// was still in the ring is lost
+static void rx_reset(void) {
+    outb(rtl8139_io_base + RTL8139_CMD, RTL8139_CMD_TX_EN);
+    rx_start();
+    outb(rtl8139_io_base + RTL8139_CMD, RTL8139_CMD_RX_EN | RTL8139_CMD_TX_EN);
+}
+
+// Move every frame in the ring to rx_queue and hand the space back to
+// the NIC. Frames that find the queue full are dropped and counted.
+static void rx_drain(void) {
+    while ((inb(rtl8139_io_base + RTL8139_CMD) & RTL8139_CMD_BUFE) == 0) {
         uint16_t* header = (uint16_t*)(rx_buffer + rx_offset);
         uint16_t rx_status = header[0];
-        uint16_t length = header[1];
+        uint16_t length = header[1];     // Includes the 4-byte CRC
         
-        // Debug: show that we received something
-        static int rx_count = 0;
-        if (rx_count++ < 5) {
-            vga_print("RX: status=");
-            vga_print_hex(rx_status);
-            vga_print(" len=");
-            vga_print_hex(length);
-            vga_print("\n");
+        if (length == 0xFFF0) break;     // NIC is still copying this frame
+        
+        if (!(rx_status & RTL8139_RX_ROK) || length < 4 + 14 ||
+            length > RTL8139_RX_MAX_FRAME + 4) {
+            rx_reset();
+            return;
         }
         
-        // Check if packet is valid (ROK bit set in status)
-        if ((rx_status & 0x01) && length > 0 && length < 1500) {
-            // Process packet (skip 4-byte header)
-            net_process_packet(rx_buffer + rx_offset + 4, length - 4);
+        if (rx_head - rx_tail < RTL8139_RX_QUEUE) {
+            struct rx_slot* slot = &rx_queue[rx_head % RTL8139_RX_QUEUE];
+            slot->length = length - 4;
+            memcpy(slot->data, rx_buffer + rx_offset + 4, slot->length);
+            asm volatile ("" : : : "memory");   // Slot before index
+            rx_head++;
+            perf_count(PERF_NET_RX, 1);
+            perf_trace(TRACE_NET_RX, slot->length);
+        } else {
+            perf_count(PERF_NET_RX_DROPPED, 1);
+            perf_trace(TRACE_NET_DROP, length - 4);
         }
         
-        // Move offset (align to 4 bytes)
+        // Next frame starts 4-byte aligned after this one
         rx_offset = (rx_offset + length + 4 + 3) & ~3;
-        if (rx_offset >= 8192) rx_offset -= 8192;
+        rx_offset %= RTL8139_RX_RING_SIZE;
         
         // Update CAPR (Current Address of Packet Read)
         outw(rtl8139_io_base + RTL8139_RXBUFPTR, rx_offset - 0x10);
     }
 }
 
+// IRQ handler: acknowledge, then empty the whole receive ring so a
+// burst can't overrun it while the main loop is busy
+void rtl8139_handle_interrupt(void) {
+    if (rtl8139_io_base == 0) return;
+    
+    uint16_t status = inw(rtl8139_io_base + RTL8139_ISR);
+    
+    // Acknowledge interrupt if any (write 1 to clear)
+    if (status != 0) {
+        outw(rtl8139_io_base + RTL8139_ISR, status);
+    }
+    
+    if (status & (RTL8139_INT_RXOVW | RTL8139_INT_FOVW)) {
+        perf_count(PERF_NET_RX_DROPPED, 1);
+        perf_trace(TRACE_NET_DROP, 0);
+    }
+    
+    rx_drain();
+    if (rx_tail != rx_head) task_wake(rx_task);
+    
+    // Completed frames free their buffers and let the backlog move on
+    if (status & (RTL8139_INT_TOK | RTL8139_INT_TER)) {
+        tx_reclaim();
+    }
+}
+
+// Give the queued frames to the network stack. Runs in the main loop,
+// never from the interrupt, so the stack can reply and run commands.
+void rtl8139_poll(void) {
+    extern void net_process_packet(uint8_t* packet, uint16_t length);
+    
+    if (rtl8139_io_base == 0) return;
+    if (!irq_driven) rtl8139_handle_interrupt();
+    
+    while (rx_tail != rx_head) {
+        struct rx_slot* slot = &rx_queue[rx_tail % RTL8139_RX_QUEUE];
+        net_process_packet(slot->data, slot->length);
+        asm volatile ("" : : : "memory");   // Done with the slot before freeing it
+        rx_tail++;
+    }
+}
+
+// Name the task that runs rtl8139_poll(), so it can sleep until frames arrive
+void rtl8139_set_rx_task(struct task* task) {
+    rx_task = task;
+}
+
 uint8_t rtl8139_get_mac(uint8_t index) {
     if (rtl8139_io_base == 0 || index >= 6) return 0;
     return inb(rtl8139_io_base + RTL8139_IDR0 + index);
@@ -5,6 +5,48 @@
  */
 
 #include "include/serial.h"
+#include "include/interrupt.h"
+#include "include/task.h"
+
+/* 16550 registers (offsets from COM1_PORT) */
+#define UART_DATA 0                 /* RBR / THR */
+#define UART_IER 1                  /* Interrupt enable */
+#define UART_IIR 2                  /* Interrupt identification (read) */
+#define UART_FCR 2                  /* FIFO control (write) */
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+
+#define IER_RDA 0x01                /* Received data available */
+#define IER_THRE 0x02               /* Transmit holding register empty */
+#define IER_RLS 0x04                /* Receiver line status */
+
+#define IIR_NONE 0x01               /* No interrupt pending */
+#define IIR_ID_MASK 0x0E
+
+#define FCR_ENABLE 0x01
+#define FCR_CLEAR_RX 0x02
+#define FCR_CLEAR_TX 0x04
+#define FCR_TRIGGER_8 0x80          /* RX interrupt at 8 bytes */
+
+#define LSR_DR 0x01                 /* Data ready */
+#define LSR_THRE 0x20               /* Transmit holding register empty */
+
+#define MCR_DTR 0x01
+#define MCR_RTS 0x02
+#define MCR_OUT2 0x08               /* Gates the IRQ line on PCs */
+
+/* Rings: head is where the producer writes, tail where the consumer reads */
+static uint8_t tx_ring[SERIAL_TX_RING];
+static volatile uint32_t tx_head;
+static volatile uint32_t tx_tail;
+static uint8_t rx_ring[SERIAL_RX_RING];
+static volatile uint32_t rx_head;
+static volatile uint32_t rx_tail;
+static uint32_t rx_overruns;
+static uint8_t irq_driven;
+static uint8_t skip_lf;             /* Last line ended on CR; drop a following LF */
 
 /* I/O port operations */
 static inline void outb(uint16_t port, uint8_t val) {
@@ -17,62 +59,158 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+/*
+ * rx_fill() - Move everything the UART has received into the RX ring
+ * 
+ * NOTE: Bytes that don't fit are read anyway and counted, so the FIFO
+ *       can't stall the receive interrupt
+ */
+static void rx_fill(void)
+{
+    while (inb(COM1_PORT + UART_LSR) & LSR_DR) {
+        uint8_t byte = inb(COM1_PORT + UART_DATA);
+        
+        if (rx_head - rx_tail < SERIAL_RX_RING) {
+            rx_ring[rx_head & (SERIAL_RX_RING - 1)] = byte;
+            rx_head++;
+        } else {
+            rx_overruns++;
+        }
+    }
+}
+
+/*
+ * tx_fill() - Load the empty transmit FIFO from the TX ring
+ * 
+ * HOW: THRE means the whole 16-byte FIFO is free. The THRE interrupt stays
+ *      enabled whenever the ring still has bytes waiting, even if the FIFO
+ *      is busy right now - otherwise bytes queued behind an earlier write
+ *      would wait for the next write to find the FIFO empty
+ * NOTE: Caller must have interrupts off, the handler also runs this
+ */
+static void tx_fill(void)
+{
+    uint32_t n = 0;
+    
+    if (inb(COM1_PORT + UART_LSR) & LSR_THRE) {
+        while (n < SERIAL_FIFO_SIZE && tx_tail != tx_head) {
+            outb(COM1_PORT + UART_DATA, tx_ring[tx_tail & (SERIAL_TX_RING - 1)]);
+            tx_tail++;
+            n++;
+        }
+    }
+    
+    if (irq_driven) {
+        outb(COM1_PORT + UART_IER, IER_RDA | IER_RLS | (tx_tail != tx_head ? IER_THRE : 0));
+    }
+}
+
+/*
+ * serial_handle_interrupt() - IRQ 4 handler
+ * 
+ * HOW: Service causes until IIR reports none left; reading LSR, RBR, IIR
+ *      or MSR acknowledges the corresponding cause
+ */
+static void serial_handle_interrupt(void)
+{
+    uint8_t iir;
+    
+    while (!((iir = inb(COM1_PORT + UART_IIR)) & IIR_NONE)) {
+        switch (iir & IIR_ID_MASK) {
+        case 0x04:               /* Received data */
+        case 0x0C:               /* Character timeout */
+            rx_fill();
+            break;
+        case 0x02:               /* THR empty */
+            tx_fill();
+            break;
+        case 0x06:               /* Line status */
+            (void)inb(COM1_PORT + UART_LSR);
+            break;
+        default:                 /* Modem status */
+            (void)inb(COM1_PORT + UART_MSR);
+            break;
+        }
+    }
+}
+
+/*
+ * serial_poll() - Service both rings by hand
+ * 
+ * WHY: Used while the ring is full or without the IRQ; safe to call at
+ *      any time since it runs with interrupts off
+ */
+static void serial_poll(void)
+{
+    uint32_t flags = irq_save();
+    
+    rx_fill();
+    tx_fill();
+    irq_restore(flags);
+}
+
 /*
  * serial_init() - Initialize serial port COM1
+ * 
+ * NOTE: Must run after interrupts_init(), which resets the IRQ handlers
  */
 void serial_init(void) 
 {
+    /* Telnet control codes: IAC WILL ECHO, IAC WILL SUPPRESS-GO-AHEAD,
+       IAC DO SUPPRESS-GO-AHEAD - the client stops echoing locally */
+    static const char telnet_setup[] = {
+        (char)255, (char)251, 1,
+        (char)255, (char)251, 3,
+        (char)255, (char)253, 3
+    };
+    
+    tx_head = 0;
+    tx_tail = 0;
+    rx_head = 0;
+    rx_tail = 0;
+    rx_overruns = 0;
+    skip_lf = 0;
+    
     /* Disable interrupts */
-    outb(COM1_PORT + 1, 0x00);
+    outb(COM1_PORT + UART_IER, 0x00);
     
     /* Enable DLAB (set baud rate divisor) */
-    outb(COM1_PORT + 3, 0x80);
+    outb(COM1_PORT + UART_LCR, 0x80);
     
     /* Set divisor to 3 (38400 baud) */
     outb(COM1_PORT + 0, 0x03);
     outb(COM1_PORT + 1, 0x00);
     
     /* 8 bits, no parity, one stop bit */
-    outb(COM1_PORT + 3, 0x03);
+    outb(COM1_PORT + UART_LCR, 0x03);
     
-    /* Enable FIFO, clear them, with 14-byte threshold */
-    outb(COM1_PORT + 2, 0xC7);
+    /* Enable FIFOs and clear them; interrupt once 8 bytes have arrived,
+       leaving room for 8 more before the receiver overruns */
+    outb(COM1_PORT + UART_FCR, FCR_ENABLE | FCR_CLEAR_RX | FCR_CLEAR_TX | FCR_TRIGGER_8);
     
-    /* IRQs enabled, RTS/DSR set */
-    outb(COM1_PORT + 4, 0x0B);
+    /* IRQ line enabled, DTR/RTS set */
+    outb(COM1_PORT + UART_MCR, MCR_DTR | MCR_RTS | MCR_OUT2);
     
-    /* Send telnet control codes to disable local echo */
-    /* Wait for port to be ready, then send IAC WILL ECHO */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 255);  /* IAC */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 251);  /* WILL */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 1);    /* ECHO */
+    /* Drop whatever is left in the receive path */
+    (void)inb(COM1_PORT + UART_LSR);
+    (void)inb(COM1_PORT + UART_DATA);
+    (void)inb(COM1_PORT + UART_IIR);
+    (void)inb(COM1_PORT + UART_MSR);
     
-    /* IAC WILL SUPPRESS-GO-AHEAD */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 255);  /* IAC */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 251);  /* WILL */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 3);    /* SUPPRESS-GO-AHEAD */
+    irq_driven = (irq_register(COM1_IRQ, serial_handle_interrupt) == 0);
+    if (irq_driven) {
+        outb(COM1_PORT + UART_IER, IER_RDA | IER_RLS);
+    }
     
-    /* IAC DO SUPPRESS-GO-AHEAD */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 255);  /* IAC */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 253);  /* DO */
-    while (!(inb(COM1_PORT + 5) & 0x20));
-    outb(COM1_PORT, 3);    /* SUPPRESS-GO-AHEAD */
+    serial_write(telnet_setup, sizeof(telnet_setup));
 }
 
 /*
- * serial_can_write() - Check if transmit buffer is empty
+ * serial_can_write() - Check if the TX ring has room
  */
 int serial_can_write(void) 
 {
-    return inb(COM1_PORT + 5) & 0x20;
+    return tx_head - tx_tail < SERIAL_TX_RING;
 }
 
 /*
@@ -80,7 +218,9 @@ int serial_can_write(void)
  */
 int serial_can_read(void) 
 {
-    return inb(COM1_PORT + 5) & 0x01;
+    if (!irq_driven) serial_poll();
+    
+    return rx_head != rx_tail;
 }
 
 /*
@@ -89,9 +229,64 @@ int serial_can_read(void)
  */
 void serial_flush_input(void)
 {
-    while (serial_can_read()) {
-        (void)inb(COM1_PORT);
+    uint32_t flags = irq_save();
+    
+    rx_fill();
+    rx_tail = rx_head;
+    skip_lf = 0;
+    irq_restore(flags);
+}
+
+/*
+ * serial_flush_output() - Wait until all queued output has been sent
+ * 
+ * WHY: For anything that stops the kernel right after printing, like an
+ *      exception report, where the interrupt would never drain the ring
+ */
+void serial_flush_output(void)
+{
+    while (tx_tail != tx_head) {
+        serial_poll();
+    }
+}
+
+/*
+ * serial_write() - Queue bytes for transmission
+ * 
+ * WHAT: Copy as much as fits into the TX ring and start the transmitter;
+ *       never waits for the UART
+ * RETURNS: Number of bytes queued, less than len when the ring is full
+ */
+uint32_t serial_write(const char* buf, uint32_t len)
+{
+    uint32_t flags;
+    uint32_t n = 0;
+    
+    flags = irq_save();
+    while (n < len && tx_head - tx_tail < SERIAL_TX_RING) {
+        tx_ring[tx_head & (SERIAL_TX_RING - 1)] = (uint8_t)buf[n];
+        tx_head++;
+        n++;
     }
+    tx_fill();  /* Kick an idle transmitter; the IRQ takes it from there */
+    irq_restore(flags);
+    
+    return n;
+}
+
+/*
+ * serial_read() - Take one byte from the RX ring
+ * RETURNS: The byte, or -1 if nothing has arrived
+ */
+int serial_read(void)
+{
+    int byte;
+    
+    if (!serial_can_read()) return -1;
+    
+    byte = rx_ring[rx_tail & (SERIAL_RX_RING - 1)];
+    rx_tail++;
+    return byte;
 }
 
 /*
@@ -99,11 +294,10 @@ void serial_flush_input(void)
  */
 void serial_putchar(char c) 
 {
-    /* Wait until transmit buffer is empty */
-    while (!serial_can_write());
-    
-    /* Send character */
-    outb(COM1_PORT, c);
+    /* Only waits if the ring is full */
+    while (serial_write(&c, 1) == 0) {
+        serial_poll();
+    }
 }
 
 /*
@@ -111,11 +305,14 @@ void serial_putchar(char c)
  */
 char serial_getchar(void) 
 {
-    /* Wait until data is available */
-    while (!serial_can_read());
+    int c;
     
-    /* Read character */
-    return inb(COM1_PORT);
+    /* Wait until data is available, letting other tasks run meanwhile */
+    while ((c = serial_read()) < 0) {
+        task_sleep(1);
+    }
+    
+    return (char)c;
 }
 
 /*
@@ -123,15 +320,27 @@ char serial_getchar(void)
  */
 void serial_print(const char* str) 
 {
-    uint32_t i = 0;
-    while (str[i] != '\0') {
-        serial_putchar(str[i]);
-        i++;
+    uint32_t len = 0;
+    uint32_t done = 0;
+    
+    while (str[len] != '\0') {
+        len++;
+    }
+    
+    while (done < len) {
+        uint32_t n = serial_write(str + done, len - done);
+        
+        done += n;
+        if (n == 0) serial_poll();  /* Ring full: push bytes out ourselves */
     }
 }
 
 /*
  * serial_readline() - Read a line from serial port
+ * 
+ * NOTE: A line ends at CR, LF or CRLF. After a CR the next byte may not
+ *       have arrived yet, so an LF right at the start of the next line is
+ *       dropped instead.
  */
 void serial_readline(char* buffer, uint32_t max_len) 
 {
@@ -141,6 +350,11 @@ void serial_readline(char* buffer, uint32_t max_len)
     while (i < max_len - 1) {
         c = serial_getchar();
         
+        if (skip_lf) {
+            skip_lf = 0;
+            if (c == '\n') continue;
+        }
+        
         /* Handle backspace */
         if (c == '\b' || c == 127) {
             if (i > 0) {
@@ -149,15 +363,9 @@ void serial_readline(char* buffer, uint32_t max_len)
             continue;
         }
         
-        /* Handle newline (consume optional CRLF pair) */
+        /* Handle newline */
         if (c == '\r' || c == '\n') {
-            if (c == '\r' && serial_can_read()) {
-                char next = serial_getchar();
-                if (next != '\n') {
-                    /* Put back if it's not part of CRLF */
-                    /* Simple fallback: ignore since buffering is minimal */
-                }
-            }
+            skip_lf = (c == '\r');
             break;
         }
         
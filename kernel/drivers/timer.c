@@ -0,0 +1,118 @@
+/*
+ * ==============================================================================
+ * PROGRAMMABLE INTERVAL TIMER IMPLEMENTATION
+ * ==============================================================================
+ */
+
+#include "include/timer.h"
+#include "include/interrupt.h"
+
+/* PIT ports */
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_MODE_RATE 0x34          /* Channel 0, low then high byte, mode 2 */
+#define PIT_MODE_ONESHOT 0xB0       /* Channel 2, low then high byte, mode 0 */
+#define PIT_CONTROL 0x61            /* Keyboard controller port B */
+#define PIT_GATE2 0x01              /* Channel 2 gate */
+#define PIT_SPEAKER 0x02            /* Channel 2 output to the speaker */
+#define PIT_OUT2 0x20               /* Channel 2 output level */
+
+#define TIMER_IRQ 0
+#define CALIBRATE_MS 10             /* Length of the TSC measurement */
+
+static volatile uint32_t ticks;
+static uint32_t tsc_mhz;            /* TSC cycles per microsecond */
+
+/* I/O port operations */
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * timer_interrupt() - IRQ 0 handler
+ */
+static void timer_interrupt(void)
+{
+    ticks++;
+}
+
+/*
+ * calibrate_tsc() - Measure the TSC rate against the PIT
+ * 
+ * WHY: Works before interrupts are on, unlike counting ticks
+ * HOW: Run channel 2 (the speaker timer, output to the speaker off) as a
+ *      CALIBRATE_MS one-shot and count TSC cycles until its output rises
+ */
+static void calibrate_tsc(void)
+{
+    uint32_t count = PIT_FREQUENCY / (1000 / CALIBRATE_MS);
+    uint32_t spins = 0;
+    uint64_t start, cycles;
+    uint8_t control = (inb(PIT_CONTROL) & ~(PIT_SPEAKER | PIT_GATE2));
+    
+    outb(PIT_CONTROL, control);
+    outb(PIT_COMMAND, PIT_MODE_ONESHOT);
+    outb(PIT_CHANNEL2, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL2, (uint8_t)((count >> 8) & 0xFF));
+    
+    outb(PIT_CONTROL, control | PIT_GATE2);  /* Raising the gate starts it */
+    start = rdtsc();
+    while (!(inb(PIT_CONTROL) & PIT_OUT2) && ++spins < 10000000);
+    cycles = rdtsc() - start;
+    outb(PIT_CONTROL, control);
+    
+    tsc_mhz = (uint32_t)cycles / (CALIBRATE_MS * 1000);
+    if (tsc_mhz == 0) tsc_mhz = 1;  /* No usable PIT: keep divisions safe */
+}
+
+/*
+ * timer_init() - Program channel 0 for TIMER_HZ and take IRQ 0
+ * 
+ * WHY: Must be called after interrupts_init(); ticks start counting once
+ *      interrupts are enabled
+ */
+void timer_init(void)
+{
+    uint32_t divisor = PIT_FREQUENCY / TIMER_HZ;
+    
+    ticks = 0;
+    calibrate_tsc();
+    
+    outb(PIT_COMMAND, PIT_MODE_RATE);
+    outb(PIT_CHANNEL0, (uint8_t)(divisor & 0xFF));
+    outb(PIT_CHANNEL0, (uint8_t)((divisor >> 8) & 0xFF));
+    
+    irq_register(TIMER_IRQ, timer_interrupt);
+}
+
+/*
+ * timer_tsc_mhz() - TSC cycles per microsecond, measured by timer_init()
+ */
+uint32_t timer_tsc_mhz(void)
+{
+    return tsc_mhz;
+}
+
+/*
+ * timer_ticks() - Ticks since timer_init()
+ * NOTE: Wraps after about 497 days; compare with differences, not <
+ */
+uint32_t timer_ticks(void)
+{
+    return ticks;
+}
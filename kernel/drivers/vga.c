@@ -5,12 +5,24 @@
  */
 
 #include "include/vga.h"
+#include "include/string.h"
 
 /* Global state variables */
 static uint16_t* vga_buffer;    /* Pointer to VGA memory */
 static uint32_t vga_index;      /* Current cursor position (0-1999) */
 static uint8_t vga_color;       /* Current color attribute */
 
+/* Shadow copy of the screen in RAM
+ * WHY: VGA memory is uncached, so every read and write of it is slow.
+ *      Text is built here and only changed lines are copied out.
+ * HOW: Rows form a ring; vga_top is the row shown on the first screen
+ *      line, so scrolling moves the ring instead of the text */
+static uint16_t vga_shadow[VGA_WIDTH * VGA_HEIGHT];
+static uint32_t vga_top;        /* Shadow row of screen line 0 */
+static uint32_t dirty_first;    /* Screen lines to copy out, none if first > last */
+static uint32_t dirty_last;
+static uint32_t hw_cursor;      /* Position last written to the CRT controller */
+
 /* I/O port functions for cursor control */
 static inline void outb(uint16_t port, uint8_t val) {
     __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
@@ -40,6 +52,31 @@ static inline uint16_t vga_make_entry(char c, uint8_t color)
     return (uint16_t)c | ((uint16_t)color << 8);
 }
 
+/*
+ * vga_line() - Shadow row of a screen line
+ */
+static inline uint16_t* vga_line(uint32_t line)
+{
+    uint32_t row = vga_top + line;
+    
+    if (row >= VGA_HEIGHT) row -= VGA_HEIGHT;
+    return &vga_shadow[row * VGA_WIDTH];
+}
+
+/*
+ * vga_mark_dirty() - Remember that screen lines first..last changed
+ */
+static inline void vga_mark_dirty(uint32_t first, uint32_t last)
+{
+    if (dirty_first > dirty_last) {
+        dirty_first = first;
+        dirty_last = last;
+        return;
+    }
+    if (first < dirty_first) dirty_first = first;
+    if (last > dirty_last) dirty_last = last;
+}
+
 /*
  * vga_update_cursor() - Update hardware cursor position
  * 
@@ -58,6 +95,34 @@ void vga_update_cursor(void)
     /* Cursor position: high byte */
     outb(0x3D4, 0x0E);
     outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
+    
+    hw_cursor = vga_index;
+}
+
+/*
+ * vga_flush() - Bring the screen up to date with the shadow
+ * 
+ * WHAT: Copy the dirty lines to VGA memory and move the cursor
+ * WHY: Called once at the end of each output call, however much text it
+ *      wrote or scrolled
+ * HOW: One block copy per line; the cursor ports are only written when
+ *      the position actually changed
+ */
+static void vga_flush(void)
+{
+    uint32_t line;
+    
+    if (dirty_first <= dirty_last) {
+        for (line = dirty_first; line <= dirty_last; line++) {
+            memcpy(&vga_buffer[line * VGA_WIDTH], vga_line(line), VGA_WIDTH * sizeof(uint16_t));
+        }
+        dirty_first = VGA_HEIGHT;
+        dirty_last = 0;
+    }
+    
+    if (vga_index != hw_cursor) {
+        vga_update_cursor();
+    }
 }
 
 /*
@@ -72,6 +137,12 @@ void vga_init(void)
     vga_buffer = (uint16_t*)VGA_MEMORY;
     vga_index = 0;
     vga_color = vga_make_color(VGA_LIGHT_GREY, VGA_BLACK);
+    
+    /* Start the shadow from what the BIOS left on screen */
+    memcpy(vga_shadow, vga_buffer, sizeof(vga_shadow));
+    vga_top = 0;
+    dirty_first = VGA_HEIGHT;
+    dirty_last = 0;
     vga_update_cursor();
 }
 
@@ -80,7 +151,7 @@ void vga_init(void)
  * 
  * WHAT: Fill screen with spaces
  * WHY: To start fresh or clear output
- * HOW: Write space character to all 2000 positions
+ * HOW: Write space character to all 2000 positions of the shadow
  */
 void vga_clear(void) 
 {
@@ -88,11 +159,13 @@ void vga_clear(void)
     uint16_t blank = vga_make_entry(' ', vga_color);
     
     for (i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
-        vga_buffer[i] = blank;
+        vga_shadow[i] = blank;
     }
     
+    vga_top = 0;
     vga_index = 0;
-    vga_update_cursor();
+    vga_mark_dirty(0, VGA_HEIGHT - 1);
+    vga_flush();
 }
 
 /*
@@ -100,36 +173,36 @@ void vga_clear(void)
  * 
  * WHAT: Move all lines up, clear bottom line
  * WHY: When we reach bottom of screen, we need to scroll
- * HOW: Copy each line to the line above it, clear last line
+ * HOW: Advance the shadow ring by one row and clear the row that comes
+ *      around as the new last line; every screen line is now dirty, but
+ *      nothing is copied until the next flush
  */
 static void vga_scroll(void) 
 {
     uint32_t i;
     uint16_t blank = vga_make_entry(' ', vga_color);
+    uint16_t* last;
     
-    /* Copy each line to the previous line */
-    for (i = 0; i < (VGA_HEIGHT - 1) * VGA_WIDTH; i++) {
-        vga_buffer[i] = vga_buffer[i + VGA_WIDTH];
-    }
+    vga_top = (vga_top + 1) % VGA_HEIGHT;
     
     /* Clear the last line */
-    for (i = (VGA_HEIGHT - 1) * VGA_WIDTH; i < VGA_HEIGHT * VGA_WIDTH; i++) {
-        vga_buffer[i] = blank;
+    last = vga_line(VGA_HEIGHT - 1);
+    for (i = 0; i < VGA_WIDTH; i++) {
+        last[i] = blank;
     }
     
     /* Move cursor to start of last line */
     vga_index = (VGA_HEIGHT - 1) * VGA_WIDTH;
-    vga_update_cursor();
+    vga_mark_dirty(0, VGA_HEIGHT - 1);
 }
 
 /*
- * vga_putchar() - Display a single character
+ * vga_emit() - Put one character into the shadow at the cursor position
  * 
- * WHAT: Put one character on screen at cursor position
- * WHY: Basic building block for all text output
- * HOW: Handle special characters (newline, tab), write to VGA memory
+ * HOW: Handle special characters (newline, tab); the screen itself is
+ *      only updated by vga_flush()
  */
-void vga_putchar(char c) 
+static void vga_emit(char c) 
 {
     /* Handle special characters */
     if (c == '\n') {
@@ -151,8 +224,11 @@ void vga_putchar(char c)
         vga_index = (vga_index + 4) & ~(4 - 1);
     }
     else if (c >= 32 && c <= 126) {
-        /* Regular printable character: write to VGA memory */
-        vga_buffer[vga_index] = vga_make_entry(c, vga_color);
+        /* Regular printable character: write to the shadow */
+        uint32_t line = vga_index / VGA_WIDTH;
+        
+        vga_line(line)[vga_index % VGA_WIDTH] = vga_make_entry(c, vga_color);
+        vga_mark_dirty(line, line);
         vga_index++;
     }
     /* Ignore non-printable characters */
@@ -161,8 +237,35 @@ void vga_putchar(char c)
     if (vga_index >= VGA_WIDTH * VGA_HEIGHT) {
         vga_scroll();
     }
+}
+
+/*
+ * vga_putchar() - Display a single character
+ * 
+ * WHAT: Put one character on screen at cursor position
+ * WHY: Basic building block for all text output
+ */
+void vga_putchar(char c) 
+{
+    vga_emit(c);
+    vga_flush();
+}
+
+/*
+ * vga_write() - Display a block of text
+ * 
+ * WHAT: Bulk output path: all characters go to the shadow first, then the
+ *       changed lines are copied out and the cursor moved once
+ */
+void vga_write(const char* buf, uint32_t len)
+{
+    uint32_t i;
     
-    vga_update_cursor();
+    for (i = 0; i < len; i++) {
+        vga_emit(buf[i]);
+    }
+    
+    vga_flush();
 }
 
 /*
@@ -170,16 +273,18 @@ void vga_putchar(char c)
  * 
  * WHAT: Display a null-terminated string
  * WHY: More convenient than calling putchar repeatedly
- * HOW: Loop through each character until we hit '\0'
+ * HOW: Emit each character until we hit '\0', then flush once
  */
 void vga_print(const char* str) 
 {
     uint32_t i = 0;
     
     while (str[i] != '\0') {
-        vga_putchar(str[i]);
+        vga_emit(str[i]);
         i++;
     }
+    
+    vga_flush();
 }
 
 /*
@@ -10,19 +10,39 @@
 #include "include/serial.h"
 #include "include/string.h"
 #include "include/xaefs.h"
+#include "include/memory.h"
+#include "include/task.h"
+#include "include/output.h"
 
-/* Editor state */
-static char lines[EDITOR_MAX_LINES][EDITOR_MAX_LINE_LEN];
-static uint32_t line_count;
-static char current_filename[64];
+/*
+ * Text store: a gap buffer in 2^text_order pages
+ * 
+ * WHAT: The file image, newlines included, with one hole (the gap) in it
+ * WHY: Typing at the insert point only fills the gap, and deleting only
+ *      widens it - neither moves the rest of the file
+ * HOW: text[0, gap_start) is the text before the insert point and
+ *      text[gap_end, capacity) the text after it. Moving the insert point
+ *      moves the bytes in between across the gap; a full buffer is copied
+ *      into one twice the size, so inserting stays O(1) amortised.
+ */
+static char* text;
+static uint32_t text_order;
+static uint32_t gap_start;
+static uint32_t gap_end;
+static uint32_t line_count;         /* Newlines in the text */
+static uint32_t insert_line;        /* Line the insert point is on (0-based) */
+
+static char current_filename[128];
 static uint8_t is_editing;
 
+/* Chunk buffer for editor_view(); nothing yields while it's in use */
+static char view_chunk[XAEFS_BLOCK_SIZE + 1];
+
 /*
  * editor_print() - Print to both VGA and serial
  */
 static void editor_print(const char* str) {
-    vga_print(str);
-    serial_print(str);
+    output_print(str);
 }
 
 /*
@@ -38,21 +58,172 @@ static void editor_readline(char* buffer, uint32_t max_len) {
             keyboard_readline(buffer, max_len);
             break;
         }
-        /* Small delay to prevent CPU spinning */
-        for (volatile int i = 0; i < 1000; i++);
+        /* Nothing typed - let the other tasks run until the next tick */
+        task_sleep(1);
     }
 }
 
 /*
- * editor_init() - Initialize the editor
+ * text_capacity() / text_length() - Size of the store and of the text in it
  */
-void editor_init(void) 
+static uint32_t text_capacity(void) 
+{
+    return (uint32_t)PAGE_SIZE << text_order;
+}
+
+static uint32_t text_length(void) 
+{
+    return text_capacity() - (gap_end - gap_start);
+}
+
+/*
+ * text_at() - Character at a position of the text (gap skipped)
+ */
+static char text_at(uint32_t pos) 
+{
+    return pos < gap_start ? text[pos] : text[pos + (gap_end - gap_start)];
+}
+
+/*
+ * text_free() - Give the store back to the page allocator
+ */
+static void text_free(void) 
+{
+    if (text) free_pages(text, text_order);
+    text = NULL;
+    text_order = 0;
+    gap_start = 0;
+    gap_end = 0;
+    line_count = 0;
+    insert_line = 0;
+}
+
+/*
+ * text_reserve() - Make the gap at least 'need' bytes wide
+ * 
+ * HOW: Double the store until it fits, copying the text on either side
+ *      of the gap to the two ends of the new one
+ * RETURNS: 0 on success, -1 if memory (or MAX_ORDER) runs out
+ */
+static int text_reserve(uint32_t need) 
+{
+    uint32_t order = text_order;
+    uint32_t tail;
+    char* bigger;
+    
+    if (text && gap_end - gap_start >= need) return 0;
+    
+    if (text) order++;
+    while (((uint32_t)PAGE_SIZE << order) - (text ? text_length() : 0) < need) {
+        order++;
+    }
+    if (order > MAX_ORDER) return -1;
+    
+    bigger = (char*)alloc_pages(order);
+    if (!bigger) return -1;
+    
+    if (!text) {
+        text = bigger;
+        text_order = order;
+        gap_start = 0;
+        gap_end = text_capacity();
+        return 0;
+    }
+    
+    tail = text_capacity() - gap_end;
+    memcpy(bigger, text, gap_start);
+    memcpy(bigger + ((uint32_t)PAGE_SIZE << order) - tail, text + gap_end, tail);
+    free_pages(text, text_order);
+    
+    text = bigger;
+    text_order = order;
+    gap_end = text_capacity() - tail;
+    return 0;
+}
+
+/*
+ * text_move_gap() - Put the insert point at a position of the text
+ */
+static void text_move_gap(uint32_t pos) 
+{
+    uint32_t n;
+    
+    if (pos < gap_start) {
+        n = gap_start - pos;
+        memmove(text + gap_end - n, text + pos, n);
+        gap_start -= n;
+        gap_end -= n;
+    } else if (pos > gap_start) {
+        n = pos - gap_start;
+        memmove(text + gap_start, text + gap_end, n);
+        gap_start += n;
+        gap_end += n;
+    }
+}
+
+/*
+ * text_insert() - Insert bytes at the insert point, which ends up after them
+ * RETURNS: 0 on success, -1 when out of memory
+ */
+static int text_insert(const char* data, uint32_t len) 
 {
     uint32_t i;
-    for (i = 0; i < EDITOR_MAX_LINES; i++) {
-        lines[i][0] = '\0';
+    
+    if (text_reserve(len) != 0) return -1;
+    
+    memcpy(text + gap_start, data, len);
+    gap_start += len;
+    for (i = 0; i < len; i++) {
+        if (data[i] == '\n') line_count++;
+    }
+    return 0;
+}
+
+/*
+ * line_offset() - Position where line n (0-based) starts
+ * 
+ * NOTE: n == line_count gives the end of the text
+ */
+static uint32_t line_offset(uint32_t n) 
+{
+    uint32_t length = text_length();
+    uint32_t pos;
+    
+    if (n == 0) return 0;
+    for (pos = 0; pos < length; pos++) {
+        if (text_at(pos) == '\n' && --n == 0) return pos + 1;
     }
+    return length;
+}
+
+/*
+ * text_delete_line() - Remove line n (0-based), newline included
+ * 
+ * HOW: Move the gap to the start of the line and widen it over the line
+ */
+static void text_delete_line(uint32_t n) 
+{
+    uint32_t start = line_offset(n);
+    uint32_t end = line_offset(n + 1);
+    
+    text_move_gap(start);
+    gap_end += end - start;
+    line_count--;
+    insert_line = n;
+}
+
+/*
+ * editor_init() - Initialize the editor
+ */
+void editor_init(void) 
+{
+    /* The store of the previous session was freed when it exited */
+    text = NULL;
+    text_order = 0;
+    gap_start = 0;
+    gap_end = 0;
     line_count = 0;
+    insert_line = 0;
     current_filename[0] = '\0';
     is_editing = 0;
 }
@@ -67,88 +238,183 @@ static void editor_show_help(void)
     editor_print("  :w    - Write (save) file\r\n");
     editor_print("  :q    - Quit editor\r\n");
     editor_print("  :wq   - Write and quit\r\n");
+    editor_print("  :g N  - Insert new lines before line N\r\n");
+    editor_print("  :d N  - Delete line N\r\n");
+    editor_print("  :show - Show the file\r\n");
     editor_print("  :help - Show this help\r\n");
     editor_print("\r\nType your text line by line.\r\n");
     editor_print("Start a line with : for commands.\r\n");
     editor_print("======================\r\n\r\n");
 }
 
+/*
+ * print_line_number() - Line number right-aligned to three columns
+ */
+static void print_line_number(uint32_t n) 
+{
+    char num[12];
+    
+    if (n < 100) editor_print(" ");
+    if (n < 10) editor_print(" ");
+    editor_print(utoa(n, num));
+}
+
 /*
  * editor_display_content() - Show current file content (simplified for serial)
+ * 
+ * HOW: Every line ends in a newline and the insert point is always at the
+ *      start of a line, so walk the text line by line, printing it in
+ *      runs of up to EDITOR_MAX_LINE_LEN, with a marker at the insert point
  */
 static void editor_display_content(void) 
 {
-    uint32_t i;
-    char num[4];
+    char run[EDITOR_MAX_LINE_LEN + 1];
+    uint32_t pos = 0;
+    uint32_t line;
+    char num[12];
     
     editor_print("\r\n=== Editing: ");
     editor_print(current_filename);
     editor_print(" ===\r\n");
     editor_print("Lines: ");
-    
-    /* Simple itoa */
-    num[0] = '0' + (line_count / 10);
-    num[1] = '0' + (line_count % 10);
-    num[2] = '\0';
-    if (line_count < 10) editor_print(num + 1);
-    else editor_print(num);
-    
+    editor_print(utoa(line_count, num));
     editor_print(" | :help for commands\r\n");
     editor_print("----------------------------------------\r\n");
     
-    /* Display all lines */
-    for (i = 0; i < line_count; i++) {
-        /* Line number */
-        if (i < 9) editor_print(" ");
-        num[0] = '0' + ((i + 1) / 10);
-        num[1] = '0' + ((i + 1) % 10);
-        num[2] = '\0';
-        if (i < 9) editor_print(num + 1);
-        else editor_print(num);
+    for (line = 0; line < line_count; line++) {
+        uint32_t len = 0;
+        char c;
         
+        if (pos == gap_start) editor_print("    > (new lines go here)\r\n");
+        print_line_number(line + 1);
         editor_print(" | ");
-        editor_print(lines[i]);
+        
+        while ((c = text_at(pos++)) != '\n') {
+            run[len++] = c;
+            if (len == EDITOR_MAX_LINE_LEN) {
+                run[len] = '\0';
+                editor_print(run);
+                len = 0;
+            }
+        }
+        run[len] = '\0';
+        editor_print(run);
         editor_print("\r\n");
     }
+    if (pos == gap_start) editor_print("    > (new lines go here)\r\n");
     editor_print("----------------------------------------\r\n");
 }
 
+/*
+ * write_run() - Write part of the text store in block-sized chunks
+ * RETURNS: 0 on success, -1 if the filesystem took less than asked
+ */
+static int write_run(int fd, const char* data, uint32_t len) 
+{
+    while (len > 0) {
+        uint32_t n = len < XAEFS_BLOCK_SIZE ? len : XAEFS_BLOCK_SIZE;
+        
+        if (xaefs_write(fd, data, n) != (int)n) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
 /*
  * editor_save() - Save file to filesystem
+ * 
+ * HOW: Truncate the file, then write the text before the gap and the text
+ *      after it straight from the store - no staging copy
  */
 static void editor_save(void) 
 {
-    uint32_t i;
-    uint32_t total_size = 0;
-    char num[8];
+    uint32_t total_size = text_length();
+    char num[12];
+    int fd;
+    
+    fd = xaefs_open(current_filename,
+                    XAEFS_OPEN_WRITE | XAEFS_OPEN_CREATE | XAEFS_OPEN_TRUNC);
+    if (fd < 0) {
+        editor_print("Error: Could not open ");
+        editor_print(current_filename);
+        editor_print(" for writing\r\n");
+        return;
+    }
     
-    /* Calculate total size */
-    for (i = 0; i < line_count; i++) {
-        total_size += strlen(lines[i]) + 1;  /* +1 for newline */
+    if (text && (write_run(fd, text, gap_start) != 0 ||
+                 write_run(fd, text + gap_end, text_capacity() - gap_end) != 0)) {
+        editor_print("Error: Write failed (disk full?)\r\n");
+        xaefs_close(fd);
+        return;
     }
+    xaefs_close(fd);
     
     editor_print("Saved ");
     editor_print(current_filename);
     editor_print(" (");
+    editor_print(utoa(total_size, num));
+    editor_print(" bytes, ");
+    editor_print(utoa(line_count, num));
+    editor_print(" lines)\r\n");
+}
+
+/*
+ * editor_load() - Load an existing file into the text store
+ * 
+ * HOW: Read it a block at a time straight into the gap, growing the store
+ *      as needed; a missing final newline is added, so every line ends
+ *      in one. New lines then go after the last one.
+ * RETURNS: 0 on success (or a new file), -1 if it doesn't fit in memory
+ */
+static int editor_load(void) 
+{
+    int fd;
+    int n;
     
-    /* Simple number formatting */
-    num[0] = '0' + (total_size / 100);
-    num[1] = '0' + ((total_size / 10) % 10);
-    num[2] = '0' + (total_size % 10);
-    num[3] = '\0';
-    if (total_size >= 100) editor_print(num);
-    else if (total_size >= 10) editor_print(num + 1);
-    else editor_print(num + 2);
+    fd = xaefs_open(current_filename, XAEFS_OPEN_READ);
+    if (fd < 0) return 0;  /* New file */
     
-    editor_print(" bytes, ");
+    do {
+        if (text_reserve(XAEFS_BLOCK_SIZE) != 0) {
+            xaefs_close(fd);
+            return -1;
+        }
+        n = xaefs_read(fd, text + gap_start, XAEFS_BLOCK_SIZE);
+        if (n > 0) {
+            uint32_t i;
+            
+            for (i = 0; i < (uint32_t)n; i++) {
+                if (text[gap_start + i] == '\n') line_count++;
+            }
+            gap_start += n;
+        }
+    } while (n > 0);
+    xaefs_close(fd);
+    
+    if (gap_start > 0 && text[gap_start - 1] != '\n' && text_insert("\n", 1) != 0) {
+        return -1;
+    }
+    insert_line = line_count;
+    return 0;
+}
+
+/*
+ * parse_line_number() - Read the N of ":g N" / ":d N"
+ * RETURNS: Line number (1-based), 0 if missing or not a number
+ */
+static uint32_t parse_line_number(const char* arg) 
+{
+    uint32_t n = 0;
     
-    num[0] = '0' + (line_count / 10);
-    num[1] = '0' + (line_count % 10);
-    num[2] = '\0';
-    if (line_count >= 10) editor_print(num);
-    else editor_print(num + 1);
+    while (*arg == ' ') arg++;
+    if (*arg == '\0') return 0;
     
-    editor_print(" lines)\r\n");
+    for (; *arg != '\0'; arg++) {
+        if (*arg < '0' || *arg > '9') return 0;
+        n = n * 10 + (*arg - '0');
+    }
+    return n;
 }
 
 /*
@@ -157,6 +423,7 @@ static void editor_save(void)
 void editor_run(void) 
 {
     char input[EDITOR_MAX_LINE_LEN];
+    char num[12];
     
     is_editing = 1;
     editor_show_help();
@@ -186,40 +453,59 @@ void editor_run(void)
             else if (strcmp(input, ":show") == 0) {
                 editor_display_content();
             }
+            else if (input[1] == 'g' && (input[2] == ' ' || input[2] == '\0')) {
+                uint32_t n = parse_line_number(input + 2);
+                
+                if (n == 0 || n > line_count + 1) {
+                    editor_print("Usage: :g N  (1 to ");
+                    editor_print(utoa(line_count + 1, num));
+                    editor_print(")\r\n");
+                } else {
+                    text_move_gap(line_offset(n - 1));
+                    insert_line = n - 1;
+                    editor_print("  New lines go before line ");
+                    editor_print(utoa(n, num));
+                    editor_print("\r\n");
+                }
+            }
+            else if (input[1] == 'd' && (input[2] == ' ' || input[2] == '\0')) {
+                uint32_t n = parse_line_number(input + 2);
+                
+                if (n == 0 || n > line_count) {
+                    editor_print("Usage: :d N  (1 to ");
+                    editor_print(utoa(line_count, num));
+                    editor_print(")\r\n");
+                } else {
+                    text_delete_line(n - 1);
+                    editor_print("  Deleted line ");
+                    editor_print(utoa(n, num));
+                    editor_print(", new lines go there\r\n");
+                }
+            }
             else {
                 editor_print("Unknown command. Type :help for commands.\r\n");
             }
         }
-        else {
-            /* Add line to buffer */
-            if (line_count < EDITOR_MAX_LINES && input[0] != '\0') {
-                uint32_t i;
-                for (i = 0; i < EDITOR_MAX_LINE_LEN - 1 && input[i] != '\0'; i++) {
-                    lines[line_count][i] = input[i];
-                }
-                lines[line_count][i] = '\0';
-                line_count++;
-                
-                char num[4];
-                editor_print("  Added line ");
-                num[0] = '0' + (line_count / 10);
-                num[1] = '0' + (line_count % 10);
-                num[2] = '\0';
-                if (line_count >= 10) editor_print(num);
-                else editor_print(num + 1);
-                editor_print(" | Type :show to view all\r\n");
-            }
-            else if (line_count >= EDITOR_MAX_LINES) {
-                char num[4];
-                editor_print("Error: Maximum lines reached (");
-                num[0] = '0' + (EDITOR_MAX_LINES / 10);
-                num[1] = '0' + (EDITOR_MAX_LINES % 10);
-                num[2] = '\0';
-                editor_print(num);
-                editor_print(")\r\n");
+        else if (input[0] != '\0') {
+            /* Insert the line at the insert point; room for the text and
+             * its newline first, so a full store never keeps half a line */
+            uint32_t len = strlen(input);
+            
+            if (text_reserve(len + 1) != 0) {
+                editor_print("Error: Out of memory for the file\r\n");
+                continue;
             }
+            text_insert(input, len);
+            text_insert("\n", 1);
+            
+            insert_line++;
+            editor_print("  Added line ");
+            editor_print(utoa(insert_line, num));
+            editor_print(" | Type :show to view all\r\n");
         }
     }
+    
+    text_free();
 }
 
 /*
@@ -229,20 +515,22 @@ void editor_open(const char* filename)
 {
     uint32_t i;
     
-    /* Copy filename */
-    for (i = 0; i < 63 && filename[i] != '\0'; i++) {
-        current_filename[i] = filename[i];
-    }
-    current_filename[i] = '\0';
-    
     /* Reset editor state */
     editor_init();
-    for (i = 0; i < 63 && filename[i] != '\0'; i++) {
+    for (i = 0; i < sizeof(current_filename) - 1 && filename[i] != '\0'; i++) {
         current_filename[i] = filename[i];
     }
     current_filename[i] = '\0';
     
-    /* TODO: Load existing file content if it exists */
+    /* Load existing file content if it exists */
+    if (editor_load() != 0) {
+        editor_print("Error: Not enough memory to edit ");
+        editor_print(current_filename);
+        editor_print("\r\n");
+        text_free();
+        return;
+    }
+    
     editor_print("\r\nOpening file: ");
     editor_print(current_filename);
     editor_print("\r\n");
@@ -253,33 +541,50 @@ void editor_open(const char* filename)
 
 /*
  * editor_view() - View file contents (like cat command)
+ * 
+ * HOW: Stream the file a block at a time straight from the filesystem,
+ *      without touching the editor's text store
  */
 void editor_view(const char* filename) 
 {
-    uint32_t i;
+    int fd;
+    int n;
+    uint32_t total = 0;
     
     editor_print("\r\n");
     editor_print("=== ");
     editor_print(filename);
     editor_print(" ===\r\n");
     
-    /* For now, show placeholder (real implementation would read from disk) */
-    /* In a real system, we'd load the file and display it */
-    
-    /* Check if file exists */
-    /* TODO: Actually read file content from filesystem */
-    
-    /* For demo, show the in-memory editor content if it matches */
-    if (line_count > 0) {
-        for (i = 0; i < line_count; i++) {
-            editor_print(lines[i]);
-            editor_print("\r\n");
-        }
-    } else {
-        editor_print("(File is empty or hasn't been created yet)\r\n");
+    fd = xaefs_open(filename, XAEFS_OPEN_READ);
+    if (fd < 0) {
+        editor_print("(File doesn't exist)\r\n");
         editor_print("Tip: Use 'edit ");
         editor_print(filename);
-        editor_print("' to create content\r\n");
+        editor_print("' to create content\r\n\r\n");
+        return;
+    }
+    
+    while ((n = xaefs_read(fd, view_chunk, XAEFS_BLOCK_SIZE)) > 0) {
+        int i, start = 0;
+        
+        /* Print runs between newlines, turning \n into \r\n for serial */
+        for (i = 0; i < n; i++) {
+            if (view_chunk[i] == '\n') {
+                view_chunk[i] = '\0';
+                editor_print(view_chunk + start);
+                editor_print("\r\n");
+                start = i + 1;
+            }
+        }
+        view_chunk[n] = '\0';
+        editor_print(view_chunk + start);
+        total += n;
+    }
+    xaefs_close(fd);
+    
+    if (total == 0) {
+        editor_print("(File is empty)\r\n");
     }
     
     editor_print("\r\n");
@@ -3,12 +3,24 @@
 ; ==============================================================================
 ; WHAT: Simple 32-bit entry point for the kernel
 ; WHY: Bootloader handles the mode switch, we just set up and call C code
-; HOW: Set up segments, stack, and call kernel_main
+; HOW: Set up segments, stack, clear .bss, and call kernel_main with the
+;      memory map pointer the bootloader left in EBX
 
 [BITS 32]
 [EXTERN kernel_main]
+[EXTERN _kernel_sectors]
+[EXTERN _bss_start]
+[EXTERN _kernel_end]
 [GLOBAL kernel_entry]
 
+; Kernel header - linker.ld puts it at the very start of the image
+; WHY: The bootloader reads this first sector to learn how much to load
+;      and where to jump
+section .header
+    dd 0x4B454158       ; Magic "XAEK"
+    dd _kernel_sectors  ; Sectors in the image (stamped by the linker)
+    dd kernel_entry     ; Entry point
+
 section .text
 align 4
 
@@ -27,7 +39,17 @@ kernel_entry:
     ; Set up stack
     mov esp, 0x90000
     
-    ; Call C kernel
+    ; Clear .bss - the bootloader only loads the image file, which ends
+    ; before it (EBX must survive for kernel_main)
+    cld
+    mov edi, _bss_start
+    mov ecx, _kernel_end
+    sub ecx, edi
+    xor eax, eax
+    rep stosb
+    
+    ; Call C kernel: kernel_main(memory map)
+    push ebx
     call kernel_main
     
     ; If we return, just halt
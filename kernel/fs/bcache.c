@@ -0,0 +1,600 @@
+/*
+ * ==============================================================================
+ * BLOCK BUFFER CACHE IMPLEMENTATION
+ * ==============================================================================
+ */
+
+#include "include/bcache.h"
+#include "include/disk.h"
+#include "include/memory.h"
+#include "include/string.h"
+
+#define BCACHE_HASH_BUCKETS 64
+#define BCACHE_NONE 0xFF                /* End of a hash chain */
+#define BCACHE_ALL_SECTORS 0xFF         /* Valid/dirty mask for a full buffer */
+#define BCACHE_MAX_RUNS (BCACHE_SECTORS_PER_BUFFER / 2)  /* Dirty runs per buffer */
+#define BCACHE_NO_GROUP 0xFFFFFFFE      /* No read yet: LBA / 8 never reaches the group after it */
+
+/* One cached group of BCACHE_SECTORS_PER_BUFFER sectors */
+struct bcache_buffer {
+    uint32_t group;          /* First LBA / BCACHE_SECTORS_PER_BUFFER */
+    uint32_t last_used;      /* LRU clock value of the last access */
+    uint8_t* data;           /* 4KB page */
+    uint8_t valid;           /* Bit n set = sector n holds disk contents */
+    uint8_t dirty;           /* Bit n set = sector n must be written back */
+    uint8_t in_use;          /* Buffer currently holds a group */
+    uint8_t next;            /* Next buffer in the same hash bucket */
+    uint8_t writing;         /* Write requests still in flight */
+    uint8_t priority;        /* BCACHE_PRIORITY_* of the last access */
+    struct disk_request io[BCACHE_MAX_RUNS];  /* One per dirty run being written */
+};
+
+static struct bcache_buffer buffers[BCACHE_MAX_BUFFERS];
+static uint8_t hash_head[BCACHE_HASH_BUCKETS];
+static uint32_t buffer_count;
+static uint32_t lru_clock;
+static uint32_t last_group = BCACHE_NO_GROUP;  /* For sequential access detection */
+static uint8_t unflushed;                 /* Written since the last disk_flush() */
+static uint8_t write_failed;              /* A queued write-back failed */
+static uint8_t current_priority;          /* Given to the buffers touched next */
+static struct bcache_stats stats;
+
+/*
+ * group_bucket() - Hash bucket for a group number
+ */
+static uint32_t group_bucket(uint32_t group)
+{
+    return (group * 2654435761u) >> 26;  /* Top 6 bits: 64 buckets */
+}
+
+/*
+ * find_buffer() - Look up the buffer caching a group
+ * RETURNS: Buffer index, or -1 if the group isn't cached
+ */
+static int find_buffer(uint32_t group)
+{
+    uint8_t i;
+    
+    for (i = hash_head[group_bucket(group)]; i != BCACHE_NONE; i = buffers[i].next) {
+        if (buffers[i].group == group) return i;
+    }
+    
+    return -1;
+}
+
+/*
+ * unhash_buffer() - Remove a buffer from its hash chain
+ */
+static void unhash_buffer(uint8_t index)
+{
+    uint8_t* link = &hash_head[group_bucket(buffers[index].group)];
+    
+    while (*link != BCACHE_NONE) {
+        if (*link == index) {
+            *link = buffers[index].next;
+            return;
+        }
+        link = &buffers[*link].next;
+    }
+}
+
+/*
+ * write_done() - Completion callback of a write-back request
+ * 
+ * HOW: On failure the run is marked dirty again so a later flush retries it
+ */
+static void write_done(struct disk_request* req)
+{
+    struct bcache_buffer* buf = (struct bcache_buffer*)req->context;
+    uint32_t first = req->lba - buf->group * BCACHE_SECTORS_PER_BUFFER;
+    
+    buf->writing--;
+    
+    if (req->status != 0) {
+        buf->dirty |= ((1 << req->count) - 1) << first;
+        write_failed = 1;
+        return;
+    }
+    
+    stats.writebacks++;
+    unflushed = 1;
+}
+
+/*
+ * start_write_back() - Queue a buffer's dirty sectors for writing
+ * 
+ * HOW: Each run of consecutive dirty sectors is one queued request; the
+ *      runs stop counting as dirty as soon as they are queued
+ * NOTE: Does nothing while an earlier write-back of the buffer is in flight.
+ *       Runs under disk_lock(), since write_done() may complete the first
+ *       run from the disk IRQ while the next one is being queued.
+ * RETURNS: 0 on success, -1 if the driver refused a request
+ */
+static int start_write_back(struct bcache_buffer* buf)
+{
+    uint32_t start = 0;
+    uint32_t lba = buf->group * BCACHE_SECTORS_PER_BUFFER;
+    uint32_t flags;
+    
+    if (buf->writing) return 0;
+    
+    flags = disk_lock();
+    
+    while (buf->dirty != 0 && start < BCACHE_SECTORS_PER_BUFFER) {
+        uint32_t end;
+        
+        if (!(buf->dirty & (1 << start))) {
+            start++;
+            continue;
+        }
+        
+        for (end = start; end < BCACHE_SECTORS_PER_BUFFER && (buf->dirty & (1 << end)); end++);
+        
+        struct disk_request* req = &buf->io[buf->writing];
+        req->lba = lba + start;
+        req->count = end - start;
+        req->buffer = buf->data + start * DISK_SECTOR_SIZE;
+        req->write = 1;
+        req->done = write_done;
+        req->context = buf;
+        
+        buf->dirty &= ~(((1 << (end - start)) - 1) << start);
+        buf->writing++;
+        
+        if (disk_submit(req) != 0) {
+            buf->writing--;
+            buf->dirty |= ((1 << (end - start)) - 1) << start;
+            disk_unlock(flags);
+            return -1;
+        }
+        start = end;
+    }
+    
+    disk_unlock(flags);
+    return 0;
+}
+
+/*
+ * wait_buffer() - Wait for a buffer's write-back to finish
+ * 
+ * WHY: The controller reads the page while the write is in flight, so it
+ *      must not be changed or reused until then
+ */
+static void wait_buffer(struct bcache_buffer* buf)
+{
+    while (buf->writing) {
+        disk_poll();
+    }
+}
+
+/*
+ * write_back() - Write a buffer's dirty sectors to disk
+ * 
+ * HOW: Queue the dirty runs and wait for them
+ * RETURNS: 0 on success, -1 on disk error (sectors stay dirty)
+ */
+static int write_back(struct bcache_buffer* buf)
+{
+    wait_buffer(buf);
+    if (start_write_back(buf) != 0) return -1;
+    wait_buffer(buf);
+    
+    return buf->dirty ? -1 : 0;
+}
+
+/*
+ * fill_buffer() - Read the sectors of a buffer that aren't valid yet
+ * 
+ * HOW: Runs of missing sectors are read in one transfer each; dirty
+ *      sectors are always valid, so they are never overwritten
+ * RETURNS: 0 on success, -1 on disk error
+ */
+static int fill_buffer(struct bcache_buffer* buf)
+{
+    uint32_t start = 0;
+    uint32_t lba = buf->group * BCACHE_SECTORS_PER_BUFFER;
+    
+    while (buf->valid != BCACHE_ALL_SECTORS && start < BCACHE_SECTORS_PER_BUFFER) {
+        uint32_t end;
+        
+        if (buf->valid & (1 << start)) {
+            start++;
+            continue;
+        }
+        
+        for (end = start; end < BCACHE_SECTORS_PER_BUFFER && !(buf->valid & (1 << end)); end++);
+        
+        if (disk_read_sectors(lba + start, end - start,
+                              buf->data + start * DISK_SECTOR_SIZE) != 0) {
+            return -1;
+        }
+        
+        buf->valid |= ((1 << (end - start)) - 1) << start;
+        start = end;
+    }
+    
+    return 0;
+}
+
+/*
+ * evict_rank() - How much a buffer deserves to stay (lowest is evicted)
+ * 
+ * HOW: Its LRU stamp, plus one full turnover of the cache per priority
+ *      level: a CRITICAL buffer outlives three cache-fulls of LOW ones
+ */
+static uint32_t evict_rank(const struct bcache_buffer* buf)
+{
+    return buf->last_used + buf->priority * buffer_count;
+}
+
+/*
+ * claim_buffer() - Get a buffer for a group that isn't cached
+ * 
+ * HOW: Take an unused buffer if there is one, otherwise evict the buffer
+ *      of lowest evict_rank() (writing back its dirty sectors first)
+ * RETURNS: Buffer index (with nothing valid yet), or -1 on disk error
+ */
+static int claim_buffer(uint32_t group)
+{
+    uint32_t i;
+    uint32_t victim = 0;
+    uint32_t oldest = 0;
+    
+    for (i = 0; i < buffer_count; i++) {
+        if (!buffers[i].in_use) {
+            victim = i;
+            break;
+        }
+        if (evict_rank(&buffers[i]) < evict_rank(&buffers[victim])) {
+            victim = i;
+        }
+        if (buffers[i].last_used < buffers[oldest].last_used) {
+            oldest = i;
+        }
+    }
+    
+    struct bcache_buffer* buf = &buffers[victim];
+    
+    if (buf->in_use) {
+        if (write_back(buf) != 0) return -1;
+        unhash_buffer(victim);
+        stats.evictions++;
+        if (buffers[oldest].last_used < buf->last_used) stats.priority_evictions++;
+    }
+    
+    buf->group = group;
+    buf->valid = 0;
+    buf->dirty = 0;
+    buf->in_use = 1;
+    buf->priority = current_priority;
+    buf->last_used = ++lru_clock;
+    buf->next = hash_head[group_bucket(group)];
+    hash_head[group_bucket(group)] = victim;
+    
+    return victim;
+}
+
+/*
+ * read_ahead() - Prefetch the groups following a sequential miss
+ * 
+ * WHY: File data is stored in contiguous extents, so the next groups
+ *      are very likely to be read soon
+ * NOTE: Failures are ignored; a failed prefetch just stays not-valid
+ */
+static void read_ahead(uint32_t group)
+{
+    uint32_t i;
+    
+    for (i = 1; i <= BCACHE_READAHEAD; i++) {
+        if (find_buffer(group + i) >= 0) continue;
+        
+        int index = claim_buffer(group + i);
+        if (index < 0) return;
+        
+        if (fill_buffer(&buffers[index]) == 0) {
+            stats.readaheads++;
+        }
+    }
+}
+
+/*
+ * get_buffer() - Find or create the buffer for a group
+ * 
+ * WHAT: Common lookup for reads and writes, counting hits and misses
+ * RETURNS: Buffer index, or -1 on disk error
+ */
+static int get_buffer(uint32_t group)
+{
+    int index = find_buffer(group);
+    
+    if (index >= 0) {
+        stats.hits++;
+        buffers[index].last_used = ++lru_clock;
+        buffers[index].priority = current_priority;
+    } else {
+        stats.misses++;
+        index = claim_buffer(group);
+    }
+    
+    return index;
+}
+
+/*
+ * bcache_init() - Allocate the cache buffers
+ * 
+ * WHAT: Grab one page per buffer from the page allocator
+ * WHY: Must be called after memory_init() and before the filesystem
+ * HOW: The number of buffers scales with the RAM the machine has,
+ *      between BCACHE_MIN_BUFFERS and BCACHE_MAX_BUFFERS
+ * NOTE: If pages run out the cache just works with fewer buffers
+ *       (with none at all, every request goes straight to disk)
+ */
+void bcache_init(void)
+{
+    uint32_t i;
+    uint32_t wanted = get_total_memory() / (BCACHE_MEMORY_SHARE * PAGE_SIZE);
+    
+    if (wanted < BCACHE_MIN_BUFFERS) wanted = BCACHE_MIN_BUFFERS;
+    if (wanted > BCACHE_MAX_BUFFERS) wanted = BCACHE_MAX_BUFFERS;
+    
+    memset(buffers, 0, sizeof(buffers));
+    memset(hash_head, BCACHE_NONE, sizeof(hash_head));
+    memset(&stats, 0, sizeof(stats));
+    buffer_count = 0;
+    lru_clock = 0;
+    last_group = BCACHE_NO_GROUP;
+    unflushed = 0;
+    current_priority = BCACHE_PRIORITY_NORMAL;
+    
+    for (i = 0; i < wanted; i++) {
+        uint8_t* page = (uint8_t*)alloc_page();
+        if (!page) break;
+        buffers[i].data = page;
+        buffer_count++;
+    }
+    
+    stats.buffers = buffer_count;
+}
+
+/*
+ * bcache_read() - Read sectors through the cache
+ * 
+ * WHAT: Same contract as disk_read_sectors()
+ * HOW: Split the request into groups; missing sectors are filled from
+ *      disk a whole group at a time, and a miss right after the previous
+ *      group starts read-ahead
+ * RETURNS: 0 on success, -1 on disk error
+ */
+int bcache_read(uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    if (buffer_count == 0) return disk_read_sectors(lba, count, buffer);
+    
+    while (count > 0) {
+        uint32_t group = lba / BCACHE_SECTORS_PER_BUFFER;
+        uint32_t first = lba % BCACHE_SECTORS_PER_BUFFER;
+        uint32_t n = BCACHE_SECTORS_PER_BUFFER - first;
+        uint8_t sequential = (group == last_group + 1);
+        uint8_t missed;
+        
+        if (n > count) n = count;
+        
+        int index = get_buffer(group);
+        if (index < 0) return -1;
+        
+        struct bcache_buffer* buf = &buffers[index];
+        uint8_t mask = ((1 << n) - 1) << first;
+        
+        missed = (buf->valid & mask) != mask;
+        if (missed && fill_buffer(buf) != 0) return -1;
+        
+        memcpy(buffer, buf->data + first * DISK_SECTOR_SIZE, n * DISK_SECTOR_SIZE);
+        
+        if (missed && sequential) {
+            read_ahead(group);
+        }
+        last_group = group;
+        
+        lba += n;
+        count -= n;
+        buffer += n * DISK_SECTOR_SIZE;
+    }
+    
+    return 0;
+}
+
+/*
+ * bcache_write() - Write sectors through the cache
+ * 
+ * WHAT: Same contract as disk_write_sectors(), but delayed
+ * HOW: Copy into the cached group and mark the sectors valid and dirty;
+ *      nothing is read from disk, and nothing reaches the disk until
+ *      the buffer is evicted or bcache_flush() runs
+ * RETURNS: 0 on success, -1 on disk error
+ */
+int bcache_write(uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    if (buffer_count == 0) {
+        unflushed = 1;
+        return disk_write_sectors(lba, count, buffer);
+    }
+    
+    while (count > 0) {
+        uint32_t group = lba / BCACHE_SECTORS_PER_BUFFER;
+        uint32_t first = lba % BCACHE_SECTORS_PER_BUFFER;
+        uint32_t n = BCACHE_SECTORS_PER_BUFFER - first;
+        
+        if (n > count) n = count;
+        
+        int index = get_buffer(group);
+        if (index < 0) return -1;
+        
+        struct bcache_buffer* buf = &buffers[index];
+        uint8_t mask = ((1 << n) - 1) << first;
+        
+        wait_buffer(buf);
+        memcpy(buf->data + first * DISK_SECTOR_SIZE, buffer, n * DISK_SECTOR_SIZE);
+        buf->valid |= mask;
+        buf->dirty |= mask;
+        
+        lba += n;
+        count -= n;
+        buffer += n * DISK_SECTOR_SIZE;
+    }
+    
+    return 0;
+}
+
+/*
+ * bcache_set_priority() - Set the priority of the buffers touched next
+ * 
+ * WHAT: Every read or write from now on gives its buffers this priority
+ * HOW: The filesystem sets its file's priority before file I/O and its
+ *      metadata priority before table I/O; since it never yields in
+ *      between, one global is enough
+ */
+void bcache_set_priority(uint8_t priority)
+{
+    current_priority = priority > BCACHE_PRIORITY_MAX ? BCACHE_PRIORITY_MAX : priority;
+}
+
+/*
+ * bcache_write_behind() - Start writing dirty buffers in the background
+ * 
+ * WHAT: Queue every dirty sector and return without waiting
+ * WHY: Called when the system goes idle, so the sectors are already on
+ *      their way when the next flush or eviction needs them to be
+ * NOTE: LOW buffers are left alone; they go out when evicted or flushed
+ */
+void bcache_write_behind(void)
+{
+    uint32_t i;
+    
+    for (i = 0; i < buffer_count; i++) {
+        if (buffers[i].in_use && buffers[i].dirty &&
+            buffers[i].priority != BCACHE_PRIORITY_LOW) {
+            start_write_back(&buffers[i]);
+        }
+    }
+}
+
+/*
+ * bcache_write_range() - Write back the dirty sectors of a disk range
+ * 
+ * WHAT: Write the cached groups in [lba, lba + count), whatever their
+ *       priority
+ * WHY: The filesystem must get new data blocks on disk before the journal
+ *      commit that makes them part of a file, even for LOW files
+ * HOW: Queue every dirty group of the range at once, then wait for them.
+ *      The drive's write cache is left to the next flush.
+ * RETURNS: 0 on success, -1 on disk error (sectors stay dirty)
+ */
+int bcache_write_range(uint32_t lba, uint32_t count)
+{
+    uint32_t group;
+    uint32_t last = (lba + count - 1) / BCACHE_SECTORS_PER_BUFFER;
+    int result = 0;
+    
+    if (count == 0) return 0;
+    
+    for (group = lba / BCACHE_SECTORS_PER_BUFFER; group <= last; group++) {
+        int index = find_buffer(group);
+        
+        if (index < 0 || !buffers[index].dirty) continue;
+        
+        wait_buffer(&buffers[index]);
+        if (start_write_back(&buffers[index]) != 0) result = -1;
+    }
+    
+    for (group = lba / BCACHE_SECTORS_PER_BUFFER; group <= last; group++) {
+        int index = find_buffer(group);
+        
+        if (index < 0) continue;
+        
+        wait_buffer(&buffers[index]);
+        if (buffers[index].dirty) result = -1;
+    }
+    
+    return result;
+}
+
+/*
+ * write_back_range() - Write back every buffer of priority 'low' to 'high'
+ * 
+ * HOW: Queue their dirty runs at once - the driver's elevator sorts them
+ *      into one sweep across the disk and merges neighbouring groups into
+ *      single transfers - then wait for every write in flight
+ * RETURNS: 0 on success, -1 if the driver refused a request
+ */
+static int write_back_range(uint8_t low, uint8_t high)
+{
+    uint32_t i;
+    int result = 0;
+    
+    for (i = 0; i < buffer_count; i++) {
+        struct bcache_buffer* buf = &buffers[i];
+        
+        if (!buf->in_use || !buf->dirty) continue;
+        if (buf->priority < low || buf->priority > high) continue;
+        
+        /* A write-behind still in flight has to finish before requeueing */
+        if (buf->writing) wait_buffer(buf);
+        if (start_write_back(buf) != 0) result = -1;
+    }
+    
+    /* Also waits for write-behind still in flight from other ranges */
+    for (i = 0; i < buffer_count; i++) {
+        wait_buffer(&buffers[i]);
+    }
+    
+    return result;
+}
+
+/*
+ * bcache_flush() - Write every dirty sector back to disk
+ * 
+ * WHAT: Called by xaefs_sync() so synced data is really on disk
+ */
+int bcache_flush(void)
+{
+    return bcache_flush_priority(BCACHE_PRIORITY_LOW);
+}
+
+/*
+ * bcache_flush_priority() - Write back dirty sectors of 'min_priority' and up
+ * 
+ * WHAT: A flush that may leave lower priority buffers dirty
+ * HOW: Buffers of BCACHE_PRIORITY_URGENT and up get a sweep of their own
+ *      ahead of the rest, so they are on disk first if the flush is cut
+ *      short. Finally the drive's own write cache is flushed if anything
+ *      was written since the last flush.
+ * RETURNS: 0 on success, -1 if any write failed
+ */
+int bcache_flush_priority(uint8_t min_priority)
+{
+    int result = 0;
+    
+    write_failed = 0;
+    
+    if (min_priority < BCACHE_PRIORITY_URGENT) {
+        if (write_back_range(BCACHE_PRIORITY_URGENT, BCACHE_PRIORITY_MAX) != 0) result = -1;
+        if (write_back_range(min_priority, BCACHE_PRIORITY_URGENT - 1) != 0) result = -1;
+    } else if (write_back_range(min_priority, BCACHE_PRIORITY_MAX) != 0) {
+        result = -1;
+    }
+    if (write_failed) result = -1;
+    
+    if (result == 0 && unflushed) {
+        if (disk_flush() != 0) return -1;
+        unflushed = 0;
+    }
+    
+    return result;
+}
+
+/*
+ * bcache_get_stats() - Copy out the cache counters
+ */
+void bcache_get_stats(struct bcache_stats* out)
+{
+    memcpy(out, &stats, sizeof(stats));
+}
@@ -6,620 +6,3075 @@
 
 #include "include/xaefs.h"
 #include "include/memory.h"
-#include "include/vga.h"
-#include "include/serial.h"
+#include "include/output.h"
 #include "include/string.h"
 #include "include/disk.h"
+#include "include/bcache.h"
+#include "include/slab.h"
+#include "include/timer.h"
+#include "include/perf.h"
 
-/* Dual output helper */
+/* Output helpers: the console, or the session a command runs for */
 static void fs_print(const char* str) {
-    vga_print(str);
-    serial_print(str);
+    output_print(str);
 }
 
 static void fs_putchar(char c) {
-    vga_putchar(c);
-    serial_putchar(c);
+    output_putchar(c);
 }
 
-/* Disk layout for XAE-FS:
+/* Disk layout for XAE-FS (version 2):
  * Sector 0: Bootloader (reserved)
  * Sector 1: Superblock
- * Sector 2-9: Inode table (256 inodes * ~100 bytes each = ~25KB = 8 sectors)
- * Sector 10+: File data blocks
+ * Sector 2-17: Metadata journal (header + up to 15 sector images)
+ * Sector 18-81: Inode table (4 inodes per sector * 64 sectors = 256 inodes)
+ * Sector 82-145: Tag table (4 tag records per sector)
+ * Sector 146+: Free block bitmap (1 sector per 4096 blocks)
+ * Next 4KB boundary: File data blocks, up to the end of the disk
+ *
+ * NOTE: Only the superblock is at a fixed place; everything else is found
+ *       through its layout fields, so the numbers above are just what a
+ *       fresh format picks (see layout_fresh).
  */
 #define XAEFS_SUPERBLOCK_SECTOR 1
-#define XAEFS_INODE_TABLE_SECTOR 2
-#define XAEFS_INODE_TABLE_SECTORS 8
-#define XAEFS_DATA_START_SECTOR 10
+#define XAEFS_META_SECTOR 2         /* Where a fresh format starts the tables */
+#define XAEFS_INODES_PER_SECTOR (DISK_SECTOR_SIZE / XAEFS_INODE_SIZE)
+#define XAEFS_INODE_TABLE_SECTORS \
+    ((XAEFS_MAX_FILES + XAEFS_INODES_PER_SECTOR - 1) / XAEFS_INODES_PER_SECTOR)
+#define XAEFS_TAGS_PER_SECTOR (DISK_SECTOR_SIZE / sizeof(struct xaefs_tags))
+#define XAEFS_TAG_TABLE_SECTORS \
+    ((XAEFS_MAX_FILES + XAEFS_TAGS_PER_SECTOR - 1) / XAEFS_TAGS_PER_SECTOR)
+#define XAEFS_SECTORS_PER_BLOCK (XAEFS_BLOCK_SIZE / DISK_SECTOR_SIZE)
+
+_Static_assert(sizeof(struct xaefs_inode) == XAEFS_INODE_SIZE, "inode record size");
+_Static_assert(DISK_SECTOR_SIZE % sizeof(struct xaefs_tags) == 0, "tag record size");
+
+/* Metadata journal
+ * HOW: One transaction at a time: a header sector listing the home
+ *      sectors, followed by their images (see xaefs_commit) */
+#define XAEFS_JOURNAL_SECTORS 16
+#define XAEFS_JOURNAL_CAPACITY (XAEFS_JOURNAL_SECTORS - 1)  /* Images per transaction */
+#define XAEFS_JOURNAL_MAGIC 0x4C4E4A58  /* "XJNL" */
+#define XAEFS_MAX_OP_SECTORS 6      /* Most sectors one operation dirties */
+
+/* Free block bitmap (1 bit per data block, 1 = used) */
+#define XAEFS_BITMAP_BITS (DISK_SECTOR_SIZE * 8)  /* Blocks per bitmap sector */
+#define XAEFS_MAX_BLOCKS 16384                    /* 64 MB of data */
+#define XAEFS_BITMAP_BYTES (XAEFS_MAX_BLOCKS / 8)
+#define XAEFS_BITMAP_MAX_SECTORS (XAEFS_MAX_BLOCKS / XAEFS_BITMAP_BITS)
+#define XAEFS_DEFAULT_BLOCKS 1024   /* 4 MB filesystem when there is no disk */
+
+/* Metadata sectors tracked for write-back: inode, tag and bitmap sectors */
+#define XAEFS_META_SECTORS \
+    (XAEFS_INODE_TABLE_SECTORS + XAEFS_TAG_TABLE_SECTORS + XAEFS_BITMAP_MAX_SECTORS)
+
+/* Version 1 layout, only read to migrate old volumes
+ * Sector 1: Superblock (+ free block bitmap from byte 256)
+ * Sector 2-129: Inode table (2 inodes per sector, tags inline)
+ * Sector 130-145: Metadata journal
+ * Sector 152+: File data blocks */
+#define XAEFS_V1_INODE_TABLE_SECTOR 2
+#define XAEFS_V1_INODES_PER_SECTOR (DISK_SECTOR_SIZE / sizeof(struct xaefs_inode_v1))
+#define XAEFS_V1_INODE_TABLE_SECTORS 128
+#define XAEFS_V1_JOURNAL_SECTOR 130
+#define XAEFS_V1_JOURNAL_CAPACITY 15
+#define XAEFS_V1_DATA_START_SECTOR 152
+#define XAEFS_V1_BITMAP_OFFSET 256
+#define XAEFS_V1_MAX_BLOCKS ((DISK_SECTOR_SIZE - XAEFS_V1_BITMAP_OFFSET) * 8)
+
+struct xaefs_inode_v1 {
+    char name[XAEFS_MAX_FILENAME];
+    uint32_t inode_num;
+    uint32_t parent_inode;
+    uint32_t size;
+    uint32_t block_start;
+    uint32_t block_count;
+    uint8_t type;
+    uint8_t priority;
+    uint16_t version;
+    uint32_t created_time;
+    uint32_t modified_time;
+    char tags[XAEFS_MAX_TAGS][XAEFS_TAG_LENGTH];
+    uint8_t tag_count;
+    uint8_t flags;
+};
+
+#define XAEFS_MAX_OPEN_FILES 16
+
+/* Buffer cache priority of the superblock and tables
+ * WHY: Every lookup and commit depends on them, so they are kept and
+ *      flushed like the data of a HIGH file */
+#define XAEFS_META_PRIORITY XAEFS_PRIORITY_HIGH
+
+/* Extent map block (see DATA BLOCKS below) */
+struct xaefs_extent {
+    uint32_t start;                 /* First data block */
+    uint32_t count;                 /* Number of blocks */
+};
+
+#define XAEFS_MAP_EXTENTS (XAEFS_BLOCK_SIZE / sizeof(struct xaefs_extent) - 1)
+#define XAEFS_NO_MAP 0xFFFFFFFF     /* map_buffer holds no map */
+
+struct xaefs_extent_map {
+    uint32_t count;                 /* Extents in use, in file order */
+    uint32_t reserved;
+    struct xaefs_extent extents[XAEFS_MAP_EXTENTS];
+};
+
+/* Sync coalescing (group commit)
+ * WHY: A burst of commands (e.g. a script doing many 'mk') should turn
+ *      into one journal transaction, not one flush per command
+ * HOW: Mutations only mark sectors dirty. They are committed once the
+ *      system has been idle for XAEFS_SYNC_WINDOW ticks, once
+ *      XAEFS_SYNC_BATCH changes have piled up, once the next change might
+ *      not fit in the journal, or when xaefs_sync() is called explicitly */
+#define XAEFS_SYNC_WINDOW TIMER_HZ  /* Idle ticks (1s) before a deferred flush */
+#define XAEFS_SYNC_BATCH 32         /* Max changes held back before flush */
+
+/* Directory index sizing (see DIRECTORY INDEX below) */
+#define XAEFS_HASH_BUCKETS (XAEFS_MAX_FILES / 2)
+#define XAEFS_NO_INODE 0xFFFF       /* End of an index chain */
+
+/* Tag index sizing (see TAG INDEX below) */
+#define XAEFS_MAX_TAG_IDS 256       /* Distinct tag strings in use */
+#define XAEFS_TAG_BUCKETS 64
+#define XAEFS_NO_TAG 0xFFFF         /* End of a tag hash chain */
+#define XAEFS_SET_WORDS (XAEFS_MAX_FILES / 32)  /* One bit per inode */
 
 /* In-memory filesystem structures */
 static struct xaefs_superblock superblock;
 static struct xaefs_inode inode_table[XAEFS_MAX_FILES];
-static struct xaefs_file file_table[16];  /* Max 16 open files */
+static struct xaefs_tags tag_table[XAEFS_MAX_FILES];
+static struct xaefs_file* file_table[XAEFS_MAX_OPEN_FILES];  /* NULL = free slot */
+static struct kmem_cache* file_cache;  /* Open file handles */
+static uint8_t block_bitmap[XAEFS_BITMAP_BYTES];
+static uint8_t io_block[XAEFS_BLOCK_SIZE];  /* Bounce buffer for partial blocks */
+static uint16_t block_refs[XAEFS_MAX_BLOCKS];  /* Users of each data block */
+static uint8_t ordered_blocks[XAEFS_BITMAP_BYTES];  /* Written before the next commit */
+static struct xaefs_extent_map map_buffer;  /* Last extent map read */
+static uint32_t map_block = XAEFS_NO_MAP;   /* Block map_buffer came from */
+
+/* Journal transaction header (first sector of the journal) */
+struct xaefs_journal_header {
+    uint32_t magic;                 /* XAEFS_JOURNAL_MAGIC when valid */
+    uint32_t sequence;              /* Increases with every transaction */
+    uint32_t count;                 /* Number of sector images */
+    uint32_t checksum;              /* Over header and images */
+    uint32_t sectors[XAEFS_JOURNAL_CAPACITY];  /* Home sector of each image */
+};
+
+static uint8_t journal_buffer[XAEFS_JOURNAL_SECTORS * DISK_SECTOR_SIZE];
+static uint32_t journal_sequence = 0;
+
+/* Directory index: hash chains and per-directory child lists */
+static uint16_t name_hash_head[XAEFS_HASH_BUCKETS];
+static uint16_t dir_hash_head[XAEFS_HASH_BUCKETS];
+static uint16_t name_hash_next[XAEFS_MAX_FILES];
+static uint16_t dir_hash_next[XAEFS_MAX_FILES];
+static uint16_t first_child[XAEFS_MAX_FILES];
+static uint16_t next_sibling[XAEFS_MAX_FILES];
+static uint32_t name_hashes[XAEFS_MAX_FILES];  /* Cached name_hash() */
+
+/* Tag index: tag dictionary, one inode set per tag and per priority */
+struct tag_entry {
+    char name[XAEFS_TAG_LENGTH];    /* Empty = free slot */
+    uint16_t files;                 /* Inodes carrying this tag */
+    uint16_t next;                  /* Next entry in the same bucket */
+};
+
+static struct tag_entry tag_dict[XAEFS_MAX_TAG_IDS];
+static uint16_t tag_hash_head[XAEFS_TAG_BUCKETS];
+static uint32_t tag_sets[XAEFS_MAX_TAG_IDS][XAEFS_SET_WORDS];
+static uint32_t priority_sets[4][XAEFS_SET_WORDS];
+
+/* Dentry cache: absolute directory path -> inode number (LRU)
+ * WHY: The shell resolves the same few directory paths over and over
+ * HOW: Entries come from a slab cache as paths are resolved, on a list
+ *      kept in most recently used order; once XAEFS_DCACHE_MAX exist,
+ *      the last one is reused */
+#define XAEFS_DCACHE_MAX 64
+#define XAEFS_DCACHE_PATH 128       /* Longest path worth caching */
+#define XAEFS_MAX_DEPTH 64          /* Guard against parent-link loops */
+
+struct dcache_entry {
+    char path[XAEFS_DCACHE_PATH];
+    uint32_t hash;                  /* dcache_hash() of path */
+    uint16_t inode_num;
+    struct dcache_entry* next;      /* Next less recently used */
+};
+
+static struct dcache_entry* dcache_head;    /* Most recently used */
+static uint32_t dcache_count;
+static struct kmem_cache* dentry_cache;
 
 /* Filesystem state */
 static uint8_t fs_initialized = 0;
 static uint8_t auto_sync_enabled = 1;  /* Auto-save on every change for production */
 
+/* Dirty tracking (one bit per metadata sector, see meta_lba)
+ * WHY: Only sectors whose inodes, tags or bitmap bits changed need to
+ *      hit the disk on sync */
+static uint8_t meta_dirty[(XAEFS_META_SECTORS + 7) / 8];
+static uint8_t superblock_dirty = 0;
+static uint32_t pending_changes = 0;   /* Changes waiting for a flush */
+static uint32_t idle_ticks = 0;        /* Ticks since last change */
+
 /*
- * xaefs_init() - Initialize the filesystem
+ * meta_count() - Number of metadata sectors on this volume
  * 
- * WHAT: Set up the filesystem in memory
- * WHY: Must be called before any filesystem operations
- * HOW: Initialize superblock and inode table
+ * HOW: Metadata sectors are numbered inode table first, then the tag
+ *      table, then the bitmap
  */
-void xaefs_init(void) 
+static uint32_t meta_count(void)
 {
-    /* Clear all structures */
-    memset(&superblock, 0, sizeof(superblock));
-    memset(inode_table, 0, sizeof(inode_table));
-    memset(file_table, 0, sizeof(file_table));
+    return superblock.inode_table_sectors + superblock.tag_table_sectors +
+           superblock.bitmap_sectors;
+}
+
+/*
+ * meta_lba() - Home sector of metadata sector 'index'
+ */
+static uint32_t meta_lba(uint32_t index)
+{
+    if (index < superblock.inode_table_sectors) {
+        return superblock.inode_table_sector + index;
+    }
+    index -= superblock.inode_table_sectors;
     
-    /* Set up superblock */
-    superblock.magic = 0x58414546;  /* "XAEF" in hex */
-    superblock.version = 1;
-    superblock.block_size = XAEFS_BLOCK_SIZE;
-    superblock.total_blocks = 1024;  /* 4MB filesystem for now */
-    superblock.free_blocks = 1024 - 10;  /* Reserve first 10 for metadata */
-    superblock.total_inodes = XAEFS_MAX_FILES;
-    superblock.free_inodes = XAEFS_MAX_FILES - 1;  /* -1 for root dir */
+    if (index < superblock.tag_table_sectors) {
+        return superblock.tag_table_sector + index;
+    }
     
-    /* Create root directory (inode 0)
-     * WHY: Every filesystem needs a root directory (/) */
-    inode_table[0].inode_num = 0;
-    inode_table[0].parent_inode = 0;  /* Root's parent is itself */
-    inode_table[0].size = 0;
-    inode_table[0].type = XAEFS_FILE_DIRECTORY;
-    inode_table[0].priority = XAEFS_PRIORITY_CRITICAL;
-    inode_table[0].version = 1;
-    inode_table[0].name[0] = '/';
-    inode_table[0].name[1] = '\0';
+    return superblock.bitmap_sector + index - superblock.tag_table_sectors;
+}
+
+static void mark_meta_dirty(uint32_t index)
+{
+    meta_dirty[index / 8] |= (1 << (index % 8));
+}
+
+/*
+ * mark_inode_dirty() - Flag the sector holding an inode for the next sync
+ */
+static void mark_inode_dirty(uint32_t inode_num)
+{
+    mark_meta_dirty(inode_num / XAEFS_INODES_PER_SECTOR);
+}
+
+/*
+ * mark_tags_dirty() - Flag the sector holding an inode's tag record
+ */
+static void mark_tags_dirty(uint32_t inode_num)
+{
+    mark_meta_dirty(superblock.inode_table_sectors + inode_num / XAEFS_TAGS_PER_SECTOR);
+}
+
+/*
+ * mark_bitmap_dirty() - Flag the bitmap sector holding a block's bit
+ */
+static void mark_bitmap_dirty(uint32_t block)
+{
+    mark_meta_dirty(superblock.inode_table_sectors + superblock.tag_table_sectors +
+                    block / XAEFS_BITMAP_BITS);
+}
+
+/*
+ * journal_capacity() - Sector images one journal transaction can hold
+ */
+static uint32_t journal_capacity(void)
+{
+    return superblock.journal_sectors - 1;
+}
+
+/*
+ * mark_all_dirty() - Flag the whole on-disk metadata for rewrite
+ * 
+ * WHY: A freshly created filesystem must overwrite whatever was on disk
+ */
+static void mark_all_dirty(void)
+{
+    memset(meta_dirty, 0xFF, sizeof(meta_dirty));
+    superblock_dirty = 1;
+}
+
+/*
+ * count_dirty_sectors() - Number of metadata sectors waiting to be written
+ */
+static uint32_t count_dirty_sectors(void)
+{
+    uint32_t i;
+    uint32_t count = superblock_dirty ? 1 : 0;
     
-    fs_initialized = 1;
+    for (i = 0; i < meta_count(); i++) {
+        if (meta_dirty[i / 8] & (1 << (i % 8))) count++;
+    }
     
-    fs_print("  - Filesystem magic: 0x58414546\n");
-    fs_print("  - Block size: 4096 bytes\n");
-    fs_print("  - Total capacity: 4 MB\n");
+    return count;
+}
+
+/*
+ * schedule_sync() - Record a change for the next group commit
+ * 
+ * WHAT: Count a mutation and commit early if the group is full
+ * WHY: Callers used to sync after every change (one full table rewrite)
+ * HOW: The commit normally happens in xaefs_idle_tick(). Committing while
+ *      there is still room for one more operation keeps every group
+ *      small enough for a single journal transaction.
+ */
+static void schedule_sync(void)
+{
+    if (!auto_sync_enabled) return;
     
-    /* Create unique starter hierarchy */
-    fs_print("  - Creating XAE hierarchy: /sys /usr /tmp\n");
+    pending_changes++;
+    idle_ticks = 0;
     
-    /* Create /sys (system files) */
-    int idx = xaefs_create("sys", XAEFS_FILE_DIRECTORY, XAEFS_PRIORITY_HIGH);
-    if (idx >= 0) inode_table[idx].parent_inode = 0;
+    if (pending_changes >= XAEFS_SYNC_BATCH ||
+        count_dirty_sectors() > journal_capacity() - XAEFS_MAX_OP_SECTORS) {
+        xaefs_commit();
+    }
+}
+
+/*
+ * ==============================================================================
+ * DIRECTORY INDEX
+ * ==============================================================================
+ * WHAT: In-memory hash index over the inode table
+ * WHY: Every lookup used to scan all XAEFS_MAX_FILES inodes
+ * HOW: Each inode sits on two hash chains - one keyed by (parent, name)
+ *      for lookups inside a directory, one keyed by name alone for the
+ *      global lookups - and on its parent's child list for 'ls'.
+ *      Nothing here is stored on disk; xaefs_load() rebuilds it.
+ */
+
+/*
+ * name_hash() - Hash a filename (FNV-1a)
+ */
+static uint32_t name_hash(const char* name)
+{
+    uint32_t hash = 2166136261u;
     
-    /* Create /usr (user files) */
-    idx = xaefs_create("usr", XAEFS_FILE_DIRECTORY, XAEFS_PRIORITY_NORMAL);
-    if (idx >= 0) inode_table[idx].parent_inode = 0;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
     
-    /* Create /tmp (temporary) */
-    idx = xaefs_create("tmp", XAEFS_FILE_DIRECTORY, XAEFS_PRIORITY_LOW);
-    if (idx >= 0) inode_table[idx].parent_inode = 0;
+    return hash;
 }
 
 /*
- * xaefs_format() - Format a disk with XAE-FS
+ * dir_bucket() - Bucket for a (parent, name hash) pair
+ */
+static uint32_t dir_bucket(uint32_t parent_inode, uint32_t hash)
+{
+    return (hash ^ (parent_inode * 2654435761u)) % XAEFS_HASH_BUCKETS;
+}
+
+/*
+ * index_insert() - Add an in-use inode to the index
  * 
- * WHAT: Prepare a disk to use our filesystem
- * WHY: To create a new filesystem on empty storage
- * HOW: Write superblock and empty inode table
+ * HOW: Push onto both hash chains, insert into the parent's child list
+ *      in inode order (so 'ls' output keeps the table order). Versions
+ *      can't be looked up by name, so they only go on their file's
+ *      child list.
  */
-void xaefs_format(const char* label) 
+static void index_insert(uint32_t ino)
 {
-    uint32_t i;
+    struct xaefs_inode* inode = &inode_table[ino];
+    uint8_t named = !(inode->flags & XAEFS_FLAG_VERSION);
+    uint32_t hash = name_hash(inode->name);
+    uint32_t bucket;
     
-    /* Copy volume label */
-    for (i = 0; i < 31 && label[i] != '\0'; i++) {
-        superblock.label[i] = label[i];
+    name_hashes[ino] = hash;
+    
+    if (named) {
+        bucket = hash % XAEFS_HASH_BUCKETS;
+        name_hash_next[ino] = name_hash_head[bucket];
+        name_hash_head[bucket] = ino;
     }
-    superblock.label[i] = '\0';
     
-    fs_print("  - Volume label: ");
-    fs_print(superblock.label);
-    fs_print("\n");
+    if (inode->parent_inode >= XAEFS_MAX_FILES) {
+        return;  /* Corrupt parent link - reachable by name only */
+    }
+    
+    if (named) {
+        bucket = dir_bucket(inode->parent_inode, hash);
+        dir_hash_next[ino] = dir_hash_head[bucket];
+        dir_hash_head[bucket] = ino;
+    }
+    
+    uint16_t* link = &first_child[inode->parent_inode];
+    while (*link != XAEFS_NO_INODE && *link < ino) {
+        link = &next_sibling[*link];
+    }
+    next_sibling[ino] = *link;
+    *link = ino;
 }
 
 /*
- * find_free_inode() - Find an unused inode
+ * unlink_chain() - Remove an inode from a singly linked chain
+ */
+static void unlink_chain(uint16_t* link, uint16_t* next, uint32_t ino)
+{
+    while (*link != XAEFS_NO_INODE) {
+        if (*link == ino) {
+            *link = next[ino];
+            next[ino] = XAEFS_NO_INODE;
+            return;
+        }
+        link = &next[*link];
+    }
+}
+
+/*
+ * index_remove() - Drop an inode from the index
  * 
- * WHAT: Search for an available inode slot
- * WHY: Needed when creating new files
- * HOW: Scan inode table for empty entry
- * RETURNS: Inode number, or -1 if none available
+ * WHY: Must be called before the inode's name or parent changes
  */
-static int find_free_inode(void) 
+static void index_remove(uint32_t ino)
+{
+    struct xaefs_inode* inode = &inode_table[ino];
+    uint32_t hash = name_hashes[ino];
+    
+    unlink_chain(&name_hash_head[hash % XAEFS_HASH_BUCKETS], name_hash_next, ino);
+    
+    if (inode->parent_inode >= XAEFS_MAX_FILES) return;
+    
+    unlink_chain(&dir_hash_head[dir_bucket(inode->parent_inode, hash)],
+                 dir_hash_next, ino);
+    unlink_chain(&first_child[inode->parent_inode], next_sibling, ino);
+}
+
+/*
+ * index_rebuild() - Recreate the whole index from inode_table
+ */
+static void index_rebuild(void)
 {
     uint32_t i;
     
-    for (i = 1; i < XAEFS_MAX_FILES; i++) {  /* Start at 1 (0 is root) */
-        if (inode_table[i].inode_num == 0) {
-            return i;
+    for (i = 0; i < XAEFS_HASH_BUCKETS; i++) {
+        name_hash_head[i] = XAEFS_NO_INODE;
+        dir_hash_head[i] = XAEFS_NO_INODE;
+    }
+    for (i = 0; i < XAEFS_MAX_FILES; i++) {
+        name_hash_next[i] = XAEFS_NO_INODE;
+        dir_hash_next[i] = XAEFS_NO_INODE;
+        first_child[i] = XAEFS_NO_INODE;
+        next_sibling[i] = XAEFS_NO_INODE;
+    }
+    
+    /* Walk backwards so the head-inserted hash chains end up in inode order */
+    for (i = XAEFS_MAX_FILES - 1; i > 0; i--) {  /* Root (0) is never indexed */
+        if (inode_table[i].inode_num != 0) {
+            index_insert(i);
         }
     }
+}
+
+/*
+ * ==============================================================================
+ * TAG INDEX
+ * ==============================================================================
+ * WHAT: Inverted index from tags (and priorities) to inodes
+ * WHY: 'find' used to compare every tag of every inode byte by byte
+ * HOW: Each distinct tag string is interned once in the tag dictionary
+ *      and owns a bitset with one bit per inode. Multi-tag queries are
+ *      then word-wise AND/OR of bitsets, and a priority filter is one
+ *      more AND with that priority's bitset. Like the directory index,
+ *      it lives only in memory and is rebuilt on load.
+ */
+
+/*
+ * tag_find() - Look up a tag in the dictionary
+ * RETURNS: Tag ID, or -1 if no file carries this tag
+ */
+static int tag_find(const char* tag)
+{
+    uint16_t id;
+    
+    for (id = tag_hash_head[name_hash(tag) % XAEFS_TAG_BUCKETS];
+         id != XAEFS_NO_TAG; id = tag_dict[id].next) {
+        if (strcmp(tag_dict[id].name, tag) == 0) return id;
+    }
     
-    return -1;  /* No free inodes */
+    return -1;
 }
 
 /*
- * find_file_by_name() - Find a file by name (global search)
+ * tag_intern() - Get the ID for a tag, adding it to the dictionary if new
+ * RETURNS: Tag ID, or -1 if the dictionary is full or the tag is empty
+ * NOTE: An empty name marks a free slot, so "" can't be a tag
+ */
+static int tag_intern(const char* tag)
+{
+    int id;
+    uint32_t bucket;
+    
+    if (tag[0] == '\0') return -1;
+    
+    id = tag_find(tag);
+    if (id >= 0) return id;
+    
+    for (id = 0; id < XAEFS_MAX_TAG_IDS; id++) {
+        if (tag_dict[id].name[0] == '\0') break;
+    }
+    if (id == XAEFS_MAX_TAG_IDS) return -1;
+    
+    strcpy(tag_dict[id].name, tag);
+    tag_dict[id].files = 0;
+    
+    bucket = name_hash(tag) % XAEFS_TAG_BUCKETS;
+    tag_dict[id].next = tag_hash_head[bucket];
+    tag_hash_head[bucket] = id;
+    
+    return id;
+}
+
+/*
+ * tag_index_add() - Record that an inode carries a tag
+ * RETURNS: 0 on success, -1 if the dictionary is full
+ */
+static int tag_index_add(uint32_t ino, const char* tag)
+{
+    int id = tag_intern(tag);
+    if (id < 0) return -1;
+    
+    if (!(tag_sets[id][ino / 32] & (1u << (ino % 32)))) {
+        tag_sets[id][ino / 32] |= (1u << (ino % 32));
+        tag_dict[id].files++;
+    }
+    
+    return 0;
+}
+
+/*
+ * tag_index_remove() - Drop an inode from the tag and priority index
  * 
- * WHAT: Search for a file in the inode table
- * WHY: Common operation for all file commands
- * HOW: Compare name strings in all inodes
- * RETURNS: Pointer to inode, or NULL if not found
+ * HOW: Tags no file carries any more leave the dictionary
+ * WHY: Must be called before the inode is cleared
  */
-static struct xaefs_inode* find_file_by_name(const char* name) 
+static void tag_index_remove(uint32_t ino)
 {
-    uint32_t i, j;
+    struct xaefs_inode* inode = &inode_table[ino];
+    uint32_t i;
     
-    for (i = 0; i < XAEFS_MAX_FILES; i++) {
-        if (inode_table[i].inode_num != 0) {
-            /* Compare name */
-            uint32_t match = 1;
-            for (j = 0; name[j] != '\0' && inode_table[i].name[j] != '\0'; j++) {
-                if (name[j] != inode_table[i].name[j]) {
-                    match = 0;
-                    break;
-                }
-            }
-            if (match && name[j] == '\0' && inode_table[i].name[j] == '\0') {
-                return &inode_table[i];
+    for (i = 0; i < inode->tag_count; i++) {
+        int id = tag_find(tag_table[ino].tags[i]);
+        
+        if (id < 0 || !(tag_sets[id][ino / 32] & (1u << (ino % 32)))) {
+            continue;  /* Already dropped (same tag twice) */
+        }
+        tag_sets[id][ino / 32] &= ~(1u << (ino % 32));
+        
+        if (--tag_dict[id].files == 0) {
+            uint16_t* link = &tag_hash_head[name_hash(tag_dict[id].name) % XAEFS_TAG_BUCKETS];
+            while (*link != id) {
+                link = &tag_dict[*link].next;
             }
+            *link = tag_dict[id].next;
+            tag_dict[id].name[0] = '\0';
         }
     }
     
-    return NULL;  /* Not found */
+    priority_sets[inode->priority & 3][ino / 32] &= ~(1u << (ino % 32));
+}
+
+/*
+ * priority_index_set() - Move an inode to the bitset of its priority
+ */
+static void priority_index_set(uint32_t ino, uint8_t old_priority, uint8_t priority)
+{
+    priority_sets[old_priority & 3][ino / 32] &= ~(1u << (ino % 32));
+    priority_sets[priority & 3][ino / 32] |= (1u << (ino % 32));
+}
+
+/*
+ * tag_index_rebuild() - Recreate the tag and priority index from inode_table
+ */
+static void tag_index_rebuild(void)
+{
+    uint32_t i, j;
+    
+    memset(tag_dict, 0, sizeof(tag_dict));
+    memset(tag_sets, 0, sizeof(tag_sets));
+    memset(priority_sets, 0, sizeof(priority_sets));
+    for (i = 0; i < XAEFS_TAG_BUCKETS; i++) {
+        tag_hash_head[i] = XAEFS_NO_TAG;
+    }
+    
+    for (i = 1; i < XAEFS_MAX_FILES; i++) {  /* Root (0) is never a result */
+        if (inode_table[i].inode_num == 0) continue;
+        if (inode_table[i].flags & XAEFS_FLAG_VERSION) continue;
+        
+        priority_sets[inode_table[i].priority & 3][i / 32] |= (1u << (i % 32));
+        for (j = 0; j < inode_table[i].tag_count; j++) {
+            tag_index_add(i, tag_table[i].tags[j]);
+        }
+    }
+}
+
+/*
+ * reset_handles() - Free every open file handle
+ * 
+ * WHAT: Used when the in-memory filesystem is (re)built
+ * NOTE: Also creates the handle cache on first use
+ */
+static void reset_handles(void)
+{
+    uint32_t i;
+    
+    if (!file_cache) {
+        file_cache = kmem_cache_create("xaefs_file", sizeof(struct xaefs_file));
+    }
+    
+    for (i = 0; i < XAEFS_MAX_OPEN_FILES; i++) {
+        if (file_table[i]) kmem_cache_free(file_cache, file_table[i]);
+        file_table[i] = NULL;
+    }
+}
+
+/*
+ * dcache_reset() - Forget every cached path
+ * 
+ * WHAT: Used when the in-memory filesystem is (re)built
+ * NOTE: Also creates the dentry cache on first use
+ */
+static void dcache_reset(void)
+{
+    if (!dentry_cache) {
+        dentry_cache = kmem_cache_create("xaefs_dentry", sizeof(struct dcache_entry));
+    }
+    
+    while (dcache_head) {
+        struct dcache_entry* e = dcache_head;
+        
+        dcache_head = e->next;
+        kmem_cache_free(dentry_cache, e);
+    }
+    dcache_count = 0;
+}
+
+/*
+ * bitmap_sectors() - Bitmap sectors needed for 'blocks' data blocks
+ */
+static uint32_t bitmap_sectors(uint32_t blocks)
+{
+    return (blocks + XAEFS_BITMAP_BITS - 1) / XAEFS_BITMAP_BITS;
+}
+
+/*
+ * place_metadata() - Lay out the journal and tables from 'sector' on
+ * 
+ * HOW: Journal, inode table, tag table and a bitmap big enough for
+ *      'blocks' data blocks, back to back
+ * RETURNS: First sector after them
+ */
+static uint32_t place_metadata(uint32_t sector, uint32_t blocks)
+{
+    superblock.inode_size = XAEFS_INODE_SIZE;
+    superblock.journal_sector = sector;
+    superblock.journal_sectors = XAEFS_JOURNAL_SECTORS;
+    sector += XAEFS_JOURNAL_SECTORS;
+    
+    superblock.inode_table_sector = sector;
+    superblock.inode_table_sectors = XAEFS_INODE_TABLE_SECTORS;
+    sector += XAEFS_INODE_TABLE_SECTORS;
+    
+    superblock.tag_table_sector = sector;
+    superblock.tag_table_sectors = XAEFS_TAG_TABLE_SECTORS;
+    sector += XAEFS_TAG_TABLE_SECTORS;
+    
+    superblock.bitmap_sector = sector;
+    superblock.bitmap_sectors = bitmap_sectors(blocks);
+    
+    return sector + superblock.bitmap_sectors;
+}
+
+/*
+ * layout_fresh() - Lay out a new volume on a disk of 'volume' sectors
+ * 
+ * HOW: Tables right after the superblock, data blocks behind them up to
+ *      the end of the disk (or XAEFS_MAX_BLOCKS). Without a disk the
+ *      volume only lives in memory and gets XAEFS_DEFAULT_BLOCKS.
+ */
+static void layout_fresh(uint32_t volume)
+{
+    uint32_t end = place_metadata(XAEFS_META_SECTOR, XAEFS_MAX_BLOCKS);
+    uint32_t blocks;
+    
+    superblock.data_start_sector = ((end + XAEFS_SECTORS_PER_BLOCK - 1) /
+                                    XAEFS_SECTORS_PER_BLOCK) * XAEFS_SECTORS_PER_BLOCK;
+    
+    if (volume <= superblock.data_start_sector) {
+        blocks = XAEFS_DEFAULT_BLOCKS;
+        volume = superblock.data_start_sector + blocks * XAEFS_SECTORS_PER_BLOCK;
+    } else {
+        blocks = (volume - superblock.data_start_sector) / XAEFS_SECTORS_PER_BLOCK;
+    }
+    if (blocks > XAEFS_MAX_BLOCKS) blocks = XAEFS_MAX_BLOCKS;
+    
+    superblock.total_blocks = blocks;
+    superblock.bitmap_sectors = bitmap_sectors(blocks);
+    superblock.volume_sectors = volume;
+}
+
+/*
+ * xaefs_init() - Initialize the filesystem
+ * 
+ * WHAT: Set up the filesystem in memory
+ * WHY: Must be called before any filesystem operations
+ * HOW: Initialize superblock and inode table
+ */
+void xaefs_init(void) 
+{
+    /* Clear all structures */
+    memset(&superblock, 0, sizeof(superblock));
+    memset(inode_table, 0, sizeof(inode_table));
+    memset(tag_table, 0, sizeof(tag_table));
+    reset_handles();
+    memset(block_bitmap, 0, sizeof(block_bitmap));
+    memset(block_refs, 0, sizeof(block_refs));
+    memset(ordered_blocks, 0, sizeof(ordered_blocks));
+    map_block = XAEFS_NO_MAP;
+    
+    /* Set up superblock, sized to the disk */
+    superblock.magic = XAEFS_MAGIC;
+    superblock.version = XAEFS_VERSION;
+    superblock.block_size = XAEFS_BLOCK_SIZE;
+    layout_fresh(disk_get_sectors());
+    superblock.free_blocks = superblock.total_blocks;
+    superblock.total_inodes = XAEFS_MAX_FILES;
+    superblock.free_inodes = XAEFS_MAX_FILES - 1;  /* -1 for root dir */
+    
+    /* Create root directory (inode 0)
+     * WHY: Every filesystem needs a root directory (/) */
+    inode_table[0].inode_num = 0;
+    inode_table[0].parent_inode = 0;  /* Root's parent is itself */
+    inode_table[0].size = 0;
+    inode_table[0].type = XAEFS_FILE_DIRECTORY;
+    inode_table[0].priority = XAEFS_PRIORITY_CRITICAL;
+    inode_table[0].version = 1;
+    inode_table[0].name[0] = '/';
+    inode_table[0].name[1] = '\0';
+    
+    index_rebuild();
+    tag_index_rebuild();
+    dcache_reset();
+    fs_initialized = 1;
+    
+    char num[12];
+    
+    fs_print("  - Filesystem magic: 0x58414546\n");
+    fs_print("  - Block size: 4096 bytes\n");
+    fs_print("  - Total capacity: ");
+    fs_print(utoa(superblock.total_blocks / (1024 * 1024 / XAEFS_BLOCK_SIZE), num));
+    fs_print(" MB\n");
+    
+    /* Create unique starter hierarchy */
+    fs_print("  - Creating XAE hierarchy: /sys /usr /tmp\n");
+    
+    /* Create /sys (system files) */
+    int idx = xaefs_create("sys", XAEFS_FILE_DIRECTORY, XAEFS_PRIORITY_HIGH);
+    if (idx >= 0) inode_table[idx].parent_inode = 0;
+    
+    /* Create /usr (user files) */
+    idx = xaefs_create("usr", XAEFS_FILE_DIRECTORY, XAEFS_PRIORITY_NORMAL);
+    if (idx >= 0) inode_table[idx].parent_inode = 0;
+    
+    /* Create /tmp (temporary) */
+    idx = xaefs_create("tmp", XAEFS_FILE_DIRECTORY, XAEFS_PRIORITY_LOW);
+    if (idx >= 0) inode_table[idx].parent_inode = 0;
+    
+    /* New filesystem: every metadata sector must be written out */
+    mark_all_dirty();
+}
+
+/*
+ * xaefs_format() - Format a disk with XAE-FS
+ * 
+ * WHAT: Prepare a disk to use our filesystem
+ * WHY: To create a new filesystem on empty storage
+ * HOW: Write superblock and empty inode table
+ */
+void xaefs_format(const char* label) 
+{
+    uint32_t i;
+    
+    /* Copy volume label */
+    for (i = 0; i < 31 && label[i] != '\0'; i++) {
+        superblock.label[i] = label[i];
+    }
+    superblock.label[i] = '\0';
+    superblock_dirty = 1;
+    
+    fs_print("  - Volume label: ");
+    fs_print(superblock.label);
+    fs_print("\n");
+}
+
+/*
+ * find_free_inode() - Find an unused inode
+ * 
+ * WHAT: Search for an available inode slot
+ * WHY: Needed when creating new files
+ * HOW: Scan inode table for empty entry
+ * RETURNS: Inode number, or -1 if none available
+ */
+static int find_free_inode(void) 
+{
+    uint32_t i;
+    
+    for (i = 1; i < superblock.total_inodes; i++) {  /* Start at 1 (0 is root) */
+        if (inode_table[i].inode_num == 0) {
+            return i;
+        }
+    }
+    
+    return -1;  /* No free inodes */
+}
+
+/*
+ * find_file_by_name() - Find a file by name (global search)
+ * 
+ * WHAT: Search for a file in the inode table
+ * WHY: Common operation for all file commands
+ * HOW: Walk the name hash chain; the lowest inode number wins if
+ *      several directories hold the same name
+ * RETURNS: Pointer to inode, or NULL if not found
+ */
+static struct xaefs_inode* find_file_by_name(const char* name) 
+{
+    uint32_t hash = name_hash(name);
+    uint16_t ino = name_hash_head[hash % XAEFS_HASH_BUCKETS];
+    struct xaefs_inode* best = NULL;
+    
+    while (ino != XAEFS_NO_INODE) {
+        if (name_hashes[ino] == hash && strcmp(inode_table[ino].name, name) == 0) {
+            if (!best || ino < best->inode_num) {
+                best = &inode_table[ino];
+            }
+        }
+        ino = name_hash_next[ino];
+    }
+    
+    return best;  /* NULL if not found */
+}
+
+/*
+ * find_file_in_dir() - Find a file in specific directory
+ * 
+ * WHAT: Search for a file by name within a parent directory
+ * WHY: To support proper directory hierarchy
+ * HOW: Walk the (parent, name) hash chain, match both name AND parent_inode
+ * RETURNS: Pointer to inode, or NULL if not found
+ */
+static struct xaefs_inode* find_file_in_dir(const char* name, uint32_t parent_inode) 
+{
+    uint32_t hash = name_hash(name);
+    uint16_t ino = dir_hash_head[dir_bucket(parent_inode, hash)];
+    
+    while (ino != XAEFS_NO_INODE) {
+        if (name_hashes[ino] == hash &&
+            inode_table[ino].parent_inode == parent_inode &&
+            strcmp(inode_table[ino].name, name) == 0) {
+            return &inode_table[ino];
+        }
+        ino = dir_hash_next[ino];
+    }
+    
+    return NULL;  /* Not found */
+}
+
+/*
+ * ==============================================================================
+ * PATH RESOLUTION
+ * ==============================================================================
+ * WHAT: Turn paths like "/usr/proj/src" into inode numbers
+ * WHY: Matching only the last component breaks as soon as two
+ *      directories share a name
+ * HOW: Walk the path one component at a time through the directory
+ *      index, with a small LRU cache of resolved directory paths
+ */
+
+/*
+ * dcache_hash() - Hash the first len characters of a path
+ */
+static uint32_t dcache_hash(const char* path, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+    
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)path[i];
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+/*
+ * dcache_lookup() - Find a cached path prefix
+ * 
+ * HOW: A hit moves to the front of the list
+ * RETURNS: Inode number, or -1 on a miss
+ */
+static int dcache_lookup(const char* path, uint32_t len)
+{
+    uint32_t hash = dcache_hash(path, len);
+    struct dcache_entry** link = &dcache_head;
+    
+    while (*link) {
+        struct dcache_entry* e = *link;
+        
+        if (e->hash == hash && memcmp(e->path, path, len) == 0 && e->path[len] == '\0') {
+            *link = e->next;
+            e->next = dcache_head;
+            dcache_head = e;
+            return e->inode_num;
+        }
+        link = &e->next;
+    }
+    
+    return -1;
+}
+
+/*
+ * dcache_insert() - Remember a resolved directory path
+ * 
+ * HOW: Allocate a new entry while there are fewer than XAEFS_DCACHE_MAX,
+ *      otherwise (or out of memory) reuse the least recently used one
+ */
+static void dcache_insert(const char* path, uint32_t len, uint32_t inode_num)
+{
+    struct dcache_entry* e = NULL;
+    
+    if (len == 0 || len >= XAEFS_DCACHE_PATH) return;
+    
+    if (dcache_count < XAEFS_DCACHE_MAX && dentry_cache) {
+        e = kmem_cache_alloc(dentry_cache);
+    }
+    if (e) {
+        dcache_count++;
+    } else {
+        struct dcache_entry** link = &dcache_head;
+        
+        if (!dcache_head) return;
+        while ((*link)->next) link = &(*link)->next;
+        e = *link;
+        *link = NULL;
+    }
+    
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    e->hash = dcache_hash(path, len);
+    e->inode_num = inode_num;
+    e->next = dcache_head;
+    dcache_head = e;
+}
+
+/*
+ * is_ancestor() - Check whether dir lies on the parent chain of an inode
+ */
+static uint8_t is_ancestor(uint32_t dir, uint32_t inode_num)
+{
+    uint32_t depth;
+    
+    for (depth = 0; depth < XAEFS_MAX_DEPTH; depth++) {
+        if (inode_num == dir) return 1;
+        if (inode_num == 0 || inode_num >= XAEFS_MAX_FILES) return 0;
+        inode_num = inode_table[inode_num].parent_inode;
+    }
+    
+    return 0;
+}
+
+/*
+ * dcache_invalidate() - Forget every cached path at or below a directory
+ * 
+ * WHY: Called before a directory is deleted or moved, since every cached
+ *      path that runs through it is about to change meaning
+ */
+static void dcache_invalidate(uint32_t dir)
+{
+    struct dcache_entry** link = &dcache_head;
+    
+    while (*link) {
+        struct dcache_entry* e = *link;
+        
+        if (is_ancestor(dir, e->inode_num)) {
+            *link = e->next;
+            kmem_cache_free(dentry_cache, e);
+            dcache_count--;
+        } else {
+            link = &e->next;
+        }
+    }
+}
+
+/*
+ * resolve_path() - Resolve a path to an inode number
+ * 
+ * WHAT: Follow each component of path from the root (absolute paths)
+ *       or from the directory dir (relative paths)
+ * HOW: For absolute paths, first try the whole path and then its parent
+ *      directory in the dentry cache; whatever had to be walked is cached.
+ *      "." and ".." are understood but such paths are never cached.
+ * RETURNS: Inode number, or -1 if any component is missing
+ */
+static int resolve_path(const char* path, uint32_t dir)
+{
+    char component[XAEFS_MAX_FILENAME];
+    const char* p = path;
+    uint32_t cur = dir;
+    uint32_t path_len = strlen(path);
+    uint32_t parent_len = 0;        /* Length of the parent prefix */
+    int cached;
+    uint32_t i;
+    uint8_t cacheable = 0;
+    
+    if (path[0] == '/') {
+        cur = 0;
+        cacheable = 1;
+        
+        /* Strip trailing slashes so "/usr/" and "/usr" share an entry */
+        while (path_len > 1 && path[path_len - 1] == '/') path_len--;
+        if (path_len == 1) return 0;  /* Root */
+        
+        /* Whole path cached? */
+        cached = dcache_lookup(path, path_len);
+        if (cached >= 0) return cached;
+        
+        /* Parent directory cached? Then only the last component is left */
+        for (i = 0; i < path_len; i++) {
+            if (path[i] == '/') parent_len = i;
+        }
+        if (parent_len > 0) {
+            cached = dcache_lookup(path, parent_len);
+            if (cached >= 0) {
+                cur = cached;
+                p = path + parent_len;
+                cacheable = 2;  /* Parent is known, only cache the result */
+            }
+        }
+    }
+    
+    while (p < path + path_len) {
+        /* Skip separators */
+        while (*p == '/') p++;
+        if (p >= path + path_len) break;
+        
+        /* Copy one component */
+        uint32_t len = 0;
+        while (p < path + path_len && *p != '/') {
+            if (len >= XAEFS_MAX_FILENAME - 1) return -1;  /* Name too long */
+            component[len++] = *p++;
+        }
+        component[len] = '\0';
+        
+        if (strcmp(component, ".") == 0) {
+            cacheable = 0;
+            continue;
+        }
+        if (strcmp(component, "..") == 0) {
+            cur = inode_table[cur].parent_inode;
+            cacheable = 0;
+            continue;
+        }
+        
+        if (inode_table[cur].type != XAEFS_FILE_DIRECTORY) return -1;
+        
+        struct xaefs_inode* child = find_file_in_dir(component, cur);
+        if (!child) return -1;
+        
+        cur = child->inode_num;
+        
+        /* Just resolved the parent prefix by walking - remember it */
+        if (cacheable == 1 && (uint32_t)(p - path) == parent_len &&
+            child->type == XAEFS_FILE_DIRECTORY) {
+            dcache_insert(path, parent_len, cur);
+        }
+    }
+    
+    if (cacheable && inode_table[cur].type == XAEFS_FILE_DIRECTORY) {
+        dcache_insert(path, path_len, cur);
+    }
+    
+    return (int)cur;
+}
+
+/*
+ * resolve_dir() - Resolve a path that must name a directory
+ * RETURNS: Inode number, or -1 if missing or not a directory
+ */
+static int resolve_dir(const char* path, uint32_t dir)
+{
+    int inode_num = resolve_path(path, dir);
+    
+    if (inode_num < 0 || inode_table[inode_num].type != XAEFS_FILE_DIRECTORY) {
+        return -1;
+    }
+    
+    return inode_num;
+}
+
+/*
+ * lookup_file() - Find a file given either a path or a bare name
+ * 
+ * WHY: Absolute paths are resolved exactly; bare names keep the old
+ *      global-by-name behaviour for callers that only have a name
+ */
+static struct xaefs_inode* lookup_file(const char* path)
+{
+    if (path[0] == '/') {
+        int inode_num = resolve_path(path, 0);
+        if (inode_num <= 0) return NULL;  /* Missing, or the root itself */
+        return &inode_table[inode_num];
+    }
+    
+    return find_file_by_name(path);
+}
+
+/*
+ * ==============================================================================
+ * DATA BLOCKS (EXTENT ALLOCATOR)
+ * ==============================================================================
+ * WHAT: Track which 4KB data blocks are in use and hand them out
+ * WHY: File contents need somewhere to live on disk
+ * HOW: A file normally owns one contiguous extent (block_start,
+ *      block_count). Contiguous blocks let a whole file move in a few
+ *      multi-sector transfers instead of one request per sector.
+ *      Once versions make a file share only some of its blocks, it
+ *      switches to an extent map: block_start then names a data block
+ *      holding the list of extents (XAEFS_FLAG_EXTENT_MAP).
+ *      Every block has a reference count (live file + versions using
+ *      it); counts are kept in memory only and rebuilt on load.
+ */
+
+/*
+ * block_lba() - First disk sector of a data block
+ */
+static uint32_t block_lba(uint32_t block)
+{
+    return superblock.data_start_sector + block * XAEFS_SECTORS_PER_BLOCK;
+}
+
+/*
+ * block_used() - Check a block's bit in the free block bitmap
+ */
+static uint8_t block_used(uint32_t block)
+{
+    return (block_bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+/*
+ * ref_blocks() - Take a reference on a run of blocks
+ * 
+ * HOW: A block's bitmap bit is set while at least one file or version
+ *      references it
+ */
+static void ref_blocks(uint32_t start, uint32_t count)
+{
+    uint32_t i;
+    
+    for (i = start; i < start + count; i++) {
+        if (block_refs[i]++ == 0) {
+            block_bitmap[i / 8] |= (1 << (i % 8));
+            superblock.free_blocks--;
+            mark_bitmap_dirty(i);
+            superblock_dirty = 1;
+        }
+    }
+}
+
+/*
+ * unref_blocks() - Drop a reference on a run of blocks
+ * 
+ * HOW: Blocks nobody references any more become free
+ */
+static void unref_blocks(uint32_t start, uint32_t count)
+{
+    uint32_t i;
+    
+    for (i = start; i < start + count; i++) {
+        if (block_refs[i] > 0 && --block_refs[i] == 0) {
+            block_bitmap[i / 8] &= ~(1 << (i % 8));
+            ordered_blocks[i / 8] &= ~(1 << (i % 8));
+            superblock.free_blocks++;
+            mark_bitmap_dirty(i);
+            superblock_dirty = 1;
+        }
+    }
+}
+
+/*
+ * order_blocks() - Have the next commit write a run of blocks first
+ * 
+ * WHY: A committed inode must not point at blocks whose contents never
+ *      reached the disk, or a crash would show whatever they held before
+ *      (possibly a deleted file's data). Takes new blocks and rewritten
+ *      extent maps; data overwritten in blocks the file already owned
+ *      may still wait for write-back.
+ */
+static void order_blocks(uint32_t start, uint32_t count)
+{
+    uint32_t i;
+    
+    for (i = start; i < start + count; i++) {
+        ordered_blocks[i / 8] |= (1 << (i % 8));
+    }
+}
+
+/*
+ * claim_blocks() - Take the first reference on a run of free blocks
+ */
+static void claim_blocks(uint32_t start, uint32_t count)
+{
+    ref_blocks(start, count);
+    order_blocks(start, count);
+}
+
+/*
+ * write_ordered_blocks() - Write every block order_blocks() asked for
+ * 
+ * HOW: One cache call per run of blocks, whatever the buffers' priority;
+ *      the flush that follows flushes the drive's write cache behind them
+ * RETURNS: 0 on success, -1 on disk error
+ */
+static int write_ordered_blocks(void)
+{
+    uint32_t block = 0;
+    int result = 0;
+    
+    while (block < superblock.total_blocks) {
+        uint32_t run = 0;
+        
+        if (block % 8 == 0 && ordered_blocks[block / 8] == 0) {
+            block += 8;
+            continue;
+        }
+        
+        while (block + run < superblock.total_blocks &&
+               (ordered_blocks[(block + run) / 8] >> ((block + run) % 8)) & 1) {
+            run++;
+        }
+        if (run > 0 &&
+            bcache_write_range(block_lba(block), run * XAEFS_SECTORS_PER_BLOCK) != 0) {
+            result = -1;
+        }
+        block += run + 1;
+    }
+    
+    return result;
+}
+
+/*
+ * range_free() - Check whether a run of blocks is entirely free
+ */
+static uint8_t range_free(uint32_t start, uint32_t count)
+{
+    uint32_t i;
+    
+    if (start + count > superblock.total_blocks) return 0;
+    
+    for (i = start; i < start + count; i++) {
+        if (block_used(i)) return 0;
+    }
+    
+    return 1;
+}
+
+/*
+ * alloc_extent() - Allocate 'count' contiguous data blocks
+ * 
+ * HOW: First fit over the bitmap, skipping fully used bytes at once
+ * RETURNS: First block of the extent, or -1 if no run is big enough
+ */
+static int alloc_extent(uint32_t count)
+{
+    uint32_t block = 0;
+    uint32_t run = 0;
+    
+    if (count == 0 || count > superblock.free_blocks) return -1;
+    
+    while (block < superblock.total_blocks) {
+        /* Jump over 8 used blocks at a time when possible */
+        if (run == 0 && block % 8 == 0 && block_bitmap[block / 8] == 0xFF) {
+            block += 8;
+            continue;
+        }
+        
+        if (block_used(block)) {
+            run = 0;
+        } else if (++run == count) {
+            uint32_t start = block + 1 - count;
+            claim_blocks(start, count);
+            return start;
+        }
+        block++;
+    }
+    
+    return -1;
+}
+
+/*
+ * copy_block() - Copy the contents of one data block to another
+ */
+static int copy_block(uint32_t from, uint32_t to)
+{
+    if (bcache_read(block_lba(from), XAEFS_SECTORS_PER_BLOCK, io_block) != 0 ||
+        bcache_write(block_lba(to), XAEFS_SECTORS_PER_BLOCK, io_block) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * load_map() - Bring a file's extent map block into map_buffer
+ */
+static int load_map(uint32_t block)
+{
+    if (map_block == block) return 0;
+    
+    map_block = XAEFS_NO_MAP;
+    if (bcache_read(block_lba(block), XAEFS_SECTORS_PER_BLOCK, (uint8_t*)&map_buffer) != 0) {
+        return -1;
+    }
+    map_block = block;
+    return 0;
+}
+
+/*
+ * store_map() - Write map_buffer back as extent map block 'block'
+ */
+static int store_map(uint32_t block)
+{
+    map_block = block;
+    order_blocks(block, 1);
+    return bcache_write(block_lba(block), XAEFS_SECTORS_PER_BLOCK, (uint8_t*)&map_buffer);
+}
+
+/*
+ * map_file_block() - Find where a logical block of a file lives
+ * 
+ * WHAT: Translate block 'logical' of the file to a data block number
+ * HOW: Single-extent files are plain arithmetic; mapped files walk
+ *      their extent list
+ * RETURNS: 0 on success, -1 if the block isn't allocated
+ *          (*run = how many blocks from here on are contiguous on disk)
+ */
+static int map_file_block(struct xaefs_inode* inode, uint32_t logical,
+                          uint32_t* block, uint32_t* run)
+{
+    uint32_t i;
+    
+    if (logical >= inode->block_count) return -1;
+    
+    if (!(inode->flags & XAEFS_FLAG_EXTENT_MAP)) {
+        *block = inode->block_start + logical;
+        *run = inode->block_count - logical;
+        return 0;
+    }
+    
+    if (load_map(inode->block_start) != 0) return -1;
+    
+    for (i = 0; i < map_buffer.count; i++) {
+        struct xaefs_extent* extent = &map_buffer.extents[i];
+        
+        if (logical < extent->count) {
+            *block = extent->start + logical;
+            *run = extent->count - logical;
+            return 0;
+        }
+        logical -= extent->count;
+    }
+    
+    return -1;
+}
+
+/*
+ * flatten_file() - Move a mapped file back into one private extent
+ * 
+ * WHY: Fallback when the extent map is full
+ * RETURNS: 0 on success, -1 if the disk is full
+ */
+static int flatten_file(struct xaefs_inode* inode)
+{
+    uint32_t count = inode->block_count;
+    uint32_t i, block, run;
+    int start;
+    
+    start = alloc_extent(count);
+    if (start < 0) return -1;
+    
+    for (i = 0; i < count; i++) {
+        if (map_file_block(inode, i, &block, &run) != 0 || copy_block(block, start + i) != 0) {
+            unref_blocks(start, count);
+            return -1;
+        }
+    }
+    
+    /* Drop the old extents and the map itself */
+    if (load_map(inode->block_start) != 0) return -1;
+    for (i = 0; i < map_buffer.count; i++) {
+        unref_blocks(map_buffer.extents[i].start, map_buffer.extents[i].count);
+    }
+    unref_blocks(inode->block_start, 1);
+    map_block = XAEFS_NO_MAP;
+    
+    inode->block_start = start;
+    inode->flags &= ~XAEFS_FLAG_EXTENT_MAP;
+    return 0;
+}
+
+/*
+ * use_extent_map() - Switch a single-extent file to an extent map
+ * RETURNS: 0 on success, -1 if the disk is full
+ */
+static int use_extent_map(struct xaefs_inode* inode)
+{
+    int map;
+    
+    if (inode->flags & XAEFS_FLAG_EXTENT_MAP) return 0;
+    
+    map = alloc_extent(1);
+    if (map < 0) return -1;
+    
+    memset(&map_buffer, 0, sizeof(map_buffer));
+    map_buffer.count = 1;
+    map_buffer.extents[0].start = inode->block_start;
+    map_buffer.extents[0].count = inode->block_count;
+    
+    inode->block_start = map;
+    inode->flags |= XAEFS_FLAG_EXTENT_MAP;
+    return store_map(map);
+}
+
+/*
+ * remap_block() - Point one logical block of a file at a new data block
+ * 
+ * HOW: Split the extent holding it into (before, new block, after) and
+ *      merge the new block into the previous extent when it directly
+ *      follows it on disk, so copying a run of blocks stays one extent
+ * RETURNS: 0 on success, 1 if the map was full and the whole file was
+ *          flattened instead ('block' is then unused), -1 on error
+ */
+static int remap_block(struct xaefs_inode* inode, uint32_t logical, uint32_t block)
+{
+    struct xaefs_extent* ext;
+    uint32_t i, offset = logical;
+    
+    if (use_extent_map(inode) != 0 || load_map(inode->block_start) != 0) return -1;
+    ext = map_buffer.extents;
+    
+    for (i = 0; i < map_buffer.count && offset >= ext[i].count; i++) {
+        offset -= ext[i].count;
+    }
+    if (i == map_buffer.count) return -1;
+    
+    if (map_buffer.count + 2 > XAEFS_MAP_EXTENTS) {
+        /* No room to split: give the file one private extent instead */
+        return (flatten_file(inode) == 0) ? 1 : -1;
+    }
+    
+    struct xaefs_extent old = ext[i];
+    uint32_t pieces = 0;
+    struct xaefs_extent split[3];
+    
+    if (offset > 0) {
+        split[pieces].start = old.start;
+        split[pieces++].count = offset;
+    }
+    split[pieces].start = block;
+    split[pieces++].count = 1;
+    if (offset + 1 < old.count) {
+        split[pieces].start = old.start + offset + 1;
+        split[pieces++].count = old.count - offset - 1;
+    }
+    
+    /* Merge the new block into the previous extent if it follows it */
+    if (offset == 0 && i > 0 && ext[i - 1].start + ext[i - 1].count == block) {
+        ext[i - 1].count++;
+        memmove(&split[0], &split[1], (--pieces) * sizeof(split[0]));
+    }
+    
+    memmove(&ext[i + pieces], &ext[i + 1], (map_buffer.count - i - 1) * sizeof(ext[0]));
+    memcpy(&ext[i], split, pieces * sizeof(split[0]));
+    map_buffer.count = map_buffer.count - 1 + pieces;
+    
+    return store_map(inode->block_start);
+}
+
+/*
+ * make_private() - Copy-on-write the shared blocks a write will touch
+ * 
+ * WHAT: Give the file its own copy of every block in [first, last]
+ *       that a version still references
+ * WHY: Versions share blocks with the live file; only blocks that are
+ *      actually modified get copied
+ * HOW: Blocks the write covers completely aren't copied, just replaced.
+ *      A new block is taken right after the previous one when possible.
+ * RETURNS: 0 on success, -1 if the disk is full
+ */
+static int make_private(struct xaefs_inode* inode, uint32_t start, uint32_t end,
+                        uint32_t old_size)
+{
+    uint32_t first = start / XAEFS_BLOCK_SIZE;
+    uint32_t last = (end - 1) / XAEFS_BLOCK_SIZE;
+    uint32_t logical, block, run;
+    int prev = -1;
+    
+    for (logical = first; logical <= last; logical++) {
+        if (map_file_block(inode, logical, &block, &run) != 0) return -1;
+        if (block_refs[block] <= 1) {
+            prev = block;
+            continue;
+        }
+        
+        uint32_t pos = logical * XAEFS_BLOCK_SIZE;
+        uint8_t covered = (pos >= start && pos + XAEFS_BLOCK_SIZE <= end);
+        int copy;
+        
+        if (prev >= 0 && range_free(prev + 1, 1)) {
+            copy = prev + 1;
+            claim_blocks(copy, 1);
+        } else {
+            copy = alloc_extent(1);
+            if (copy < 0) return -1;
+        }
+        
+        int result = -1;
+        if (covered || pos >= old_size || copy_block(block, copy) == 0) {
+            result = remap_block(inode, logical, copy);
+        }
+        
+        if (result != 0) {
+            unref_blocks(copy, 1);
+            if (result < 0) return -1;
+            continue;  /* Flattened: every block is private now */
+        }
+        unref_blocks(block, 1);
+        
+        prev = copy;
+    }
+    
+    return 0;
+}
+
+/*
+ * grow_extent() - Make sure a file owns at least 'needed' blocks
+ * 
+ * HOW: Extend the last extent in place if the blocks after it are free.
+ *      Otherwise a single-extent file moves to a new extent (with room
+ *      to grow), and a mapped file gets one more extent.
+ * RETURNS: 0 on success, -1 if the disk is full
+ */
+static int grow_extent(struct xaefs_inode* inode, uint32_t needed)
+{
+    uint32_t old_start = inode->block_start;
+    uint32_t old_count = inode->block_count;
+    uint32_t used_blocks = (inode->size + XAEFS_BLOCK_SIZE - 1) / XAEFS_BLOCK_SIZE;
+    uint32_t i;
+    int start;
+    
+    if (needed <= old_count) return 0;
+    
+    /* Empty file: just allocate */
+    if (old_count == 0) {
+        start = alloc_extent(needed);
+        if (start < 0) return -1;
+        inode->block_start = start;
+        inode->block_count = needed;
+        return 0;
+    }
+    
+    if (inode->flags & XAEFS_FLAG_EXTENT_MAP) {
+        uint32_t extra = needed - old_count;
+        struct xaefs_extent* last;
+        
+        if (load_map(inode->block_start) != 0) return -1;
+        last = &map_buffer.extents[map_buffer.count - 1];
+        
+        if (range_free(last->start + last->count, extra)) {
+            claim_blocks(last->start + last->count, extra);
+            last->count += extra;
+        } else {
+            if (map_buffer.count == XAEFS_MAP_EXTENTS) {
+                if (flatten_file(inode) != 0) return -1;
+                return grow_extent(inode, needed);
+            }
+            start = alloc_extent(extra);
+            if (start < 0) return -1;
+            map_buffer.extents[map_buffer.count].start = start;
+            map_buffer.extents[map_buffer.count].count = extra;
+            map_buffer.count++;
+        }
+        
+        inode->block_count = needed;
+        return store_map(inode->block_start);
+    }
+    
+    /* Extend in place */
+    if (range_free(old_start + old_count, needed - old_count)) {
+        claim_blocks(old_start + old_count, needed - old_count);
+        inode->block_count = needed;
+        return 0;
+    }
+    
+    /* Relocate, doubling so repeated appends don't move the file every time */
+    start = alloc_extent(needed * 2);
+    if (start >= 0) {
+        needed *= 2;
+    } else {
+        start = alloc_extent(needed);
+        if (start < 0) return -1;
+    }
+    
+    for (i = 0; i < used_blocks; i++) {
+        if (copy_block(old_start + i, start + i) != 0) {
+            unref_blocks(start, needed);
+            return -1;
+        }
+    }
+    
+    unref_blocks(old_start, old_count);
+    inode->block_start = start;
+    inode->block_count = needed;
+    return 0;
+}
+
+/*
+ * ref_file_data() - Take a reference on every block a file uses
+ * 
+ * WHY: Used to rebuild the reference counts on load
+ */
+static void ref_file_data(struct xaefs_inode* inode)
+{
+    uint32_t i;
+    
+    if (inode->block_count == 0) return;
+    bcache_set_priority(inode->priority);
+    
+    if (!(inode->flags & XAEFS_FLAG_EXTENT_MAP)) {
+        ref_blocks(inode->block_start, inode->block_count);
+        return;
+    }
+    
+    ref_blocks(inode->block_start, 1);
+    if (load_map(inode->block_start) != 0) return;
+    for (i = 0; i < map_buffer.count; i++) {
+        ref_blocks(map_buffer.extents[i].start, map_buffer.extents[i].count);
+    }
+}
+
+/*
+ * share_file_data() - Make 'dst' reference the same data as 'src'
+ * 
+ * WHAT: The metadata-only copy behind versions and restores
+ * HOW: Take a reference on every block; a mapped file also gets its own
+ *      copy of the extent map, since maps are changed in place
+ * RETURNS: 0 on success, -1 if the disk is full
+ */
+static int share_file_data(struct xaefs_inode* src, struct xaefs_inode* dst)
+{
+    uint32_t start = src->block_start;
+    uint32_t i;
+    
+    bcache_set_priority(src->priority);
+    if (src->block_count > 0 && (src->flags & XAEFS_FLAG_EXTENT_MAP)) {
+        int map = alloc_extent(1);
+        if (map < 0) return -1;
+        if (load_map(src->block_start) != 0 || store_map(map) != 0) {
+            unref_blocks(map, 1);
+            return -1;
+        }
+        for (i = 0; i < map_buffer.count; i++) {
+            ref_blocks(map_buffer.extents[i].start, map_buffer.extents[i].count);
+        }
+        start = map;
+    } else if (src->block_count > 0) {
+        ref_blocks(src->block_start, src->block_count);
+    }
+    
+    dst->block_start = start;
+    dst->block_count = src->block_count;
+    dst->size = src->size;
+    dst->flags = (dst->flags & ~XAEFS_FLAG_EXTENT_MAP) | (src->flags & XAEFS_FLAG_EXTENT_MAP);
+    return 0;
+}
+
+/*
+ * release_file_data() - Drop a file's references to its data blocks
+ * 
+ * HOW: Blocks still used by a version stay allocated
+ */
+static void release_file_data(struct xaefs_inode* inode)
+{
+    uint32_t i;
+    
+    bcache_set_priority(inode->priority);
+    if (inode->flags & XAEFS_FLAG_EXTENT_MAP) {
+        if (load_map(inode->block_start) == 0) {
+            for (i = 0; i < map_buffer.count; i++) {
+                unref_blocks(map_buffer.extents[i].start, map_buffer.extents[i].count);
+            }
+        }
+        unref_blocks(inode->block_start, 1);
+        map_block = XAEFS_NO_MAP;
+        inode->flags &= ~XAEFS_FLAG_EXTENT_MAP;
+    } else if (inode->block_count > 0) {
+        unref_blocks(inode->block_start, inode->block_count);
+    }
+    inode->block_start = 0;
+    inode->block_count = 0;
+    inode->size = 0;
+}
+
+/*
+ * close_handles() - Close every open handle that refers to an inode
+ * 
+ * WHY: A deleted file's handles must not keep writing into its old blocks
+ */
+static void close_handles(struct xaefs_inode* inode)
+{
+    uint32_t i;
+    
+    for (i = 0; i < XAEFS_MAX_OPEN_FILES; i++) {
+        if (file_table[i] && file_table[i]->inode == inode) {
+            kmem_cache_free(file_cache, file_table[i]);
+            file_table[i] = NULL;
+        }
+    }
+}
+
+/*
+ * delete_inode() - Remove an inode from the filesystem
+ * 
+ * WHAT: Shared tail of all the delete operations
+ * WHY: Directories with children are refused, since deleting them would
+ *      orphan their contents
+ * RETURNS: 0 on success, -1 on error
+ */
+static int delete_inode(struct xaefs_inode* inode)
+{
+    /* Don't allow deleting root */
+    if (inode->inode_num == 0) return -1;
+    
+    if (inode->type == XAEFS_FILE_DIRECTORY) {
+        if (first_child[inode->inode_num] != XAEFS_NO_INODE) return -1;
+        dcache_invalidate(inode->inode_num);
+    } else {
+        /* A file's children are its versions: they go with it */
+        while (first_child[inode->inode_num] != XAEFS_NO_INODE) {
+            struct xaefs_inode* version = &inode_table[first_child[inode->inode_num]];
+            release_file_data(version);
+            index_remove(version->inode_num);
+            mark_inode_dirty(version->inode_num);
+            memset(version, 0, sizeof(struct xaefs_inode));
+            superblock.free_inodes++;
+        }
+    }
+    
+    /* Release its data blocks and any open handles */
+    release_file_data(inode);
+    close_handles(inode);
+    
+    /* Clear the inode */
+    index_remove(inode->inode_num);
+    tag_index_remove(inode->inode_num);
+    mark_inode_dirty(inode->inode_num);
+    memset(inode, 0, sizeof(struct xaefs_inode));
+    superblock.free_inodes++;
+    superblock_dirty = 1;
+    schedule_sync();
+    
+    return 0;
+}
+
+/*
+ * xaefs_lookup() - Resolve a path to an inode number
+ * 
+ * WHAT: Public wrapper around resolve_path()
+ * WHY: Lets the shell resolve 'cd' targets once and keep the inode
+ * RETURNS: Inode number, or -1 if not found
+ */
+int xaefs_lookup(const char* path, uint32_t dir)
+{
+    if (!fs_initialized || dir >= XAEFS_MAX_FILES) return -1;
+    return resolve_path(path, dir);
+}
+
+/*
+ * xaefs_is_directory() - Check whether an inode is a directory
+ */
+uint8_t xaefs_is_directory(uint32_t inode_num)
+{
+    if (inode_num >= XAEFS_MAX_FILES) return 0;
+    if (inode_num != 0 && inode_table[inode_num].inode_num == 0) return 0;
+    return inode_table[inode_num].type == XAEFS_FILE_DIRECTORY;
+}
+
+/*
+ * xaefs_create_at() - Create a new file inside a directory
+ * 
+ * WHAT: Create a new file or directory named 'name' in directory 'dir'
+ * WHY: Basic filesystem operation
+ * HOW: Allocate inode, fill metadata, mark as used
+ * RETURNS: Inode number, or negative error code
+ *   -1: filesystem not initialized
+ *   -2: no free inodes (filesystem full)
+ *   -3: file already exists
+ *   -4: 'dir' is not a directory, or name is invalid
+ */
+int xaefs_create_at(uint32_t dir, const char* name, uint8_t type, uint8_t priority)
+{
+    int inode_num;
+    struct xaefs_inode* inode;
+    uint32_t i;
+    
+    if (!fs_initialized) return -1;
+    if (!xaefs_is_directory(dir)) return -4;
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -4;
+    }
+    for (i = 0; name[i] != '\0'; i++) {
+        if (name[i] == '/') return -4;
+    }
+    
+    /* Check if file already exists in this directory */
+    if (find_file_in_dir(name, dir) != NULL) return -3;
+    
+    /* Whatever goes into a LOW directory (like /tmp) is LOW too */
+    if (inode_table[dir].priority == XAEFS_PRIORITY_LOW) {
+        priority = XAEFS_PRIORITY_LOW;
+    }
+    
+    /* Find free inode */
+    inode_num = find_free_inode();
+    if (inode_num < 0) return -2;
+    
+    /* Set up inode */
+    inode = &inode_table[inode_num];
+    inode->inode_num = inode_num;
+    inode->parent_inode = dir;
+    inode->size = 0;
+    inode->type = type;
+    inode->priority = priority;
+    inode->version = 1;
+    inode->tag_count = 0;
+    
+    /* Copy filename */
+    for (i = 0; i < XAEFS_MAX_FILENAME - 1 && name[i] != '\0'; i++) {
+        inode->name[i] = name[i];
+    }
+    inode->name[i] = '\0';
+    
+    index_insert(inode_num);
+    priority_index_set(inode_num, priority, priority);
+    superblock.free_inodes--;
+    
+    mark_inode_dirty(inode_num);
+    superblock_dirty = 1;
+    schedule_sync();
+    
+    return inode_num;
+}
+
+/*
+ * xaefs_create() - Create a new file by path
+ * 
+ * WHAT: Create a new file or directory
+ * HOW: Resolve everything before the last '/' as the parent directory
+ *      (a bare name goes into the root) and call xaefs_create_at()
+ * RETURNS: Same as xaefs_create_at()
+ */
+int xaefs_create(const char* path, uint8_t type, uint8_t priority) 
+{
+    char parent[XAEFS_DCACHE_PATH];
+    const char* filename = path;
+    int parent_num = 0;
+    uint32_t i;
+    
+    if (!fs_initialized) return -1;
+    
+    /* Extract just the filename from path (e.g., "new.txt" from "sys/new.txt") */
+    for (i = 0; path[i] != '\0'; i++) {
+        if (path[i] == '/') {
+            filename = &path[i + 1];  /* Point to char after last / */
+        }
+    }
+    
+    /* Resolve the directory part, if there is one */
+    if (filename != path) {
+        uint32_t len = filename - path;
+        if (len >= sizeof(parent)) return -4;
+        memcpy(parent, path, len);
+        parent[len] = '\0';
+        
+        parent_num = resolve_dir(parent, 0);
+        if (parent_num < 0) return -4;
+    }
+    
+    return xaefs_create_at(parent_num, filename, type, priority);
+}
+
+/*
+ * xaefs_set_parent() - Set parent directory for a file
+ * 
+ * WHAT: Update the parent_inode field (move a file to another directory)
+ * WHY: To build directory hierarchy
+ * HOW: Find file and parent, relink it in the index
+ * RETURNS: 0 on success, -1 on error
+ */
+int xaefs_set_parent(const char* filename, const char* parent_path) 
+{
+    struct xaefs_inode* file = lookup_file(filename);
+    if (!file) return -1;
+    
+    int parent_num = resolve_dir(parent_path, 0);
+    if (parent_num < 0) return -1;
+    if ((uint32_t)parent_num == file->parent_inode) return 0;  /* Nothing to do */
+    
+    if (file->type == XAEFS_FILE_DIRECTORY) {
+        /* A directory can't be moved inside itself */
+        if (is_ancestor(file->inode_num, parent_num)) return -1;
+        dcache_invalidate(file->inode_num);
+    }
+    
+    if (find_file_in_dir(file->name, parent_num) != NULL) return -1;
+    
+    index_remove(file->inode_num);
+    file->parent_inode = parent_num;
+    index_insert(file->inode_num);
+    
+    mark_inode_dirty(file->inode_num);
+    schedule_sync();
+    return 0;
+}
+
+/*
+ * xaefs_mkdir() - Create a directory
+ * 
+ * WHAT: Create a new directory
+ * WHY: Convenience wrapper around create()
+ * HOW: Call create() with directory type
+ */
+int xaefs_mkdir(const char* path, uint8_t priority) 
+{
+    return xaefs_create(path, XAEFS_FILE_DIRECTORY, priority);
+}
+
+/*
+ * xaefs_add_tag() - Add a tag to a file (UNIQUE FEATURE!)
+ * 
+ * WHAT: Attach a metadata tag to a file
+ * WHY: To categorize files beyond just directories
+ * HOW: Add tag string to inode's tag array
+ * EXAMPLE: xaefs_add_tag("/myfile.txt", "important")
+ */
+int xaefs_add_tag(const char* path, const char* tag) 
+{
+    uint32_t i;
+    struct xaefs_inode* inode;
+    char* slot;
+    
+    /* Find file by path (or bare name) */
+    inode = lookup_file(path);
+    if (!inode) return -1;  /* File not found */
+    if (inode->tag_count >= XAEFS_MAX_TAGS) return -1;  /* Too many tags */
+    
+    /* Add tag */
+    slot = tag_table[inode->inode_num].tags[inode->tag_count];
+    for (i = 0; i < XAEFS_TAG_LENGTH - 1 && tag[i] != '\0'; i++) {
+        slot[i] = tag[i];
+    }
+    slot[i] = '\0';
+    
+    /* Index it first; a full tag dictionary or an empty tag refuses it */
+    if (tag_index_add(inode->inode_num, slot) != 0) {
+        return -1;
+    }
+    inode->tag_count++;
+    
+    mark_inode_dirty(inode->inode_num);
+    mark_tags_dirty(inode->inode_num);
+    schedule_sync();
+    return 0;
+}
+
+/*
+ * xaefs_delete() - Delete a file by path (or bare name, global search)
+ * 
+ * WHAT: Remove a file from the filesystem
+ * WHY: Basic file operation
+ * HOW: Clear the inode and free it
+ * RETURNS: 0 on success, -1 on error
+ */
+int xaefs_delete(const char* path) 
+{
+    struct xaefs_inode* inode;
+    
+    /* Find file */
+    inode = lookup_file(path);
+    if (!inode) return -1;  /* File not found */
+    
+    return delete_inode(inode);
+}
+
+/*
+ * xaefs_delete_at() - Delete a file in a directory given by inode
+ * 
+ * WHAT: Remove file 'name' from directory 'dir'
+ * WHY: The shell already knows its cwd inode, so no path lookup is needed
+ * RETURNS: 0 on success, -1 on error
+ */
+int xaefs_delete_at(uint32_t dir, const char* name)
+{
+    struct xaefs_inode* inode;
+    
+    if (!xaefs_is_directory(dir)) return -1;
+    
+    /* Find file in this directory */
+    inode = find_file_in_dir(name, dir);
+    if (!inode) return -1;  /* File not found */
+    
+    return delete_inode(inode);
+}
+
+/*
+ * xaefs_delete_in_dir() - Delete a file in specific directory
+ * 
+ * WHAT: Remove a file from current directory
+ * WHY: To support directory hierarchy in shell
+ * HOW: Resolve the directory path, then delete by name+parent
+ * RETURNS: 0 on success, -1 on error
+ */
+int xaefs_delete_in_dir(const char* name, const char* current_dir) 
+{
+    /* Get parent directory inode */
+    int parent_num = resolve_dir(current_dir, 0);
+    if (parent_num < 0) return -1;
+    
+    return xaefs_delete_at(parent_num, name);
+}
+
+/*
+ * xaefs_set_priority() - Change file priority (UNIQUE FEATURE!)
+ * 
+ * WHAT: Set the priority level of a file
+ * WHY: The buffer cache keeps HIGH and CRITICAL files cached longer and
+ *      writes them first; LOW files are evicted first and their data is
+ *      only written back when evicted or on an explicit sync
+ * HOW: Update priority field in inode; cached blocks pick up the new
+ *      priority the next time they are read or written
+ */
+int xaefs_set_priority(const char* path, uint8_t priority) 
+{
+    struct xaefs_inode* inode;
+    
+    /* Find file */
+    inode = lookup_file(path);
+    if (!inode) return -1;  /* File not found */
+    
+    if (inode->inode_num != 0) {
+        priority_index_set(inode->inode_num, inode->priority, priority);
+    }
+    inode->priority = priority;
+    
+    mark_inode_dirty(inode->inode_num);
+    schedule_sync();
+    return 0;
+}
+
+/*
+ * xaefs_find_tags() - Find files matching a tag query (UNIQUE FEATURE!)
+ * 
+ * WHAT: Print every file matching a combination of tags
+ * WHY: To use the tagging system for file discovery
+ * HOW: The query is groups of tags joined by '+' (file has all of them),
+ *      separated by ',' (any group matches): "src+c,docs" means
+ *      (src AND c) OR docs. Each tag is one bitset from the tag index,
+ *      so a query costs a few word operations per tag, no table scan.
+ *      With priority >= 0 only files of that priority are shown.
+ * RETURNS: Number of matching files
+ */
+int xaefs_find_tags(const char* query, int priority)
+{
+    uint32_t result[XAEFS_SET_WORDS];
+    uint32_t group[XAEFS_SET_WORDS];
+    char tag[XAEFS_TAG_LENGTH];
+    const char* p = query;
+    uint32_t i, len;
+    int found = 0;
+    
+    memset(result, 0, sizeof(result));
+    memset(group, 0xFF, sizeof(group));
+    
+    while (1) {
+        /* Next tag name */
+        for (len = 0; *p != '\0' && *p != '+' && *p != ','; p++) {
+            if (len < XAEFS_TAG_LENGTH - 1) tag[len++] = *p;
+        }
+        tag[len] = '\0';
+        
+        int id = tag_find(tag);
+        for (i = 0; i < XAEFS_SET_WORDS; i++) {
+            group[i] &= (id >= 0) ? tag_sets[id][i] : 0;
+        }
+        
+        if (*p == '+') {
+            p++;
+            continue;
+        }
+        
+        /* End of an AND group: merge it into the result */
+        for (i = 0; i < XAEFS_SET_WORDS; i++) {
+            result[i] |= group[i];
+        }
+        if (*p == '\0') break;
+        
+        memset(group, 0xFF, sizeof(group));
+        p++;
+    }
+    
+    if (priority >= 0) {
+        for (i = 0; i < XAEFS_SET_WORDS; i++) {
+            result[i] &= priority_sets[priority & 3][i];
+        }
+    }
+    
+    fs_print("\nFiles tagged with '");
+    fs_print(query);
+    fs_print("':\n");
+    
+    /* Walk the set bits in inode order */
+    for (i = 0; i < XAEFS_SET_WORDS; i++) {
+        uint32_t bits = result[i];
+        
+        while (bits) {
+            uint32_t ino = i * 32 + __builtin_ctz(bits);
+            bits &= bits - 1;
+            
+            fs_print("  - ");
+            fs_print(inode_table[ino].name);
+            fs_print("\n");
+            found++;
+        }
+    }
+    
+    if (!found) {
+        fs_print("  (no files found)\n");
+    }
+    
+    return found;
+}
+
+/*
+ * xaefs_find_by_tag() - Find files by a single tag
+ */
+void xaefs_find_by_tag(const char* tag) 
+{
+    xaefs_find_tags(tag, -1);
+}
+
+/*
+ * xaefs_list_dir() - List files in a directory
+ * 
+ * WHAT: Show files in specified directory
+ * WHY: So users can see directory contents
+ * HOW: Resolve the path, then list it with xaefs_list_dir_at()
+ */
+int xaefs_list_dir(const char* path) 
+{
+    int dir = resolve_dir(path, 0);
+    
+    if (dir < 0) {
+        fs_print("Directory not found: ");
+        fs_print(path);
+        fs_print("\n");
+        return -1;
+    }
+    
+    return xaefs_list_dir_at(dir, path);
+}
+
+/*
+ * xaefs_list_dir_at() - List files in a directory given by inode
+ * 
+ * WHAT: Show the contents of directory 'dir', titled with 'label'
+ * HOW: Walk the directory's child list from the index
+ */
+int xaefs_list_dir_at(uint32_t dir, const char* label)
+{
+    uint32_t i, j;
+    const char* type_names[] = {"FILE", "DIR ", "DEV "};
+    const char* priority_names[] = {"LOW ", "NORM", "HIGH", "CRIT"};
+    uint8_t found_any = 0;
+    
+    if (!xaefs_is_directory(dir)) return -1;
+    
+    fs_print("\nFiles in ");
+    fs_print(label);
+    fs_print(":\n");
+    fs_print("NAME                  TYPE  PRIORITY  SIZE    TAGS\n");
+    fs_print("----------------------------------------------------\n");
+    
+    /* Show files that have this directory as parent (its child list) */
+    for (i = first_child[dir]; i != XAEFS_NO_INODE; i = next_sibling[i]) {
+        found_any = 1;
+        
+        /* Print filename */
+        fs_print(inode_table[i].name);
+        
+        /* Pad to 22 chars */
+        for (j = strlen(inode_table[i].name); j < 22; j++) {
+            fs_putchar(' ');
+        }
+        
+        /* Print type */
+        fs_print(type_names[inode_table[i].type]);
+        fs_print("  ");
+        
+        /* Print priority */
+        fs_print(priority_names[inode_table[i].priority]);
+        fs_print("      ");
+        
+        /* Print size (bytes below 1 KB, KB above), padded to 8 chars */
+        char num[12];
+        uint32_t size = inode_table[i].size;
+        if (size < 1024) {
+            utoa(size, num);
+            fs_print(num);
+            fs_print(" B");
+        } else {
+            utoa((size + 1023) / 1024, num);
+            fs_print(num);
+            fs_print(" KB");
+        }
+        for (j = strlen(num) + (size < 1024 ? 2 : 3); j < 8; j++) {
+            fs_putchar(' ');
+        }
+        
+        /* Print tags */
+        if (inode_table[i].tag_count > 0) {
+            fs_putchar('[');
+            for (j = 0; j < inode_table[i].tag_count; j++) {
+                if (j > 0) fs_print(", ");
+                fs_print(tag_table[i].tags[j]);
+            }
+            fs_putchar(']');
+        }
+        
+        fs_putchar('\n');
+    }
+    
+    if (!found_any) {
+        fs_print("(empty directory)\n");
+    }
+    
+    return 0;
+}
+
+/*
+ * ==============================================================================
+ * FILE CONTENTS
+ * ==============================================================================
+ */
+
+/*
+ * get_handle() - Validate a file descriptor
+ * RETURNS: Pointer to the open handle, or NULL
+ */
+static struct xaefs_file* get_handle(int fd)
+{
+    if (fd < 0 || fd >= XAEFS_MAX_OPEN_FILES) {
+        return NULL;
+    }
+    return file_table[fd];
+}
+
+/*
+ * xaefs_open() - Open a file
+ * 
+ * WHAT: Get a file descriptor for reading and/or writing a regular file
+ * HOW: Resolve the path (relative paths start at the root); with
+ *      XAEFS_OPEN_CREATE a missing file is created, with XAEFS_OPEN_TRUNC
+ *      its old contents are released
+ * RETURNS: File descriptor, or negative error code
+ *   -1: file not found (or not a regular file)
+ *   -2: too many open files (or no memory for the handle)
+ */
+int xaefs_open(const char* path, uint8_t mode)
+{
+    int inode_num;
+    uint32_t fd;
+    
+    if (!fs_initialized) return -1;
+    
+    inode_num = resolve_path(path, 0);
+    if (inode_num < 0 && (mode & XAEFS_OPEN_CREATE)) {
+        inode_num = xaefs_create(path, XAEFS_FILE_REGULAR, XAEFS_PRIORITY_NORMAL);
+    }
+    if (inode_num <= 0 || inode_table[inode_num].type != XAEFS_FILE_REGULAR) {
+        return -1;
+    }
+    
+    for (fd = 0; fd < XAEFS_MAX_OPEN_FILES; fd++) {
+        if (!file_table[fd]) break;
+    }
+    if (fd == XAEFS_MAX_OPEN_FILES) return -2;
+    
+    struct xaefs_file* file = kmem_cache_alloc(file_cache);
+    if (!file) return -2;
+    
+    struct xaefs_inode* inode = &inode_table[inode_num];
+    
+    if ((mode & XAEFS_OPEN_WRITE) && (mode & XAEFS_OPEN_TRUNC) && inode->size > 0) {
+        release_file_data(inode);
+        mark_inode_dirty(inode_num);
+        schedule_sync();
+    }
+    
+    file->inode = inode;
+    file->mode = mode;
+    file->position = (mode & XAEFS_OPEN_APPEND) ? inode->size : 0;
+    file->is_open = 1;
+    file_table[fd] = file;
+    
+    return fd;
+}
+
+/*
+ * xaefs_close() - Close a file descriptor
+ * RETURNS: 0 on success, -1 if fd isn't open
+ */
+int xaefs_close(int fd)
+{
+    struct xaefs_file* file = get_handle(fd);
+    if (!file) return -1;
+    
+    kmem_cache_free(file_cache, file);
+    file_table[fd] = NULL;
+    return 0;
+}
+
+/*
+ * xaefs_read() - Read from an open file
+ * 
+ * WHAT: Copy up to 'size' bytes from the current position into buffer
+ * HOW: Runs of whole blocks that are contiguous on disk go straight into
+ *      the caller's buffer in one multi-sector transfer; partial blocks
+ *      go through the bounce buffer
+ * RETURNS: Bytes read (0 at end of file), or -1 on error
+ */
+int xaefs_read(int fd, void* buffer, uint32_t size)
+{
+    struct xaefs_file* file = get_handle(fd);
+    uint8_t* dst = (uint8_t*)buffer;
+    uint32_t done = 0;
+    
+    if (!file || !(file->mode & XAEFS_OPEN_READ)) return -1;
+    
+    struct xaefs_inode* inode = file->inode;
+    if (file->position >= inode->size) return 0;
+    bcache_set_priority(inode->priority);
+    if (size > inode->size - file->position) {
+        size = inode->size - file->position;
+    }
+    
+    while (done < size) {
+        uint32_t offset = file->position % XAEFS_BLOCK_SIZE;
+        uint32_t left = size - done;
+        uint32_t block, run, chunk;
+        
+        if (map_file_block(inode, file->position / XAEFS_BLOCK_SIZE, &block, &run) != 0) {
+            return -1;
+        }
+        
+        if (offset == 0 && left >= XAEFS_BLOCK_SIZE) {
+            /* Whole blocks: one transfer for the contiguous run */
+            uint32_t blocks = left / XAEFS_BLOCK_SIZE;
+            if (blocks > run) blocks = run;
+            if (bcache_read(block_lba(block), blocks * XAEFS_SECTORS_PER_BLOCK,
+                            dst + done) != 0) {
+                return -1;
+            }
+            chunk = blocks * XAEFS_BLOCK_SIZE;
+        } else {
+            /* Partial block */
+            if (bcache_read(block_lba(block), XAEFS_SECTORS_PER_BLOCK, io_block) != 0) {
+                return -1;
+            }
+            chunk = XAEFS_BLOCK_SIZE - offset;
+            if (chunk > left) chunk = left;
+            memcpy(dst + done, io_block + offset, chunk);
+        }
+        
+        done += chunk;
+        file->position += chunk;
+    }
+    
+    return done;
+}
+
+/*
+ * xaefs_write() - Write to an open file
+ * 
+ * WHAT: Copy 'size' bytes from buffer to the current position
+ * HOW: Grow the file first and copy-on-write any blocks it shares with
+ *      a version, then write runs of whole blocks directly from the
+ *      caller's buffer; partial blocks are merged in the bounce buffer
+ *      (no read needed past the old end of file)
+ * RETURNS: Bytes written, or negative error code
+ *   -1: bad descriptor or not open for writing
+ *   -2: disk full
+ *   -3: disk I/O error
+ */
+int xaefs_write(int fd, const void* buffer, uint32_t size)
+{
+    struct xaefs_file* file = get_handle(fd);
+    const uint8_t* src = (const uint8_t*)buffer;
+    uint32_t done = 0;
+    
+    if (!file || !(file->mode & XAEFS_OPEN_WRITE)) return -1;
+    if (size == 0) return 0;
+    
+    struct xaefs_inode* inode = file->inode;
+    uint32_t old_size = inode->size;
+    uint32_t end = file->position + size;
+    
+    bcache_set_priority(inode->priority);
+    if (grow_extent(inode, (end + XAEFS_BLOCK_SIZE - 1) / XAEFS_BLOCK_SIZE) != 0 ||
+        make_private(inode, file->position, end, old_size) != 0) {
+        mark_inode_dirty(inode->inode_num);
+        return -2;
+    }
+    
+    while (done < size) {
+        uint32_t logical = file->position / XAEFS_BLOCK_SIZE;
+        uint32_t offset = file->position % XAEFS_BLOCK_SIZE;
+        uint32_t left = size - done;
+        uint32_t block, run, lba, chunk;
+        
+        if (map_file_block(inode, logical, &block, &run) != 0) return -3;
+        lba = block_lba(block);
+        
+        if (offset == 0 && left >= XAEFS_BLOCK_SIZE) {
+            /* Whole blocks: one transfer for the contiguous run */
+            uint32_t blocks = left / XAEFS_BLOCK_SIZE;
+            if (blocks > run) blocks = run;
+            if (bcache_write(lba, blocks * XAEFS_SECTORS_PER_BLOCK, src + done) != 0) {
+                return -3;
+            }
+            chunk = blocks * XAEFS_BLOCK_SIZE;
+        } else {
+            /* Partial block: merge with existing contents */
+            chunk = XAEFS_BLOCK_SIZE - offset;
+            if (chunk > left) chunk = left;
+            
+            if (logical * XAEFS_BLOCK_SIZE < old_size) {
+                if (bcache_read(lba, XAEFS_SECTORS_PER_BLOCK, io_block) != 0) {
+                    return -3;
+                }
+            } else {
+                memset(io_block, 0, XAEFS_BLOCK_SIZE);  /* Fresh block */
+            }
+            memcpy(io_block + offset, src + done, chunk);
+            
+            if (bcache_write(lba, XAEFS_SECTORS_PER_BLOCK, io_block) != 0) {
+                return -3;
+            }
+        }
+        
+        done += chunk;
+        file->position += chunk;
+    }
+    
+    if (file->position > inode->size) {
+        inode->size = file->position;
+    }
+    mark_inode_dirty(inode->inode_num);
+    schedule_sync();
+    
+    return done;
+}
+
+/*
+ * ==============================================================================
+ * FILE VERSIONS (UNIQUE FEATURE!)
+ * ==============================================================================
+ * WHAT: Snapshots of a file's contents that can be listed and restored
+ * HOW: A version is a hidden inode (XAEFS_FLAG_VERSION) whose parent is
+ *      the live file. It shares the file's data blocks instead of copying
+ *      them; later writes to the live file copy only the blocks they
+ *      change (see make_private). Taking, listing and restoring versions
+ *      only touch metadata.
+ */
+
+/*
+ * find_version() - Find version 'number' of a file
+ * RETURNS: Pointer to the version inode, or NULL
+ */
+static struct xaefs_inode* find_version(struct xaefs_inode* file, uint32_t number)
+{
+    uint32_t i;
+    
+    for (i = first_child[file->inode_num]; i != XAEFS_NO_INODE; i = next_sibling[i]) {
+        if (inode_table[i].version == number) return &inode_table[i];
+    }
+    
+    return NULL;
+}
+
+/*
+ * snapshot_file() - Save the current contents of a file as a version
+ * RETURNS: Version number, or negative error code
+ *   -2: no free inodes (or no room for an extent map)
+ */
+static int snapshot_file(struct xaefs_inode* file)
+{
+    int inode_num = find_free_inode();
+    if (inode_num < 0) return -2;
+    
+    struct xaefs_inode* version = &inode_table[inode_num];
+    
+    memset(version, 0, sizeof(struct xaefs_inode));
+    if (share_file_data(file, version) != 0) return -2;
+    
+    strcpy(version->name, file->name);
+    version->inode_num = inode_num;
+    version->parent_inode = file->inode_num;
+    version->type = XAEFS_FILE_REGULAR;
+    version->priority = file->priority;
+    version->version = file->version;
+    version->modified_time = file->modified_time;
+    version->flags |= XAEFS_FLAG_VERSION;
+    
+    /* The live file moves on to the next version number */
+    file->version++;
+    
+    index_insert(inode_num);
+    superblock.free_inodes--;
+    mark_inode_dirty(inode_num);
+    mark_inode_dirty(file->inode_num);
+    superblock_dirty = 1;
+    schedule_sync();
+    
+    return version->version;
+}
+
+/*
+ * xaefs_create_version() - Take a snapshot of a file
+ * 
+ * WHAT: Freeze the file's current contents as a numbered version
+ * HOW: Metadata only - the version shares every data block
+ * RETURNS: Version number, or negative error code
+ *   -1: file not found (or not a regular file)
+ *   -2: no free inodes
+ */
+int xaefs_create_version(const char* path)
+{
+    struct xaefs_inode* file = lookup_file(path);
+    
+    if (!file || file->type != XAEFS_FILE_REGULAR) return -1;
+    
+    return snapshot_file(file);
+}
+
+/*
+ * xaefs_restore_version() - Bring back an older version of a file
+ * 
+ * WHAT: Make the live file's contents those of version 'number'
+ * HOW: The current contents are saved as a new version first, then
+ *      the file just takes references on the version's blocks
+ * RETURNS: 0 on success, or negative error code
+ *   -1: file not found
+ *   -2: no free inodes
+ *   -3: no such version
+ */
+int xaefs_restore_version(const char* path, uint32_t number)
+{
+    struct xaefs_inode* file = lookup_file(path);
+    struct xaefs_inode* version;
+    struct xaefs_inode saved;
+    
+    if (!file || file->type != XAEFS_FILE_REGULAR) return -1;
+    
+    version = find_version(file, number);
+    if (!version) return -3;
+    
+    if (snapshot_file(file) < 0) return -2;
+    
+    /* Share the version's data before dropping the current data */
+    memcpy(&saved, file, sizeof(saved));
+    if (share_file_data(version, file) != 0) return -2;
+    release_file_data(&saved);
+    
+    mark_inode_dirty(file->inode_num);
+    schedule_sync();
+    return 0;
+}
+
+/*
+ * xaefs_list_versions() - Show the saved versions of a file
+ * RETURNS: Number of versions, or -1 if the file doesn't exist
+ */
+int xaefs_list_versions(const char* path)
+{
+    struct xaefs_inode* file = lookup_file(path);
+    char num[12];
+    uint32_t i;
+    int count = 0;
+    
+    if (!file || file->type != XAEFS_FILE_REGULAR) return -1;
+    
+    fs_print("\nVersions of ");
+    fs_print(file->name);
+    fs_print(" (current: v");
+    fs_print(utoa(file->version, num));
+    fs_print(", ");
+    fs_print(utoa(file->size, num));
+    fs_print(" bytes):\n");
+    
+    for (i = first_child[file->inode_num]; i != XAEFS_NO_INODE; i = next_sibling[i]) {
+        fs_print("  v");
+        fs_print(utoa(inode_table[i].version, num));
+        fs_print("  ");
+        fs_print(utoa(inode_table[i].size, num));
+        fs_print(" bytes\n");
+        count++;
+    }
+    
+    if (count == 0) {
+        fs_print("  (no versions saved)\n");
+    }
+    
+    return count;
+}
+
+/*
+ * ==============================================================================
+ * DISK PERSISTENCE FUNCTIONS
+ * ==============================================================================
+ */
+
+/*
+ * meta_sector_image() - Build the on-disk image of metadata sector 'index'
+ * 
+ * HOW: Inode and tag records tile the sector exactly, so every sector
+ *      is a straight copy of the in-memory table
+ */
+static void meta_sector_image(uint32_t index, uint8_t* buffer)
+{
+    if (index < superblock.inode_table_sectors) {
+        memcpy(buffer, &inode_table[index * XAEFS_INODES_PER_SECTOR], DISK_SECTOR_SIZE);
+        return;
+    }
+    index -= superblock.inode_table_sectors;
+    
+    if (index < superblock.tag_table_sectors) {
+        memcpy(buffer, &tag_table[index * XAEFS_TAGS_PER_SECTOR], DISK_SECTOR_SIZE);
+        return;
+    }
+    index -= superblock.tag_table_sectors;
+    
+    memcpy(buffer, block_bitmap + index * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+}
+
+/*
+ * superblock_image() - Build the on-disk image of the superblock sector
+ */
+static void superblock_image(uint8_t* buffer)
+{
+    memset(buffer, 0, DISK_SECTOR_SIZE);
+    memcpy(buffer, &superblock, sizeof(superblock));
 }
 
 /*
- * find_file_in_dir() - Find a file in specific directory
+ * journal_checksum() - Checksum a journal transaction (FNV-1a)
  * 
- * WHAT: Search for a file by name within a parent directory
- * WHY: To support proper directory hierarchy
- * HOW: Match both name AND parent_inode
- * RETURNS: Pointer to inode, or NULL if not found
+ * HOW: Covers the header (with its checksum field zeroed) and every
+ *      sector image, so a torn write of any part is detected
  */
-static struct xaefs_inode* find_file_in_dir(const char* name, uint32_t parent_inode) 
+static uint32_t journal_checksum(const uint8_t* data, uint32_t count)
 {
-    uint32_t i, j;
+    uint32_t hash = 2166136261u;
+    uint32_t i;
     
-    for (i = 0; i < XAEFS_MAX_FILES; i++) {
-        if (inode_table[i].inode_num != 0 && inode_table[i].parent_inode == parent_inode) {
-            /* Compare name */
-            uint32_t match = 1;
-            for (j = 0; name[j] != '\0' && inode_table[i].name[j] != '\0'; j++) {
-                if (name[j] != inode_table[i].name[j]) {
-                    match = 0;
-                    break;
-                }
-            }
-            if (match && name[j] == '\0' && inode_table[i].name[j] == '\0') {
-                return &inode_table[i];
-            }
-        }
+    for (i = 0; i < (count + 1) * DISK_SECTOR_SIZE; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
     }
     
-    return NULL;  /* Not found */
+    return hash;
 }
 
 /*
- * find_parent_dir() - Find parent directory inode from path
+ * write_home() - Write the dirty metadata sectors to their real location
  * 
- * WHAT: Extract and find parent directory
- * WHY: To support directory hierarchy
- * HOW: Parse path and find parent dir inode
- * RETURNS: Parent inode number (0 for root)
+ * HOW: Goes through the buffer cache; nothing is forced to disk here
+ * RETURNS: 0 on success, -1 on disk error (sectors stay dirty)
  */
-static uint32_t find_parent_dir(const char* current_dir) 
+static int write_home(void)
 {
+    uint8_t buffer[DISK_SECTOR_SIZE];
     uint32_t i;
     
-    /* If at root, parent is root */
-    if (strcmp(current_dir, "/") == 0) {
-        return 0;
-    }
-    
-    /* Extract directory name from path */
-    /* For "/usr" we want "usr", for "/sys/bin" we want "bin" */
-    const char* dir_name = current_dir;
-    if (current_dir[0] == '/') {
-        dir_name = current_dir + 1;  /* Skip leading / */
-    }
-    
-    /* For now, only support single-level: /dirname */
-    /* Find last / if any (for multi-level support later) */
-    uint32_t last_slash = 0;
-    for (i = 0; dir_name[i] != '\0'; i++) {
-        if (dir_name[i] == '/') last_slash = i;
-    }
-    if (last_slash > 0) {
-        dir_name = dir_name + last_slash + 1;
+    bcache_set_priority(XAEFS_META_PRIORITY);
+    for (i = 0; i < meta_count(); i++) {
+        if (!(meta_dirty[i / 8] & (1 << (i % 8)))) {
+            continue;  /* Nothing changed in this sector */
+        }
+        
+        meta_sector_image(i, buffer);
+        if (bcache_write(meta_lba(i), 1, buffer) != 0) {
+            fs_print("[ERROR] Failed to write inode table to disk\n");
+            return -1;
+        }
+        
+        meta_dirty[i / 8] &= ~(1 << (i % 8));
     }
     
-    /* Find directory by name */
-    struct xaefs_inode* dir = find_file_by_name(dir_name);
-    if (dir && dir->type == XAEFS_FILE_DIRECTORY) {
-        return dir->inode_num;
+    if (superblock_dirty) {
+        superblock_image(buffer);
+        if (bcache_write(XAEFS_SUPERBLOCK_SECTOR, 1, buffer) != 0) {
+            fs_print("[ERROR] Failed to write superblock to disk\n");
+            return -1;
+        }
+        superblock_dirty = 0;
     }
     
-    return 0;  /* Default to root */
+    return 0;
 }
 
 /*
- * xaefs_create() - Create a new file
+ * journal_write() - Write one transaction to the journal region
  * 
- * WHAT: Create a new file or directory
- * WHY: Basic filesystem operation
- * HOW: Allocate inode, fill metadata, mark as used
- * RETURNS: Inode number, or negative error code
- *   -1: filesystem not initialized
- *   -2: no free inodes (filesystem full)
- *   -3: file already exists
+ * WHAT: Log the images of every dirty metadata sector in one disk write
+ * WHY: The header and images land together; replay only trusts a
+ *      transaction whose checksum matches, so it is all or nothing
+ * RETURNS: 0 on success, -1 on disk error
  */
-int xaefs_create(const char* path, uint8_t type, uint8_t priority) 
+static int journal_write(void)
 {
-    int inode_num;
-    struct xaefs_inode* inode;
+    struct xaefs_journal_header* header = (struct xaefs_journal_header*)journal_buffer;
+    uint8_t* image = journal_buffer + DISK_SECTOR_SIZE;
     uint32_t i;
     
-    if (!fs_initialized) return -1;
-    
-    /* Check if file already exists */
-    if (find_file_by_name(path) != NULL) return -3;
-    
-    /* Find free inode */
-    inode_num = find_free_inode();
-    if (inode_num < 0) return -2;
-    
-    /* Set up inode */
-    inode = &inode_table[inode_num];
-    inode->inode_num = inode_num;
-    inode->parent_inode = 0;  /* Will be updated by shell based on current_path */
-    inode->size = 0;
-    inode->type = type;
-    inode->priority = priority;
-    inode->version = 1;
-    inode->tag_count = 0;
+    memset(journal_buffer, 0, DISK_SECTOR_SIZE);
+    header->magic = XAEFS_JOURNAL_MAGIC;
+    header->sequence = ++journal_sequence;
     
-    /* Extract just the filename from path (e.g., "new.txt" from "sys/new.txt") */
-    const char* filename = path;
-    for (i = 0; path[i] != '\0'; i++) {
-        if (path[i] == '/') {
-            filename = &path[i + 1];  /* Point to char after last / */
+    for (i = 0; i < meta_count(); i++) {
+        if (meta_dirty[i / 8] & (1 << (i % 8))) {
+            header->sectors[header->count++] = meta_lba(i);
+            meta_sector_image(i, image);
+            image += DISK_SECTOR_SIZE;
         }
     }
-    
-    /* Copy filename only */
-    for (i = 0; i < XAEFS_MAX_FILENAME - 1 && filename[i] != '\0'; i++) {
-        inode->name[i] = filename[i];
+    if (superblock_dirty) {
+        header->sectors[header->count++] = XAEFS_SUPERBLOCK_SECTOR;
+        superblock_image(image);
     }
-    inode->name[i] = '\0';
     
-    superblock.free_inodes--;
+    header->checksum = journal_checksum(journal_buffer, header->count);
     
-    /* Auto-sync to disk */
-    if (auto_sync_enabled) {
-        xaefs_sync();
+    /* Flush so no home write can reach the media ahead of the journal */
+    if (disk_write_sectors(superblock.journal_sector, header->count + 1, journal_buffer) != 0) {
+        return -1;
     }
-    
-    return inode_num;
+    return disk_flush();
 }
 
 /*
- * xaefs_set_parent() - Set parent directory for a file
+ * journal_clear() - Invalidate the journal
  * 
- * WHAT: Update the parent_inode field
- * WHY: To build directory hierarchy
- * HOW: Find file and parent, update link
+ * WHY: Before metadata is written without going through the journal,
+ *      an older transaction must not be replayed over it
  */
-int xaefs_set_parent(const char* filename, const char* parent_path) 
+static int journal_clear(void)
 {
-    uint32_t i;
-    
-    /* Extract just the filename from full path */
-    const char* base_name = filename;
-    for (i = 0; filename[i] != '\0'; i++) {
-        if (filename[i] == '/') {
-            base_name = &filename[i + 1];
-        }
-    }
-    
-    struct xaefs_inode* file = find_file_by_name(base_name);
-    if (!file) return -1;
-    
-    file->parent_inode = find_parent_dir(parent_path);
-    return 0;
+    memset(journal_buffer, 0, DISK_SECTOR_SIZE);
+    if (disk_write_sector(superblock.journal_sector, journal_buffer) != 0) return -1;
+    return disk_flush();
 }
 
 /*
- * xaefs_mkdir() - Create a directory
+ * xaefs_commit() - Commit pending metadata changes as one transaction
  * 
- * WHAT: Create a new directory
- * WHY: Convenience wrapper around create()
- * HOW: Call create() with directory type
+ * WHAT: Make every change since the last commit durable, atomically
+ * WHY: Writing inode sectors in place isn't atomic - a crash between two
+ *      sector writes used to leave the table half updated
+ * HOW: 1. Flush the buffer cache: file data and the previous transaction's
+ *         home writes reach the disk before the journal is reused. Blocks
+ *         allocated since the last commit and changed extent maps always
+ *         go out. Overwrites of LOW files' existing blocks may stay behind
+ *         (written when evicted or by xaefs_sync), so after a crash those
+ *         can show their previous contents.
+ *      2. Write the dirty sector images to the journal in one transfer
+ *         and flush the drive's write cache behind it
+ *      3. Write the same sectors to their home location through the
+ *         cache; they reach the disk at the next commit or flush
+ *      Groups too big for the journal (like a fresh format) are written
+ *      in place and flushed right away instead.
  */
-int xaefs_mkdir(const char* path, uint8_t priority) 
+void xaefs_commit(void)
 {
-    return xaefs_create(path, XAEFS_FILE_DIRECTORY, priority);
+    uint32_t count = count_dirty_sectors();
+    
+    if (count == 0) {
+        pending_changes = 0;
+        return;
+    }
+    
+    if (write_ordered_blocks() != 0 ||
+        bcache_flush_priority(XAEFS_PRIORITY_NORMAL) != 0) {
+        fs_print("[ERROR] Failed to flush buffer cache to disk\n");
+        return;
+    }
+    memset(ordered_blocks, 0, sizeof(ordered_blocks));
+    
+    if (count <= journal_capacity()) {
+        if (journal_write() != 0) {
+            fs_print("[ERROR] Failed to write journal\n");
+            return;  /* Leave it dirty so the next commit retries */
+        }
+        if (write_home() != 0) return;
+    } else {
+        if (journal_clear() != 0 || write_home() != 0 || bcache_flush() != 0) {
+            fs_print("[ERROR] Failed to write metadata to disk\n");
+            return;
+        }
+    }
+    
+    pending_changes = 0;
+    idle_ticks = 0;
 }
 
 /*
- * xaefs_add_tag() - Add a tag to a file (UNIQUE FEATURE!)
+ * xaefs_sync() - Save filesystem to disk
  * 
- * WHAT: Attach a metadata tag to a file
- * WHY: To categorize files beyond just directories
- * HOW: Add tag string to inode's tag array
- * EXAMPLE: xaefs_add_tag("/myfile.txt", "important")
+ * WHAT: Write all changed filesystem data to persistent storage
+ * WHY: So files survive power-off (this is the explicit sync barrier)
+ * HOW: Commit pending changes, then flush the buffer cache so the home
+ *      locations are up to date as well
  */
-int xaefs_add_tag(const char* path, const char* tag) 
+void xaefs_sync(void) 
 {
-    uint32_t i;
-    struct xaefs_inode* inode;
+    uint64_t start = perf_clock();
     
-    /* Find file by name */
-    inode = find_file_by_name(path);
-    if (!inode) return -1;  /* File not found */
-    if (inode->tag_count >= XAEFS_MAX_TAGS) return -1;  /* Too many tags */
+    xaefs_commit();
     
-    /* Add tag */
-    for (i = 0; i < XAEFS_TAG_LENGTH - 1 && tag[i] != '\0'; i++) {
-        inode->tags[inode->tag_count][i] = tag[i];
+    if (bcache_flush() != 0) {
+        fs_print("[ERROR] Failed to flush buffer cache to disk\n");
     }
-    inode->tags[inode->tag_count][i] = '\0';
-    inode->tag_count++;
     
-    return 0;
+    perf_trace(TRACE_XAEFS_SYNC, perf_record(PERF_XAEFS_SYNC, start));
 }
 
 /*
- * xaefs_delete() - Delete a file (global search)
+ * xaefs_idle_tick() - Group-commit coalesced changes once the system is idle
  * 
- * WHAT: Remove a file from the filesystem
- * WHY: Basic file operation
- * HOW: Clear the inode and free it
- * RETURNS: 0 on success, -1 on error
+ * WHAT: Called by the flusher task on every timer tick
+ * WHY: Lets a burst of changes share a single journal transaction
+ * HOW: Keep the disk request queue moving, and commit when
+ *      XAEFS_SYNC_WINDOW ticks pass without a new change. The commit's
+ *      home writes are then queued in the background instead of waiting
+ *      for the next flush.
  */
-int xaefs_delete(const char* path) 
+void xaefs_idle_tick(void)
 {
-    struct xaefs_inode* inode;
-    
-    /* Find file */
-    inode = find_file_by_name(path);
-    if (!inode) return -1;  /* File not found */
-    
-    /* Don't allow deleting root */
-    if (inode->inode_num == 0) return -1;
+    disk_poll();
     
-    /* Clear the inode */
-    memset(inode, 0, sizeof(struct xaefs_inode));
-    superblock.free_inodes++;
+    if (pending_changes == 0) return;
     
-    return 0;
+    if (++idle_ticks >= XAEFS_SYNC_WINDOW) {
+        uint64_t start = perf_clock();
+        
+        xaefs_commit();
+        bcache_write_behind();
+        perf_record(PERF_XAEFS_COMMIT, start);
+    }
 }
 
 /*
- * xaefs_delete_in_dir() - Delete a file in specific directory
+ * journal_replay() - Re-apply the last committed transaction
  * 
- * WHAT: Remove a file from current directory
- * WHY: To support directory hierarchy in shell
- * HOW: Find file by name+parent, then delete
- * RETURNS: 0 on success, -1 on error
+ * WHAT: Called on load, before anything else is read
+ * WHY: A crash after a commit can leave its home writes unfinished
+ * HOW: If the journal holds a transaction with a valid checksum, copy its
+ *      sector images home. Replaying an already applied transaction just
+ *      rewrites the same data, so the journal isn't cleared afterwards.
+ *      The journal never moves once a volume is formatted, so the home
+ *      superblock can be trusted to say where it is.
+ * RETURNS: Number of sectors replayed, 0 if there was nothing to replay
  */
-int xaefs_delete_in_dir(const char* name, const char* current_dir) 
+static uint32_t journal_replay(uint32_t sector, uint32_t capacity)
 {
-    struct xaefs_inode* inode;
-    uint32_t parent_num;
+    struct xaefs_journal_header* header = (struct xaefs_journal_header*)journal_buffer;
+    uint32_t checksum;
+    uint32_t i;
     
-    /* Get parent directory inode */
-    parent_num = find_parent_dir(current_dir);
+    journal_sequence = 0;
     
-    /* Find file in this directory */
-    inode = find_file_in_dir(name, parent_num);
-    if (!inode) return -1;  /* File not found */
+    if (disk_read_sector(sector, journal_buffer) != 0 ||
+        header->magic != XAEFS_JOURNAL_MAGIC ||
+        header->count == 0 || header->count > capacity) {
+        return 0;
+    }
+    journal_sequence = header->sequence;
     
-    /* Don't allow deleting root or directories */
-    if (inode->inode_num == 0) return -1;
+    if (disk_read_sectors(sector + 1, header->count,
+                          journal_buffer + DISK_SECTOR_SIZE) != 0) {
+        return 0;
+    }
     
-    /* Clear the inode */
-    memset(inode, 0, sizeof(struct xaefs_inode));
-    superblock.free_inodes++;
+    checksum = header->checksum;
+    header->checksum = 0;
+    if (journal_checksum(journal_buffer, header->count) != checksum) {
+        return 0;  /* Torn transaction: it never committed */
+    }
     
-    /* Auto-sync to disk */
-    if (auto_sync_enabled) {
-        xaefs_sync();
+    bcache_set_priority(XAEFS_META_PRIORITY);
+    for (i = 0; i < header->count; i++) {
+        if (bcache_write(header->sectors[i], 1,
+                         journal_buffer + (i + 1) * DISK_SECTOR_SIZE) != 0) {
+            return 0;
+        }
     }
+    bcache_flush();
     
-    return 0;
+    return header->count;
 }
 
 /*
- * xaefs_set_priority() - Change file priority (UNIQUE FEATURE!)
- * 
- * WHAT: Set the priority level of a file
- * WHY: Can be used by scheduler or backup systems
- * HOW: Update priority field in inode
+ * layout_valid() - Check that a version 2 superblock describes a volume
+ *                  this code can mount
  */
-int xaefs_set_priority(const char* path, uint8_t priority) 
+static uint8_t layout_valid(const struct xaefs_superblock* sb)
 {
-    struct xaefs_inode* inode;
-    
-    /* Find file */
-    inode = find_file_by_name(path);
-    if (!inode) return -1;  /* File not found */
-    
-    inode->priority = priority;
-    return 0;
+    return sb->inode_size == XAEFS_INODE_SIZE &&
+           sb->total_inodes > 0 && sb->total_inodes <= XAEFS_MAX_FILES &&
+           sb->inode_table_sectors * XAEFS_INODES_PER_SECTOR >= sb->total_inodes &&
+           sb->inode_table_sectors <= XAEFS_INODE_TABLE_SECTORS &&
+           sb->tag_table_sectors * XAEFS_TAGS_PER_SECTOR >= sb->total_inodes &&
+           sb->tag_table_sectors <= XAEFS_TAG_TABLE_SECTORS &&
+           sb->total_blocks <= XAEFS_MAX_BLOCKS &&
+           sb->bitmap_sectors == bitmap_sectors(sb->total_blocks) &&
+           sb->journal_sectors > XAEFS_MAX_OP_SECTORS + 1 &&
+           sb->journal_sectors <= XAEFS_JOURNAL_SECTORS;
 }
 
 /*
- * xaefs_find_by_tag() - Find files by tag (UNIQUE FEATURE!)
+ * read_tables() - Read the inode and tag tables of a version 2 volume
  * 
- * WHAT: Search for all files with a specific tag
- * WHY: To use the tagging system for file discovery
- * HOW: Scan all inodes, check their tags, print matches
+ * NOTE: The bitmap isn't read; it is rebuilt from the files on load
+ * RETURNS: 0 on success, -1 on disk error
  */
-void xaefs_find_by_tag(const char* tag) 
+static int read_tables(void)
 {
-    uint32_t i, j, k;
-    uint8_t found = 0;
-    
-    fs_print("\nFiles tagged with '");
-    fs_print(tag);
-    fs_print("':\n");
-    
-    /* Loop through all inodes */
-    for (i = 1; i < XAEFS_MAX_FILES; i++) {  /* Skip root at 0 */
-        if (inode_table[i].inode_num != 0) {
-            /* Check each tag in this file */
-            for (j = 0; j < inode_table[i].tag_count; j++) {
-                /* Compare tag strings */
-                uint8_t match = 1;
-                for (k = 0; tag[k] != '\0'; k++) {
-                    if (tag[k] != inode_table[i].tags[j][k]) {
-                        match = 0;
-                        break;
-                    }
-                }
-                
-                if (match && inode_table[i].tags[j][k] == '\0') {
-                    /* Found a match! */
-                    fs_print("  - ");
-                    fs_print(inode_table[i].name);
-                    fs_print("\n");
-                    found = 1;
-                    break;
-                }
-            }
-        }
+    if (bcache_read(superblock.inode_table_sector, superblock.inode_table_sectors,
+                    (uint8_t*)inode_table) != 0) {
+        return -1;
     }
     
-    if (!found) {
-        fs_print("  (no files found)\n");
-    }
+    return bcache_read(superblock.tag_table_sector, superblock.tag_table_sectors,
+                       (uint8_t*)tag_table);
 }
 
 /*
- * xaefs_list_dir() - List files in a directory
+ * migrate_v1() - Load a version 1 volume into the version 2 tables
  * 
- * WHAT: Show files in specified directory
- * WHY: So users can see directory contents
- * HOW: Print inodes that have matching parent_inode
+ * WHAT: Convert the old inodes and lay the volume out anew
+ * HOW: Data blocks stay where they are; the new tables go at the end
+ *      of the disk, where version 1 never wrote. Nothing of the old
+ *      layout is overwritten before the new superblock is written (see
+ *      write_migrated), so an interrupted migration starts over.
+ * RETURNS: 0 on success, -1 on disk error or if the disk has no room
  */
-int xaefs_list_dir(const char* path) 
+static int migrate_v1(const uint8_t* sb_sector)
 {
+    uint8_t buffer[DISK_SECTOR_SIZE];
+    const uint8_t* bitmap = sb_sector + XAEFS_V1_BITMAP_OFFSET;
+    uint32_t volume = disk_get_sectors();
+    uint32_t used_end = 0;
+    uint32_t meta_start, blocks;
     uint32_t i, j;
-    uint32_t parent_num;
-    const char* type_names[] = {"FILE", "DIR ", "DEV "};
-    const char* priority_names[] = {"LOW ", "NORM", "HIGH", "CRIT"};
-    uint8_t found_any = 0;
-    
-    /* Find parent directory inode number */
-    parent_num = find_parent_dir(path);
     
-    fs_print("\nFiles in ");
-    fs_print(path);
-    fs_print(":\n");
-    fs_print("NAME                  TYPE  PRIORITY  SIZE    TAGS\n");
-    fs_print("----------------------------------------------------\n");
+    /* Only the part up to the label existed in version 1 */
+    memset(&superblock, 0, sizeof(superblock));
+    memcpy(&superblock, sb_sector, (uint32_t)((const uint8_t*)&superblock.inode_size -
+                                              (const uint8_t*)&superblock));
     
-    /* Show files that have this directory as parent */
-    for (i = 1; i < XAEFS_MAX_FILES; i++) {  /* Skip root at 0 */
-        if (inode_table[i].inode_num != 0 && inode_table[i].parent_inode == parent_num) {
-            found_any = 1;
-            
-            /* Print filename */
-            fs_print(inode_table[i].name);
-            
-            /* Pad to 22 chars */
-            for (j = strlen(inode_table[i].name); j < 22; j++) {
-                fs_putchar(' ');
-            }
-            
-            /* Print type */
-            fs_print(type_names[inode_table[i].type]);
-            fs_print("  ");
-            
-            /* Print priority */
-            fs_print(priority_names[inode_table[i].priority]);
-            fs_print("      ");
-            
-            /* Print size (simplified) */
-            fs_print("0 KB");
-            fs_print("    ");
+    for (i = 0; i < XAEFS_V1_INODE_TABLE_SECTORS; i++) {
+        if (bcache_read(XAEFS_V1_INODE_TABLE_SECTOR + i, 1, buffer) != 0) return -1;
+        
+        for (j = 0; j < XAEFS_V1_INODES_PER_SECTOR; j++) {
+            const struct xaefs_inode_v1* old =
+                (const struct xaefs_inode_v1*)(buffer + j * sizeof(struct xaefs_inode_v1));
+            uint32_t ino = i * XAEFS_V1_INODES_PER_SECTOR + j;
+            struct xaefs_inode* inode = &inode_table[ino];
             
-            /* Print tags */
-            if (inode_table[i].tag_count > 0) {
-                fs_putchar('[');
-                for (j = 0; j < inode_table[i].tag_count; j++) {
-                    if (j > 0) fs_print(", ");
-                    fs_print(inode_table[i].tags[j]);
-                }
-                fs_putchar(']');
-            }
+            if (ino >= XAEFS_MAX_FILES) break;
             
-            fs_putchar('\n');
+            memcpy(inode->name, old->name, XAEFS_MAX_FILENAME);
+            inode->inode_num = old->inode_num;
+            inode->parent_inode = old->parent_inode;
+            inode->size = old->size;
+            inode->block_start = old->block_start;
+            inode->block_count = old->block_count;
+            inode->type = old->type;
+            inode->priority = old->priority;
+            inode->version = old->version;
+            inode->created_time = old->created_time;
+            inode->modified_time = old->modified_time;
+            inode->tag_count = old->tag_count;
+            inode->flags = old->flags;
+            memcpy(tag_table[ino].tags, old->tags, sizeof(tag_table[ino].tags));
         }
     }
     
-    if (!found_any) {
-        fs_print("(empty directory)\n");
+    /* The new tables must fit between the last used block and the end */
+    for (i = 0; i < XAEFS_V1_MAX_BLOCKS && i < superblock.total_blocks; i++) {
+        if ((bitmap[i / 8] >> (i % 8)) & 1) used_end = i + 1;
+    }
+    
+    meta_start = volume - XAEFS_JOURNAL_SECTORS - XAEFS_INODE_TABLE_SECTORS -
+                 XAEFS_TAG_TABLE_SECTORS - XAEFS_BITMAP_MAX_SECTORS;
+    meta_start -= meta_start % XAEFS_SECTORS_PER_BLOCK;
+    if (volume < meta_start ||
+        meta_start < XAEFS_V1_DATA_START_SECTOR + used_end * XAEFS_SECTORS_PER_BLOCK) {
+        return -1;
     }
     
+    blocks = (meta_start - XAEFS_V1_DATA_START_SECTOR) / XAEFS_SECTORS_PER_BLOCK;
+    if (blocks > XAEFS_MAX_BLOCKS) blocks = XAEFS_MAX_BLOCKS;
+    
+    place_metadata(meta_start, blocks);
+    superblock.version = XAEFS_VERSION;
+    superblock.total_blocks = blocks;
+    superblock.total_inodes = XAEFS_MAX_FILES;
+    superblock.data_start_sector = XAEFS_V1_DATA_START_SECTOR;
+    superblock.volume_sectors = volume;
+    
     return 0;
 }
 
 /*
- * ==============================================================================
- * DISK PERSISTENCE FUNCTIONS
- * ==============================================================================
- */
-
-/*
- * xaefs_sync() - Save filesystem to disk
+ * write_migrated() - Write a migrated volume out in the new format
  * 
- * WHAT: Write all filesystem data to persistent storage
- * WHY: So files survive power-off
- * HOW: Write superblock and inode table to disk sectors
+ * HOW: Every new table is on the disk before the superblock that points
+ *      at it; the single superblock write then switches the volume over
+ * RETURNS: 0 on success, -1 on disk error
  */
-void xaefs_sync(void) 
+static int write_migrated(void)
 {
-    uint8_t buffer[DISK_SECTOR_SIZE];
-    uint32_t i;
-    
-    /* Write superblock to sector 1 */
-    memset(buffer, 0, DISK_SECTOR_SIZE);
-    memcpy(buffer, &superblock, sizeof(superblock));
-    if (disk_write_sector(XAEFS_SUPERBLOCK_SECTOR, buffer) != 0) {
-        fs_print("[ERROR] Failed to write superblock to disk\n");
-        return;
-    }
+    memset(meta_dirty, 0xFF, sizeof(meta_dirty));
+    superblock_dirty = 0;
+    if (journal_clear() != 0 || write_home() != 0 || bcache_flush() != 0) return -1;
     
-    /* Write inode table (8 sectors) */
-    for (i = 0; i < XAEFS_INODE_TABLE_SECTORS; i++) {
-        uint32_t inodes_per_sector = DISK_SECTOR_SIZE / sizeof(struct xaefs_inode);
-        uint32_t inode_start = i * inodes_per_sector;
-        
-        memset(buffer, 0, DISK_SECTOR_SIZE);
-        
-        /* Copy inodes to buffer */
-        uint32_t j;
-        for (j = 0; j < inodes_per_sector && (inode_start + j) < XAEFS_MAX_FILES; j++) {
-            memcpy(buffer + (j * sizeof(struct xaefs_inode)), 
-                   &inode_table[inode_start + j], 
-                   sizeof(struct xaefs_inode));
-        }
-        
-        if (disk_write_sector(XAEFS_INODE_TABLE_SECTOR + i, buffer) != 0) {
-            fs_print("[ERROR] Failed to write inode table to disk\n");
-            return;
-        }
-    }
+    superblock_dirty = 1;
+    if (write_home() != 0 || bcache_flush() != 0) return -1;
     
-    /* Show sync status */
-    if (auto_sync_enabled) {
-        fs_print("  [Synced to disk]\n");
-    }
+    return 0;
 }
 
 /*
@@ -627,52 +3082,85 @@ void xaefs_sync(void)
  * 
  * WHAT: Read filesystem data from persistent storage
  * WHY: To restore files after boot
- * HOW: Read superblock and inode table from disk sectors
+ * HOW: Read the superblock, replay the journal it points to, then the
+ *      inode and tag tables. Version 1 volumes are converted and written
+ *      back in the current format.
  */
 void xaefs_load(void) 
 {
     uint8_t buffer[DISK_SECTOR_SIZE];
+    struct xaefs_superblock* sb = (struct xaefs_superblock*)buffer;
+    uint8_t migrated = 0;
+    uint32_t replayed;
     uint32_t i;
     
     fs_print("  - Attempting to load filesystem from disk...\n");
     
-    /* Clear inode table before loading */
+    /* Clear tables before loading */
     memset(inode_table, 0, sizeof(inode_table));
+    memset(tag_table, 0, sizeof(tag_table));
+    bcache_set_priority(XAEFS_META_PRIORITY);
     
     /* Read superblock from sector 1 */
-    if (disk_read_sector(XAEFS_SUPERBLOCK_SECTOR, buffer) != 0) {
+    if (bcache_read(XAEFS_SUPERBLOCK_SECTOR, 1, buffer) != 0) {
         fs_print("  - Disk read failed, will create new filesystem\n");
         return;
     }
     
     /* Check magic number */
-    struct xaefs_superblock* sb = (struct xaefs_superblock*)buffer;
-    if (sb->magic != 0x58414546) {
+    if (sb->magic != XAEFS_MAGIC) {
         fs_print("  - No valid XAE-FS found on disk\n");
         return;
     }
     
-    /* Load superblock */
-    memcpy(&superblock, buffer, sizeof(superblock));
+    /* Finish the last committed transaction first */
+    if (sb->version == 1) {
+        replayed = journal_replay(XAEFS_V1_JOURNAL_SECTOR, XAEFS_V1_JOURNAL_CAPACITY);
+    } else if (sb->version == XAEFS_VERSION && layout_valid(sb)) {
+        replayed = journal_replay(sb->journal_sector, sb->journal_sectors - 1);
+    } else {
+        fs_print("  - Unsupported XAE-FS version on disk\n");
+        return;
+    }
+    
+    if (replayed > 0) {
+        fs_print("  - Replayed metadata journal\n");
+        if (bcache_read(XAEFS_SUPERBLOCK_SECTOR, 1, buffer) != 0 ||
+            sb->magic != XAEFS_MAGIC) {
+            fs_print("  - Disk read failed, will create new filesystem\n");
+            return;
+        }
+    }
+    
+    reset_handles();
     fs_print("  - Found existing XAE-FS! Loading...\n");
     
-    /* Read inode table (8 sectors) */
-    for (i = 0; i < XAEFS_INODE_TABLE_SECTORS; i++) {
-        if (disk_read_sector(XAEFS_INODE_TABLE_SECTOR + i, buffer) != 0) {
+    if (sb->version == 1) {
+        fs_print("  - Migrating version 1 volume\n");
+        if (migrate_v1(buffer) != 0) {
+            fs_print("  - Error migrating volume, aborting load\n");
+            fs_initialized = 0;
+            return;
+        }
+        migrated = 1;
+    } else {
+        memcpy(&superblock, buffer, sizeof(superblock));
+        if (read_tables() != 0) {
             fs_print("  - Error reading inode table, aborting load\n");
             fs_initialized = 0;
             return;
         }
-        
-        /* Copy inodes from buffer */
-        uint32_t inodes_per_sector = DISK_SECTOR_SIZE / sizeof(struct xaefs_inode);
-        uint32_t inode_start = i * inodes_per_sector;
-        uint32_t j;
-        
-        for (j = 0; j < inodes_per_sector && (inode_start + j) < XAEFS_MAX_FILES; j++) {
-            memcpy(&inode_table[inode_start + j],
-                   buffer + (j * sizeof(struct xaefs_inode)),
-                   sizeof(struct xaefs_inode));
+    }
+    
+    /* Rebuild block reference counts (and so the bitmap) from the files */
+    memset(block_refs, 0, sizeof(block_refs));
+    memset(block_bitmap, 0, sizeof(block_bitmap));
+    memset(ordered_blocks, 0, sizeof(ordered_blocks));
+    map_block = XAEFS_NO_MAP;
+    superblock.free_blocks = superblock.total_blocks;
+    for (i = 1; i < XAEFS_MAX_FILES; i++) {
+        if (inode_table[i].inode_num != 0) {
+            ref_file_data(&inode_table[i]);
         }
     }
     
@@ -691,6 +3179,20 @@ void xaefs_load(void)
     }
     fs_print(" files from disk\n");
     
+    index_rebuild();
+    tag_index_rebuild();
+    dcache_reset();
+    
+    /* Memory now matches the disk */
+    memset(meta_dirty, 0, sizeof(meta_dirty));
+    superblock_dirty = 0;
+    pending_changes = 0;
+    
+    if (migrated && write_migrated() != 0) {
+        fs_print("[ERROR] Failed to write migrated volume to disk\n");
+        mark_all_dirty();  /* The next commit tries again */
+    }
+    
     fs_initialized = 1;
 }
 
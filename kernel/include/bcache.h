@@ -0,0 +1,67 @@
+/*
+ * ==============================================================================
+ * BLOCK BUFFER CACHE
+ * ==============================================================================
+ * WHAT: A write-back cache of disk sectors between the filesystem and ATA driver
+ * WHY: PIO disk access is slow; the same metadata and data sectors are
+ *      read and written over and over
+ * HOW: Cache 4KB groups of 8 sectors (one filesystem block) in pages from
+ *      alloc_page(), evict the least recently used group, and only write
+ *      dirty sectors back on eviction or flush
+ * 
+ * NOTES:
+ * - Each buffer tracks which of its 8 sectors are valid and which are dirty,
+ *   so a single 512-byte sector can be cached or written without reading
+ *   the rest of its group
+ * - Reading the group right after the last one that missed triggers
+ *   read-ahead of the following groups
+ * - Write-back goes through the disk request queue, so a flush hands all
+ *   dirty sectors to the elevator at once; a buffer is only touched again
+ *   once its writes have completed
+ * - Every buffer carries the priority of whoever touched it last (the
+ *   filesystem passes its file priorities, LOW to CRITICAL): higher
+ *   priorities survive longer under eviction and are flushed first,
+ *   LOW buffers are evicted first and left out of write-behind
+ */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+
+/* Cache configuration */
+#define BCACHE_SECTORS_PER_BUFFER 8     /* 4KB per buffer (one page) */
+#define BCACHE_MIN_BUFFERS 8            /* 32KB of cache */
+#define BCACHE_MAX_BUFFERS 128          /* 512KB of cache */
+#define BCACHE_MEMORY_SHARE 128         /* Use 1/128 of RAM (256KB with 32MB) */
+#define BCACHE_READAHEAD 2              /* Groups to prefetch on sequential access */
+
+/* Buffer priorities (same levels as enum xaefs_priority) */
+#define BCACHE_PRIORITY_LOW 0           /* Evicted first, write-back deferred */
+#define BCACHE_PRIORITY_NORMAL 1
+#define BCACHE_PRIORITY_URGENT 2        /* From here on: flushed first */
+#define BCACHE_PRIORITY_MAX 3
+
+/* Counters for sizing the cache */
+struct bcache_stats {
+    uint32_t buffers;        /* Buffers actually allocated */
+    uint32_t hits;           /* Group lookups served from the cache */
+    uint32_t misses;         /* Group lookups that went to disk */
+    uint32_t readaheads;     /* Groups prefetched */
+    uint32_t writebacks;     /* Disk writes of dirty sectors */
+    uint32_t evictions;      /* Buffers reused for another group */
+    uint32_t priority_evictions;  /* Evictions that spared an older buffer */
+};
+
+/* Cache functions */
+void bcache_init(void);
+int bcache_read(uint32_t lba, uint32_t count, uint8_t* buffer);
+int bcache_write(uint32_t lba, uint32_t count, const uint8_t* buffer);
+int bcache_flush(void);
+int bcache_flush_priority(uint8_t min_priority);
+int bcache_write_range(uint32_t lba, uint32_t count);
+void bcache_set_priority(uint8_t priority);
+void bcache_write_behind(void);
+void bcache_get_stats(struct bcache_stats* stats);
+
+#endif /* BCACHE_H */
@@ -10,7 +10,18 @@
  * - ATA = Advanced Technology Attachment (standard hard disk interface)
  * - PIO = Programmed I/O (CPU directly controls transfers)
  * - Each sector is 512 bytes
- * - We use LBA28 addressing (can address up to 128GB)
+ * - LBA28 addressing below 128GB, LBA48 above it when the drive supports
+ *   it (sector numbers are 32-bit, so up to 2TB)
+ * - Transfers use READ/WRITE MULTIPLE, so the drive hands over a block of
+ *   sectors per data request
+ * - Writes may sit in the drive's cache; disk_flush() makes them durable
+ * - With a PCI bus-master IDE controller, transfers are DMA requests on an
+ *   elevator-sorted queue: disk_submit() returns at once and the IRQ 14
+ *   handler completes them and starts the next batch (disk_poll() does the
+ *   same by hand, without the IRQ or for a lost interrupt). The
+ *   *_sectors() calls are a submit-and-wait on top.
+ * - Completion callbacks may run in the interrupt handler, so they must
+ *   not block, and what they touch must be updated with disk_lock() held
  */
 
 #ifndef DISK_H
@@ -20,6 +31,22 @@
 
 /* Disk constants */
 #define DISK_SECTOR_SIZE 512
+#define DISK_MAX_TRANSFER 256   /* Sectors per command / request */
+
+/* Request status while it is queued or running */
+#define DISK_REQ_PENDING 1
+
+/* Asynchronous transfer; owned by the driver from submit until done runs */
+struct disk_request {
+    uint32_t lba;            /* First sector */
+    uint32_t count;          /* Sectors, 1 to DISK_MAX_TRANSFER */
+    uint8_t* buffer;         /* Data (identity mapped, so also the DMA address) */
+    uint8_t write;           /* 0 = read from disk, 1 = write to disk */
+    volatile int status;     /* DISK_REQ_PENDING, then 0 or -1 */
+    void (*done)(struct disk_request* req);  /* Completion callback, may be NULL */
+    void* context;           /* For the callback */
+    struct disk_request* next;  /* Queue link (driver use) */
+};
 
 /* Disk functions */
 void disk_init(void);
@@ -27,5 +54,12 @@ int disk_read_sector(uint32_t lba, uint8_t* buffer);
 int disk_write_sector(uint32_t lba, const uint8_t* buffer);
 int disk_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer);
 int disk_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer);
+int disk_flush(void);
+int disk_submit(struct disk_request* req);
+void disk_poll(void);
+int disk_wait_request(struct disk_request* req);
+uint32_t disk_lock(void);
+void disk_unlock(uint32_t flags);
+uint32_t disk_get_sectors(void);
 
 #endif /* DISK_H */
@@ -4,7 +4,8 @@
  * ==============================================================================
  * WHAT: A basic line-based text editor
  * WHY: To create and edit files in the OS
- * HOW: Line-by-line editing with save/exit commands
+ * HOW: Line-by-line editing with save/exit commands, on a gap buffer
+ *      that grows in pages, so file size is only limited by memory
  */
 
 #ifndef EDITOR_H
@@ -13,8 +14,7 @@
 #include <stdint.h>
 
 /* Editor configuration */
-#define EDITOR_MAX_LINES 50
-#define EDITOR_MAX_LINE_LEN 80
+#define EDITOR_MAX_LINE_LEN 80         /* Longest line typed in one go */
 
 /* Editor functions */
 void editor_init(void);
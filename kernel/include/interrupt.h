@@ -0,0 +1,65 @@
+/*
+ * ==============================================================================
+ * INTERRUPTS (IDT AND 8259 PIC)
+ * ==============================================================================
+ * WHAT: Interrupt descriptor table, PIC setup and IRQ handler registration
+ * WHY: Without interrupts every device has to be polled from the shell
+ *      loop, and anything that arrives between two polls piles up in the
+ *      device's own small buffer
+ * HOW: The 32 CPU exceptions and 16 hardware IRQs each get an assembly stub
+ *      that saves the registers and calls one C dispatcher; the PICs are
+ *      remapped so IRQs land on vectors 32-47 instead of on the exceptions
+ * 
+ * NOTES:
+ * - An IRQ stays masked at the PIC until a handler is registered for it
+ * - Handlers run with interrupts disabled and must not block; anything
+ *   heavier than emptying the device goes to a queue for the main loop
+ * - An exception prints its vector and halts
+ */
+
+#ifndef INTERRUPT_H
+#define INTERRUPT_H
+
+#include <stdint.h>
+
+/* Vector layout */
+#define IRQ_BASE 32                 /* IRQ 0 is vector 32 */
+#define IRQ_COUNT 16
+
+/* Registers saved by the stubs, lowest address first */
+struct interrupt_frame {
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;   /* pusha */
+    uint32_t vector;
+    uint32_t error_code;     /* 0 for vectors without one */
+    uint32_t eip, cs, eflags;    /* Pushed by the CPU */
+};
+
+typedef void (*irq_handler_t)(void);
+
+/* Interrupt functions */
+void interrupts_init(void);
+int irq_register(uint8_t irq, irq_handler_t handler);
+void interrupts_enable(void);
+
+/*
+ * irq_save() / irq_restore() - Critical section against interrupt handlers
+ * 
+ * WHY: Code that shares data with a handler must keep it from running in
+ *      the middle of an update; restoring the old flag nests correctly
+ */
+static inline uint32_t irq_save(void)
+{
+    uint32_t flags;
+    
+    __asm__ volatile ("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags)
+{
+    if (flags & 0x200) {     /* IF was set */
+        __asm__ volatile ("sti" : : : "memory");
+    }
+}
+
+#endif /* INTERRUPT_H */
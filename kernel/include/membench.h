@@ -0,0 +1,18 @@
+/*
+ * ==============================================================================
+ * MEMORY ROUTINE BENCHMARK
+ * ==============================================================================
+ * WHAT: Times memcpy/memset/memcmp/memmove against plain byte loops
+ * WHY: The string routines are on every disk, cache and network path; this
+ *      shows what the word-wide versions actually buy on this machine
+ * HOW: Cycle counts from rdtsc over sector- and page-sized buffers, aligned
+ *      and misaligned
+ */
+
+#ifndef MEMBENCH_H
+#define MEMBENCH_H
+
+/* Run every case and print one line per result */
+void membench_run(void (*print)(const char* str));
+
+#endif /* MEMBENCH_H */
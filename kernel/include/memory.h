@@ -4,12 +4,18 @@
  * ==============================================================================
  * WHAT: System for tracking and allocating physical memory
  * WHY: The OS needs to know which RAM is free and which is used
- * HOW: Use a bitmap where each bit represents one 4KB page of memory
+ * HOW: A buddy allocator - free memory is kept in blocks of 2^order
+ *      pages, one free list per order
  * 
  * TECHNICAL DETAILS:
  * - Page size: 4KB (4096 bytes) - standard x86 page size
- * - We use a bitmap: 1 bit per page (1 = used, 0 = free)
- * - For 32MB RAM: 32MB / 4KB = 8192 pages = 1024 bytes of bitmap
+ * - Blocks are aligned to their size; a block's buddy is the other half
+ *   of the block it was split from, and free buddies merge again
+ * - Allocation and freeing take at most MAX_ORDER split/merge steps,
+ *   however much memory there is
+ * - One state byte per page: for 32MB RAM, 8192 pages = 8KB
+ * - RAM size comes from the BIOS E820 map the bootloader collects; the
+ *   state array is placed in the first usable memory above 1MB
  */
 
 #ifndef MEMORY_H
@@ -20,13 +26,32 @@
 
 /* Memory constants */
 #define PAGE_SIZE 4096              /* 4KB pages */
-#define MEMORY_SIZE (32 * 1024 * 1024)  /* Assume 32MB for now */
-#define NUM_PAGES (MEMORY_SIZE / PAGE_SIZE)
+#define MEMORY_DEFAULT_SIZE (32 * 1024 * 1024)  /* Assumed when there is no E820 map */
+#define MAX_ORDER 10                /* Largest block: 2^10 pages = 4MB */
+
+/* BIOS E820 memory map, as left at 0x500 by the bootloader */
+#define E820_MAX_ENTRIES 32
+#define E820_USABLE 1               /* Type of RAM we may allocate */
+
+struct e820_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;                  /* ACPI 3.0 extended attributes */
+} __attribute__((packed));
+
+struct e820_map {
+    uint32_t count;
+    struct e820_entry entries[E820_MAX_ENTRIES];
+} __attribute__((packed));
 
 /* Function declarations */
-void memory_init(void);
+void memory_init(const struct e820_map* map);
 void* alloc_page(void);
 void free_page(void* page);
+void* alloc_pages(uint32_t order);
+void free_pages(void* addr, uint32_t order);
 uint32_t get_free_memory(void);
+uint32_t get_total_memory(void);
 
 #endif /* MEMORY_H */
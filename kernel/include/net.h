@@ -2,6 +2,8 @@
 #define NET_H
 
 #include <stdint.h>
+#include "include/timer.h"
+#include "include/shell.h"
 
 // Ethernet frame structure
 typedef struct {
@@ -37,6 +39,24 @@ typedef struct {
     uint16_t urgent_ptr;
 } __attribute__((packed)) tcp_header_t;
 
+// ARP packet for IPv4 over Ethernet
+typedef struct {
+    uint16_t hw_type;        // 1 = Ethernet
+    uint16_t proto_type;     // 0x0800 = IPv4
+    uint8_t hw_len;
+    uint8_t proto_len;
+    uint16_t opcode;         // ARP_REQUEST or ARP_REPLY
+    uint8_t sender_mac[6];
+    uint32_t sender_ip;
+    uint8_t target_mac[6];
+    uint32_t target_ip;
+} __attribute__((packed)) arp_packet_t;
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP  0x0806
+#define ARP_REQUEST    1
+#define ARP_REPLY      2
+
 // TCP flags
 #define TCP_FIN  0x01
 #define TCP_SYN  0x02
@@ -47,28 +67,144 @@ typedef struct {
 
 // Network configuration
 #define MY_IP_ADDR    0x0A000002  // 10.0.0.2
-#define MY_MAC_ADDR   {0x52, 0x54, 0x00, 0x12, 0x34, 0x56}
 #define TELNET_PORT   23
+#define NET_TCP_MSS   1460        // Largest TCP payload per frame (1500 MTU)
 
-// Session structure
-typedef struct {
+// TCP tuning. Times are in net_tick() calls, one per timer tick.
+#define NET_TCP_SNDBUF      8192    // Per-connection send buffer (2 pages)
+#define NET_TCP_SNDBUF_ORDER 1
+#define NET_TCP_RCV_WINDOW  4096    // Window we advertise
+#define NET_TCP_RTO_INITIAL (1 * TIMER_HZ)   // First retransmit timeout
+#define NET_TCP_RTO_MAX     (60 * TIMER_HZ)  // Backoff limit
+#define NET_TCP_MAX_RETRIES 8       // Retransmits before the connection is dropped
+#define NET_TCP_DELACK      (TIMER_HZ / 5)   // Longest an ACK is held back
+
+// Neighbour (ARP) cache. Times are in net_tick() calls.
+#define NET_ARP_CACHE       16      // Entries, replaced oldest first
+#define NET_ARP_TIMEOUT     (300 * TIMER_HZ) // Entries older than this are asked for again
+#define NET_ARP_RETRY       (1 * TIMER_HZ)   // Minimum gap between requests for one address
+
+// Sessions are allocated from a slab cache as connections arrive and
+// found through a hash on (client IP, client port). The limits are the
+// boot defaults; net_set_limits() (shell: net max|perip <n>) changes them.
+#define NET_MAX_SESSIONS    64      // Connections at once
+#define NET_MAX_PER_IP      16      // Connections from one client address
+#define NET_SESSION_BUCKETS 64      // Hash buckets (power of two)
+#define NET_IDLE_TIMEOUT    (1800 * TIMER_HZ) // Silent connections are reset after this
+
+// Commands of a logged-in connection run in a task of their own
+#define NET_CMD_MAX         256     // Longest command line
+#define NET_CMD_QUEUE       512     // Lines received but not yet run
+
+// Command output is collected per connection and sent in whole segments,
+// XOR-encoded like everything the client sends us
+#define NET_OUT_BUF         8192    // Output held back during a command (2 pages)
+#define NET_OUT_ORDER       1
+#define NET_XOR_KEY         0x42    // Must match xae_client.py
+
+// TCP connection states (we only ever open passively, and close as soon
+// as the client does, so FIN_WAIT/CLOSE_WAIT/TIME_WAIT are never held)
+#define TCP_STATE_CLOSED       0
+#define TCP_STATE_SYN_RECEIVED 1   // SYN-ACK sent, waiting for its ACK
+#define TCP_STATE_ESTABLISHED  2
+#define TCP_STATE_LAST_ACK     3   // Client closed, our FIN sent after the data
+
+struct task;
+
+// Session structure: one TCP connection and its login state
+typedef struct session {
     uint32_t client_ip;
     uint16_t client_port;
-    uint32_t seq_num;
-    uint32_t ack_num;
+    uint8_t state;          // TCP_STATE_*
     uint8_t authenticated;
     uint8_t active;
+    
+    // Send side. The buffer holds every byte from snd_una on: the first
+    // snd_sent have been sent (and wait for an ACK), the rest are queued.
+    uint32_t snd_una;       // Oldest unacknowledged sequence number
+    uint32_t snd_wnd;       // Window the client advertised
+    uint8_t* snd_buf;       // NET_TCP_SNDBUF ring
+    uint16_t snd_start;     // Ring offset of snd_una
+    uint16_t snd_len;       // Bytes in the ring
+    uint16_t snd_sent;      // Of those, bytes sent (since the last timeout)
+    uint32_t snd_max;       // Sequence number after the highest one ever sent
+    uint8_t fin_queued;     // Send a FIN once the buffer is empty
+    uint8_t fin_sent;
+    
+    // Receive side
+    uint32_t rcv_nxt;       // Next sequence number expected
+    uint8_t ack_pending;    // Segments received but not acknowledged
+    uint16_t ack_timer;     // Delayed ACK countdown, 0 = off
+    
+    // Retransmission
+    uint32_t rto;           // Current timeout (doubles on each retransmit)
+    uint32_t rto_timer;     // Countdown, 0 = off
+    uint8_t retries;
+    
+    uint32_t last_active;   // net_tick() count of the last segment received
+    
+    // Header template: the IP and TCP headers with every field that never
+    // changes filled in, IP checksum computed for a zero length
+    uint8_t hdr_template[20 + 20];
+    uint32_t tcp_sum_base;  // Checksum of the template's fixed TCP fields
+    
     char username[32];
+    
+    // The shell's working directory for this session (the console and
+    // every other session keep their own)
+    char cwd[SHELL_PATH_SIZE];
+    uint32_t cwd_inode;
+    
+    // Shell task and the lines waiting for it, each NUL-terminated
+    struct task* shell;
+    char commands[NET_CMD_QUEUE];
+    uint16_t commands_len;
+    
+    // Output of the running command, not yet handed to TCP (plain text)
+    uint8_t* out_buf;       // NET_OUT_BUF bytes
+    uint16_t out_len;
+    uint32_t out_lost;      // Bytes dropped because both buffers were full
+    
+    struct session* next;   // Next in the same hash bucket
 } session_t;
 
+// Connection counters for the shell
+struct net_stats {
+    uint32_t active;         // Sessions now
+    uint32_t opened;         // Connections accepted since boot
+    uint32_t closed;         // Orderly FIN close
+    uint32_t reset;          // Closed by a client RST
+    uint32_t timed_out;      // Dropped for idling or unanswered retransmits
+    uint32_t refused;        // SYNs turned away by the limits
+    uint32_t max_sessions;   // Limits now in force
+    uint32_t max_per_ip;
+};
+
+// One connection, for listing
+struct net_session_info {
+    uint32_t client_ip;
+    uint16_t client_port;
+    uint8_t state;
+    uint8_t authenticated;
+    uint32_t idle;           // Ticks since the last segment
+    uint32_t queued;         // Bytes in the send buffer
+};
+
 // Network functions
 void net_init(void);
 void net_process_packet(uint8_t* packet, uint16_t length);
 void net_send_tcp(session_t* session, const char* data, uint16_t length);
+void net_session_print(void* session, const char* str);
+void net_session_flush(session_t* session);
+void net_tick(void);
+void net_get_stats(struct net_stats* stats);
+int net_set_limits(uint32_t max_sessions, uint32_t max_per_ip);
+int net_get_session_info(uint32_t index, struct net_session_info* info);
 session_t* net_get_session(uint32_t ip, uint16_t port);
 session_t* net_create_session(uint32_t ip, uint16_t port);
 
 // Checksum calculation
 uint16_t net_checksum(uint16_t* data, uint16_t length);
+uint16_t net_checksum_adjust(uint16_t checksum, uint16_t old_value, uint16_t new_value);
 
 #endif
@@ -2,26 +2,41 @@
  * ==============================================================================
  * UNIFIED OUTPUT SYSTEM
  * ==============================================================================
- * WHAT: Single print function that outputs to both VGA and serial
- * WHY: So remote users see the same output as local users
+ * WHAT: Single print function that outputs to both VGA and serial, or to
+ *       whatever sink it has been redirected to
+ * WHY: So remote users see the same output as local users - a command run
+ *      for a network session prints through the same calls as on the console
+ * HOW: output_print() hands each string to the current sink; with none set
+ *      it goes to the screen and COM1
+ * 
+ * NOTES:
+ * - There is one sink for the whole kernel. Tasks only switch when they
+ *   yield, so a redirect is safe as long as the code between
+ *   output_redirect() and output_restore() never sleeps
+ * - Sinks have the perf_print_t shape, so they can be passed to
+ *   perf_report() and the like directly
  */
 
 #ifndef OUTPUT_H
 #define OUTPUT_H
 
-#include "vga.h"
-#include "serial.h"
+#include <stdint.h>
+#include <stddef.h>
 
-/* Print to both VGA and serial */
-static inline void print(const char* str) {
-    vga_print(str);
-    serial_print(str);
-}
+/* Output function of a sink: ctx is passed through unchanged */
+typedef void (*output_fn_t)(void* ctx, const char* str);
 
-/* Print character to both outputs */
-static inline void putchar_dual(char c) {
-    vga_putchar(c);
-    serial_putchar(c);
-}
+struct output_sink {
+    output_fn_t print;       /* NULL = VGA and serial */
+    void* ctx;
+};
+
+/* Output functions */
+void output_init(void);
+void output_print(const char* str);
+void output_putchar(char c);
+void output_to(void* ctx, const char* str);  /* output_print() as a sink */
+void output_redirect(output_fn_t print, void* ctx, struct output_sink* saved);
+void output_restore(const struct output_sink* saved);
 
 #endif /* OUTPUT_H */
@@ -0,0 +1,79 @@
+/*
+ * ==============================================================================
+ * PERFORMANCE COUNTERS AND TRACING
+ * ==============================================================================
+ * WHAT: Event counters, latency histograms and a trace ring for the disk,
+ *       filesystem, NIC and page allocator, dumped by the 'info' command
+ * WHY: To see where time goes on a running box, locally or over telnet,
+ *      without attaching a debugger
+ * HOW: Times come from the TSC, converted with the rate timer_init()
+ *      measured; updates are a few instructions with interrupts off,
+ *      cheap enough to leave on
+ * 
+ * NOTES:
+ * - A histogram has one bucket per power of two microseconds
+ * - Tracing is off until 'info trace on'; the ring keeps the latest
+ *   PERF_TRACE_SIZE events
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+/* Counters */
+#define PERF_DISK_READ_SECTORS 0
+#define PERF_DISK_WRITE_SECTORS 1
+#define PERF_NET_RX 2               /* Frames queued for the stack */
+#define PERF_NET_TX 3               /* Frames handed to the NIC */
+#define PERF_NET_RX_DROPPED 4       /* Overflows and a full receive queue */
+#define PERF_NET_TX_DROPPED 5       /* No buffer in time, or too long */
+#define PERF_NET_TX_ERRORS 6        /* Underruns and aborts */
+#define PERF_PAGE_ALLOCS 7
+#define PERF_PAGE_FREES 8
+#define PERF_COUNTERS 9
+
+/* Latency histograms */
+#define PERF_DISK_READ 0            /* One disk_read_sectors() call */
+#define PERF_DISK_WRITE 1           /* One disk_write_sectors() call */
+#define PERF_XAEFS_SYNC 2           /* xaefs_sync() */
+#define PERF_XAEFS_COMMIT 3         /* Background group commit */
+#define PERF_HISTOGRAMS 4
+
+#define PERF_BUCKETS 24             /* Up to 2^23 us (8s); the last is open-ended */
+
+/* Trace events (the argument depends on the event) */
+#define TRACE_DISK_READ 0           /* LBA */
+#define TRACE_DISK_WRITE 1          /* LBA */
+#define TRACE_XAEFS_SYNC 2          /* Duration in us */
+#define TRACE_NET_RX 3              /* Frame length */
+#define TRACE_NET_TX 4              /* Frame length */
+#define TRACE_NET_DROP 5            /* Frame length, 0 if unknown */
+#define TRACE_EVENTS 6
+
+#define PERF_TRACE_SIZE 256         /* Events kept (power of two) */
+#define PERF_TRACE_SHOWN 32         /* Latest events 'info' prints */
+
+/* Output function for the report: ctx is passed through unchanged */
+typedef void (*perf_print_t)(void* ctx, const char* str);
+
+/*
+ * perf_clock() - Current TSC value, the start time for perf_record()
+ */
+static inline uint64_t perf_clock(void)
+{
+    uint32_t lo, hi;
+    
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Instrumentation functions */
+void perf_init(void);
+void perf_count(uint32_t counter, uint32_t n);
+uint32_t perf_record(uint32_t histogram, uint64_t start);
+void perf_trace(uint32_t event, uint32_t arg);
+void perf_set_tracing(int on);
+void perf_report(perf_print_t print, void* ctx);
+
+#endif /* PERF_H */
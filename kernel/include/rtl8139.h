@@ -22,10 +22,15 @@
 #define RTL8139_CMD_RESET  0x10
 #define RTL8139_CMD_RX_EN  0x08
 #define RTL8139_CMD_TX_EN  0x04
+#define RTL8139_CMD_BUFE   0x01  // Receive ring empty
 
 // Interrupt bits
 #define RTL8139_INT_ROK    0x01  // Receive OK
+#define RTL8139_INT_RER    0x02  // Receive error
 #define RTL8139_INT_TOK    0x04  // Transmit OK
+#define RTL8139_INT_TER    0x08  // Transmit error
+#define RTL8139_INT_RXOVW  0x10  // Receive ring overflow
+#define RTL8139_INT_FOVW   0x40  // Receive FIFO overflow
 
 // Receive config
 #define RTL8139_RCR_AAP    0x01  // Accept all packets
@@ -33,11 +38,37 @@
 #define RTL8139_RCR_AM     0x04  // Accept multicast
 #define RTL8139_RCR_AB     0x08  // Accept broadcast
 #define RTL8139_RCR_WRAP   0x80  // Wrap at end of buffer
+#define RTL8139_RCR_RBLEN_32K (2 << 11)  // 32KB + 16 byte receive ring
+
+// Transmit status (TSD) bits
+#define RTL8139_TSD_OWN    0x00002000  // Frame copied to the FIFO
+#define RTL8139_TSD_TUN    0x00004000  // FIFO underrun
+#define RTL8139_TSD_TOK    0x00008000  // Sent
+#define RTL8139_TSD_TABT   0x40000000  // Aborted
+
+// Transmit path
+#define RTL8139_TX_DESCRIPTORS 4     // Fixed by the hardware
+#define RTL8139_TX_BUFFERS 16        // Frame buffers: in flight, backlog or free
+#define RTL8139_TX_BUFFER_SIZE 1536
+#define RTL8139_TX_MAX_FRAME 1514    // Ethernet header + 1500, CRC added by the NIC
+#define RTL8139_TX_MIN_FRAME 60      // Shorter frames are padded
+
+// Receive path
+#define RTL8139_RX_RING_SIZE 32768  // Must match RCR_RBLEN
+#define RTL8139_RX_ROK     0x0001   // Packet header: received OK
+#define RTL8139_RX_MAX_FRAME 1518   // Largest Ethernet frame, CRC excluded
+#define RTL8139_RX_QUEUE   32       // Received frames waiting for the stack
+
+struct task;
 
 // RTL8139 driver
 void rtl8139_init(void);
 void rtl8139_send_packet(const uint8_t* data, uint16_t length);
+uint8_t* rtl8139_tx_alloc(void);
+int rtl8139_tx_submit(uint8_t* frame, uint16_t length);
 void rtl8139_handle_interrupt(void);
+void rtl8139_poll(void);
+void rtl8139_set_rx_task(struct task* task);
 uint8_t rtl8139_get_mac(uint8_t index);
 
 #endif
@@ -5,6 +5,13 @@
  * WHAT: Serial port communication for remote terminal access
  * WHY: Allows users to connect via telnet/minicom instead of QEMU window
  * HOW: Uses COM1 (I/O port 0x3F8) for communication
+ * 
+ * NOTES:
+ * - Output goes to a TX ring that the IRQ 4 handler feeds into the 16550
+ *   FIFO, so printing only waits for the UART when the ring is full
+ * - Received bytes are moved from the FIFO into an RX ring by the same
+ *   handler, so input typed during a long disk sync isn't lost
+ * - Without the IRQ both rings are serviced by polling instead
  */
 
 #ifndef SERIAL_H
@@ -14,6 +21,12 @@
 
 /* Serial port I/O addresses */
 #define COM1_PORT 0x3F8
+#define COM1_IRQ 4
+
+/* Software buffers (powers of two) */
+#define SERIAL_TX_RING 4096
+#define SERIAL_RX_RING 1024
+#define SERIAL_FIFO_SIZE 16         /* 16550 transmit FIFO depth */
 
 /* Initialize serial port */
 void serial_init(void);
@@ -27,6 +40,15 @@ int serial_can_read(void);
 /* Drain any pending RX bytes */
 void serial_flush_input(void);
 
+/* Wait until all queued output has left the UART */
+void serial_flush_output(void);
+
+/* Queue bytes for transmission without waiting */
+uint32_t serial_write(const char* buf, uint32_t len);
+
+/* Take one received byte without waiting (-1 if none) */
+int serial_read(void);
+
 /* Write a character to serial port */
 void serial_putchar(char c);
 
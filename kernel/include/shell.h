@@ -10,8 +10,15 @@
 #ifndef SHELL_H
 #define SHELL_H
 
+#define SHELL_PATH_SIZE 128         /* Longest working directory path */
+
+struct session;
+
 /* Initialize and run the shell */
 void shell_init(void);
 void shell_run(void);
 
+/* Run one command line for a network session (see net.c) */
+void shell_execute_command(const char* cmd, struct session* session);
+
 #endif /* SHELL_H */
@@ -0,0 +1,55 @@
+/*
+ * ==============================================================================
+ * SLAB OBJECT ALLOCATOR
+ * ==============================================================================
+ * WHAT: kmalloc()/kfree() and per-type object caches
+ * WHY: Without a heap every table is a fixed static array, sized for the
+ *      worst case and capped at compile time
+ * HOW: A cache hands out objects of one size, carved from 4KB slabs taken
+ *      from alloc_page(); each slab keeps a free list threaded through
+ *      its free objects and a bitmap of the ones handed out
+ * 
+ * NOTES:
+ * - Every slab starts with a small header, so kfree() finds the cache of
+ *   any object by rounding its address down to the page
+ * - kmalloc() uses power-of-two caches from 16 to 1024 bytes; bigger
+ *   requests get their own block of pages from alloc_pages() (a 2048
+ *   byte class would fit only one object per slab next to the header)
+ * - One empty slab per cache is kept as a spare; further empty slabs go
+ *   back to the page allocator
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Limits */
+#define KMEM_MAX_CACHES 24          /* Cache descriptors, kmalloc's included */
+#define KMALLOC_MAX_SIZE 1024       /* Largest size served from a slab */
+
+struct kmem_cache;
+
+/* Usage counters of one cache */
+struct kmem_cache_stats {
+    const char* name;
+    uint32_t object_size;    /* Bytes per object (rounded up) */
+    uint32_t per_slab;       /* Objects per 4KB slab */
+    uint32_t slabs;          /* Pages held, spare included */
+    uint32_t active;         /* Objects currently allocated */
+    uint32_t allocs;         /* Allocations since boot */
+    uint32_t frees;          /* Frees since boot */
+};
+
+/* Allocator functions */
+void slab_init(void);
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+void* kmalloc(uint32_t size);
+void kfree(void* ptr);
+uint32_t kmem_cache_count(void);
+int kmem_cache_get_stats(uint32_t index, struct kmem_cache_stats* stats);
+
+#endif /* SLAB_H */
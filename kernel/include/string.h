@@ -17,10 +17,12 @@
 size_t strlen(const char* str);
 void* memset(void* dest, int val, size_t len);
 void* memcpy(void* dest, const void* src, size_t len);
+void* memmove(void* dest, const void* src, size_t len);
 int memcmp(const void* s1, const void* s2, size_t n);
 int strcmp(const char* s1, const char* s2);
 int strncmp(const char* s1, const char* s2, size_t n);
 void strcpy(char* dest, const char* src);
 char* strtok(char* str, char delim);
+char* utoa(uint32_t value, char* buf);
 
 #endif /* STRING_H */
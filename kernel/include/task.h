@@ -0,0 +1,43 @@
+/*
+ * ==============================================================================
+ * COOPERATIVE TASK SCHEDULER
+ * ==============================================================================
+ * WHAT: Kernel tasks that take turns on the CPU
+ * WHY: With everything in one polling loop, waiting for a login kept the
+ *      network from running, and idle time was spent spinning
+ * HOW: Each task has its own stack and runs until it yields or sleeps;
+ *      then the next ready task is switched in, round-robin. When no task
+ *      is ready the CPU halts until the next interrupt.
+ * 
+ * NOTES:
+ * - Switches only happen inside task_yield(), task_sleep() and
+ *   task_wait(), so code between those calls needs no locking against
+ *   other tasks - only interrupt handlers can interleave with it
+ * - Filesystem and disk code never yields, so a task is never switched
+ *   out in the middle of a filesystem operation
+ * - sched_init() turns the boot stack into the first task
+ * - Sleeps are measured in timer ticks (TIMER_HZ per second)
+ */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <stdint.h>
+
+#define TASK_STACK_ORDER 2          /* 16KB stack per task */
+
+struct task;
+typedef void (*task_entry_t)(void* arg);
+
+/* Scheduler functions */
+void sched_init(const char* name);
+struct task* task_create(const char* name, task_entry_t entry, void* arg);
+struct task* task_current(void);
+void task_yield(void);
+void task_sleep(uint32_t ticks);
+void task_wait(void);
+void task_wake(struct task* task);
+void task_kill(struct task* task);
+void task_exit(void);
+
+#endif /* TASK_H */
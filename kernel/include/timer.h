@@ -0,0 +1,29 @@
+/*
+ * ==============================================================================
+ * PROGRAMMABLE INTERVAL TIMER (8253/8254)
+ * ==============================================================================
+ * WHAT: A periodic interrupt that counts time since boot
+ * WHY: Timeouts used to be counted in loop iterations, so they changed
+ *      with CPU speed and with how busy the loop was
+ * HOW: PIT channel 0 fires IRQ 0 TIMER_HZ times a second; the handler
+ *      only increments the tick counter
+ * 
+ * NOTES:
+ * - timer_init() also measures the CPU's time stamp counter against the
+ *   PIT, for timing shorter than a tick (see perf.h)
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_HZ 100                /* Ticks per second (10ms each) */
+#define PIT_FREQUENCY 1193182       /* Input clock of the PIT */
+
+/* Timer functions */
+void timer_init(void);
+uint32_t timer_ticks(void);
+uint32_t timer_tsc_mhz(void);
+
+#endif /* TIMER_H */
@@ -12,6 +12,8 @@
  *   Byte 0: ASCII character code
  *   Byte 1: Attribute (color: 4 bits background, 4 bits foreground)
  * - Memory address: 0xB8000 - 0xB8FA0
+ * - Output is drawn into a shadow copy in RAM and only the changed lines
+ *   are copied to VGA memory, once per call
  */
 
 #ifndef VGA_H
@@ -51,6 +53,7 @@ void vga_init(void);
 void vga_clear(void);
 void vga_putchar(char c);
 void vga_print(const char* str);
+void vga_write(const char* buf, uint32_t len);
 void vga_set_color(uint8_t fg, uint8_t bg);
 void vga_update_cursor(void);
 void vga_print_hex(uint32_t value);
@@ -10,12 +10,12 @@
  * - Simple and educational (not production-ready)
  * - Tree-based structure (like most filesystems)
  * - Fixed-size blocks for simplicity
- * - In-memory for now (we'll add disk I/O later)
+ * - Each file's data is one contiguous run (extent) of blocks
  * 
  * FILESYSTEM LAYOUT:
- * Block 0: Superblock (filesystem metadata)
- * Block 1-N: Inode table (file/directory metadata)
- * Block N+1-M: Data blocks (actual file contents)
+ * Sector 1: Superblock (filesystem metadata and where everything else is)
+ * Journal, inode table, tag table and free block bitmap (see xaefs.c)
+ * Data blocks (actual file contents) up to the size of the disk
  * 
  * UNIQUE FEATURES (what makes this YOUR filesystem):
  * 1. Node priority system - files can have priority levels
@@ -29,12 +29,26 @@
 #include <stdint.h>
 
 /* Filesystem constants */
+#define XAEFS_MAGIC 0x58414546      /* "XAEF" */
+#define XAEFS_VERSION 2             /* On-disk format written by this code */
 #define XAEFS_BLOCK_SIZE 4096       /* 4KB blocks (same as page size) */
-#define XAEFS_MAX_FILES 256         /* Max 256 files for now */
+#define XAEFS_MAX_FILES 256         /* Inodes held in memory (and formatted) */
+#define XAEFS_INODE_SIZE 128        /* Bytes per on-disk inode record */
 #define XAEFS_MAX_FILENAME 64       /* Max filename length */
 #define XAEFS_MAX_TAGS 8            /* Max tags per file */
 #define XAEFS_TAG_LENGTH 16         /* Max tag string length */
 
+/* Open modes for xaefs_open() */
+#define XAEFS_OPEN_READ   0x01
+#define XAEFS_OPEN_WRITE  0x02
+#define XAEFS_OPEN_CREATE 0x04      /* Create the file if it doesn't exist */
+#define XAEFS_OPEN_TRUNC  0x08      /* Discard existing contents */
+#define XAEFS_OPEN_APPEND 0x10      /* Start at end of file */
+
+/* Inode flags */
+#define XAEFS_FLAG_VERSION    0x01  /* Hidden snapshot of its parent file */
+#define XAEFS_FLAG_EXTENT_MAP 0x02  /* block_start is an extent map block */
+
 /* File types */
 enum xaefs_file_type {
     XAEFS_FILE_REGULAR = 0,
@@ -53,19 +67,35 @@ enum xaefs_priority {
 /*
  * Superblock - Filesystem metadata
  * 
- * WHAT: First block on disk, describes the entire filesystem
+ * WHAT: First sector after the bootloader, describes the entire filesystem
  * WHY: We need to know filesystem size, number of files, etc.
- * HOW: Stored at block 0, loaded into memory on mount
+ * HOW: Stored at sector 1, loaded into memory on mount
+ * 
+ * NOTE: Version 1 stopped after the label and had a fixed layout; the
+ *       fields after it let every table live anywhere on the disk.
  */
 struct xaefs_superblock {
-    uint32_t magic;                 /* 0x58414546 ("XAEF") - identifies our FS */
+    uint32_t magic;                 /* XAEFS_MAGIC - identifies our FS */
     uint32_t version;               /* Filesystem version */
     uint32_t block_size;            /* Size of each block */
-    uint32_t total_blocks;          /* Total blocks on disk */
+    uint32_t total_blocks;          /* Data blocks on the volume */
     uint32_t free_blocks;           /* Number of free blocks */
     uint32_t total_inodes;          /* Total inodes (files) */
     uint32_t free_inodes;           /* Number of free inodes */
     char label[32];                 /* Volume label (e.g., "My XAE Disk") */
+    
+    /* Version 2 layout (sector numbers and lengths) */
+    uint32_t inode_size;            /* Bytes per inode record */
+    uint32_t inode_table_sector;
+    uint32_t inode_table_sectors;
+    uint32_t tag_table_sector;      /* One tag record per inode */
+    uint32_t tag_table_sectors;
+    uint32_t bitmap_sector;         /* Free block bitmap */
+    uint32_t bitmap_sectors;
+    uint32_t journal_sector;        /* Metadata journal */
+    uint32_t journal_sectors;
+    uint32_t data_start_sector;     /* First sector of data block 0 */
+    uint32_t volume_sectors;        /* Disk size at format (IDENTIFY) */
 };
 
 /*
@@ -73,25 +103,38 @@ struct xaefs_superblock {
  * 
  * WHAT: Metadata about a single file or directory
  * WHY: We need to track file properties, location, size, etc.
- * HOW: One inode per file, stored in inode table
+ * HOW: One XAEFS_INODE_SIZE record per file, stored in the inode table
+ *      (4 per sector). The fields every lookup, read and write touches
+ *      fill the first 64 bytes (one cache line); the name is only
+ *      compared once its cached hash matches.
  * 
  * UNIQUE: We add priority, version, and tags!
  */
 struct xaefs_inode {
-    char name[XAEFS_MAX_FILENAME];  /* Filename */
     uint32_t inode_num;             /* Inode number (ID) */
     uint32_t parent_inode;          /* Parent directory inode */
     uint32_t size;                  /* File size in bytes */
-    uint32_t block_start;           /* First data block */
-    uint32_t block_count;           /* Number of blocks used */
+    uint32_t block_start;           /* First data block (or extent map) */
+    uint32_t block_count;           /* Blocks allocated (may exceed size) */
     uint8_t type;                   /* File type (regular, dir, etc.) */
     uint8_t priority;               /* File priority (UNIQUE!) */
     uint16_t version;               /* File version number (UNIQUE!) */
     uint32_t created_time;          /* Creation timestamp */
     uint32_t modified_time;         /* Last modification timestamp */
-    char tags[XAEFS_MAX_TAGS][XAEFS_TAG_LENGTH];  /* Custom tags (UNIQUE!) */
-    uint8_t tag_count;              /* Number of tags */
+    uint8_t tag_count;              /* Number of tags (see xaefs_tags) */
     uint8_t flags;                  /* Permission/special flags */
+    uint8_t reserved[30];           /* Pads the hot fields to 64 bytes */
+    char name[XAEFS_MAX_FILENAME];  /* Filename */
+};
+
+/*
+ * Tag record - The tags of one inode
+ * 
+ * WHY: Tags are only read by tag commands and listings, so they live in
+ *      their own table instead of making every inode 128 bytes bigger
+ */
+struct xaefs_tags {
+    char tags[XAEFS_MAX_TAGS][XAEFS_TAG_LENGTH];  /* Custom tags (UNIQUE!) */
 };
 
 /*
@@ -99,7 +142,7 @@ struct xaefs_inode {
  * 
  * WHAT: Represents an open file
  * WHY: Need to track position, mode, etc. for open files
- * HOW: Created when file is opened, destroyed when closed
+ * HOW: Allocated from a slab cache when a file is opened, freed when closed
  */
 struct xaefs_file {
     struct xaefs_inode* inode;      /* Pointer to file's inode */
@@ -114,26 +157,38 @@ void xaefs_format(const char* label);
 
 /* File operations */
 int xaefs_create(const char* path, uint8_t type, uint8_t priority);
+int xaefs_create_at(uint32_t dir, const char* name, uint8_t type, uint8_t priority);
 int xaefs_open(const char* path, uint8_t mode);
 int xaefs_close(int fd);
 int xaefs_read(int fd, void* buffer, uint32_t size);
 int xaefs_write(int fd, const void* buffer, uint32_t size);
 int xaefs_delete(const char* path);
 int xaefs_delete_in_dir(const char* name, const char* current_dir);
+int xaefs_delete_at(uint32_t dir, const char* name);
 
 /* Directory operations */
 int xaefs_mkdir(const char* path, uint8_t priority);
 int xaefs_list_dir(const char* path);
+int xaefs_list_dir_at(uint32_t dir, const char* label);
 int xaefs_set_parent(const char* filename, const char* parent_path);
 
+/* Path resolution (absolute paths, or relative to directory 'dir') */
+int xaefs_lookup(const char* path, uint32_t dir);  /* Inode number or -1 */
+uint8_t xaefs_is_directory(uint32_t inode_num);
+
 /* Unique features */
 int xaefs_set_priority(const char* path, uint8_t priority);
 int xaefs_add_tag(const char* path, const char* tag);
 int xaefs_create_version(const char* path);
+int xaefs_restore_version(const char* path, uint32_t number);
+int xaefs_list_versions(const char* path);
 void xaefs_find_by_tag(const char* tag);
+int xaefs_find_tags(const char* query, int priority);  /* "a+b,c", -1 = any priority */
 
 /* Disk persistence */
 void xaefs_sync(void);       /* Save filesystem to disk */
+void xaefs_commit(void);     /* Journal pending metadata changes */
+void xaefs_idle_tick(void);  /* Flush coalesced changes when idle */
 void xaefs_load(void);       /* Load filesystem from disk */
 uint8_t xaefs_is_loaded(void); /* Check if filesystem was loaded */
 
@@ -9,14 +9,59 @@
 
 #include "include/vga.h"
 #include "include/memory.h"
+#include "include/slab.h"
 #include "include/xaefs.h"
 #include "include/keyboard.h"
 #include "include/shell.h"
 #include "include/disk.h"
+#include "include/bcache.h"
 #include "include/serial.h"
+#include "include/output.h"
 #include "include/rtl8139.h"
 #include "include/net.h"
 #include "include/auth.h"
+#include "include/string.h"
+#include "include/interrupt.h"
+#include "include/timer.h"
+#include "include/task.h"
+#include "include/perf.h"
+
+/*
+ * network_task() - Runs the network stack
+ * 
+ * HOW: Sleeps until the NIC interrupt queues frames or the next tick.
+ *      net_tick() is called once for every tick that passed, so TCP
+ *      timers keep time even after a long disk sync held the CPU.
+ */
+static void network_task(void* arg)
+{
+    uint32_t last_tick = timer_ticks();
+    
+    (void)arg;
+    while (1) {
+        rtl8139_poll();
+        while (last_tick != timer_ticks()) {
+            last_tick++;
+            net_tick();
+        }
+        task_sleep(1);
+    }
+}
+
+/*
+ * flusher_task() - Background filesystem work
+ * 
+ * WHAT: Keeps the disk queue moving and group-commits coalesced changes
+ *       once the filesystem has been idle for a while
+ */
+static void flusher_task(void* arg)
+{
+    (void)arg;
+    while (1) {
+        xaefs_idle_tick();
+        task_sleep(1);
+    }
+}
 
 /*
  * kernel_main() - The first C function that runs
@@ -24,15 +69,24 @@
  * WHAT: This is where your OS starts after the bootloader
  * WHY: The bootloader is written in assembly and is limited. Here we can use C!
  * HOW: We'll initialize each subsystem one by one
+ * 
+ * PARAMS:
+ *   memory_map - BIOS E820 map collected by the bootloader
  */
-void kernel_main(void) 
+void kernel_main(const struct e820_map* memory_map) 
 {
+    char num[12];
+    
     /* Initialize display and serial */
     vga_init();
+    output_init();
     vga_clear();
     vga_print("KERNEL STARTED!\n");
     
+    interrupts_init();  /* IDT and PIC, before any driver takes an IRQ */
     serial_init();
+    timer_init();
+    perf_init();            /* Before any counted event */
     
     /* Welcome messages */
     vga_clear();
@@ -40,12 +94,19 @@ void kernel_main(void)
     vga_print("==============================\n");
     
     /* Initialize subsystems */
-    memory_init();
-    vga_print("Memory initialized\n");
+    memory_init(memory_map);
+    slab_init();
+    sched_init("console");  /* This stack becomes the local console task */
+    vga_print("Memory initialized (");
+    vga_print(utoa(get_total_memory() / (1024 * 1024), num));
+    vga_print(" MB usable)\n");
     
     disk_init();
     vga_print("Disk initialized\n");
     
+    bcache_init();  /* Needs memory_init() for its pages */
+    vga_print("Buffer cache initialized\n");
+    
     /* Initialize networking */
     vga_print("\n--- Network Initialization ---\n");
     rtl8139_init();
@@ -71,7 +132,13 @@ void kernel_main(void)
     keyboard_init();
     shell_init();
     
-    /* Run the shell - it will handle both keyboard and network */
+    /* Background tasks; they start once the console first waits for input */
+    rtl8139_set_rx_task(task_create("net", network_task, NULL));
+    task_create("flusher", flusher_task, NULL);
+    
+    interrupts_enable();
+    
+    /* Run the shell - the console task handles keyboard and serial input */
     shell_run();
     
     /* Should never reach here */
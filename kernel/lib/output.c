@@ -0,0 +1,81 @@
+/*
+ * ==============================================================================
+ * UNIFIED OUTPUT SYSTEM IMPLEMENTATION
+ * ==============================================================================
+ */
+
+#include "include/output.h"
+#include "include/vga.h"
+#include "include/serial.h"
+
+static struct output_sink sink;     /* print NULL: the console */
+
+/*
+ * output_init() - Start out on the console
+ */
+void output_init(void)
+{
+    sink.print = NULL;
+    sink.ctx = NULL;
+}
+
+/*
+ * output_print() - Print a string to the current sink
+ */
+void output_print(const char* str)
+{
+    if (sink.print) {
+        sink.print(sink.ctx, str);
+        return;
+    }
+    
+    vga_print(str);
+    serial_print(str);
+}
+
+/*
+ * output_putchar() - Print one character to the current sink
+ */
+void output_putchar(char c)
+{
+    char str[2];
+    
+    if (!sink.print) {
+        vga_putchar(c);
+        serial_putchar(c);
+        return;
+    }
+    
+    str[0] = c;
+    str[1] = '\0';
+    sink.print(sink.ctx, str);
+}
+
+/*
+ * output_to() - output_print() in the sink shape, for report functions
+ */
+void output_to(void* ctx, const char* str)
+{
+    (void)ctx;
+    output_print(str);
+}
+
+/*
+ * output_redirect() - Send all output to print(ctx, str) until restored
+ * 
+ * WHAT: The previous sink is stored in *saved for output_restore()
+ */
+void output_redirect(output_fn_t print, void* ctx, struct output_sink* saved)
+{
+    *saved = sink;
+    sink.print = print;
+    sink.ctx = ctx;
+}
+
+/*
+ * output_restore() - Go back to the sink output_redirect() replaced
+ */
+void output_restore(const struct output_sink* saved)
+{
+    sink = *saved;
+}
@@ -0,0 +1,258 @@
+/*
+ * ==============================================================================
+ * PERFORMANCE COUNTERS AND TRACING IMPLEMENTATION
+ * ==============================================================================
+ */
+
+#include "include/perf.h"
+#include "include/timer.h"
+#include "include/memory.h"
+#include "include/interrupt.h"
+#include "include/string.h"
+
+struct perf_histogram {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t buckets[PERF_BUCKETS];  /* Bucket b: below 2^b us */
+};
+
+struct trace_event {
+    uint32_t time_us;        /* Since perf_init(), wraps after 71 minutes */
+    uint32_t event;
+    uint32_t arg;
+};
+
+static uint32_t perf_counters[PERF_COUNTERS];
+static struct perf_histogram histograms[PERF_HISTOGRAMS];
+static struct trace_event trace_ring[PERF_TRACE_SIZE];
+static uint32_t trace_next;         /* Events recorded since tracing began */
+static uint8_t tracing;
+static uint64_t boot_clock;
+
+static const char* counter_names[PERF_COUNTERS] = {
+    "Disk sectors read:    ",
+    "Disk sectors written: ",
+    "Frames received:      ",
+    "Frames sent:          ",
+    "RX dropped:           ",
+    "TX dropped:           ",
+    "TX errors:            ",
+    "Page allocations:     ",
+    "Page frees:           "
+};
+
+static const char* histogram_names[PERF_HISTOGRAMS] = {
+    "disk read", "disk write", "xaefs sync", "xaefs commit"
+};
+
+static const char* event_names[TRACE_EVENTS] = {
+    "disk-read", "disk-write", "sync", "net-rx", "net-tx", "net-drop"
+};
+
+/*
+ * div64() - 64 by 32 bit division, result clamped to 32 bits
+ * 
+ * WHY: gcc turns a 64-bit '/' into a call to libgcc, which we don't link
+ * HOW: Two DIVL steps, high word first
+ */
+static uint32_t div64(uint64_t n, uint32_t d)
+{
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t q, r;
+    
+    if (hi >= d) return 0xFFFFFFFF;
+    
+    __asm__ ("divl %4" : "=a"(q), "=d"(r) : "a"(lo), "d"(hi), "rm"(d));
+    return q;
+}
+
+/*
+ * cycles_to_us() - Convert a TSC difference to microseconds
+ */
+static uint32_t cycles_to_us(uint64_t cycles)
+{
+    return div64(cycles, timer_tsc_mhz());
+}
+
+/*
+ * perf_init() - Clear everything and start the trace clock
+ * 
+ * WHY: Must be called after timer_init(), which measures the TSC rate
+ */
+void perf_init(void)
+{
+    memset(perf_counters, 0, sizeof(perf_counters));
+    memset(histograms, 0, sizeof(histograms));
+    trace_next = 0;
+    tracing = 0;
+    boot_clock = perf_clock();
+}
+
+/*
+ * perf_count() - Add to a counter
+ * 
+ * NOTE: Called from interrupt handlers too, hence the critical section
+ */
+void perf_count(uint32_t counter, uint32_t n)
+{
+    uint32_t flags = irq_save();
+    
+    perf_counters[counter] += n;
+    irq_restore(flags);
+}
+
+/*
+ * perf_record() - Add the time since start to a histogram
+ * RETURNS: The time in microseconds, for a trace event
+ * 
+ * NOTE: Interrupts are off for the update, as in perf_count(), so a
+ *       handler may record into a histogram too
+ */
+uint32_t perf_record(uint32_t histogram, uint64_t start)
+{
+    struct perf_histogram* h = &histograms[histogram];
+    uint32_t us = cycles_to_us(perf_clock() - start);
+    uint32_t bucket = 0;
+    uint32_t flags;
+    
+    while (bucket < PERF_BUCKETS - 1 && us >= (1u << bucket)) {
+        bucket++;
+    }
+    
+    flags = irq_save();
+    h->count++;
+    h->total_us += us;
+    if (us > h->max_us) h->max_us = us;
+    h->buckets[bucket]++;
+    irq_restore(flags);
+    
+    return us;
+}
+
+/*
+ * perf_trace() - Record an event in the trace ring, if tracing is on
+ * 
+ * NOTE: Called from interrupt handlers too, hence the critical section
+ */
+void perf_trace(uint32_t event, uint32_t arg)
+{
+    struct trace_event* e;
+    uint32_t flags;
+    
+    if (!tracing) return;
+    
+    flags = irq_save();
+    e = &trace_ring[trace_next & (PERF_TRACE_SIZE - 1)];
+    e->time_us = cycles_to_us(perf_clock() - boot_clock);
+    e->event = event;
+    e->arg = arg;
+    trace_next++;
+    irq_restore(flags);
+}
+
+/*
+ * perf_set_tracing() - Turn the trace ring on (emptied first) or off
+ */
+void perf_set_tracing(int on)
+{
+    if (on && !tracing) trace_next = 0;
+    tracing = on ? 1 : 0;
+}
+
+/*
+ * print_value() - Print a label, a number and a line break
+ */
+static void print_value(perf_print_t print, void* ctx, const char* label, uint32_t value)
+{
+    char num[12];
+    
+    print(ctx, label);
+    print(ctx, utoa(value, num));
+    print(ctx, "\n");
+}
+
+/*
+ * print_histogram() - One summary line and the non-empty buckets
+ */
+static void print_histogram(perf_print_t print, void* ctx, uint32_t index)
+{
+    struct perf_histogram* h = &histograms[index];
+    char num[12];
+    uint32_t b;
+    
+    print(ctx, "  ");
+    print(ctx, histogram_names[index]);
+    print(ctx, ": ");
+    print(ctx, utoa(h->count, num));
+    if (h->count == 0) {
+        print(ctx, "\n");
+        return;
+    }
+    print(ctx, " calls, avg ");
+    print(ctx, utoa(div64(h->total_us, h->count), num));
+    print(ctx, " us, max ");
+    print(ctx, utoa(h->max_us, num));
+    print(ctx, " us\n   ");
+    
+    for (b = 0; b < PERF_BUCKETS; b++) {
+        if (h->buckets[b] == 0) continue;
+        
+        print(ctx, b == PERF_BUCKETS - 1 ? " >=" : " <");
+        print(ctx, utoa(b == PERF_BUCKETS - 1 ? 1u << (b - 1) : 1u << b, num));
+        print(ctx, ":");
+        print(ctx, utoa(h->buckets[b], num));
+    }
+    print(ctx, "\n");
+}
+
+/*
+ * perf_report() - Print every counter, histogram and the latest events
+ * 
+ * WHAT: The body of the 'info' command
+ * HOW: Everything goes through print(ctx, ...), so the same report can
+ *      go to the console or into a network session
+ */
+void perf_report(perf_print_t print, void* ctx)
+{
+    char num[12];
+    uint32_t i;
+    
+    print(ctx, "\nSystem:\n");
+    print_value(print, ctx, "  Uptime (s):           ", timer_ticks() / TIMER_HZ);
+    print_value(print, ctx, "  TSC (MHz):            ", timer_tsc_mhz());
+    print_value(print, ctx, "  Free pages:           ", get_free_memory() / PAGE_SIZE);
+    
+    print(ctx, "\nCounters:\n");
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        print(ctx, "  ");
+        print_value(print, ctx, counter_names[i], perf_counters[i]);
+    }
+    
+    print(ctx, "\nLatency (us, per power of two):\n");
+    for (i = 0; i < PERF_HISTOGRAMS; i++) {
+        print_histogram(print, ctx, i);
+    }
+    
+    print(ctx, "\nTrace: ");
+    if (!tracing) {
+        print(ctx, "off ('info trace on' to start)\n");
+        return;
+    }
+    print(ctx, utoa(trace_next, num));
+    print(ctx, " events\n");
+    
+    i = trace_next > PERF_TRACE_SHOWN ? trace_next - PERF_TRACE_SHOWN : 0;
+    for (; i != trace_next; i++) {
+        struct trace_event* e = &trace_ring[i & (PERF_TRACE_SIZE - 1)];
+        
+        print(ctx, "  ");
+        print(ctx, utoa(e->time_us, num));
+        print(ctx, " us ");
+        print(ctx, e->event < TRACE_EVENTS ? event_names[e->event] : "?");
+        print(ctx, " ");
+        print(ctx, utoa(e->arg, num));
+        print(ctx, "\n");
+    }
+}
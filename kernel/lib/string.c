@@ -22,40 +22,139 @@ size_t strlen(const char* str)
     return len;
 }
 
+/* 32-bit load/store that is allowed to alias any other type */
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#define STRING_SMALL 16             /* Below this, byte loops win */
+
 /*
  * memset() - Fill memory with a value
  * 
  * WHAT: Set all bytes in a memory region to a specific value
  * WHY: Useful for clearing memory or initializing buffers
- * HOW: Loop through and set each byte
+ * HOW: Byte stores up to a 4-byte aligned destination, "rep stosl" with
+ *      the byte repeated four times for the bulk, bytes for the tail.
+ *      Aligned lengths (sectors, pages) skip straight to the stosl.
  */
 void* memset(void* dest, int val, size_t len) 
 {
     uint8_t* d = (uint8_t*)dest;
-    size_t i;
+    uint32_t pattern = (uint8_t)val * 0x01010101u;
+    size_t words;
     
-    for (i = 0; i < len; i++) {
-        d[i] = (uint8_t)val;
+    if (len >= STRING_SMALL) {
+        while ((uintptr_t)d & 3) {
+            *d++ = (uint8_t)val;
+            len--;
+        }
+        
+        words = len / 4;
+        __asm__ volatile ("rep stosl"
+                          : "+D"(d), "+c"(words)
+                          : "a"(pattern)
+                          : "memory");
+        len &= 3;
+    }
+    
+    while (len > 0) {
+        *d++ = (uint8_t)val;
+        len--;
     }
     
     return dest;
 }
 
+/*
+ * copy_forward() - Copy low to high addresses
+ * 
+ * WHAT: The shared body of memcpy() and the non-overlapping memmove() case
+ * HOW: Align the destination with byte moves, then "rep movsl" for the
+ *      bulk and "rep movsb" for up to 3 tail bytes. When both pointers
+ *      and the length are already multiples of 4 - every sector and page
+ *      copy - there is no head or tail at all.
+ */
+static void copy_forward(uint8_t* d, const uint8_t* s, size_t len)
+{
+    size_t words;
+    
+    if (len >= STRING_SMALL && (((uintptr_t)d | (uintptr_t)s | len) & 3) != 0) {
+        while ((uintptr_t)d & 3) {
+            *d++ = *s++;
+            len--;
+        }
+    } else if (len < STRING_SMALL) {
+        while (len > 0) {
+            *d++ = *s++;
+            len--;
+        }
+        return;
+    }
+    
+    words = len / 4;
+    len &= 3;
+    __asm__ volatile ("rep movsl"
+                      : "+D"(d), "+S"(s), "+c"(words)
+                      :
+                      : "memory");
+    if (len > 0) {
+        __asm__ volatile ("rep movsb"
+                          : "+D"(d), "+S"(s), "+c"(len)
+                          :
+                          : "memory");
+    }
+}
+
 /*
  * memcpy() - Copy memory from source to destination
  * 
  * WHAT: Copy bytes from one memory location to another
  * WHY: Fundamental operation for moving data around
- * HOW: Copy byte by byte
+ * HOW: A 32-bit string move (see copy_forward())
  */
 void* memcpy(void* dest, const void* src, size_t len) 
+{
+    copy_forward((uint8_t*)dest, (const uint8_t*)src, len);
+    return dest;
+}
+
+/*
+ * memmove() - Copy memory between regions that may overlap
+ * 
+ * WHAT: Like memcpy, but safe when source and destination overlap
+ * WHY: Needed to shift array elements in place
+ * HOW: A forward string move is safe when the destination is below the
+ *      source (or they don't overlap). Otherwise copy backwards with the
+ *      direction flag set: whole words from the end, then the 0-3 bytes
+ *      left at the start.
+ */
+void* memmove(void* dest, const void* src, size_t len) 
 {
     uint8_t* d = (uint8_t*)dest;
     const uint8_t* s = (const uint8_t*)src;
-    size_t i;
     
-    for (i = 0; i < len; i++) {
-        d[i] = s[i];
+    if (d <= s || d >= s + len) {
+        copy_forward(d, s, len);
+        return dest;
+    }
+    
+    size_t words = len / 4;
+    size_t bytes = len & 3;
+    
+    if (words > 0) {
+        uint8_t* dw = d + len - 4;
+        const uint8_t* sw = s + len - 4;
+        
+        __asm__ volatile ("std\n\t"
+                          "rep movsl\n\t"
+                          "cld"
+                          : "+D"(dw), "+S"(sw), "+c"(words)
+                          :
+                          : "memory");
+    }
+    
+    while (bytes > 0) {
+        bytes--;
+        d[bytes] = s[bytes];
     }
     
     return dest;
@@ -66,19 +165,28 @@ void* memcpy(void* dest, const void* src, size_t len)
  * 
  * WHAT: Compare bytes in two memory locations
  * WHY: To check if memory regions are equal
- * HOW: Compare byte by byte, return difference
+ * HOW: Skip equal 32-bit words (x86 allows unaligned loads), then find
+ *      the first differing byte within the word that differs
  * RETURNS: 0 if equal, <0 if s1 < s2, >0 if s1 > s2
  */
 int memcmp(const void* s1, const void* s2, size_t n) 
 {
     const uint8_t* p1 = (const uint8_t*)s1;
     const uint8_t* p2 = (const uint8_t*)s2;
-    size_t i;
     
-    for (i = 0; i < n; i++) {
-        if (p1[i] != p2[i]) {
-            return p1[i] - p2[i];
+    while (n >= 4 && *(const word_t*)p1 == *(const word_t*)p2) {
+        p1 += 4;
+        p2 += 4;
+        n -= 4;
+    }
+    
+    while (n > 0) {
+        if (*p1 != *p2) {
+            return *p1 - *p2;
         }
+        p1++;
+        p2++;
+        n--;
     }
     
     return 0;
@@ -183,3 +291,30 @@ char* strtok(char* str, char delim)
     
     return start;
 }
+
+/*
+ * utoa() - Convert an unsigned number to a decimal string
+ * 
+ * WHAT: Format value as decimal digits into buf
+ * WHY: Sizes and counters need printing, and we have no printf
+ * HOW: Emit digits in reverse, then flip them around
+ * RETURNS: buf (needs room for 11 chars)
+ */
+char* utoa(uint32_t value, char* buf)
+{
+    char tmp[10];
+    uint32_t len = 0;
+    uint32_t i;
+    
+    do {
+        tmp[len++] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    
+    for (i = 0; i < len; i++) {
+        buf[i] = tmp[len - 1 - i];
+    }
+    buf[len] = '\0';
+    
+    return buf;
+}
@@ -6,79 +6,378 @@
 
 #include "include/memory.h"
 #include "include/string.h"
+#include "include/perf.h"
 
-/* Memory bitmap 
- * WHY: Each bit represents one 4KB page (1=used, 0=free)
- * SIZE: 32MB / 4KB = 8192 pages = 8192 bits = 1024 bytes */
-static uint8_t memory_bitmap[NUM_PAGES / 8];
+#define MEMORY_LOW_PAGES ((1024 * 1024) / PAGE_SIZE)  /* Pages below 1MB */
+#define MEMORY_MAX_RESERVED 8       /* Ranges kept out of the free lists */
+#define KERNEL_STACK_TOP 0x90000    /* Set by entry.asm */
+#define KERNEL_STACK_SIZE 0x10000   /* Reserved below it */
+
+/* Image bounds from linker.ld */
+extern uint8_t _kernel_start[];
+extern uint8_t _kernel_end[];
+
+/* Page state
+ * WHY: One byte per 4KB page tells whether it starts a free block, starts
+ *      an allocated block, or lies inside one - enough to find buddies and
+ *      catch bad frees without scanning
+ * SIZE: One byte per page up to the end of the highest usable E820 range
+ *       (8KB for 32MB), carved by memory_init() out of the first usable
+ *       range above 1MB with room for it */
+#define PAGE_INSIDE 0xFF            /* Not the first page of a block */
+#define PAGE_ALLOCATED 0x80         /* Flag on the first page of an allocated block */
+static uint8_t* page_state;         /* Block head: order (| PAGE_ALLOCATED) */
+static uint32_t total_pages;        /* Pages covered by page_state */
+
+/* A free block; the links live in the first bytes of the block itself */
+struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+};
+
+/* One list of free blocks per order */
+static struct free_block* free_lists[MAX_ORDER + 1];
+
+/* Page ranges that are never freed, whatever the BIOS map says */
+struct page_range {
+    uint32_t first;
+    uint32_t end;                   /* One past the last page */
+};
+static struct page_range reserved[MEMORY_MAX_RESERVED];
+static uint32_t reserved_count;
 
 /* Statistics */
+static uint32_t usable_pages = 0;   /* Pages handed to the free lists at init */
 static uint32_t pages_used = 0;
 
 /*
- * set_page_used() - Mark a page as used in bitmap
+ * page_number() / page_address() - Convert between addresses and page numbers
+ */
+static uint32_t page_number(const void* addr)
+{
+    return (uint32_t)addr / PAGE_SIZE;
+}
+
+static struct free_block* page_address(uint32_t page_num)
+{
+    return (struct free_block*)(page_num * PAGE_SIZE);
+}
+
+/*
+ * list_add() - Put a free block on the list for its order
+ * 
+ * WHAT: Mark the block's first page free with its order and link it in
+ * HOW: Push at the head - O(1)
+ */
+static void list_add(uint32_t page_num, uint32_t order)
+{
+    struct free_block* block = page_address(page_num);
+    
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (block->next) block->next->prev = block;
+    free_lists[order] = block;
+    
+    page_state[page_num] = order;
+}
+
+/*
+ * list_remove() - Take a free block off its list
+ * 
+ * HOW: The list is doubly linked, so any block unlinks in O(1)
+ */
+static void list_remove(uint32_t page_num, uint32_t order)
+{
+    struct free_block* block = page_address(page_num);
+    
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if (block->next) block->next->prev = block->prev;
+    
+    page_state[page_num] = PAGE_INSIDE;
+}
+
+/*
+ * release_block() - Return a block to the free lists, merging buddies
+ * 
+ * WHAT: The heart of freeing
+ * HOW: A block's buddy is the neighbour it was split from (page number
+ *      XOR block size). While the buddy is also free and of the same
+ *      order, unlink it and continue with the merged block one order up.
+ */
+static void release_block(uint32_t page_num, uint32_t order)
+{
+    while (order < MAX_ORDER) {
+        uint32_t buddy = page_num ^ (1u << order);
+        
+        if (buddy >= total_pages || page_state[buddy] != order) break;
+        
+        list_remove(buddy, order);
+        page_state[page_num] = PAGE_INSIDE;
+        page_num &= ~(1u << order);  /* The lower of the two heads the merged block */
+        order++;
+    }
+    
+    list_add(page_num, order);
+}
+
+/*
+ * free_range() - Hand a range of pages to the allocator
+ * 
+ * WHAT: Used at init for every usable stretch of RAM
+ * HOW: Carve the range into the largest naturally aligned blocks that fit
+ */
+static void free_range(uint32_t first, uint32_t end)
+{
+    while (first < end) {
+        uint32_t order = 0;
+        
+        while (order < MAX_ORDER &&
+               (first & ((2u << order) - 1)) == 0 &&
+               first + (2u << order) <= end) {
+            order++;
+        }
+        
+        list_add(first, order);
+        first += 1u << order;
+    }
+}
+
+/*
+ * free_usable() - Free a usable range, minus the reserved ranges in it
  * 
- * WHAT: Set the bit for a specific page to 1
- * WHY: To track which pages are allocated
- * HOW: Calculate byte and bit position, use OR to set bit
+ * HOW: Free the stretch up to the next reserved range, jump past that
+ *      range, and repeat
  */
-static void set_page_used(uint32_t page_num) 
+static void free_usable(uint32_t first, uint32_t end)
 {
-    uint32_t byte = page_num / 8;       /* Which byte in bitmap */
-    uint32_t bit = page_num % 8;        /* Which bit in that byte */
-    memory_bitmap[byte] |= (1 << bit);  /* Set the bit to 1 */
+    while (first < end) {
+        uint32_t stop = end;
+        uint32_t skip = 0;
+        uint32_t i;
+        
+        for (i = 0; i < reserved_count; i++) {
+            if (first >= reserved[i].first && first < reserved[i].end) {
+                skip = reserved[i].end;
+            } else if (reserved[i].first > first && reserved[i].first < stop) {
+                stop = reserved[i].first;
+            }
+        }
+        
+        if (skip) {
+            first = skip;
+            continue;
+        }
+        
+        free_range(first, stop);
+        usable_pages += stop - first;
+        first = stop;
+    }
 }
 
 /*
- * set_page_free() - Mark a page as free in bitmap
+ * reserve() - Keep a byte range out of the free lists
  * 
- * WHAT: Set the bit for a specific page to 0
- * WHY: To mark pages as available for allocation
- * HOW: Calculate byte and bit position, use AND with NOT to clear bit
+ * HOW: Rounded outwards to whole pages
  */
-static void set_page_free(uint32_t page_num) 
+static void reserve(uint32_t start, uint32_t end)
 {
-    uint32_t byte = page_num / 8;
-    uint32_t bit = page_num % 8;
-    memory_bitmap[byte] &= ~(1 << bit);  /* Clear the bit to 0 */
+    if (reserved_count == MEMORY_MAX_RESERVED) return;
+    
+    reserved[reserved_count].first = start / PAGE_SIZE;
+    reserved[reserved_count].end = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+    reserved_count++;
 }
 
 /*
- * is_page_used() - Check if a page is used
+ * usable_range() - Page range of one E820 entry
  * 
- * WHAT: Read the bit for a specific page
- * WHY: To check availability before allocating
- * HOW: Calculate position and use AND to test bit
- * RETURNS: 1 if used, 0 if free
+ * HOW: Rounded inwards to whole pages and cut off at 4GB, which is all a
+ *      32-bit kernel can address
+ * RETURNS: 1 if the entry is usable RAM with at least one whole page
  */
-static int is_page_used(uint32_t page_num) 
+static int usable_range(const struct e820_entry* entry, uint32_t* first, uint32_t* end)
 {
-    uint32_t byte = page_num / 8;
-    uint32_t bit = page_num % 8;
-    return (memory_bitmap[byte] & (1 << bit)) != 0;
+    uint64_t start = entry->base;
+    uint64_t stop = entry->base + entry->length;
+    
+    if (entry->type != E820_USABLE || !(entry->acpi & 1)) return 0;
+    
+    if (stop > 0x100000000ULL) stop = 0x100000000ULL;
+    if (start >= stop) return 0;
+    
+    *first = (uint32_t)((start + PAGE_SIZE - 1) / PAGE_SIZE);
+    *end = (uint32_t)(stop / PAGE_SIZE);
+    return *first < *end;
 }
 
 /*
  * memory_init() - Initialize memory manager
  * 
- * WHAT: Set up the page bitmap and mark kernel memory as used
+ * WHAT: Size the allocator from the BIOS map and free all usable RAM
  * WHY: Must be called before any memory allocation
- * HOW: Clear bitmap, then mark first 1MB as used (kernel code lives there)
+ * HOW: 1. The highest usable page sets the size of the page state array,
+ *         which goes into the first usable range above 1MB that fits it
+ *         (outside the kernel image)
+ *      2. The low page (IVT, BIOS data, this map), the kernel image and
+ *         stack, VGA memory and ROM, and the state array are reserved
+ *      3. Every usable entry is freed into the buddy lists, with the
+ *         reserved ranges cut out
+ *      Without a map (count 0), MEMORY_DEFAULT_SIZE of RAM is assumed.
  */
-void memory_init(void) 
+void memory_init(const struct e820_map* map) 
 {
+    static struct e820_map fallback;
+    struct page_range ranges[E820_MAX_ENTRIES];
+    uint32_t count = 0;
+    uint32_t first, end;
+    uint32_t state_pages;
+    uint32_t kernel_first_page = (uint32_t)_kernel_start / PAGE_SIZE;
+    uint32_t kernel_end_page = ((uint32_t)_kernel_end + PAGE_SIZE - 1) / PAGE_SIZE;
     uint32_t i;
     
-    /* Clear entire bitmap (mark all pages as free) */
-    memset(memory_bitmap, 0, sizeof(memory_bitmap));
+    if (!map || map->count == 0) {
+        /* Same as before the map existed: everything above 1MB */
+        fallback.count = 1;
+        fallback.entries[0].base = 1024 * 1024;
+        fallback.entries[0].length = MEMORY_DEFAULT_SIZE - 1024 * 1024;
+        fallback.entries[0].type = E820_USABLE;
+        fallback.entries[0].acpi = 1;
+        map = &fallback;
+    }
+    
+    for (i = 0; i <= MAX_ORDER; i++) {
+        free_lists[i] = NULL;
+    }
+    total_pages = 0;
+    usable_pages = 0;
+    pages_used = 0;
+    reserved_count = 0;
+    page_state = NULL;
+    
+    /* Usable ranges sorted by start, overlapping ones merged, so no page
+     * is freed twice even if the BIOS reports overlapping entries */
+    for (i = 0; i < map->count && i < E820_MAX_ENTRIES; i++) {
+        uint32_t j;
+        
+        if (!usable_range(&map->entries[i], &first, &end)) continue;
+        
+        for (j = count; j > 0 && ranges[j - 1].first > first; j--) {
+            ranges[j] = ranges[j - 1];
+        }
+        ranges[j].first = first;
+        ranges[j].end = end;
+        count++;
+    }
+    for (i = 1; i < count; ) {
+        if (ranges[i].first <= ranges[i - 1].end) {
+            uint32_t j;
+            
+            if (ranges[i].end > ranges[i - 1].end) ranges[i - 1].end = ranges[i].end;
+            for (j = i + 1; j < count; j++) {
+                ranges[j - 1] = ranges[j];
+            }
+            count--;
+        } else {
+            i++;
+        }
+    }
+    if (count == 0) return;
+    total_pages = ranges[count - 1].end;
+    
+    /* Place the state array (one byte per page), past the kernel image
+     * if the range starts with it - the kernel is loaded at 1MB */
+    state_pages = (total_pages + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (i = 0; i < count; i++) {
+        first = ranges[i].first < MEMORY_LOW_PAGES ? MEMORY_LOW_PAGES : ranges[i].first;
+        if (first < kernel_end_page && first + state_pages > kernel_first_page) {
+            first = kernel_end_page;
+        }
+        if (first + state_pages <= ranges[i].end) {
+            page_state = (uint8_t*)page_address(first);
+            break;
+        }
+    }
+    if (!page_state) {
+        total_pages = 0;  /* No RAM above 1MB: nothing to allocate from */
+        return;
+    }
+    
+    memset(page_state, PAGE_INSIDE, total_pages);
+    
+    reserve(0, PAGE_SIZE);
+    reserve((uint32_t)_kernel_start, (uint32_t)_kernel_end);
+    reserve(KERNEL_STACK_TOP - KERNEL_STACK_SIZE, KERNEL_STACK_TOP);
+    reserve(0xA0000, 0x100000);  /* VGA memory, option and BIOS ROMs */
+    reserve((uint32_t)page_state, (uint32_t)page_state + state_pages * PAGE_SIZE);
+    
+    for (i = 0; i < count; i++) {
+        free_usable(ranges[i].first, ranges[i].end);
+    }
+}
+
+/*
+ * alloc_pages() - Allocate 2^order physically contiguous pages
+ * 
+ * WHAT: Get a block of 4KB << order bytes, aligned to its own size
+ * WHY: The buffer cache, DMA buffers and RX rings need contiguous memory
+ * HOW: Take a block from the smallest non-empty list at or above the
+ *      order, splitting it in halves and freeing the upper halves until
+ *      it is the right size - at most MAX_ORDER steps
+ * RETURNS: Pointer to the first page, or NULL if no block is big enough
+ */
+void* alloc_pages(uint32_t order)
+{
+    uint32_t current = order;
+    uint32_t page_num;
+    
+    if (order > MAX_ORDER) return NULL;
+    
+    while (current <= MAX_ORDER && free_lists[current] == NULL) {
+        current++;
+    }
+    if (current > MAX_ORDER) return NULL;  /* No free pages available */
+    
+    page_num = page_number(free_lists[current]);
+    list_remove(page_num, current);
+    
+    while (current > order) {
+        current--;
+        list_add(page_num + (1u << current), current);
+    }
+    
+    page_state[page_num] = PAGE_ALLOCATED | order;
+    pages_used += 1u << order;
+    perf_count(PERF_PAGE_ALLOCS, 1);
+    
+    return page_address(page_num);
+}
+
+/*
+ * free_pages() - Free a block from alloc_pages()
+ * 
+ * WHAT: Give back 2^order pages starting at addr
+ * HOW: Ignored unless addr really starts an allocated block of that order,
+ *      so a double or mismatched free can't corrupt the lists
+ */
+void free_pages(void* addr, uint32_t order)
+{
+    uint32_t page_num = page_number(addr);
     
-    /* Mark first 1MB as used (bootloader, kernel, VGA memory, etc.)
-     * WHY: Our kernel is loaded at 0x10000 (64KB) and grows from there
-     *      Also protects BIOS data area, VGA buffer, etc. */
-    for (i = 0; i < (1024 * 1024) / PAGE_SIZE; i++) {
-        set_page_used(i);
-        pages_used++;
+    /* Sanity check: is this a valid block? */
+    if (page_num >= total_pages || ((uint32_t)addr % PAGE_SIZE) != 0) {
+        return;  /* Invalid address */
     }
+    if (page_state[page_num] != (PAGE_ALLOCATED | order)) {
+        return;  /* Not allocated, or allocated with another order */
+    }
+    
+    pages_used -= 1u << order;
+    perf_count(PERF_PAGE_FREES, 1);
+    release_block(page_num, order);
 }
 
 /*
@@ -86,28 +385,12 @@ void memory_init(void)
  * 
  * WHAT: Find a free page and mark it as used
  * WHY: When kernel or programs need memory
- * HOW: Scan bitmap for first free page, mark it used, return address
+ * HOW: An order-0 buddy allocation
  * RETURNS: Pointer to start of page, or NULL if no memory available
  */
 void* alloc_page(void) 
 {
-    uint32_t page_num;
-    
-    /* Search for a free page */
-    for (page_num = 0; page_num < NUM_PAGES; page_num++) {
-        if (!is_page_used(page_num)) {
-            /* Found a free page! */
-            set_page_used(page_num);
-            pages_used++;
-            
-            /* Calculate physical address of this page
-             * WHY: page_num * PAGE_SIZE gives us the byte address */
-            return (void*)(page_num * PAGE_SIZE);
-        }
-    }
-    
-    /* No free pages available */
-    return NULL;
+    return alloc_pages(0);
 }
 
 /*
@@ -115,23 +398,11 @@ void* alloc_page(void)
  * 
  * WHAT: Mark a page as available again
  * WHY: To reclaim memory that's no longer needed
- * HOW: Convert address to page number, clear bitmap bit
+ * HOW: An order-0 buddy free
  */
 void free_page(void* page) 
 {
-    /* Convert address to page number */
-    uint32_t page_num = (uint32_t)page / PAGE_SIZE;
-    
-    /* Sanity check: is this a valid page? */
-    if (page_num >= NUM_PAGES) {
-        return;  /* Invalid address */
-    }
-    
-    /* Mark as free */
-    if (is_page_used(page_num)) {
-        set_page_free(page_num);
-        pages_used--;
-    }
+    free_pages(page, 0);
 }
 
 /*
@@ -139,9 +410,20 @@ void free_page(void* page)
  * 
  * WHAT: Calculate how much RAM is still available
  * WHY: For reporting system status
- * HOW: (Total pages - Used pages) * Page size
+ * HOW: (Usable pages - Used pages) * Page size
  */
 uint32_t get_free_memory(void) 
 {
-    return (NUM_PAGES - pages_used) * PAGE_SIZE;
+    return (usable_pages - pages_used) * PAGE_SIZE;
+}
+
+/*
+ * get_total_memory() - Get amount of allocatable RAM in bytes
+ * 
+ * WHAT: Everything the BIOS reported usable, minus the reserved ranges
+ * WHY: Lets caches size themselves to the machine
+ */
+uint32_t get_total_memory(void)
+{
+    return usable_pages * PAGE_SIZE;
 }
@@ -0,0 +1,360 @@
+/*
+ * ==============================================================================
+ * SLAB OBJECT ALLOCATOR IMPLEMENTATION
+ * ==============================================================================
+ */
+
+#include "include/slab.h"
+#include "include/memory.h"
+#include "include/string.h"
+
+#define SLAB_MAGIC 0x534C4142       /* "SLAB" */
+#define SLAB_ALIGN 8                /* Object alignment */
+#define KMALLOC_MIN_SHIFT 4         /* Smallest kmalloc class: 16 bytes */
+#define KMALLOC_CLASSES 7           /* 16, 32, ... 1024 */
+#define SLAB_MAX_OBJECTS (PAGE_SIZE / SLAB_ALIGN)  /* Bound for the smallest objects */
+
+/* Header at the start of every slab page */
+struct slab {
+    uint32_t magic;          /* SLAB_MAGIC while the page belongs to us */
+    struct kmem_cache* cache;   /* Owning cache, NULL for a large kmalloc block */
+    struct slab* prev;       /* Neighbours in the cache's partial or full list */
+    struct slab* next;
+    void* free_list;         /* First free object; each holds the next */
+    uint16_t in_use;         /* Objects handed out */
+    uint16_t order;          /* Large block: 2^order pages */
+    uint32_t used[SLAB_MAX_OBJECTS / 32];  /* Bit n set = object n handed out */
+};
+
+/* Header size rounded up so the objects after it stay aligned */
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 15) & ~15u)
+
+struct kmem_cache {
+    const char* name;
+    uint32_t object_size;
+    uint32_t per_slab;
+    struct slab* partial;    /* Slabs with at least one free object */
+    struct slab* full;       /* Slabs with none */
+    struct slab* spare;      /* One completely free slab kept for reuse */
+    uint32_t slabs;
+    uint32_t active;
+    uint32_t allocs;
+    uint32_t frees;
+};
+
+static struct kmem_cache caches[KMEM_MAX_CACHES];
+static uint32_t cache_count;
+static struct kmem_cache* kmalloc_caches[KMALLOC_CLASSES];
+static const char* kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+/*
+ * slab_of() - The slab header of the page an object lives in
+ */
+static struct slab* slab_of(const void* obj)
+{
+    return (struct slab*)((uintptr_t)obj & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+/*
+ * object_index() - Position of an object in its slab
+ */
+static uint32_t object_index(const struct slab* slab, const void* obj)
+{
+    uint32_t offset = (uint32_t)((const uint8_t*)obj - (const uint8_t*)slab);
+    return (offset - SLAB_HEADER_SIZE) / slab->cache->object_size;
+}
+
+/*
+ * slab_push() / slab_unlink() - Doubly linked slab list helpers
+ */
+static void slab_push(struct slab** list, struct slab* slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_unlink(struct slab** list, struct slab* slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+/*
+ * new_slab() - Get a page for a cache and thread its free list
+ * RETURNS: The slab, or NULL when out of pages
+ */
+static struct slab* new_slab(struct kmem_cache* cache)
+{
+    struct slab* slab = (struct slab*)alloc_page();
+    uint8_t* obj;
+    uint32_t i;
+    
+    if (!slab) return NULL;
+    
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->in_use = 0;
+    slab->order = 0;
+    memset(slab->used, 0, sizeof(slab->used));
+    
+    /* Link the objects front to back so allocation walks the page in order */
+    obj = (uint8_t*)slab + SLAB_HEADER_SIZE;
+    slab->free_list = obj;
+    for (i = 0; i + 1 < cache->per_slab; i++) {
+        *(void**)obj = obj + cache->object_size;
+        obj += cache->object_size;
+    }
+    *(void**)obj = NULL;
+    
+    cache->slabs++;
+    return slab;
+}
+
+/*
+ * kmem_cache_create() - Set up a cache of same-sized objects
+ * 
+ * WHAT: Subsystems make one per object type (inodes, sessions, ...)
+ * NOTE: Caches are never destroyed, so the descriptors live in a table
+ * RETURNS: The cache, or NULL if the size is too big or the table is full
+ */
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size)
+{
+    struct kmem_cache* cache;
+    
+    size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    if (size < sizeof(void*)) size = sizeof(void*);
+    if (size > PAGE_SIZE - SLAB_HEADER_SIZE || cache_count == KMEM_MAX_CACHES) {
+        return NULL;
+    }
+    
+    cache = &caches[cache_count++];
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->object_size = size;
+    cache->per_slab = (PAGE_SIZE - SLAB_HEADER_SIZE) / size;
+    
+    return cache;
+}
+
+/*
+ * kmem_cache_alloc() - Allocate one object
+ * 
+ * HOW: Take the first free object of a partially used slab; only when
+ *      there is none, reuse the spare slab or get a new page
+ * RETURNS: Uninitialised object, or NULL when out of memory
+ */
+void* kmem_cache_alloc(struct kmem_cache* cache)
+{
+    struct slab* slab = cache->partial;
+    uint32_t index;
+    void* obj;
+    
+    if (!slab) {
+        if (cache->spare) {
+            slab = cache->spare;
+            cache->spare = NULL;
+        } else {
+            slab = new_slab(cache);
+            if (!slab) return NULL;
+        }
+        slab_push(&cache->partial, slab);
+    }
+    
+    obj = slab->free_list;
+    slab->free_list = *(void**)obj;
+    slab->in_use++;
+    
+    index = object_index(slab, obj);
+    slab->used[index / 32] |= 1u << (index % 32);
+    
+    if (!slab->free_list) {
+        slab_unlink(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+    
+    cache->active++;
+    cache->allocs++;
+    return obj;
+}
+
+/*
+ * object_in_use() - Check that obj is an allocated object of its slab
+ * 
+ * WHY: An object freed twice would be on the free list twice, and later
+ *      be handed out to two owners
+ * HOW: It must start on an object boundary and have its bit set in the
+ *      slab's bitmap
+ */
+static int object_in_use(const struct slab* slab, const void* obj)
+{
+    uint32_t offset = (uint32_t)((const uint8_t*)obj - (const uint8_t*)slab);
+    const struct kmem_cache* cache = slab->cache;
+    uint32_t index;
+    
+    if (offset < SLAB_HEADER_SIZE) return 0;
+    offset -= SLAB_HEADER_SIZE;
+    index = offset / cache->object_size;
+    if (offset % cache->object_size != 0 || index >= cache->per_slab) return 0;
+    
+    return (slab->used[index / 32] >> (index % 32)) & 1;
+}
+
+/*
+ * kmem_cache_free() - Return an object to its cache
+ * 
+ * HOW: Push it on its slab's free list; a full slab becomes partial
+ *      again, an empty one becomes the spare or goes back to the page
+ *      allocator. Objects from another cache, pointers into the middle
+ *      of an object and objects that are already free are ignored.
+ */
+void kmem_cache_free(struct kmem_cache* cache, void* obj)
+{
+    struct slab* slab;
+    uint32_t index;
+    
+    if (!obj) return;
+    
+    slab = slab_of(obj);
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) return;
+    if (!object_in_use(slab, obj)) return;
+    
+    if (!slab->free_list) {
+        slab_unlink(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+    
+    index = object_index(slab, obj);
+    slab->used[index / 32] &= ~(1u << (index % 32));
+    
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    cache->active--;
+    cache->frees++;
+    
+    if (slab->in_use == 0) {
+        slab_unlink(&cache->partial, slab);
+        if (!cache->spare) {
+            cache->spare = slab;
+        } else {
+            slab->magic = 0;
+            cache->slabs--;
+            free_page(slab);
+        }
+    }
+}
+
+/*
+ * slab_init() - Create the kmalloc size classes
+ * 
+ * WHY: Must be called after memory_init() and before anything allocates
+ */
+void slab_init(void)
+{
+    uint32_t i;
+    
+    cache_count = 0;
+    for (i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], 1u << (KMALLOC_MIN_SHIFT + i));
+    }
+}
+
+/*
+ * kmalloc() - Allocate memory of any size
+ * 
+ * HOW: Sizes up to KMALLOC_MAX_SIZE come from the smallest power-of-two
+ *      cache that fits; larger ones get 2^order pages of their own, with
+ *      a slab header (cache NULL) in front so kfree() can tell them apart
+ * RETURNS: Uninitialised memory, or NULL
+ */
+void* kmalloc(uint32_t size)
+{
+    uint32_t order = 0;
+    struct slab* block;
+    
+    if (size == 0) return NULL;
+    
+    if (size <= KMALLOC_MAX_SIZE) {
+        uint32_t index = 0;
+        while ((1u << (KMALLOC_MIN_SHIFT + index)) < size) {
+            index++;
+        }
+        return kmem_cache_alloc(kmalloc_caches[index]);
+    }
+    
+    while (((uint32_t)PAGE_SIZE << order) < size + SLAB_HEADER_SIZE) {
+        order++;
+    }
+    
+    block = (struct slab*)alloc_pages(order);
+    if (!block) return NULL;
+    
+    block->magic = SLAB_MAGIC;
+    block->cache = NULL;
+    block->order = order;
+    
+    return (uint8_t*)block + SLAB_HEADER_SIZE;
+}
+
+/*
+ * kfree() - Free memory from kmalloc()
+ */
+void kfree(void* ptr)
+{
+    struct slab* slab;
+    
+    if (!ptr) return;
+    
+    slab = slab_of(ptr);
+    if (slab->magic != SLAB_MAGIC) return;  /* Not ours */
+    
+    if (slab->cache) {
+        kmem_cache_free(slab->cache, ptr);
+    } else {
+        slab->magic = 0;
+        free_pages(slab, slab->order);
+    }
+}
+
+/*
+ * kmem_cache_count() - Number of caches (for listing stats)
+ */
+uint32_t kmem_cache_count(void)
+{
+    return cache_count;
+}
+
+/*
+ * kmem_cache_get_stats() - Copy out the counters of one cache
+ * RETURNS: 0 on success, -1 if index is out of range
+ */
+int kmem_cache_get_stats(uint32_t index, struct kmem_cache_stats* stats)
+{
+    struct kmem_cache* cache;
+    
+    if (index >= cache_count) return -1;
+    
+    cache = &caches[index];
+    stats->name = cache->name;
+    stats->object_size = cache->object_size;
+    stats->per_slab = cache->per_slab;
+    stats->slabs = cache->slabs;
+    stats->active = cache->active;
+    stats->allocs = cache->allocs;
+    stats->frees = cache->frees;
+    
+    return 0;
+}
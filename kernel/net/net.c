@@ -4,10 +4,31 @@
 #include "include/auth.h"
 #include "include/shell.h"
 #include "include/string.h"
+#include "include/slab.h"
+#include "include/memory.h"
+#include "include/task.h"
+#include "include/perf.h"
 
-static uint8_t my_mac[6] = MY_MAC_ADDR;
-static session_t sessions[5];
-static uint8_t num_sessions = 0;
+static uint8_t my_mac[6];         // Read from the NIC by net_init()
+static const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+static struct kmem_cache* session_cache;
+static session_t* session_table[NET_SESSION_BUCKETS];   // Hash chains
+static uint32_t num_sessions = 0;
+static uint32_t max_sessions = NET_MAX_SESSIONS;   // See net_set_limits()
+static uint32_t max_per_ip = NET_MAX_PER_IP;
+static struct net_stats stats;
+static uint32_t net_ticks = 0;    // net_tick() calls (timer ticks) since boot
+static uint32_t isn_secret[2];    // Key of tcp_isn(), set by net_init()
+
+// Neighbour cache: IP -> MAC, learned from ARP and from every IPv4 frame
+typedef struct {
+    uint32_t ip;             // 0 = unused
+    uint8_t mac[6];
+    uint8_t resolved;        // 0 while only a request is out
+    uint32_t updated;        // net_ticks when last confirmed (or asked)
+} arp_entry_t;
+
+static arp_entry_t arp_cache[NET_ARP_CACHE];
 
 // Helper to convert network byte order
 static uint16_t htons(uint16_t x) {
@@ -20,212 +41,905 @@ static uint32_t htonl(uint32_t x) {
 }
 
 void net_init(void) {
-    // Initialize all sessions as inactive
-    for (int i = 0; i < 5; i++) {
-        sessions[i].active = 0;
-        sessions[i].authenticated = 0;
+    for (int i = 0; i < 6; i++) {
+        my_mac[i] = rtl8139_get_mac(i);
+    }
+    memset(arp_cache, 0, sizeof(arp_cache));
+    
+    // Sessions come from their own slab cache, so only live ones use memory
+    if (!session_cache) {
+        session_cache = kmem_cache_create("session", sizeof(session_t));
     }
+    memset(session_table, 0, sizeof(session_table));
+    memset(&stats, 0, sizeof(stats));
     num_sessions = 0;
+    
+    // Key for initial sequence numbers: the TSC this far into boot
+    // differs from boot to boot, the MAC from machine to machine
+    uint64_t tsc = perf_clock();
+    isn_secret[0] = (uint32_t)tsc ^ ((uint32_t)my_mac[2] << 24 | (uint32_t)my_mac[3] << 16 |
+                                     (uint32_t)my_mac[4] << 8 | my_mac[5]);
+    isn_secret[1] = (uint32_t)(tsc >> 32) ^ ((uint32_t)my_mac[0] << 8 | my_mac[1]);
 }
 
-uint16_t net_checksum(uint16_t* data, uint16_t length) {
-    uint32_t sum = 0;
-    
-    while (length > 1) {
-        sum += *data++;
-        length -= 2;
+// Find the cache entry of an address, or NULL
+static arp_entry_t* arp_lookup(uint32_t ip) {
+    for (int i = 0; i < NET_ARP_CACHE; i++) {
+        if (arp_cache[i].ip == ip) return &arp_cache[i];
     }
+    return 0;
+}
+
+// Find an entry to (re)use for an address: its own, a free one, or the
+// least recently confirmed
+static arp_entry_t* arp_slot(uint32_t ip) {
+    arp_entry_t* oldest = &arp_cache[0];
+    arp_entry_t* entry = arp_lookup(ip);
     
-    if (length == 1) {
-        sum += *(uint8_t*)data;
-    }
+    if (entry) return entry;
     
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    for (int i = 0; i < NET_ARP_CACHE; i++) {
+        if (arp_cache[i].ip == 0) return &arp_cache[i];
+        if (net_ticks - arp_cache[i].updated > net_ticks - oldest->updated) {
+            oldest = &arp_cache[i];
+        }
     }
+    return oldest;
+}
+
+// Record that ip is at mac
+static void arp_learn(uint32_t ip, const uint8_t* mac) {
+    if (ip == 0 || (mac[0] & 0x01)) return;   // Never cache multicast/broadcast
     
-    return ~sum;
+    arp_entry_t* entry = arp_slot(ip);
+    entry->ip = ip;
+    memcpy(entry->mac, mac, 6);
+    entry->resolved = 1;
+    entry->updated = net_ticks;
 }
 
-session_t* net_get_session(uint32_t ip, uint16_t port) {
-    for (int i = 0; i < 5; i++) {
-        if (sessions[i].active && 
-            sessions[i].client_ip == ip && 
-            sessions[i].client_port == port) {
-            return &sessions[i];
-        }
+// Send an ARP request or reply (addresses in host order)
+static void arp_send(uint16_t opcode, const uint8_t* dest_mac, uint32_t target_ip,
+                     const uint8_t* target_mac) {
+    uint8_t* packet = rtl8139_tx_alloc();
+    if (!packet) return;
+    
+    eth_header_t* eth = (eth_header_t*)packet;
+    memcpy(eth->dest_mac, dest_mac, 6);
+    memcpy(eth->src_mac, my_mac, 6);
+    eth->ethertype = htons(ETHERTYPE_ARP);
+    
+    arp_packet_t* arp = (arp_packet_t*)(packet + sizeof(eth_header_t));
+    arp->hw_type = htons(1);
+    arp->proto_type = htons(ETHERTYPE_IPV4);
+    arp->hw_len = 6;
+    arp->proto_len = 4;
+    arp->opcode = htons(opcode);
+    memcpy(arp->sender_mac, my_mac, 6);
+    arp->sender_ip = htonl(MY_IP_ADDR);
+    memcpy(arp->target_mac, target_mac, 6);
+    arp->target_ip = htonl(target_ip);
+    
+    rtl8139_tx_submit(packet, sizeof(eth_header_t) + sizeof(arp_packet_t));
+}
+
+// Answer requests for our address. The sender is learned only from packets
+// aimed at us, or refreshed if it is cached already (RFC 826), so other
+// hosts' broadcast chatter can't push the real entries out of the cache.
+static void arp_process(uint8_t* packet, uint16_t length) {
+    if (length < sizeof(eth_header_t) + sizeof(arp_packet_t)) return;
+    
+    arp_packet_t* arp = (arp_packet_t*)(packet + sizeof(eth_header_t));
+    if (htons(arp->hw_type) != 1 || htons(arp->proto_type) != ETHERTYPE_IPV4 ||
+        arp->hw_len != 6 || arp->proto_len != 4) return;
+    
+    uint32_t sender_ip = htonl(arp->sender_ip);
+    uint8_t for_us = htonl(arp->target_ip) == MY_IP_ADDR;
+    if (for_us || arp_lookup(sender_ip)) {
+        arp_learn(sender_ip, arp->sender_mac);
+    }
+    
+    if (htons(arp->opcode) == ARP_REQUEST && for_us) {
+        arp_send(ARP_REPLY, arp->sender_mac, sender_ip, arp->sender_mac);
     }
-    return 0;
 }
 
-session_t* net_create_session(uint32_t ip, uint16_t port) {
-    if (num_sessions >= 5) return 0;
+// Destination MAC for an on-link address. Unknown or stale addresses get
+// an ARP request (rate limited) and, meanwhile, the broadcast address, so
+// nothing is held back; the next frame goes out unicast.
+static const uint8_t* arp_resolve(uint32_t ip) {
+    static const uint8_t zero_mac[6] = {0};
+    arp_entry_t* entry = arp_lookup(ip);
     
-    for (int i = 0; i < 5; i++) {
-        if (!sessions[i].active) {
-            sessions[i].active = 1;
-            sessions[i].authenticated = 0;
-            sessions[i].client_ip = ip;
-            sessions[i].client_port = port;
-            sessions[i].seq_num = 1000;
-            sessions[i].ack_num = 0;
-            num_sessions++;
-            return &sessions[i];
+    if (entry && entry->resolved && net_ticks - entry->updated < NET_ARP_TIMEOUT) {
+        return entry->mac;
+    }
+    
+    if (!entry || net_ticks - entry->updated >= NET_ARP_RETRY) {
+        if (!entry) {
+            entry = arp_slot(ip);
+            entry->ip = ip;
+            entry->resolved = 0;
         }
+        entry->updated = net_ticks;
+        arp_send(ARP_REQUEST, broadcast_mac, ip, zero_mac);
     }
-    return 0;
+    
+    return entry->resolved ? entry->mac : broadcast_mac;
 }
 
-void net_send_tcp(session_t* session, const char* data, uint16_t data_len) {
-    if (!session) return;
+// Unaligned 32-bit load; x86 doesn't mind the alignment
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+
+// Fold a wide one's-complement sum down to 16 bits (not inverted)
+static uint32_t checksum_reduce(uint64_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint32_t)sum;
+}
+
+// One's-complement sum of a buffer, folded but not inverted
+//
+// The sum is taken 32 bits at a time into a 64-bit accumulator, four
+// words per loop, and folded once at the end. One's-complement addition
+// doesn't care about word size or byte order, so this equals the sum of
+// 16-bit words in memory order.
+static uint32_t checksum_add(uint32_t sum, const void* data, uint16_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t acc = sum;
     
-    uint16_t total_len = sizeof(eth_header_t) + sizeof(ip_header_t) + 
-                         sizeof(tcp_header_t) + data_len;
-    uint8_t packet[total_len];
+    while (length >= 16) {
+        acc += *(const unaligned_u32*)p;
+        acc += *(const unaligned_u32*)(p + 4);
+        acc += *(const unaligned_u32*)(p + 8);
+        acc += *(const unaligned_u32*)(p + 12);
+        p += 16;
+        length -= 16;
+    }
     
-    // Ethernet header
-    eth_header_t* eth = (eth_header_t*)packet;
-    for (int i = 0; i < 6; i++) {
-        eth->dest_mac[i] = 0xFF;  // Broadcast for now
-        eth->src_mac[i] = my_mac[i];
+    while (length >= 4) {
+        acc += *(const unaligned_u32*)p;
+        p += 4;
+        length -= 4;
     }
-    eth->ethertype = htons(0x0800);  // IPv4
     
-    // IP header
-    ip_header_t* ip = (ip_header_t*)(packet + sizeof(eth_header_t));
+    if (length >= 2) {
+        acc += *(const uint16_t*)p;
+        p += 2;
+        length -= 2;
+    }
+    
+    if (length == 1) {
+        acc += *p;
+    }
+    
+    return checksum_reduce(acc);
+}
+
+// Add a 32-bit field (as stored, network order) to a partial sum
+static uint32_t checksum_add32(uint32_t sum, uint32_t value) {
+    return checksum_reduce((uint64_t)sum + (value >> 16) + (value & 0xFFFF));
+}
+
+static uint16_t checksum_fold(uint32_t sum) {
+    return ~checksum_reduce(sum);
+}
+
+uint16_t net_checksum(uint16_t* data, uint16_t length) {
+    return checksum_fold(checksum_add(0, data, length));
+}
+
+// Incremental update (RFC 1624, eqn. 3): the checksum after one 16-bit
+// field changed from old_value to new_value, HC' = ~(~HC + ~m + m').
+// Values are as stored in the header.
+uint16_t net_checksum_adjust(uint16_t checksum, uint16_t old_value, uint16_t new_value) {
+    uint32_t sum = (uint16_t)~checksum + (uint16_t)~old_value + new_value;
+    return checksum_fold(sum);
+}
+
+// Partial sum of the TCP pseudo-header (both addresses, the protocol and
+// the TCP length)
+static uint32_t tcp_pseudo_sum(const ip_header_t* ip, uint16_t tcp_len) {
+    uint32_t sum = checksum_add32(0, ip->src_ip);
+    sum = checksum_add32(sum, ip->dest_ip);
+    return sum + htons(6) + htons(tcp_len);   // Zero byte, protocol TCP
+}
+
+// Fill in a session's header template. Every segment starts as a copy;
+// only the length, sequence/ack numbers, flags and checksums change.
+static void tcp_build_template(session_t* session) {
+    ip_header_t* ip = (ip_header_t*)session->hdr_template;
+    tcp_header_t* tcp = (tcp_header_t*)(session->hdr_template + sizeof(ip_header_t));
+    
+    // IP header (DF set, so the constant ID is fine - RFC 6864)
     ip->version_ihl = 0x45;
     ip->tos = 0;
-    ip->total_length = htons(sizeof(ip_header_t) + sizeof(tcp_header_t) + data_len);
+    ip->total_length = 0;
     ip->id = htons(1234);
-    ip->flags_fragment = 0;
+    ip->flags_fragment = htons(0x4000);
     ip->ttl = 64;
     ip->protocol = 6;  // TCP
     ip->src_ip = htonl(MY_IP_ADDR);
     ip->dest_ip = htonl(session->client_ip);
     ip->checksum = 0;
-    ip->checksum = net_checksum((uint16_t*)ip, sizeof(ip_header_t));
+    ip->checksum = checksum_fold(checksum_add(0, ip, sizeof(ip_header_t)));
     
     // TCP header
-    tcp_header_t* tcp = (tcp_header_t*)(packet + sizeof(eth_header_t) + sizeof(ip_header_t));
+    memset(tcp, 0, sizeof(tcp_header_t));
     tcp->src_port = htons(TELNET_PORT);
     tcp->dest_port = htons(session->client_port);
-    tcp->seq_num = htonl(session->seq_num);
-    tcp->ack_num = htonl(session->ack_num);
-    tcp->data_offset = 0x50;  // 20 bytes, no options
-    tcp->flags = TCP_PSH | TCP_ACK;
-    tcp->window = htons(8192);
-    tcp->urgent_ptr = 0;
-    tcp->checksum = 0;
+    tcp->window = htons(NET_TCP_RCV_WINDOW);
     
-    // Copy data
-    if (data_len > 0) {
-        uint8_t* payload = packet + sizeof(eth_header_t) + sizeof(ip_header_t) + sizeof(tcp_header_t);
-        for (uint16_t i = 0; i < data_len; i++) {
-            payload[i] = data[i];
+    // Pseudo-header addresses and protocol, ports and window
+    session->tcp_sum_base = checksum_add(tcp_pseudo_sum(ip, 0), tcp, sizeof(tcp_header_t));
+}
+
+// One round of the ISN hash (the MurmurHash3 finaliser)
+static uint32_t isn_mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    return h ^ (h >> 16);
+}
+
+// Initial sequence number as RFC 6528 describes it: a keyed hash of the
+// connection's addresses and ports, plus a clock ticking about every 4us
+// (TSC / 4096). Neither uptime nor the client's port gives it away, and
+// a reused port still starts past the old connection's numbers.
+static uint32_t tcp_isn(uint32_t ip, uint16_t port) {
+    uint32_t h = isn_mix(isn_secret[0] ^ ip);
+    h = isn_mix(h ^ isn_secret[1] ^ MY_IP_ADDR);
+    h = isn_mix(h ^ ((uint32_t)port << 16 | TELNET_PORT));
+    return h + (uint32_t)(perf_clock() >> 12);
+}
+
+// Hash bucket of a connection
+static uint32_t session_hash(uint32_t ip, uint16_t port) {
+    uint32_t h = (ip ^ ((uint32_t)port << 16) ^ port) * 2654435761u;
+    return h >> 26;   // Top bits: NET_SESSION_BUCKETS is 64
+}
+
+session_t* net_get_session(uint32_t ip, uint16_t port) {
+    for (session_t* s = session_table[session_hash(ip, port)]; s; s = s->next) {
+        if (s->active && 
+            s->client_ip == ip && 
+            s->client_port == port) {
+            return s;
         }
     }
+    return 0;
+}
+
+// Connections open from one client address (only checked on SYN)
+static uint32_t sessions_from(uint32_t ip) {
+    uint32_t count = 0;
     
-    // Calculate TCP checksum (simplified - not including pseudo-header)
-    tcp->checksum = net_checksum((uint16_t*)tcp, sizeof(tcp_header_t) + data_len);
+    for (uint32_t b = 0; b < NET_SESSION_BUCKETS; b++) {
+        for (session_t* s = session_table[b]; s; s = s->next) {
+            if (s->client_ip == ip) count++;
+        }
+    }
+    return count;
+}
+
+session_t* net_create_session(uint32_t ip, uint16_t port) {
+    if (num_sessions >= max_sessions || !session_cache ||
+        sessions_from(ip) >= max_per_ip) {
+        stats.refused++;
+        return 0;
+    }
+    
+    session_t* s = kmem_cache_alloc(session_cache);
+    if (!s) {
+        stats.refused++;
+        return 0;
+    }
+    
+    memset(s, 0, sizeof(session_t));
+    s->snd_buf = (uint8_t*)alloc_pages(NET_TCP_SNDBUF_ORDER);
+    s->out_buf = (uint8_t*)alloc_pages(NET_OUT_ORDER);
+    if (!s->snd_buf || !s->out_buf) {
+        if (s->snd_buf) free_pages(s->snd_buf, NET_TCP_SNDBUF_ORDER);
+        if (s->out_buf) free_pages(s->out_buf, NET_OUT_ORDER);
+        kmem_cache_free(session_cache, s);
+        stats.refused++;
+        return 0;
+    }
+    
+    s->active = 1;
+    s->authenticated = 0;
+    s->client_ip = ip;
+    s->client_port = port;
+    s->state = TCP_STATE_CLOSED;
+    s->rto = NET_TCP_RTO_INITIAL;
+    s->last_active = net_ticks;
+    strcpy(s->cwd, "/");
+    s->cwd_inode = 0;
+    tcp_build_template(s);
+    
+    uint32_t bucket = session_hash(ip, port);
+    s->next = session_table[bucket];
+    session_table[bucket] = s;
+    num_sessions++;
+    stats.opened++;
+    return s;
+}
+
+// Forget a connection and give back its memory. Its shell task can only
+// be waiting for the next line, or for send buffer space after a command
+// has finished (running one never yields), so it is simply dropped.
+static void net_release_session(session_t* session) {
+    session_t** link = &session_table[session_hash(session->client_ip, session->client_port)];
+    
+    for (; *link; link = &(*link)->next) {
+        if (*link == session) {
+            *link = session->next;
+            break;
+        }
+    }
+    
+    task_kill(session->shell);
+    free_pages(session->snd_buf, NET_TCP_SNDBUF_ORDER);
+    free_pages(session->out_buf, NET_OUT_ORDER);
+    session->active = 0;
+    kmem_cache_free(session_cache, session);
+    num_sessions--;
+}
+
+void net_get_stats(struct net_stats* out) {
+    *out = stats;
+    out->active = num_sessions;
+    out->max_sessions = max_sessions;
+    out->max_per_ip = max_per_ip;
+}
+
+// Change the connection limits. They only apply to new SYNs: connections
+// already open above a lowered limit are left to finish. Returns -1 if a
+// limit is zero.
+int net_set_limits(uint32_t sessions, uint32_t per_ip) {
+    if (sessions == 0 || per_ip == 0) return -1;
+    
+    max_sessions = sessions;
+    max_per_ip = per_ip;
+    return 0;
+}
+
+// Describe the index-th connection; returns -1 past the last one
+int net_get_session_info(uint32_t index, struct net_session_info* info) {
+    for (uint32_t b = 0; b < NET_SESSION_BUCKETS; b++) {
+        for (session_t* s = session_table[b]; s; s = s->next) {
+            if (index-- > 0) continue;
+            
+            info->client_ip = s->client_ip;
+            info->client_port = s->client_port;
+            info->state = s->state;
+            info->authenticated = s->authenticated;
+            info->idle = net_ticks - s->last_active;
+            info->queued = s->snd_len;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Send one segment. The payload is `len` bytes starting `offset` bytes
+// into the send ring; every segment carries our current ACK, so it also
+// settles any delayed one. The MAC is resolved before a TX buffer is
+// taken, since a cache miss sends an ARP request through one itself.
+static void tcp_transmit(session_t* session, uint32_t seq, uint16_t offset,
+                         uint16_t len, uint8_t flags) {
+    uint16_t options = (flags & TCP_SYN) ? 4 : 0;   // MSS option on SYN-ACK
+    uint16_t tcp_len = sizeof(tcp_header_t) + options + len;
+    uint16_t total_len = sizeof(eth_header_t) + sizeof(ip_header_t) + tcp_len;
+    const uint8_t* dest_mac = arp_resolve(session->client_ip);
+    uint8_t* packet = rtl8139_tx_alloc();
+    if (!packet) return;
+    
+    // Ethernet header
+    eth_header_t* eth = (eth_header_t*)packet;
+    memcpy(eth->dest_mac, dest_mac, 6);
+    memcpy(eth->src_mac, my_mac, 6);
+    eth->ethertype = htons(ETHERTYPE_IPV4);
+    
+    // IP and TCP headers from the template; the IP checksum only needs
+    // the length patched in
+    memcpy(packet + sizeof(eth_header_t), session->hdr_template, sizeof(session->hdr_template));
+    ip_header_t* ip = (ip_header_t*)(packet + sizeof(eth_header_t));
+    uint16_t ip_len = htons(sizeof(ip_header_t) + tcp_len);
+    ip->total_length = ip_len;
+    ip->checksum = net_checksum_adjust(ip->checksum, 0, ip_len);
+    
+    tcp_header_t* tcp = (tcp_header_t*)(packet + sizeof(eth_header_t) + sizeof(ip_header_t));
+    tcp->seq_num = htonl(seq);
+    tcp->ack_num = htonl(session->rcv_nxt);
+    tcp->data_offset = (uint8_t)((sizeof(tcp_header_t) + options) / 4) << 4;
+    tcp->flags = flags | TCP_ACK;
+    
+    // TCP checksum: the template's sum plus the fields set above, then
+    // options and payload
+    uint32_t sum = session->tcp_sum_base + htons(tcp_len);
+    sum = checksum_add32(sum, tcp->seq_num);
+    sum = checksum_add32(sum, tcp->ack_num);
+    sum += tcp->data_offset | ((uint16_t)tcp->flags << 8);
+    
+    uint8_t* payload = (uint8_t*)tcp + sizeof(tcp_header_t);
+    if (options) {
+        payload[0] = 2;          // Kind: maximum segment size
+        payload[1] = 4;
+        payload[2] = NET_TCP_MSS >> 8;
+        payload[3] = NET_TCP_MSS & 0xFF;
+        sum = checksum_add(sum, payload, options);
+        payload += options;
+    }
+    
+    // Copy data out of the ring, in two pieces if it wraps
+    if (len > 0) {
+        uint16_t start = (session->snd_start + offset) % NET_TCP_SNDBUF;
+        uint16_t first = NET_TCP_SNDBUF - start;
+        if (first > len) first = len;
+        memcpy(payload, session->snd_buf + start, first);
+        memcpy(payload + first, session->snd_buf, len - first);
+        sum = checksum_add(sum, payload, len);
+    }
+    
+    tcp->checksum = checksum_fold(sum);
     
     // Send packet
-    rtl8139_send_packet(packet, total_len);
+    rtl8139_tx_submit(packet, total_len);
     
-    // Update sequence number
-    session->seq_num += data_len;
+    session->ack_pending = 0;
+    session->ack_timer = 0;
+}
+
+// Send a bare RST|ACK to a client we don't keep (or no longer keep) a
+// session for. The segment is built in a static scratch session: a
+// session_t is over 1KB, too much for the small task stacks, and only
+// the network task sends resets.
+static void tcp_reset(uint32_t ip, uint16_t port, uint32_t seq, uint32_t ack) {
+    static session_t peer;
+    
+    memset(&peer, 0, sizeof(peer));
+    peer.client_ip = ip;
+    peer.client_port = port;
+    peer.rcv_nxt = ack;
+    tcp_build_template(&peer);
+    tcp_transmit(&peer, seq, 0, 0, TCP_RST);
+}
+
+// Arm the retransmit timer unless it is already running
+static void tcp_start_timer(session_t* session) {
+    if (session->rto_timer == 0) {
+        session->rto_timer = session->rto;
+    }
+}
+
+// Remember how far we have ever sent. A retransmit timeout moves snd_sent
+// back, but ACKs for data sent before it are still valid.
+static void tcp_note_sent(session_t* session, uint32_t end) {
+    if ((int32_t)(end - session->snd_max) > 0) {
+        session->snd_max = end;
+    }
+}
+
+// Send whatever the window and Nagle's rule allow: full segments always,
+// a partial one only when nothing else is unacknowledged, so small
+// writes made while data is in flight are coalesced. The FIN follows
+// the last byte.
+static void tcp_output(session_t* session) {
+    if (session->state != TCP_STATE_ESTABLISHED && session->state != TCP_STATE_LAST_ACK) return;
+    
+    while (session->snd_sent < session->snd_len) {
+        uint16_t seg = session->snd_len - session->snd_sent;
+        uint32_t usable = session->snd_wnd > session->snd_sent ?
+                          session->snd_wnd - session->snd_sent : 0;
+        
+        if (seg > NET_TCP_MSS) seg = NET_TCP_MSS;
+        if (seg > usable) seg = (uint16_t)usable;
+        
+        if (seg == 0) {
+            tcp_start_timer(session);   // Window closed: the timer probes it
+            return;
+        }
+        if (seg < NET_TCP_MSS && session->snd_sent > 0) return;   // Nagle
+        
+        uint8_t flags = (session->snd_sent + seg == session->snd_len) ? TCP_PSH : 0;
+        tcp_transmit(session, session->snd_una + session->snd_sent, session->snd_sent, seg, flags);
+        session->snd_sent += seg;
+        tcp_note_sent(session, session->snd_una + session->snd_sent);
+        tcp_start_timer(session);
+    }
+    
+    if (session->fin_queued && !session->fin_sent) {
+        tcp_transmit(session, session->snd_una + session->snd_len, 0, 0, TCP_FIN);
+        session->fin_sent = 1;
+        tcp_note_sent(session, session->snd_una + session->snd_len + 1);
+        tcp_start_timer(session);
+    }
+}
+
+// Queue data for a connection; it goes out as the window allows.
+// Data that doesn't fit in the send buffer is dropped.
+void net_send_tcp(session_t* session, const char* data, uint16_t data_len) {
+    if (!session || session->state != TCP_STATE_ESTABLISHED) return;
+    
+    uint16_t space = NET_TCP_SNDBUF - session->snd_len;
+    if (data_len > space) data_len = space;
+    
+    uint16_t end = (session->snd_start + session->snd_len) % NET_TCP_SNDBUF;
+    uint16_t first = NET_TCP_SNDBUF - end;
+    if (first > data_len) first = data_len;
+    memcpy(session->snd_buf + end, data, first);
+    memcpy(session->snd_buf, data + first, data_len - first);
+    session->snd_len += data_len;
+    
+    tcp_output(session);
+}
+
+// Process an ACK: drop acknowledged bytes from the ring and restart the
+// retransmit timer. Anything up to snd_max counts, so after a timeout an
+// ACK for data from before it isn't mistaken for a bogus one (and that
+// data resent once more). Returns 1 if it acknowledged our FIN.
+static int tcp_ack(session_t* session, uint32_t ack) {
+    uint32_t acked = ack - session->snd_una;
+    uint32_t outstanding = session->snd_max - session->snd_una;
+    
+    if (acked == 0 || acked > outstanding) return 0;   // Old or bogus
+    
+    uint16_t data = acked > session->snd_len ? session->snd_len : (uint16_t)acked;
+    session->snd_start = (session->snd_start + data) % NET_TCP_SNDBUF;
+    session->snd_len -= data;
+    session->snd_sent = session->snd_sent > data ? session->snd_sent - data : 0;
+    session->snd_una = ack;
+    
+    session->retries = 0;
+    session->rto = NET_TCP_RTO_INITIAL;
+    session->rto_timer = 0;
+    if (session->snd_sent > 0) tcp_start_timer(session);
+    
+    return acked > data;
+}
+
+// Move collected output into the send buffer, one segment at a time,
+// encoding each segment as it goes. A partial segment is only sent when
+// `wait` is set (end of a command); then the connection's own shell task
+// also sleeps for the client's ACKs until everything fits. From anywhere
+// else sleeping would hold up the ACKs themselves, so it stops instead.
+static void session_push(session_t* session, uint8_t wait) {
+    uint16_t done = 0;
+    
+    while (done < session->out_len && session->state == TCP_STATE_ESTABLISHED) {
+        uint16_t seg = session->out_len - done;
+        if (seg > NET_TCP_MSS) seg = NET_TCP_MSS;
+        if (seg < NET_TCP_MSS && !wait) break;
+        
+        if (NET_TCP_SNDBUF - session->snd_len < seg) {
+            if (!wait || !session->shell || task_current() != session->shell) break;
+            task_sleep(1);
+            continue;
+        }
+        
+        encrypt_data(session->out_buf + done, seg, NET_XOR_KEY);
+        net_send_tcp(session, (const char*)session->out_buf + done, seg);
+        done += seg;
+    }
+    
+    session->out_len -= done;
+    memmove(session->out_buf, session->out_buf + done, session->out_len);
+}
+
+// Output sink for a connection (the output_fn_t shape): collect the text
+// and pass on every full segment. Never sleeps, since it runs in the
+// middle of commands.
+void net_session_print(void* arg, const char* str) {
+    session_t* session = arg;
+    uint32_t len = strlen(str);
+    
+    while (len > 0) {
+        if (session->out_len == NET_OUT_BUF) {
+            session_push(session, 0);
+            if (session->out_len == NET_OUT_BUF) {
+                session->out_lost += len;   // Client isn't keeping up
+                return;
+            }
+        }
+        
+        uint32_t n = NET_OUT_BUF - session->out_len;
+        if (n > len) n = len;
+        memcpy(session->out_buf + session->out_len, str, n);
+        session->out_len += n;
+        str += n;
+        len -= n;
+    }
+}
+
+// Send everything collected, at the end of a command. Output that still
+// can't be sent (connection closing, or not called from its shell task)
+// is dropped.
+void net_session_flush(session_t* session) {
+    if (session->out_lost > 0) {
+        session->out_lost = 0;
+        net_session_print(session, "\n[Output truncated]\n");
+    }
+    
+    session_push(session, 1);
+    session->out_len = 0;
+}
+
+// Shell task of a logged-in connection: runs the lines net_deliver()
+// queued, one at a time, so a command never runs inside packet processing
+static void net_session_shell(void* arg) {
+    session_t* session = arg;
+    char cmd[NET_CMD_MAX];
+    
+    while (1) {
+        while (session->commands_len == 0) {
+            task_wait();
+        }
+        
+        uint16_t len = strlen(session->commands) + 1;
+        memcpy(cmd, session->commands, len);
+        session->commands_len -= len;
+        memmove(session->commands, session->commands + len, session->commands_len);
+        
+        shell_execute_command(cmd, session);
+    }
+}
+
+// Hand in-order payload to the login or shell layer
+static void net_deliver(session_t* session, uint8_t* payload, uint16_t payload_len) {
+    // Decrypt payload
+    decrypt_data(payload, payload_len, NET_XOR_KEY);
+    
+    if (!session->authenticated) {
+        // Handle authentication
+        char username[32] = {0};
+        char password[64] = {0};
+        
+        // Parse username:password from payload
+        uint16_t i = 0, j = 0;
+        while (i < payload_len && payload[i] != ':' && j < 31) {
+            username[j++] = payload[i++];
+        }
+        i++; // skip ':'
+        j = 0;
+        while (i < payload_len && payload[i] != '\n' && j < 63) {
+            password[j++] = payload[i++];
+        }
+        
+        if (auth_verify(username, password)) {
+            session->authenticated = 1;
+            strcpy(session->username, username);
+            session->shell = task_create("telnet", net_session_shell, session);
+            net_session_print(session, "\nWelcome to XAE OS!\n> ");
+        } else {
+            net_session_print(session, "\nAuthentication failed!\nUsername: ");
+        }
+        net_session_flush(session);
+    } else {
+        char cmd[NET_CMD_MAX];
+        uint16_t len = 0;
+        while (len < payload_len && len < NET_CMD_MAX - 1 && payload[len] != 0) {
+            cmd[len] = payload[len];
+            len++;
+        }
+        cmd[len++] = '\0';
+        
+        // No task (out of memory): run the command right here
+        if (!session->shell) {
+            shell_execute_command(cmd, session);
+            return;
+        }
+        
+        // Queue it for the shell task; a client this far ahead loses the line
+        if (session->commands_len + len > NET_CMD_QUEUE) return;
+        memcpy(session->commands + session->commands_len, cmd, len);
+        session->commands_len += len;
+        task_wake(session->shell);
+    }
 }
 
 void net_process_packet(uint8_t* packet, uint16_t length) {
-    if (length < sizeof(eth_header_t) + sizeof(ip_header_t)) return;
+    if (length < sizeof(eth_header_t)) return;
     
     eth_header_t* eth = (eth_header_t*)packet;
     
+    if (htons(eth->ethertype) == ETHERTYPE_ARP) {
+        arp_process(packet, length);
+        return;
+    }
+    
     // Check if IPv4
-    if (htons(eth->ethertype) != 0x0800) return;
+    if (htons(eth->ethertype) != ETHERTYPE_IPV4) return;
+    if (length < sizeof(eth_header_t) + sizeof(ip_header_t)) return;
     
     ip_header_t* ip = (ip_header_t*)(packet + sizeof(eth_header_t));
+    uint16_t ip_header_len = (ip->version_ihl & 0x0F) * 4;
+    uint16_t ip_len = htons(ip->total_length);
+    
+    // Only frames for us; their source MAC keeps the neighbour cache fresh
+    if (htonl(ip->dest_ip) != MY_IP_ADDR) return;
+    arp_learn(htonl(ip->src_ip), eth->src_mac);
     
     // Check if TCP
     if (ip->protocol != 6) return;
+    if (ip_header_len < sizeof(ip_header_t) || ip_len > length - sizeof(eth_header_t) ||
+        ip_len < ip_header_len + sizeof(tcp_header_t)) return;
     
-    tcp_header_t* tcp = (tcp_header_t*)(packet + sizeof(eth_header_t) + sizeof(ip_header_t));
+    // Both checksums must add up to all ones (0 after inversion)
+    if (checksum_fold(checksum_add(0, ip, ip_header_len)) != 0) return;
+    if (checksum_fold(checksum_add(tcp_pseudo_sum(ip, ip_len - ip_header_len),
+                                   (uint8_t*)ip + ip_header_len, ip_len - ip_header_len)) != 0) return;
+    
+    tcp_header_t* tcp = (tcp_header_t*)((uint8_t*)ip + ip_header_len);
+    uint16_t tcp_header_len = (tcp->data_offset >> 4) * 4;
+    if (tcp_header_len < sizeof(tcp_header_t) || tcp_header_len > ip_len - ip_header_len) return;
     
     uint32_t src_ip = htonl(ip->src_ip);
     uint16_t src_port = htons(tcp->src_port);
     uint16_t dest_port = htons(tcp->dest_port);
+    uint32_t seq = htonl(tcp->seq_num);
+    uint8_t flags = tcp->flags;
+    uint8_t* payload = (uint8_t*)tcp + tcp_header_len;
+    uint16_t payload_len = ip_len - ip_header_len - tcp_header_len;
     
     // Check if packet is for our telnet port
     if (dest_port != TELNET_PORT) return;
     
     session_t* session = net_get_session(src_ip, src_port);
     
-    // Handle SYN (new connection)
-    if (tcp->flags & TCP_SYN) {
+    if (!session) {
+        // Only a SYN opens a connection
+        if ((flags & (TCP_SYN | TCP_ACK | TCP_RST)) != TCP_SYN) return;
+        
+        session = net_create_session(src_ip, src_port);
         if (!session) {
-            session = net_create_session(src_ip, src_port);
-            if (session) {
-                vga_print("New connection from IP\n");
-                session->ack_num = htonl(tcp->seq_num) + 1;
-                
-                // Send SYN-ACK
-                uint8_t syn_ack[sizeof(eth_header_t) + sizeof(ip_header_t) + sizeof(tcp_header_t)];
-                // ... build SYN-ACK packet ...
-                
-                // Send login prompt
-                const char* prompt = "XAE OS Login\nUsername: ";
-                net_send_tcp(session, prompt, strlen(prompt));
-            }
+            tcp_reset(src_ip, src_port, 0, seq + 1);   // Over a limit: refuse
+            return;
+        }
+        
+        vga_print("New connection from IP\n");
+        session->state = TCP_STATE_SYN_RECEIVED;
+        session->rcv_nxt = seq + 1;
+        session->snd_una = tcp_isn(src_ip, src_port);   // Our ISS
+        session->snd_max = session->snd_una + 1;        // The SYN takes one
+        session->snd_wnd = htons(tcp->window);
+        
+        // Send SYN-ACK
+        tcp_transmit(session, session->snd_una, 0, 0, TCP_SYN);
+        tcp_start_timer(session);
+        return;
+    }
+    
+    // Only an RST at exactly the expected sequence number counts, so a
+    // blind guess can't tear the connection down
+    if (flags & TCP_RST) {
+        if (seq == session->rcv_nxt) {
+            stats.reset++;
+            net_release_session(session);
         }
         return;
     }
     
-    // Handle data packet
-    if (session && (tcp->flags & TCP_PSH)) {
-        uint16_t data_offset = (tcp->data_offset >> 4) * 4;
-        uint8_t* payload = (uint8_t*)tcp + data_offset;
-        uint16_t payload_len = htons(ip->total_length) - sizeof(ip_header_t) - data_offset;
+    session->last_active = net_ticks;
+    
+    if (session->state == TCP_STATE_SYN_RECEIVED) {
+        if (flags & TCP_SYN) {
+            // Our SYN-ACK was lost; the timer will resend it
+            return;
+        }
+        if (!(flags & TCP_ACK) || htonl(tcp->ack_num) != session->snd_una + 1) return;
         
-        // Update ACK
-        session->ack_num = htonl(tcp->seq_num) + payload_len;
+        // Handshake complete; the SYN used one sequence number
+        session->state = TCP_STATE_ESTABLISHED;
+        session->snd_una++;
+        session->rto_timer = 0;
+        session->retries = 0;
         
-        // Decrypt payload
-        decrypt_data(payload, payload_len, 0x42);
+        // Send login prompt
+        const char* prompt = "XAE OS Login\nUsername: ";
+        net_send_tcp(session, prompt, strlen(prompt));
+    }
+    
+    if (flags & TCP_ACK) {
+        session->snd_wnd = htons(tcp->window);
+        if (tcp_ack(session, htonl(tcp->ack_num)) && session->state == TCP_STATE_LAST_ACK) {
+            stats.closed++;
+            net_release_session(session);   // Our FIN acknowledged: done
+            return;
+        }
+    }
+    
+    if (payload_len > 0 || (flags & TCP_FIN)) {
+        if (seq != session->rcv_nxt) {
+            // Out of order or a retransmit: repeat our ACK at once
+            tcp_transmit(session, session->snd_max, 0, 0, 0);
+            return;
+        }
         
-        if (!session->authenticated) {
-            // Handle authentication
-            char username[32] = {0};
-            char password[64] = {0};
-            
-            // Parse username:password from payload
-            uint8_t i = 0, j = 0;
-            while (i < payload_len && payload[i] != ':' && j < 31) {
-                username[j++] = payload[i++];
-            }
-            i++; // skip ':'
-            j = 0;
-            while (i < payload_len && payload[i] != '\n' && j < 63) {
-                password[j++] = payload[i++];
-            }
-            
-            if (auth_verify(username, password)) {
-                session->authenticated = 1;
-                strcpy(session->username, username);
-                const char* welcome = "\nWelcome to XAE OS!\n> ";
-                net_send_tcp(session, welcome, strlen(welcome));
-            } else {
-                const char* fail = "\nAuthentication failed!\nUsername: ";
-                net_send_tcp(session, fail, strlen(fail));
-            }
-        } else {
-            // Execute shell command
-            char cmd[256] = {0};
-            for (uint16_t i = 0; i < payload_len && i < 255; i++) {
-                cmd[i] = payload[i];
+        session->rcv_nxt += payload_len;
+        session->ack_pending++;
+        
+        if (payload_len > 0 && session->state == TCP_STATE_ESTABLISHED) {
+            net_deliver(session, payload, payload_len);   // Replies carry the ACK
+        }
+        
+        if (flags & TCP_FIN) {
+            // Client closed: nothing is left to say but our own FIN
+            session->rcv_nxt++;
+            if (session->state == TCP_STATE_ESTABLISHED) {
+                session->state = TCP_STATE_LAST_ACK;
+                session->fin_queued = 1;
             }
-            
-            // Process command through shell
-            extern void shell_execute_command(const char* cmd, session_t* session);
-            shell_execute_command(cmd, session);
+            session->ack_pending = 2;
+        }
+    }
+    
+    tcp_output(session);
+    
+    // Delayed ACK: answer every second segment at once, hold a single one
+    // back so a reply can carry it
+    if (session->ack_pending >= 2) {
+        tcp_transmit(session, session->snd_max, 0, 0, 0);
+    } else if (session->ack_pending && session->ack_timer == 0) {
+        session->ack_timer = NET_TCP_DELACK;
+    }
+}
+
+// Drive the TCP timers of one connection
+static void tcp_timers(session_t* s) {
+    if (net_ticks - s->last_active > NET_IDLE_TIMEOUT) {
+        tcp_reset(s->client_ip, s->client_port, s->snd_max, s->rcv_nxt);
+        stats.timed_out++;
+        net_release_session(s);   // Idle too long
+        return;
+    }
+    
+    if (s->ack_timer && --s->ack_timer == 0 && s->ack_pending) {
+        tcp_transmit(s, s->snd_max, 0, 0, 0);
+    }
+    
+    if (s->rto_timer == 0 || --s->rto_timer != 0) return;
+    
+    if (++s->retries > NET_TCP_MAX_RETRIES) {
+        stats.timed_out++;
+        net_release_session(s);   // Client is gone
+        return;
+    }
+    
+    s->rto = s->rto * 2 > NET_TCP_RTO_MAX ? NET_TCP_RTO_MAX : s->rto * 2;
+    s->rto_timer = s->rto;
+    
+    if (s->state == TCP_STATE_SYN_RECEIVED) {
+        tcp_transmit(s, s->snd_una, 0, 0, TCP_SYN);
+        return;
+    }
+    
+    // Go back to the oldest unacknowledged byte and resend one segment
+    // (even into a closed window, as a probe); ACKs bring the rest
+    uint16_t seg = s->snd_len > NET_TCP_MSS ? NET_TCP_MSS : s->snd_len;
+    s->snd_sent = 0;
+    s->fin_sent = 0;
+    if (seg > 0) {
+        tcp_transmit(s, s->snd_una, 0, seg, seg == s->snd_len ? TCP_PSH : 0);
+        s->snd_sent = seg;
+    }
+    tcp_output(s);
+}
+
+// Called once per timer tick by the network task
+void net_tick(void) {
+    net_ticks++;
+    
+    if (num_sessions == 0) return;
+    
+    for (uint32_t b = 0; b < NET_SESSION_BUCKETS; b++) {
+        session_t* next;
+        
+        for (session_t* s = session_table[b]; s; s = next) {
+            next = s->next;   // s may be released
+            tcp_timers(s);
         }
     }
 }
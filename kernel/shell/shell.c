@@ -9,31 +9,85 @@
 #include "include/keyboard.h"
 #include "include/string.h"
 #include "include/xaefs.h"
+#include "include/bcache.h"
+#include "include/memory.h"
+#include "include/slab.h"
+#include "include/membench.h"
 #include "include/editor.h"
 #include "include/serial.h"
 #include "include/auth.h"
+#include "include/net.h"
+#include "include/task.h"
+#include "include/timer.h"
+#include "include/perf.h"
+#include "include/output.h"
 
 #define CMD_BUFFER_SIZE 256
-#define PATH_BUFFER_SIZE 128
 
 /* Command buffer */
 static char cmd_buffer[CMD_BUFFER_SIZE];
 
-/* Current directory path */
-static char current_path[PATH_BUFFER_SIZE] = "/";
+/* Current directory path, and its inode so commands that work on the
+ * current directory never need a path lookup. This is the console's;
+ * shell_execute_command() swaps a session's own in for its command. */
+static char current_path[SHELL_PATH_SIZE] = "/";
+static uint32_t current_dir_inode = 0;
 
-/* Dual output helper */
+/* Set while a command runs for a network session */
+static uint8_t remote_command = 0;
+
+/* Output helper: the console, or the session a command runs for */
 static void shell_print(const char* str) {
-    vga_print(str);
-    serial_print(str);
+    output_print(str);
 }
 
-/* Network output helper */
-static void shell_net_print(void* session, const char* str) {
-    extern void net_send_tcp(void* session, const char* data, uint16_t length);
-    if (session) {
-        net_send_tcp(session, str, (uint16_t)strlen(str));
+/*
+ * build_path() - Turn a name typed by the user into an absolute path
+ * 
+ * WHAT: Join 'name' onto current_path (unless it is already absolute)
+ * HOW: Add one component at a time, folding away "." and ".."
+ * RETURNS: 0 on success, -1 if the result doesn't fit in SHELL_PATH_SIZE
+ */
+static int build_path(const char* name, char* out)
+{
+    uint32_t len;
+    
+    if (name[0] == '/') {
+        out[0] = '/';
+        out[1] = '\0';
+    } else {
+        strcpy(out, current_path);
+    }
+    len = strlen(out);
+    
+    while (*name) {
+        /* Skip separators */
+        while (*name == '/') name++;
+        if (*name == '\0') break;
+        
+        /* Find end of this component */
+        uint32_t comp_len = 0;
+        while (name[comp_len] != '\0' && name[comp_len] != '/') comp_len++;
+        
+        if (comp_len == 1 && name[0] == '.') {
+            /* Current directory - nothing to add */
+        } else if (comp_len == 2 && name[0] == '.' && name[1] == '.') {
+            /* Parent directory - drop the last component */
+            while (len > 1 && out[len - 1] != '/') len--;
+            if (len > 1) len--;  /* Remove the '/' too, except at root */
+            out[len] = '\0';
+        } else {
+            if (len + comp_len + 2 > SHELL_PATH_SIZE) return -1;
+            if (len > 1) out[len++] = '/';
+            memcpy(out + len, name, comp_len);
+            len += comp_len;
+            out[len] = '\0';
+        }
+        
+        name += comp_len;
     }
+    
+    return 0;
 }
 
 /*
@@ -61,9 +115,17 @@ static void cmd_help(void)
     shell_print("  sync              - Save to disk\n");
     shell_print("\nPart 2/2:\n");
     shell_print("  tag <file> <tag>  - Add tag\n");
-    shell_print("  find <tag>        - Find by tag\n");
+    shell_print("  find <tag> [lvl]  - Find by tag\n");
+    shell_print("                      (a+b = both, a,b = either)\n");
     shell_print("  pri <file> <lvl>  - Set priority\n");
     shell_print("                      (low/mid/high/max)\n");
+    shell_print("  ver <file>        - Save a version\n");
+    shell_print("  back <file> [n]   - List/restore versions\n");
+    shell_print("  cache             - Buffer cache stats\n");
+    shell_print("  mem               - Memory and slab stats\n");
+    shell_print("  net [max|perip <n>] - Connections, limits\n");
+    shell_print("  bench             - Time memcpy/memset/...\n");
+    shell_print("  info [trace on|off] - Counters, latencies, trace\n");
     shell_print("  clear             - Clear screen\n");
     shell_print("  help              - This help\n");
     shell_print("\n");
@@ -90,37 +152,26 @@ static void cmd_mk(char* name)
         name[len - 1] = '\0';  /* Remove the / */
     }
     
-    /* Build full path: current_path + name */
-    char full_path[PATH_BUFFER_SIZE];
-    int i = 0, j = 0;
-    
-    /* Copy current path */
-    while (current_path[i] != '\0' && i < PATH_BUFFER_SIZE - 1) {
-        full_path[j++] = current_path[i++];
-    }
-    
-    /* Add / if not at root and path doesn't end with / */
-    if (j > 0 && full_path[j-1] != '/') {
-        full_path[j++] = '/';
+    /* Names without a '/' go straight into the current directory */
+    uint8_t type = is_dir ? XAEFS_FILE_DIRECTORY : XAEFS_FILE_REGULAR;
+    uint8_t has_slash = 0;
+    for (len = 0; name[len] != '\0'; len++) {
+        if (name[len] == '/') has_slash = 1;
     }
     
-    /* Add filename */
-    i = 0;
-    while (name[i] != '\0' && j < PATH_BUFFER_SIZE - 1) {
-        full_path[j++] = name[i++];
+    int result;
+    if (has_slash) {
+        char full_path[SHELL_PATH_SIZE];
+        if (build_path(name, full_path) != 0) {
+            shell_print("Error: Path too long\n");
+            return;
+        }
+        result = xaefs_create(full_path, type, XAEFS_PRIORITY_NORMAL);
+    } else {
+        result = xaefs_create_at(current_dir_inode, name, type, XAEFS_PRIORITY_NORMAL);
     }
-    full_path[j] = '\0';
-    
-    uint8_t type = is_dir ? XAEFS_FILE_DIRECTORY : XAEFS_FILE_REGULAR;
-    int result = xaefs_create(full_path, type, XAEFS_PRIORITY_NORMAL);
     
     if (result >= 0) {
-        /* Set parent directory */
-        xaefs_set_parent(full_path, current_path);
-        
-        /* Manually sync to ensure parent is saved */
-        xaefs_sync();
-        
         shell_print("Created ");
         shell_print(is_dir ? "folder: " : "file: ");
         shell_print(name);
@@ -134,6 +185,10 @@ static void cmd_mk(char* name)
             shell_print("Error: File already exists: ");
             shell_print(name);
             shell_print("\n");
+        } else if (result == -4) {
+            shell_print("Error: Directory not found or invalid name: ");
+            shell_print(name);
+            shell_print("\n");
         } else {
             shell_print("Error: Could not create ");
             shell_print(is_dir ? "folder\n" : "file\n");
@@ -146,7 +201,7 @@ static void cmd_mk(char* name)
  */
 static void cmd_ls(void) 
 {
-    xaefs_list_dir(current_path);
+    xaefs_list_dir_at(current_dir_inode, current_path);
 }
 
 /*
@@ -159,14 +214,14 @@ static void cmd_rm(char* name)
         return;
     }
     
-    int result = xaefs_delete_in_dir(name, current_path);
+    int result = xaefs_delete_at(current_dir_inode, name);
     
     if (result == 0) {
         shell_print("Deleted: ");
         shell_print(name);
         shell_print("\n");
     } else {
-        shell_print("Error: File not found or cannot be deleted: ");
+        shell_print("Error: File not found, folder not empty, or cannot be deleted: ");
         shell_print(name);
         shell_print("\n");
     }
@@ -184,69 +239,30 @@ static void cmd_cd(char* dirname)
         return;
     }
     
-    /* Handle special cases */
-    if (strcmp(dirname, "/") == 0) {
-        current_path[0] = '/';
-        current_path[1] = '\0';
-        shell_print("Changed to: /\n");
+    if (strcmp(dirname, "..") == 0 && strcmp(current_path, "/") == 0) {
+        shell_print("Already at root directory\n");
         return;
     }
     
-    if (strcmp(dirname, "..") == 0) {
-        /* Go up one level */
-        if (strcmp(current_path, "/") == 0) {
-            shell_print("Already at root directory\n");
-            return;
-        }
-        
-        /* Find last / and truncate */
-        int i = 0;
-        while (current_path[i] != '\0') i++;
-        i--;
-        while (i > 0 && current_path[i] != '/') i--;
-        
-        if (i == 0) {
-            /* Going back to root */
-            current_path[0] = '/';
-            current_path[1] = '\0';
-        } else {
-            current_path[i] = '\0';
-        }
-        shell_print("Changed to: ");
-        shell_print(current_path);
-        shell_print("\n");
+    /* Build new path (handles /, .. and multi-level paths) */
+    char new_path[SHELL_PATH_SIZE];
+    if (build_path(dirname, new_path) != 0) {
+        shell_print("Error: Path too long\n");
         return;
     }
     
-    /* Check if directory exists (simplified - assumes it exists) */
-    /* Build new path */
-    char new_path[PATH_BUFFER_SIZE];
-    int i = 0, j = 0;
-    
-    /* Copy current path */
-    while (current_path[i] != '\0' && i < PATH_BUFFER_SIZE - 1) {
-        new_path[j++] = current_path[i++];
-    }
-    
-    /* Add / if needed */
-    if (j > 0 && new_path[j-1] != '/') {
-        new_path[j++] = '/';
-    }
-    
-    /* Add dirname */
-    i = 0;
-    while (dirname[i] != '\0' && j < PATH_BUFFER_SIZE - 1) {
-        new_path[j++] = dirname[i++];
+    /* Check that the directory exists, and remember its inode */
+    int inode_num = xaefs_lookup(new_path, 0);
+    if (inode_num < 0 || !xaefs_is_directory(inode_num)) {
+        shell_print("Error: Directory not found: ");
+        shell_print(dirname);
+        shell_print("\n");
+        return;
     }
-    new_path[j] = '\0';
     
     /* Update current path */
-    i = 0;
-    while (new_path[i] != '\0' && i < PATH_BUFFER_SIZE - 1) {
-        current_path[i] = new_path[i];
-        i++;
-    }
-    current_path[i] = '\0';
+    strcpy(current_path, new_path);
+    current_dir_inode = inode_num;
     
     shell_print("Changed to: ");
     shell_print(current_path);
@@ -263,7 +279,13 @@ static void cmd_tag(char* file, char* tag)
         return;
     }
     
-    int result = xaefs_add_tag(file, tag);
+    char full_path[SHELL_PATH_SIZE];
+    if (build_path(file, full_path) != 0) {
+        shell_print("Error: Path too long\n");
+        return;
+    }
+    
+    int result = xaefs_add_tag(full_path, tag);
     if (result == 0) {
         shell_print("Tagged '");
         shell_print(file);
@@ -280,12 +302,22 @@ static void cmd_tag(char* file, char* tag)
  */
 static void cmd_edit(char* filename) 
 {
+    if (remote_command) {
+        shell_print("edit needs the local console (use 'fun' to view a file)\n");
+        return;
+    }
     if (!filename) {
         shell_print("Usage: edit <filename>\n");
         return;
     }
     
-    editor_open(filename);
+    char full_path[SHELL_PATH_SIZE];
+    if (build_path(filename, full_path) != 0) {
+        shell_print("Error: Path too long\n");
+        return;
+    }
+    
+    editor_open(full_path);
 }
 
 /*
@@ -298,20 +330,51 @@ static void cmd_fun(char* filename)
         return;
     }
     
-    editor_view(filename);
+    char full_path[SHELL_PATH_SIZE];
+    if (build_path(filename, full_path) != 0) {
+        shell_print("Error: Path too long\n");
+        return;
+    }
+    
+    editor_view(full_path);
+}
+
+/*
+ * parse_priority() - Turn a level name into a priority
+ * RETURNS: XAEFS_PRIORITY_* value, or -1 for an unknown name
+ */
+static int parse_priority(const char* level) 
+{
+    if (strcmp(level, "low") == 0) return XAEFS_PRIORITY_LOW;
+    if (strcmp(level, "mid") == 0) return XAEFS_PRIORITY_NORMAL;
+    if (strcmp(level, "high") == 0) return XAEFS_PRIORITY_HIGH;
+    if (strcmp(level, "max") == 0) return XAEFS_PRIORITY_CRITICAL;
+    return -1;
 }
 
 /*
  * cmd_find() - Find files by tag
+ * 
+ * "find a+b" = tagged a and b, "find a,b" = tagged a or b,
+ * optionally limited to one priority level: "find a high"
  */
-static void cmd_find(char* tag) 
+static void cmd_find(char* tags, char* level) 
 {
-    if (!tag) {
-        shell_print("Usage: find <tag>\n");
+    if (!tags) {
+        shell_print("Usage: find <tag>[+tag|,tag...] [level]\n");
         return;
     }
     
-    xaefs_find_by_tag(tag);
+    int priority = -1;
+    if (level) {
+        priority = parse_priority(level);
+        if (priority < 0) {
+            shell_print("Invalid level. Use: low, mid, high, max\n");
+            return;
+        }
+    }
+    
+    xaefs_find_tags(tags, priority);
 }
 
 /*
@@ -325,21 +388,19 @@ static void cmd_pri(char* file, char* level)
         return;
     }
     
-    uint8_t priority;
-    if (strcmp(level, "low") == 0) {
-        priority = XAEFS_PRIORITY_LOW;
-    } else if (strcmp(level, "mid") == 0) {
-        priority = XAEFS_PRIORITY_NORMAL;
-    } else if (strcmp(level, "high") == 0) {
-        priority = XAEFS_PRIORITY_HIGH;
-    } else if (strcmp(level, "max") == 0) {
-        priority = XAEFS_PRIORITY_CRITICAL;
-    } else {
+    int priority = parse_priority(level);
+    if (priority < 0) {
         shell_print("Invalid level. Use: low, mid, high, max\n");
         return;
     }
     
-    int result = xaefs_set_priority(file, priority);
+    char full_path[SHELL_PATH_SIZE];
+    if (build_path(file, full_path) != 0) {
+        shell_print("Error: Path too long\n");
+        return;
+    }
+    
+    int result = xaefs_set_priority(full_path, priority);
     if (result == 0) {
         shell_print("Priority set to ");
         shell_print(level);
@@ -349,11 +410,99 @@ static void cmd_pri(char* file, char* level)
     }
 }
 
+/*
+ * cmd_ver() - Save the current contents of a file as a version
+ */
+static void cmd_ver(char* file) 
+{
+    if (!file) {
+        shell_print("Usage: ver <file>\n");
+        return;
+    }
+    
+    char full_path[SHELL_PATH_SIZE];
+    if (build_path(file, full_path) != 0) {
+        shell_print("Error: Path too long\n");
+        return;
+    }
+    
+    char num[12];
+    int result = xaefs_create_version(full_path);
+    if (result >= 0) {
+        shell_print("Saved '");
+        shell_print(file);
+        shell_print("' as version ");
+        shell_print(utoa(result, num));
+        shell_print("\n");
+    } else if (result == -2) {
+        shell_print("Error: No free inodes\n");
+    } else {
+        shell_print("Error: File not found\n");
+    }
+}
+
+/*
+ * cmd_back() - List the versions of a file, or restore one
+ */
+static void cmd_back(char* file, char* number) 
+{
+    if (!file) {
+        shell_print("Usage: back <file>       (list versions)\n");
+        shell_print("   or: back <file> <n>   (restore version n)\n");
+        return;
+    }
+    
+    char full_path[SHELL_PATH_SIZE];
+    if (build_path(file, full_path) != 0) {
+        shell_print("Error: Path too long\n");
+        return;
+    }
+    
+    if (!number) {
+        if (xaefs_list_versions(full_path) < 0) {
+            shell_print("Error: File not found\n");
+        }
+        return;
+    }
+    
+    /* Parse the version number */
+    uint32_t n = 0;
+    uint32_t i;
+    for (i = 0; number[i] != '\0'; i++) {
+        if (number[i] < '0' || number[i] > '9') {
+            shell_print("Error: Version must be a number\n");
+            return;
+        }
+        n = n * 10 + (number[i] - '0');
+    }
+    
+    int result = xaefs_restore_version(full_path, n);
+    if (result == 0) {
+        shell_print("Restored '");
+        shell_print(file);
+        shell_print("' to version ");
+        shell_print(number);
+        shell_print(" (previous contents saved as a version)\n");
+    } else if (result == -3) {
+        shell_print("Error: No such version (try 'back ");
+        shell_print(file);
+        shell_print("')\n");
+    } else if (result == -2) {
+        shell_print("Error: No free inodes\n");
+    } else {
+        shell_print("Error: File not found\n");
+    }
+}
+
 /*
  * cmd_clear() - Clear screen
  */
 static void cmd_clear(void) 
 {
+    if (remote_command) {
+        shell_print("\033[2J\033[H");  /* ANSI: clear, cursor home */
+        return;
+    }
     vga_clear();
 }
 
@@ -375,6 +524,174 @@ static void cmd_debug(void)
     xaefs_debug_list_all();
 }
 
+/*
+ * print_stat() - Print one "label: value" line
+ */
+static void print_stat(const char* label, uint32_t value) 
+{
+    char num[12];
+    
+    shell_print(label);
+    shell_print(utoa(value, num));
+    shell_print("\n");
+}
+
+/*
+ * cmd_cache() - Show buffer cache counters
+ * WHY: Hit rate and eviction count tell us whether the cache is big enough
+ */
+static void cmd_cache(void) 
+{
+    struct bcache_stats stats;
+    uint32_t lookups;
+    
+    bcache_get_stats(&stats);
+    lookups = stats.hits + stats.misses;
+    
+    shell_print("\nBuffer cache:\n");
+    print_stat("  Buffers (4 KB):  ", stats.buffers);
+    print_stat("  Hits:            ", stats.hits);
+    print_stat("  Misses:          ", stats.misses);
+    print_stat("  Hit rate (%):    ", lookups ? (stats.hits * 100) / lookups : 0);
+    print_stat("  Read-ahead:      ", stats.readaheads);
+    print_stat("  Write-backs:     ", stats.writebacks);
+    print_stat("  Evictions:       ", stats.evictions);
+    print_stat("  By priority:     ", stats.priority_evictions);
+}
+
+/*
+ * cmd_mem() - Show free memory and slab cache usage
+ * 
+ * HOW: One line per cache: objects in use / capacity of its slabs
+ */
+static void cmd_mem(void) 
+{
+    struct kmem_cache_stats stats;
+    char num[12];
+    uint32_t i;
+    
+    shell_print("\nMemory:\n");
+    print_stat("  Free (KB):       ", get_free_memory() / 1024);
+    shell_print("\nSlab caches (in use/capacity, slabs):\n");
+    
+    for (i = 0; kmem_cache_get_stats(i, &stats) == 0; i++) {
+        if (stats.slabs == 0 && stats.allocs == 0) continue;  /* Never used */
+        
+        shell_print("  ");
+        shell_print(stats.name);
+        shell_print(": ");
+        shell_print(utoa(stats.active, num));
+        shell_print("/");
+        shell_print(utoa(stats.slabs * stats.per_slab, num));
+        shell_print(" x ");
+        shell_print(utoa(stats.object_size, num));
+        shell_print(" B, ");
+        shell_print(utoa(stats.slabs, num));
+        shell_print("\n");
+    }
+}
+
+/*
+ * print_ip() - Print an IPv4 address (host order) in dotted form
+ */
+static void print_ip(uint32_t ip) 
+{
+    char num[12];
+    int shift;
+    
+    for (shift = 24; shift >= 0; shift -= 8) {
+        shell_print(utoa((ip >> shift) & 0xFF, num));
+        if (shift > 0) shell_print(".");
+    }
+}
+
+/*
+ * cmd_net() - Show connection counters and the open connections, or
+ * change the connection limits ("net max <n>", "net perip <n>")
+ */
+static void cmd_net(const char* arg1, const char* arg2) 
+{
+    static const char* state_names[] = { "closed", "syn-rcvd", "established", "last-ack" };
+    struct net_stats stats;
+    struct net_session_info info;
+    char num[12];
+    uint32_t i;
+    
+    net_get_stats(&stats);
+    
+    if (arg1) {
+        uint32_t n = 0;
+        uint8_t max = strcmp(arg1, "max") == 0;
+        
+        if (!max && strcmp(arg1, "perip") != 0) {
+            shell_print("Usage: net [max|perip <n>]\n");
+            return;
+        }
+        for (i = 0; arg2 && arg2[i] != '\0'; i++) {
+            if (arg2[i] < '0' || arg2[i] > '9' || n > 99999) {
+                n = 0;
+                break;
+            }
+            n = n * 10 + (arg2[i] - '0');
+        }
+        if (net_set_limits(max ? n : stats.max_sessions,
+                           max ? stats.max_per_ip : n) != 0) {
+            shell_print("Error: Limit must be a number above 0\n");
+            return;
+        }
+        shell_print(max ? "Connections at once: " : "Connections per address: ");
+        shell_print(utoa(n, num));
+        shell_print("\n");
+        return;
+    }
+    
+    shell_print("\nConnections:\n");
+    print_stat("  Active:          ", stats.active);
+    print_stat("  Opened:          ", stats.opened);
+    print_stat("  Closed:          ", stats.closed);
+    print_stat("  Reset by client: ", stats.reset);
+    print_stat("  Timed out:       ", stats.timed_out);
+    print_stat("  Refused:         ", stats.refused);
+    print_stat("  Limit:           ", stats.max_sessions);
+    print_stat("  Limit per addr:  ", stats.max_per_ip);
+    
+    for (i = 0; net_get_session_info(i, &info) == 0; i++) {
+        shell_print("  ");
+        print_ip(info.client_ip);
+        shell_print(":");
+        shell_print(utoa(info.client_port, num));
+        shell_print(" ");
+        shell_print(info.state < 4 ? state_names[info.state] : "?");
+        shell_print(info.authenticated ? ", logged in" : "");
+        shell_print(", idle ");
+        shell_print(utoa(info.idle / TIMER_HZ, num));
+        shell_print(" s");
+        shell_print(", queued ");
+        shell_print(utoa(info.queued, num));
+        shell_print(" B\n");
+    }
+}
+
+/*
+ * cmd_info() - Dump the performance counters, or switch tracing
+ */
+static void cmd_info(const char* arg1, const char* arg2, perf_print_t print, void* ctx)
+{
+    if (arg1 && strcmp(arg1, "trace") == 0) {
+        if (arg2 && (strcmp(arg2, "on") == 0 || strcmp(arg2, "off") == 0)) {
+            perf_set_tracing(strcmp(arg2, "on") == 0);
+            print(ctx, "Tracing ");
+            print(ctx, arg2);
+            print(ctx, "\n");
+        } else {
+            print(ctx, "Usage: info trace on|off\n");
+        }
+        return;
+    }
+    
+    perf_report(print, ctx);
+}
+
 /*
  * parse_and_execute() - Parse command and execute
  */
@@ -406,7 +723,7 @@ static void parse_and_execute(char* cmd)
         cmd_tag(arg1, arg2);
     }
     else if (strcmp(token, "find") == 0) {
-        cmd_find(arg1);
+        cmd_find(arg1, arg2);
     }
     else if (strcmp(token, "pri") == 0) {
         cmd_pri(arg1, arg2);
@@ -432,14 +749,26 @@ static void parse_and_execute(char* cmd)
     else if (strcmp(token, "debug") == 0) {
         cmd_debug();
     }
+    else if (strcmp(token, "cache") == 0) {
+        cmd_cache();
+    }
+    else if (strcmp(token, "mem") == 0) {
+        cmd_mem();
+    }
+    else if (strcmp(token, "net") == 0) {
+        cmd_net(arg1, arg2);
+    }
+    else if (strcmp(token, "bench") == 0) {
+        membench_run(shell_print);
+    }
     else if (strcmp(token, "ver") == 0) {
-        shell_print("Command 'ver' not yet implemented\n");
+        cmd_ver(arg1);
     }
     else if (strcmp(token, "back") == 0) {
-        shell_print("Command 'back' not yet implemented\n");
+        cmd_back(arg1, arg2);
     }
     else if (strcmp(token, "info") == 0) {
-        shell_print("Command 'info' not yet implemented\n");
+        cmd_info(arg1, arg2, output_to, NULL);
     }
     else {
         shell_print("Unknown command: ");
@@ -460,8 +789,8 @@ static uint8_t shell_login(void)
     const uint8_t MAX_ATTEMPTS = 3;
     
     /* Small delay for connection to stabilize */
-    for (volatile int i = 0; i < 100000; i++);
-
+    task_sleep(TIMER_HZ / 10);
+    
     /* Drop any bytes that arrived before we printed prompts */
     serial_flush_input();
     
@@ -483,7 +812,7 @@ static uint8_t shell_login(void)
                     break;
                 }
             }
-            for (volatile int i = 0; i < 1000; i++);
+            task_sleep(1);
         }
         
         shell_print("\r\nPassword: ");
@@ -500,7 +829,7 @@ static uint8_t shell_login(void)
                     break;
                 }
             }
-            for (volatile int i = 0; i < 1000; i++);
+            task_sleep(1);
         }
         
         /* Verify credentials */
@@ -547,13 +876,8 @@ void shell_run(void)
         shell_print(current_path);
         shell_print(" > ");
         
-        /* Wait for input - poll network while waiting */
-        extern void rtl8139_handle_interrupt(void);
-        
+        /* Wait for input - the network and flusher tasks run meanwhile */
         while (1) {
-            /* Check for network packets */
-            rtl8139_handle_interrupt();
-            
             /* Check for input */
             if (serial_can_read()) {
                 serial_readline(cmd_buffer, CMD_BUFFER_SIZE);
@@ -565,8 +889,8 @@ void shell_run(void)
                 break;
             }
             
-            /* Small delay to prevent CPU spinning */
-            for (volatile int i = 0; i < 1000; i++);
+            /* Nothing typed - sleep until the next tick */
+            task_sleep(1);
         }
         
         /* Parse and execute */
@@ -578,9 +902,20 @@ void shell_run(void)
 
 /*
  * shell_execute_command() - Execute command from network session
+ * 
+ * WHAT: Run one line exactly as the console would, with its output going
+ *       back over the connection
+ * HOW: The session's working directory and output are swapped in for the
+ *      length of the command, then the output is flushed in whole
+ *      segments. Commands never sleep, so nothing else can print into
+ *      the redirect; the flush comes after the restore because it may
+ *      wait for the client's ACKs.
  */
-void shell_execute_command(const char* cmd, void* session) {
+void shell_execute_command(const char* cmd, struct session* session) {
     char buffer[CMD_BUFFER_SIZE];
+    char console_path[SHELL_PATH_SIZE];
+    uint32_t console_dir_inode;
+    struct output_sink saved;
     
     /* Copy command to buffer */
     uint16_t i = 0;
@@ -590,33 +925,26 @@ void shell_execute_command(const char* cmd, void* session) {
     }
     buffer[i] = '\0';
     
-    /* Temporarily redirect output to network session */
-    /* For now, just acknowledge the command */
-    shell_net_print(session, "\nExecuting: ");
-    shell_net_print(session, buffer);
-    shell_net_print(session, "\n");
+    /* Run in the session's working directory, so its cd doesn't move
+     * the console's or any other session's */
+    strcpy(console_path, current_path);
+    console_dir_inode = current_dir_inode;
+    strcpy(current_path, session->cwd);
+    current_dir_inode = session->cwd_inode;
     
-    /* Parse command (reuse existing logic) */
-    char* token = buffer;
-    while (*token == ' ') token++;
+    output_redirect(net_session_print, session, &saved);
+    remote_command = 1;
     
-    if (*token == '\0') {
-        shell_net_print(session, "> ");
-        return;
-    }
+    parse_and_execute(buffer);
     
-    /* Execute based on command */
-    if (strncmp(token, "ls", 2) == 0) {
-        /* List files and send to network */
-        shell_net_print(session, "Files in current directory:\n");
-        /* TODO: Implement ls output to network */
-    } else if (strncmp(token, "help", 4) == 0) {
-        shell_net_print(session, "XAE Shell Commands:\n");
-        shell_net_print(session, "  ls, cd, mk, rm, edit, fun, sync, help\n");
-    } else {
-        shell_net_print(session, "Command not yet supported via network\n");
-    }
+    remote_command = 0;
+    output_restore(&saved);
     
-    shell_net_print(session, "> ");
+    strcpy(session->cwd, current_path);
+    session->cwd_inode = current_dir_inode;
+    strcpy(current_path, console_path);
+    current_dir_inode = console_dir_inode;
+    
+    net_session_print(session, "> ");
+    net_session_flush(session);
 }
-
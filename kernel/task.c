@@ -0,0 +1,303 @@
+/*
+ * ==============================================================================
+ * COOPERATIVE TASK SCHEDULER IMPLEMENTATION
+ * ==============================================================================
+ */
+
+#include "include/task.h"
+#include "include/timer.h"
+#include "include/interrupt.h"
+#include "include/memory.h"
+#include "include/slab.h"
+#include "include/string.h"
+
+/* Task states */
+#define TASK_READY 0
+#define TASK_SLEEPING 1             /* Until wake_tick or task_wake() */
+#define TASK_WAITING 2              /* Until task_wake() */
+
+struct task {
+    uint32_t esp;            /* Saved stack pointer while switched out */
+    struct task* next;       /* Ring of all tasks */
+    const char* name;
+    volatile uint8_t state;  /* Set to TASK_READY by interrupt handlers too */
+    uint32_t wake_tick;
+    task_entry_t entry;
+    void* arg;
+    void* stack;             /* 2^TASK_STACK_ORDER pages, NULL for the boot task */
+};
+
+static struct task boot_task;
+static struct task* current;        /* NULL until sched_init() */
+static struct task* zombie;         /* Exited task whose stack is still in use */
+static uint32_t task_count;
+static struct kmem_cache* task_cache;
+
+/*
+ * task_switch() - Save the callee-saved registers and change stacks
+ * 
+ * HOW: Push EBP/EBX/ESI/EDI, store ESP through the first argument, load
+ *      the second one and pop the other task's registers; the RET then
+ *      returns into that task. A new task's stack is prepared by
+ *      task_create() to look the same, returning into task_start().
+ */
+void task_switch(uint32_t* save_esp, uint32_t load_esp);
+
+__asm__(
+    ".text\n"
+    ".globl task_switch\n"
+    "task_switch:\n"
+    "    movl 4(%esp), %eax\n"
+    "    movl 8(%esp), %edx\n"
+    "    pushl %ebp\n"
+    "    pushl %ebx\n"
+    "    pushl %esi\n"
+    "    pushl %edi\n"
+    "    movl %esp, (%eax)\n"
+    "    movl %edx, %esp\n"
+    "    popl %edi\n"
+    "    popl %esi\n"
+    "    popl %ebx\n"
+    "    popl %ebp\n"
+    "    ret\n"
+);
+
+/*
+ * task_reap() - Free the task that exited before the last switch
+ */
+static void task_reap(void)
+{
+    if (zombie && zombie != current) {
+        free_pages(zombie->stack, TASK_STACK_ORDER);
+        kmem_cache_free(task_cache, zombie);
+        zombie = NULL;
+    }
+}
+
+/*
+ * task_unlink() - Take a task out of the ring
+ */
+static void task_unlink(struct task* task)
+{
+    struct task* prev = task;
+    
+    while (prev->next != task) {
+        prev = prev->next;
+    }
+    prev->next = task->next;
+    task_count--;
+}
+
+/*
+ * schedule() - Switch to the next task that can run
+ * 
+ * HOW: Walk the ring starting after the current task, waking sleepers
+ *      whose tick has come, and take the first ready one - the current
+ *      task itself last. If nothing is ready, halt until an interrupt
+ *      (the tick or a device) and look again. "sti; hlt" can't miss an
+ *      interrupt in between, since STI only takes effect after the next
+ *      instruction.
+ * NOTE: The current task may already be out of the ring (task_exit)
+ */
+static void schedule(void)
+{
+    struct task* prev = current;
+    struct task* next;
+    uint32_t flags = irq_save();
+    
+    while (1) {
+        uint32_t now = timer_ticks();
+        uint32_t i;
+        
+        next = prev->next;
+        for (i = 0; i < task_count; i++, next = next->next) {
+            if (next->state == TASK_SLEEPING && (int32_t)(now - next->wake_tick) >= 0) {
+                next->state = TASK_READY;
+            }
+            if (next->state == TASK_READY) break;
+        }
+        if (i < task_count) break;
+        
+        __asm__ volatile ("sti; hlt; cli" : : : "memory");
+    }
+    
+    if (next != prev) {
+        current = next;
+        task_switch(&prev->esp, next->esp);
+        task_reap();   /* Back in prev: the task that ran before may have exited */
+    }
+    
+    irq_restore(flags);
+}
+
+/*
+ * task_start() - First code a new task runs
+ * 
+ * WHY: schedule() switches with interrupts off; a new task has no
+ *      irq_restore() of its own to turn them back on
+ */
+static void task_start(void)
+{
+    task_reap();
+    __asm__ volatile ("sti");
+    
+    current->entry(current->arg);
+    task_exit();
+}
+
+/*
+ * sched_init() - Set up the scheduler with the caller as the first task
+ * 
+ * WHY: Must be called after slab_init(); the boot stack keeps running
+ *      as the task called name
+ */
+void sched_init(const char* name)
+{
+    memset(&boot_task, 0, sizeof(boot_task));
+    boot_task.name = name;
+    boot_task.state = TASK_READY;
+    boot_task.next = &boot_task;
+    
+    current = &boot_task;
+    zombie = NULL;
+    task_count = 1;
+    task_cache = kmem_cache_create("task", sizeof(struct task));
+}
+
+/*
+ * task_create() - Start a new task
+ * 
+ * WHAT: entry(arg) runs on its own stack once the current task yields;
+ *       returning from entry ends the task
+ * RETURNS: The task, or NULL when out of memory
+ */
+struct task* task_create(const char* name, task_entry_t entry, void* arg)
+{
+    struct task* task;
+    uint32_t* sp;
+    
+    if (!current || !task_cache) return NULL;
+    
+    task = kmem_cache_alloc(task_cache);
+    if (!task) return NULL;
+    
+    task->stack = alloc_pages(TASK_STACK_ORDER);
+    if (!task->stack) {
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+    
+    task->name = name;
+    task->entry = entry;
+    task->arg = arg;
+    task->wake_tick = 0;
+    task->state = TASK_READY;
+    
+    /* The frame task_switch() pops: four registers, then the return address */
+    sp = (uint32_t*)((uint8_t*)task->stack + (PAGE_SIZE << TASK_STACK_ORDER));
+    *--sp = 0;                       /* task_start()'s own return address */
+    *--sp = (uint32_t)task_start;
+    *--sp = 0;                       /* EBP */
+    *--sp = 0;                       /* EBX */
+    *--sp = 0;                       /* ESI */
+    *--sp = 0;                       /* EDI */
+    task->esp = (uint32_t)sp;
+    
+    /* Run it after the tasks already in the ring */
+    task->next = current->next;
+    current->next = task;
+    task_count++;
+    
+    return task;
+}
+
+/*
+ * task_current() - The running task (NULL before sched_init())
+ */
+struct task* task_current(void)
+{
+    return current;
+}
+
+/*
+ * task_yield() - Let every other ready task run once
+ */
+void task_yield(void)
+{
+    if (!current) return;
+    
+    schedule();
+}
+
+/*
+ * task_sleep() - Block for a number of ticks
+ * 
+ * NOTE: task_wake() ends the sleep early. Without the scheduler this
+ *       returns at once, so callers that poll keep working.
+ */
+void task_sleep(uint32_t ticks)
+{
+    if (!current) return;
+    
+    current->wake_tick = timer_ticks() + ticks;
+    current->state = TASK_SLEEPING;
+    schedule();
+}
+
+/*
+ * task_wait() - Block until task_wake()
+ */
+void task_wait(void)
+{
+    if (!current) return;
+    
+    current->state = TASK_WAITING;
+    schedule();
+}
+
+/*
+ * task_wake() - Make a sleeping or waiting task ready
+ * 
+ * WHY: Safe from interrupt handlers, so a device can wake the task that
+ *      services it
+ */
+void task_wake(struct task* task)
+{
+    if (task) task->state = TASK_READY;
+}
+
+/*
+ * task_kill() - End another task
+ * 
+ * NOTE: The task is dropped wherever it last yielded, so it must not be
+ *       holding anything there but its stack. The boot task and the
+ *       current task can't be killed.
+ */
+void task_kill(struct task* task)
+{
+    if (!task || task == current || task == &boot_task) return;
+    
+    task_unlink(task);
+    free_pages(task->stack, TASK_STACK_ORDER);
+    kmem_cache_free(task_cache, task);
+}
+
+/*
+ * task_exit() - End the current task
+ * 
+ * HOW: Leave the ring and switch away; the stack we are running on is
+ *      freed by the next task to run
+ */
+void task_exit(void)
+{
+    if (current == &boot_task) {
+        while (1) {
+            task_wait();   /* Nothing can wake it */
+        }
+    }
+    
+    task_reap();
+    task_unlink(current);
+    zombie = current;
+    schedule();
+}
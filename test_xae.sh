@@ -129,6 +129,20 @@ else
     fail "QEMU boot test failed"
 fi
 
+# Test 7: Filesystem on the host (every operation must succeed)
+echo ""
+echo "Test 7: Host Filesystem Benchmark"
+echo "---------------------------------"
+if make build/xaefs_bench > /dev/null 2>&1; then
+    if ./build/xaefs_bench > bench_output.txt 2>&1; then
+        pass "xaefs benchmark ran cleanly ($(grep -c '^{' bench_output.txt) results in bench_output.txt)"
+    else
+        fail "xaefs benchmark reported failed operations (see bench_output.txt)"
+    fi
+else
+    fail "Host benchmark build failed"
+fi
+
 # Summary
 echo ""
 echo "==================================="